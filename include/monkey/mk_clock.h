@@ -23,23 +23,93 @@
 #define MK_CLOCK_H
 
 #include <time.h>
+#include <stdint.h>
 #include <monkey/mk_core.h>
+#include <monkey/mk_tls.h>
 
-extern time_t log_current_utime;
 extern time_t monkey_init_time;
 
-extern mk_ptr_t log_current_time;
-extern mk_ptr_t headers_preset;
-
-pthread_t mk_clock_tid;
-
 #define MK_CLOCK_GMT_DATEFORMAT "Date: %a, %d %b %Y %H:%M:%S GMT\r\n"
 #define HEADER_PRESET_SIZE 128
 #define HEADER_TIME_BUFFER_SIZE 64
 #define LOG_TIME_BUFFER_SIZE 30
 
-void *mk_clock_worker_init(void *args);
-void mk_clock_set_time(void);
+/*
+ * Per thread clock: every worker owns one and refresh it once per event
+ * loop iteration, so reading the time is just a memory access. The human
+ * readable strings are only formatted when the second changes. Threads
+ * which do not run a worker loop get a clock on demand that is refreshed
+ * on every access.
+ */
+struct mk_clock {
+    int lazy;                     /* refresh on every access      */
+    int idx;                      /* active buffer                */
+    time_t utime;                 /* unix time (coarse)           */
+    uint64_t msec;                /* monotonic time, milliseconds */
+
+    mk_ptr_t headers_preset;      /* Server + Date headers        */
+    mk_ptr_t log_time;            /* log timestamp                */
+
+    /*
+     * Strings are double buffered: an iov may still reference the
+     * previous one while a pending response is being written.
+     */
+    char header_buf[2][HEADER_PRESET_SIZE];
+    char log_buf[2][LOG_TIME_BUFFER_SIZE];
+
+    struct mk_list _head;
+};
+
+struct mk_clock *mk_clock_lazy_create();
+void mk_clock_update(struct mk_clock *clk);
+
+static inline struct mk_clock *mk_clock_get()
+{
+    struct mk_clock *clk;
+
+    clk = MK_TLS_GET(mk_tls_clock);
+    if (mk_unlikely(!clk)) {
+        return mk_clock_lazy_create();
+    }
+
+    if (mk_unlikely(clk->lazy)) {
+        mk_clock_update(clk);
+    }
+    return clk;
+}
+
+/* Refresh the calling worker clock, called once per event loop iteration */
+static inline void mk_clock_refresh()
+{
+    struct mk_clock *clk;
+
+    clk = MK_TLS_GET(mk_tls_clock);
+    if (clk) {
+        mk_clock_update(clk);
+    }
+}
+
+static inline time_t mk_clock_utime()
+{
+    return mk_clock_get()->utime;
+}
+
+static inline uint64_t mk_clock_msec()
+{
+    return mk_clock_get()->msec;
+}
+
+/* Monotonic time in microseconds, read on every call */
+static inline uint64_t mk_clock_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int mk_clock_worker_init();
+void mk_clock_worker_exit();
 void mk_clock_sequential_init(struct mk_server *server);
 void mk_clock_exit();
 
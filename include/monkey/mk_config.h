@@ -22,6 +22,7 @@
 
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <signal.h>
 
 #include <monkey/mk_core.h>
 #include "../../deps/rbtree/rbtree.h"
@@ -96,6 +97,7 @@ struct mk_server
     int8_t hideversion;           /* hide version of server to clients ? */
     int8_t resume;                /* Resume (on/off) */
     int8_t symlink;               /* symbolic links */
+    int8_t metrics;               /* metrics plugin enabled ? */
 
     /* keep alive */
     int8_t keep_alive;            /* it's a persisten connection ? */
@@ -105,6 +107,9 @@ struct mk_server
     /* counter of threads working */
     int thread_counter;
 
+    /* bumped on SIGHUP, log writers open their files again */
+    volatile sig_atomic_t reopen_logs;
+
     /* real user */
     uid_t egid;
     gid_t euid;
@@ -116,6 +121,7 @@ struct mk_server
     /* configured host quantity */
     int nhosts;
     struct mk_list hosts;
+    struct mk_vhost_table *vhost_table;  /* hash index over 'hosts' */
 
     mode_t open_flags;
     struct mk_list plugins;
@@ -131,13 +137,16 @@ struct mk_server
 
     /* Define the default mime type when is not possible to find the proper one */
     struct mk_list mimetype_list;
-    struct rb_tree mimetype_rb_head;
+    struct mk_phash *mimetype_hash;
+    struct mk_phash *mimetype_type_hash;
     void *mimetype_default;
     char *mimetype_default_str;
 
     char server_signature[16];
     char server_signature_header[32];
     int  server_signature_header_len;
+    char server_signature_hpack[32];
+    int  server_signature_hpack_len;
 
     /* Library  mode */
     int lib_mode;                   /* is running in Library mode ? */
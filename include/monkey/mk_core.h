@@ -50,6 +50,8 @@ extern "C" {
 #include "mk_core/mk_event.h"
 #include "mk_core/mk_rconf.h"
 #include "mk_core/mk_string.h"
+#include "mk_core/mk_phash.h"
+#include "mk_core/mk_hpack.h"
 #include "mk_core/mk_macros.h"
 #include "mk_core/mk_utils.h"
 #include "mk_core/mk_unistd.h"
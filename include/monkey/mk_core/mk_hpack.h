@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_CORE_HPACK_H
+#define MK_CORE_HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * HPACK (RFC 7541) header compression. The decoder keeps the dynamic table
+ * of the peer encoder; the encoder never adds entries to the table of the
+ * peer so it is stateless and safe under any SETTINGS_HEADER_TABLE_SIZE.
+ */
+
+#define MK_HPACK_STATIC_SIZE      61
+#define MK_HPACK_ENTRY_OVERHEAD   32   /* RFC 7541 4.1 */
+
+/* Dynamic table entry, name and value are stored together in the ring */
+struct mk_hpack_entry {
+    uint32_t offset;
+    uint32_t name_len;
+    uint32_t value_len;
+};
+
+struct mk_hpack {
+    /* Entries: circular array, 'head' is the newest one */
+    struct mk_hpack_entry *entries;
+    int capacity;
+    int head;
+    int count;
+
+    /* Names and values: byte ring, allocated on the first insertion */
+    char *data;
+    uint32_t data_size;
+    uint32_t data_pos;
+
+    uint32_t size;          /* current size in octets            */
+    uint32_t max_size;      /* limit set by the peer size update  */
+    uint32_t settings_max;  /* our SETTINGS_HEADER_TABLE_SIZE     */
+
+    /* Scratch space for Huffman decoded strings */
+    char *buf;
+    size_t buf_size;
+};
+
+/* Callback invoked by the decoder for every decoded header field */
+typedef int (*mk_hpack_cb)(void *data,
+                           char *name, size_t name_len,
+                           char *value, size_t value_len);
+
+int mk_hpack_init(struct mk_hpack *ctx, uint32_t max_size);
+void mk_hpack_destroy(struct mk_hpack *ctx);
+
+int mk_hpack_decode(struct mk_hpack *ctx, uint8_t *block, size_t len,
+                    mk_hpack_cb cb, void *data);
+
+int mk_hpack_encode_status(uint8_t *out, size_t size, int status);
+int mk_hpack_encode_header(uint8_t *out, size_t size,
+                           char *name, size_t name_len,
+                           char *value, size_t value_len);
+
+int mk_hpack_huffman_encode(uint8_t *out, size_t size,
+                            const char *str, size_t len);
+int mk_hpack_huffman_decode(uint8_t *src, size_t len, char *dst);
+size_t mk_hpack_huffman_length(const char *str, size_t len);
+
+#endif
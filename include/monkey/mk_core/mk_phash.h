@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_CORE_PHASH_H
+#define MK_CORE_PHASH_H
+
+/*
+ * Minimal perfect hash over a static set of case-insensitive string keys
+ * (hash and displace). The table is built once from a known set of keys,
+ * later lookups cost one hash for the bucket, one for the slot and a
+ * single key comparison.
+ */
+
+struct mk_phash_entry {
+    char *key;                 /* lower case copy of the key */
+    int len;
+    void *data;
+};
+
+struct mk_phash {
+    unsigned int size;         /* number of keys and slots */
+    int *disp;                 /* per bucket displacement */
+    struct mk_phash_entry *entries;
+};
+
+struct mk_phash *mk_phash_create(char **keys, int *lens, void **data, int n);
+void *mk_phash_lookup(struct mk_phash *ph, const char *key, int len);
+void mk_phash_destroy(struct mk_phash *ph);
+
+#endif
@@ -131,6 +131,9 @@ struct mk_http_session
     /* creation time for this HTTP session */
     time_t init_time;
 
+    /* current request began: first read of it, usec monotonic (metrics) */
+    uint64_t begin;
+
     /* request body buffer */
     char *body;
 
@@ -185,6 +188,9 @@ mk_ptr_t mk_http_protocol_check_str(int protocol);
 
 int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                  struct mk_server *server);
+int mk_http_request_prepare(struct mk_http_session *cs,
+                            struct mk_http_request *sr,
+                            struct mk_server *server);
 
 int mk_http_keepalive_check(struct mk_http_session *cs,
                             struct mk_http_request *sr,
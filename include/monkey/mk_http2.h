@@ -22,11 +22,14 @@
 
 #include <stdint.h>
 #include <monkey/mk_stream.h>
+#include <monkey/mk_http.h>
 #include <monkey/mk_http2_settings.h>
+#include <monkey/mk_core.h>
 
-/* Connection was just upgraded */
+/* Session status: waiting for the client preface (upgraded or direct h2c) */
 #define MK_HTTP2_UPGRADED               1
 #define MK_HTTP2_OK                     2
+#define MK_HTTP2_CLOSING                3  /* GOAWAY sent, flush and close */
 
 /*
  * The Client 'sent' the SETTINGS frame according to Section 6.5:
@@ -93,6 +96,11 @@ static inline uint32_t mk_http2_frame_len(struct mk_http2_frame *f)
 /* HTTP/2 General flags */
 
 #define MK_HTTP2_SETTINGS_ACK        0x1
+#define MK_HTTP2_PING_ACK            0x1
+#define MK_HTTP2_END_STREAM          0x1
+#define MK_HTTP2_END_HEADERS         0x4
+#define MK_HTTP2_PADDED              0x8
+#define MK_HTTP2_PRIORITY_FLAG      0x20
 
 /*
  * HTTP/2 Frame types
@@ -107,6 +115,7 @@ static inline uint32_t mk_http2_frame_len(struct mk_http2_frame *f)
 #define MK_HTTP2_GOAWAY              0x7   /* Section 6.8  */
 #define MK_HTTP2_WINDOW_UPDATE       0x8   /* Section 6.9  */
 #define MK_HTTP2_CONTINUATION        0x9   /* Section 6.10 */
+#define MK_HTTP2_PRIORITY_UPDATE     0x10  /* RFC 9218, Section 7.1 */
 
 /*
  * HTTP/2 Settings Parameters (Section 6.5.2)
@@ -160,9 +169,96 @@ static inline uint32_t mk_http2_frame_len(struct mk_http2_frame *f)
 #define MK_H2_TRACE(...) do {} while (0)
 #endif
 
-#define mk_http2_send_raw(conn, buf, length)            \
-    mk_stream_set(NULL, MK_STREAM_RAW, &conn->channel,  \
-                  buf, length, NULL, NULL, NULL, NULL)
+/* Largest window size, 2^31 - 1 (Section 6.9.1) */
+#define MK_HTTP2_MAX_WINDOW          2147483647
+
+/* Outgoing frames buffer, flushed to the socket on every write event */
+#define MK_HTTP2_OUT_SIZE            65536
+
+/* Control frames may grow the buffer up to this limit */
+#define MK_HTTP2_OUT_MAX             (MK_HTTP2_OUT_SIZE * 16)
+
+/* Largest header block accepted or generated */
+#define MK_HTTP2_HEAD_MAX            65536
+
+/* Extensible priorities (RFC 9218): urgency 0 (highest) to 7 */
+#define MK_HTTP2_URGENCY_LEVELS      8
+#define MK_HTTP2_URGENCY_DEFAULT     3
+
+/*
+ * Unsent bytes allowed in the socket buffer. Keeping it short lets a more
+ * urgent response overtake the ones already queued.
+ */
+#define MK_HTTP2_NOTSENT_LOWAT       16384
+
+/* Smallest DATA frame worth sending when the congestion window is small */
+#define MK_HTTP2_FRAME_MIN           1400
+
+/*
+ * Stream states (Section 5.1). Server push is not supported, so the
+ * reserved states are never used.
+ */
+#define MK_HTTP2_STATE_IDLE                 0
+#define MK_HTTP2_STATE_OPEN                 1
+#define MK_HTTP2_STATE_HALF_CLOSED_REMOTE   2
+#define MK_HTTP2_STATE_HALF_CLOSED_LOCAL    3
+#define MK_HTTP2_STATE_CLOSED               4
+
+/*
+ * A HTTP/2 stream carries one request. The request itself is processed by
+ * the HTTP/1.x core (mk_http.c) through its own mk_http_session whose
+ * channel is a virtual one (MK_CHANNEL_HTTP2): handlers queue the response
+ * there as usual and the session turns it into HEADERS and DATA frames.
+ */
+struct mk_http2_stream {
+    uint32_t id;
+    int state;
+
+    int32_t send_window;         /* what the peer can still receive  */
+    int32_t recv_window;         /* what we still accept from peer   */
+
+    int urgency;                 /* RFC 9218 priority parameters     */
+    int incremental;
+
+    int dispatched;              /* request handed to the HTTP core  */
+    int async;                   /* handler finishes on its own      */
+    int req_end;                 /* response complete once drained   */
+    int headers_sent;
+
+    /* Request being received: pseudo headers, headers and body */
+    char *req;
+    size_t req_len;
+    size_t req_size;
+    size_t req_headers;          /* offset where the headers end     */
+    mk_ptr_t method;
+    mk_ptr_t path;
+    mk_ptr_t authority;
+    char *cookie;                /* crumbs joined back (8.1.2.5)     */
+    size_t cookie_len;
+    size_t cookie_size;
+    long content_length;
+    int regular;                 /* a regular header was seen        */
+    int malformed;
+    int error;                   /* HTTP status to reply with        */
+
+    /* Response head as generated by the HTTP/1.x core */
+    char *head;
+    size_t head_len;
+    size_t head_size;
+
+    /* Body bytes that came along with the response head */
+    char *pending;
+    size_t pending_len;
+    size_t pending_offset;
+
+    struct mk_event event;       /* private, never registered        */
+    struct mk_channel channel;
+    struct mk_http_session cs;
+
+    struct mk_http2_session *h2s;
+    struct mk_list _head;
+    struct mk_list _sched;       /* link to h2s->sched[urgency]      */
+};
 
 struct mk_http2_session {
     int status;
@@ -173,10 +269,51 @@ struct mk_http2_session {
     char *buffer;
     char buffer_fixed[MK_HTTP2_CHUNK];
 
-    /* Session Settings */
+    /* Session Settings: the peer ones, ours are the defaults */
     struct mk_http2_settings settings;
+    int peer_settings;           /* first SETTINGS frame received    */
 
-    struct mk_stream stream_settings;
+    /* Connection flow control */
+    int32_t send_window;
+    int32_t recv_window;
+
+    uint32_t last_stream_id;     /* highest stream opened by the peer */
+    uint32_t goaway_id;          /* peer sent GOAWAY                  */
+    int goaway;
+    int streams_active;
+
+    /* Header block being assembled (HEADERS + CONTINUATION) */
+    uint32_t cont_stream_id;
+    uint32_t cont_error;         /* reset the stream once decoded     */
+    int cont_end_stream;
+    char *hblock;
+    size_t hblock_len;
+    size_t hblock_size;
+
+    struct mk_hpack hpack;
+
+    /* Outgoing frames */
+    char *out;
+    size_t out_size;
+    size_t out_len;
+    size_t out_offset;
+    int pumping;
+    int events;
+
+    /*
+     * Scheduler: one queue per urgency level, non incremental streams
+     * first in stream order, then the incremental ones in round robin.
+     */
+    struct mk_list sched[MK_HTTP2_URGENCY_LEVELS];
+    struct mk_http2_stream *sched_current;
+    uint32_t frame_size;         /* DATA frame size for this round    */
+
+    struct mk_list streams;
+    struct mk_sched_conn *conn;
+    struct mk_server *server;
 };
 
+int mk_http2_channel_flush(struct mk_channel *channel);
+int mk_http2_request_end(struct mk_http_session *cs, struct mk_server *server);
+
 #endif
@@ -30,22 +30,15 @@ struct mk_http2_settings {
 };
 
 
-const struct mk_http2_settings MK_HTTP2_SETTINGS_DEFAULT =
-    {
-        .header_table_size      = 4096,
-        .enable_push            = 1,
-        .max_concurrent_streams = 64,
-        .initial_window_size    = 65535,
-        .max_frame_size         = 16384, /* 6.5.2 -> 2^14 */
-        .max_header_list_size   = UINT32_MAX
-    };
+/* Initial values defined by the protocol (Section 6.5.2) */
+extern const struct mk_http2_settings MK_HTTP2_SETTINGS_DEFAULT;
 
 /*
  * Default settings of Monkey, we send this upon a new connection arrives
  * to the HTTP/2 handler.
  */
 #define MK_HTTP2_SETTINGS_DEFAULT_FRAME                 \
-    "\x00\x00\x0c"       /* frame length     */         \
+    "\x00\x00\x12"       /* frame length     */         \
     "\x04"               /* type=SETTINGS    */         \
     "\x00"               /* flags            */         \
     "\x00\x00\x00\x00"   /* stream ID        */         \
@@ -56,7 +49,11 @@ const struct mk_http2_settings MK_HTTP2_SETTINGS_DEFAULT =
                                                         \
     /* SETTINGS_INITIAL_WINDOW_SIZE     */              \
     "\x00\x04"                                          \
-    "\x00\x00\xff\xff"   /* value=65535 */
+    "\x00\x00\xff\xff"   /* value=65535 */              \
+                                                        \
+    /* SETTINGS_NO_RFC7540_PRIORITIES (RFC 9218) */     \
+    "\x00\x09"                                          \
+    "\x00\x00\x00\x01"   /* value=1     */
 
 #define MK_HTTP2_SETTINGS_ACK_FRAME             \
     "\x00\x00\x00\x04\x01\x00\x00\x00\x00"
@@ -67,5 +64,6 @@ const struct mk_http2_settings MK_HTTP2_SETTINGS_DEFAULT =
 #define MK_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE     0x4
 #define MK_HTTP2_SETTINGS_MAX_FRAME_SIZE          0x5
 #define MK_HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE    0x6
+#define MK_HTTP2_SETTINGS_NO_RFC7540_PRIORITIES   0x9
 
 #endif
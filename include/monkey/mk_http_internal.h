@@ -90,6 +90,12 @@ struct mk_http_request
     long port;
     /*------------*/
 
+    /* Request parsed, monotonic usec */
+    uint64_t start;
+
+    /* channel->bytes_out when the request began (metrics) */
+    uint64_t bytes_out;
+
     /* Body Stream size */
     uint64_t stream_size;
 
@@ -32,6 +32,7 @@
 #include <pthread.h>
 
 struct mk_lib_ctx {
+    int started;                    /* mk_start() done ?            */
     pthread_t worker_tid;
     struct mk_server *server;
     struct mk_fifo *fifo;
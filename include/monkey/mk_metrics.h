@@ -0,0 +1,136 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_METRICS_H
+#define MK_METRICS_H
+
+#include <monkey/mk_core.h>
+
+/*
+ * Runtime metrics
+ * ---------------
+ * Every worker records its requests on its own histograms and counters:
+ * it's the only writer so no lock nor atomic read-modify-write is needed,
+ * the values are just stored with relaxed atomics. A reader adds up the
+ * workers while they keep going (mk_metrics_collect()), each value is
+ * consistent on its own.
+ *
+ * The histograms are log-linear (HDR): 2^MK_METRICS_SUB_BITS buckets for
+ * every power of two, so a value is placed within 1/16 (6.25%) of its
+ * magnitude with a fixed amount of memory and no configuration.
+ */
+
+#define MK_METRICS_SUB_BITS     4
+#define MK_METRICS_SUB_COUNT    (1 << MK_METRICS_SUB_BITS)
+#define MK_METRICS_MAX_BITS     40     /* larger values are clamped      */
+#define MK_METRICS_BUCKETS      ((MK_METRICS_MAX_BITS - MK_METRICS_SUB_BITS + 1) \
+                                 << MK_METRICS_SUB_BITS)
+
+/* Plugin stages timed */
+#define MK_METRICS_STAGE_10     0
+#define MK_METRICS_STAGE_20     1
+#define MK_METRICS_STAGE_30     2
+#define MK_METRICS_STAGE_40     3
+#define MK_METRICS_STAGE_50     4
+#define MK_METRICS_STAGES       5
+
+/* Status classes: 1xx to 5xx, anything else goes to the last one */
+#define MK_METRICS_STATUS_CLASSES 6
+
+struct mk_metrics_histogram {
+    uint64_t sum;
+    uint64_t buckets[MK_METRICS_BUCKETS];
+};
+
+struct mk_metrics {
+    /* microseconds */
+    struct mk_metrics_histogram first_byte;  /* request begin -> first byte */
+    struct mk_metrics_histogram done;        /* first byte -> last byte     */
+    struct mk_metrics_histogram stage[MK_METRICS_STAGES];
+
+    /* bytes written for the request, headers included */
+    struct mk_metrics_histogram size;
+
+    uint64_t status[MK_METRICS_STATUS_CLASSES];
+
+    int vhosts;
+    uint64_t *vhost_requests;                /* by mk_vhost->id             */
+
+    struct mk_list _head;
+};
+
+/* Bucket of a value */
+static inline int mk_metrics_bucket(uint64_t value)
+{
+    int msb;
+
+    if (value < MK_METRICS_SUB_COUNT) {
+        return value;
+    }
+
+    if (value >= (1ULL << MK_METRICS_MAX_BITS)) {
+        value = (1ULL << MK_METRICS_MAX_BITS) - 1;
+    }
+
+    msb = 63 - __builtin_clzll(value);
+    return ((msb - MK_METRICS_SUB_BITS + 1) << MK_METRICS_SUB_BITS) +
+           ((value >> (msb - MK_METRICS_SUB_BITS)) & (MK_METRICS_SUB_COUNT - 1));
+}
+
+/* Smallest value that falls into a bucket */
+static inline uint64_t mk_metrics_bucket_low(int bucket)
+{
+    int base = bucket >> MK_METRICS_SUB_BITS;
+    int sub = bucket & (MK_METRICS_SUB_COUNT - 1);
+
+    if (base == 0) {
+        return sub;
+    }
+    return (uint64_t) (MK_METRICS_SUB_COUNT + sub) << (base - 1);
+}
+
+/* Only the owner worker writes */
+static inline void mk_metrics_add(struct mk_metrics_histogram *h,
+                                  uint64_t value)
+{
+    int b = mk_metrics_bucket(value);
+
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+}
+
+static inline void mk_metrics_inc(uint64_t *counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+struct mk_server;
+struct mk_http_session;
+struct mk_http_request;
+
+int mk_metrics_init(struct mk_server *server);
+int mk_metrics_worker_init(struct mk_server *server);
+void mk_metrics_stage(int stage, uint64_t start);
+void mk_metrics_request(struct mk_http_session *cs,
+                        struct mk_http_request *sr);
+struct mk_metrics *mk_metrics_collect();
+void mk_metrics_free(struct mk_metrics *m);
+void mk_metrics_exit();
+
+#endif
@@ -18,12 +18,11 @@
  */
 
 #include <monkey/mk_core.h>
-#include <rbtree.h>
 
 #ifndef MK_MIMETYPE_H
 #define MK_MIMETYPE_H
 
-#define MIMETYPE_DEFAULT_TYPE "text/plain\r\n"
+#define MIMETYPE_DEFAULT_TYPE "text/plain"
 #define MIMETYPE_DEFAULT_NAME "default"
 
 struct mk_mimetype
@@ -31,15 +30,18 @@ struct mk_mimetype
     char *name;
     mk_ptr_t type;
     mk_ptr_t header_type;
+    mk_ptr_t hpack_type;        /* HTTP/2: pre-encoded content-type field */
     struct mk_list _head;
-    struct rb_tree_node _rb_head;
 };
 
 int mk_mimetype_init(struct mk_server *server);
 int mk_mimetype_add(struct mk_server *server, char *name, const char *type);
 int mk_mimetype_read_config();
+int mk_mimetype_index(struct mk_server *server);
 struct mk_mimetype *mk_mimetype_find(struct mk_server *server, mk_ptr_t *filename);
 struct mk_mimetype *mk_mimetype_lookup(struct mk_server *server, char *name);
+struct mk_mimetype *mk_mimetype_type_lookup(struct mk_server *server,
+                                            char *type, int len);
 void mk_mimetype_free_all();
 
 #endif
@@ -23,6 +23,22 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_stream.h>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+/* Address of a peer: Unix socket (path or abstract name), IPv4 or IPv6 */
+struct mk_net_addr {
+    int family;                  /* AF_UNIX, AF_INET or AF_INET6   */
+    socklen_t len;
+    union {
+        struct sockaddr sa;
+        struct sockaddr_un un;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } addr;
+};
+
 struct mk_net_connection {
     struct mk_event event;
     int fd;
@@ -31,6 +47,12 @@ struct mk_net_connection {
     void *thread;
 };
 
+int mk_net_addr_parse(const char *host, int port, struct mk_net_addr *addr);
+int mk_net_addr_resolve(const char *host, int port, struct mk_net_addr *addr);
+int mk_net_addr_str(struct mk_net_addr *addr, char *buf, size_t size);
+int mk_net_connect(struct mk_net_addr *addr);
+int mk_net_connect_status(int fd);
+
 struct mk_net_connection *mk_net_conn_create(char *addr, int port);
 int mk_net_conn_write(struct mk_channel *channel,
                       void *data, size_t len);
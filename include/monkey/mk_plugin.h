@@ -29,6 +29,9 @@
 #include <monkey/mk_utils.h>
 #include <monkey/mk_info.h>
 #include <monkey/mk_plugin_net.h>
+#include <monkey/mk_net.h>
+#include <monkey/mk_resolver.h>
+#include <monkey/mk_metrics.h>
 #include <monkey/mk_core.h>
 
 #define MK_PLUGIN_ERROR -1      /* plugin execution error */
@@ -100,11 +103,27 @@ struct plugin_api
     int (*socket_read) (int, void *, int);
     int (*socket_send_file) (int, int, off_t *, size_t);
     int (*socket_ip_str) (int, char **, int, unsigned long *);
+    int (*socket_addr_str) (struct mk_socket_addr *, char *, int,
+                            unsigned long *);
+    int (*socket_addr_port) (struct mk_socket_addr *);
 
     /* Async Network */
     struct mk_net_connection *(*net_conn_create) (char *, int);
-
-    struct mk_server_config *config;
+    int (*net_addr_parse) (const char *, int, struct mk_net_addr *);
+    int (*net_addr_resolve) (const char *, int, struct mk_net_addr *);
+    int (*net_addr_str) (struct mk_net_addr *, char *, size_t);
+    int (*net_connect) (struct mk_net_addr *);
+    int (*net_connect_status) (int);
+    int (*net_resolve) (const char *, int, struct mk_net_addr *,
+                        mk_resolver_cb, void *);
+    void (*net_resolve_cancel) (void *);
+    void (*net_resolve_stats) (struct mk_resolver_stats *);
+
+    /* Workers metrics */
+    struct mk_metrics *(*metrics_collect) ();
+    void (*metrics_free) (struct mk_metrics *);
+
+    struct mk_server *config;
     struct mk_list *plugins;
 
     /* Error helper */
@@ -237,6 +256,10 @@ struct plugin_api
     /* Handler */
     struct mk_vhost_handler_param *(*handler_param_get)(int, struct mk_list *);
 
+    /* Virtual hosts */
+    int (*vhost_get) (mk_ptr_t, struct mk_vhost **, struct mk_vhost_alias **,
+                      struct mk_server *);
+
 #ifdef JEMALLOC_STATS
     int (*je_mallctl) (const char *, void *, size_t *, void *, size_t);
 #endif
@@ -313,7 +336,7 @@ struct mk_plugin_stage {
 };
 
 
-void mk_plugin_api_init();
+void mk_plugin_api_init(struct mk_server *server);
 void mk_plugin_load_all();
 void mk_plugin_exit_all(struct mk_server *server);
 void mk_plugin_exit_worker();
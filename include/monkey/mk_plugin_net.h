@@ -33,6 +33,24 @@ struct mk_plugin_network {
     int (*close) (int);
     int (*send_file) (int, int, off_t *, size_t);
     int buffer_size;
+
+    /*
+     * Optional: complete the transport handshake before any read. The
+     * listener capabilities (MK_CAP_HTTP, MK_CAP_HTTP2) are the protocols
+     * to offer, the negotiated one is returned in the last argument or 0
+     * if none. Returns 0 once done, -1 with errno EAGAIN meanwhile.
+     * The connection event is given so a layer completing the handshake
+     * out of the worker thread can take it out of the event loop and
+     * register it back once done.
+     */
+    int (*handshake) (int, int, int *, struct mk_event *);
+
+    /*
+     * Optional: move up to 'count' bytes from a pipe to the connection
+     * without copying them to user space, like send_file. Layers that
+     * need to see the data (eg: TLS) leave it unset.
+     */
+    int (*splice) (int, int, size_t);
 };
 
 #endif
@@ -20,80 +20,126 @@
 #ifndef MK_PLUGIN_STAGE_H
 #define MK_PLUGIN_STAGE_H
 
+#include <monkey/mk_clock.h>
+#include <monkey/mk_metrics.h>
+
 static inline int mk_plugin_stage_run_10(int socket, struct mk_server *server)
 {
-    int ret;
+    int ret = -1;
+    uint64_t start = 0;
     struct mk_list *head;
     struct mk_plugin_stage *stage;
 
+    if (mk_list_is_empty(&server->stage10_handler) == 0) {
+        return -1;
+    }
+
+    if (server->metrics == MK_TRUE) {
+        start = mk_clock_usec();
+    }
     mk_list_foreach(head, &server->stage10_handler) {
         stage = mk_list_entry(head, struct mk_plugin_stage, _head);
         ret = stage->stage10(socket);
-        switch (ret) {
-        case MK_PLUGIN_RET_CLOSE_CONX:
+        if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
             MK_TRACE("return MK_PLUGIN_RET_CLOSE_CONX");
-            return MK_PLUGIN_RET_CLOSE_CONX;
+            break;
         }
     }
+    if (server->metrics == MK_TRUE) {
+        mk_metrics_stage(MK_METRICS_STAGE_10, start);
+    }
 
-    return -1;
+    return ret == MK_PLUGIN_RET_CLOSE_CONX ? ret : -1;
 }
 
 static inline int mk_plugin_stage_run_20(struct mk_http_session *cs,
                                          struct mk_http_request *sr,
                                          struct mk_server *server)
 {
-    int ret;
+    int ret = -1;
+    uint64_t start = 0;
     struct mk_list *head;
     struct mk_plugin_stage *stage;
 
+    if (mk_list_is_empty(&server->stage20_handler) == 0) {
+        return -1;
+    }
+
+    if (server->metrics == MK_TRUE) {
+        start = mk_clock_usec();
+    }
     mk_list_foreach(head, &server->stage20_handler) {
         stage = mk_list_entry(head, struct mk_plugin_stage, _head);
         ret = stage->stage20(cs, sr);
-        switch (ret) {
-        case MK_PLUGIN_RET_CLOSE_CONX:
+        if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
             MK_TRACE("return MK_PLUGIN_RET_CLOSE_CONX");
-            return MK_PLUGIN_RET_CLOSE_CONX;
+            break;
         }
     }
+    if (server->metrics == MK_TRUE) {
+        mk_metrics_stage(MK_METRICS_STAGE_20, start);
+    }
 
-    return -1;
+    return ret == MK_PLUGIN_RET_CLOSE_CONX ? ret : -1;
 }
 
+/* The request is over: account it, then let the plugins know */
 static inline int mk_plugin_stage_run_40(struct mk_http_session *cs,
                                          struct mk_http_request *sr,
                                          struct mk_server *server)
 {
+    uint64_t start = 0;
     struct mk_list *head;
     struct mk_plugin_stage *stage;
 
+    if (server->metrics == MK_TRUE) {
+        mk_metrics_request(cs, sr);
+    }
+
+    if (mk_list_is_empty(&server->stage40_handler) == 0) {
+        return -1;
+    }
+
+    if (server->metrics == MK_TRUE) {
+        start = mk_clock_usec();
+    }
     mk_list_foreach(head, &server->stage40_handler) {
         stage = mk_list_entry(head, struct mk_plugin_stage, _head);
         stage->stage40(cs, sr);
     }
+    if (server->metrics == MK_TRUE) {
+        mk_metrics_stage(MK_METRICS_STAGE_40, start);
+    }
 
     return -1;
 }
 
 static inline int mk_plugin_stage_run_50(int socket, struct mk_server *server)
 {
-    int ret;
-
+    int ret = -1;
+    uint64_t start = 0;
     struct mk_list *head;
     struct mk_plugin_stage *stage;
 
+    if (mk_list_is_empty(&server->stage50_handler) == 0) {
+        return -1;
+    }
+
+    if (server->metrics == MK_TRUE) {
+        start = mk_clock_usec();
+    }
     mk_list_foreach(head, &server->stage50_handler) {
         stage = mk_list_entry(head, struct mk_plugin_stage, _head);
         ret = stage->stage50(socket);
-        switch (ret) {
-        case MK_PLUGIN_RET_NOT_ME:
+        if (ret == MK_PLUGIN_RET_CONTINUE) {
             break;
-        case MK_PLUGIN_RET_CONTINUE:
-            return MK_PLUGIN_RET_CONTINUE;
         }
     }
+    if (server->metrics == MK_TRUE) {
+        mk_metrics_stage(MK_METRICS_STAGE_50, start);
+    }
 
-    return -1;
+    return ret == MK_PLUGIN_RET_CONTINUE ? ret : -1;
 }
 
 #endif
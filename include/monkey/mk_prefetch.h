@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef MK_PREFETCH_H
+#define MK_PREFETCH_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_stream.h>
+#include <monkey/mk_scheduler.h>
+
+/*
+ * Static files prefetch
+ * ---------------------
+ * Before sending a window of a large file, the worker checks through
+ * preadv2(RWF_NOWAIT) if the pages are resident. If they are not, the
+ * window is loaded into the page cache by a small pool of I/O helper
+ * threads while the connection sleeps, so sendfile(2) never blocks the
+ * worker event loop on disk.
+ */
+#ifdef MK_HAVE_PREADV2_NOWAIT
+
+#define MK_PREFETCH_MIN_SIZE   (1024 * 1024)   /* files smaller are not checked */
+#define MK_PREFETCH_WINDOW     (512 * 1024)    /* bytes loaded per job          */
+#define MK_PREFETCH_THREADS    2               /* I/O helper threads            */
+
+/* mk_prefetch_check() return values */
+#define MK_PREFETCH_READY      0
+#define MK_PREFETCH_WAIT       1
+
+struct mk_prefetch_worker;
+
+struct mk_prefetch_job {
+    int fd;                             /* dup(2) of the file descriptor  */
+    off_t offset;
+    size_t length;
+    struct mk_sched_conn *conn;         /* NULL if the connection is gone */
+    struct mk_stream_input *in;
+    struct mk_prefetch_worker *worker;  /* owner worker                   */
+    struct mk_list _head;               /* link to pool or done queue     */
+    struct mk_list _head_pending;       /* link to worker pending list    */
+};
+
+/* Per worker context, the event must be the first field */
+struct mk_prefetch_worker {
+    struct mk_event event;              /* completion notification        */
+    int ch_r;
+    int ch_w;
+    pthread_mutex_t lock;
+    struct mk_list done;                /* completed jobs (locked)        */
+    struct mk_list pending;             /* jobs in flight (worker only)   */
+    struct mk_list _head;
+};
+
+int mk_prefetch_init(struct mk_server *server);
+void mk_prefetch_exit();
+int mk_prefetch_worker_init(struct mk_event_loop *evl);
+int mk_prefetch_check(struct mk_channel *channel, struct mk_stream_input *in);
+void mk_prefetch_cancel(struct mk_sched_conn *conn);
+
+#endif
+#endif
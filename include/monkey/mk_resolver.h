@@ -0,0 +1,121 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_RESOLVER_H
+#define MK_RESOLVER_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_net.h>
+
+/*
+ * Host names resolver
+ * -------------------
+ * Outbound connections to a host name must not block the worker on
+ * getaddrinfo(3). Every worker keeps a small cache of answers; a miss is
+ * queued to a pool of helper threads and the answer comes back through
+ * the worker event loop, where the callback of the caller runs. An
+ * expired answer is still handed out while it's being refreshed.
+ */
+
+#define MK_RESOLVER_THREADS     2
+#define MK_RESOLVER_CACHE_SIZE  64     /* entries per worker              */
+#define MK_RESOLVER_TTL         30     /* seconds an answer is fresh      */
+#define MK_RESOLVER_TTL_FAIL    5      /* seconds a failure is remembered */
+
+/* mk_resolver_lookup() return values */
+#define MK_RESOLVER_DONE        0
+#define MK_RESOLVER_WAIT        1
+
+/* Called on the worker loop: status is 0 or -1 with errno set */
+typedef void (*mk_resolver_cb) (void *data, int status,
+                                struct mk_net_addr *addr);
+
+struct mk_resolver_worker;
+
+struct mk_resolver_waiter {
+    mk_resolver_cb cb;                  /* NULL once cancelled            */
+    void *data;
+    struct mk_list _head;
+};
+
+struct mk_resolver_entry {
+    uint32_t hash;
+    char *host;
+    int port;
+
+    int status;                         /* answer, 0 or -1                */
+    int error;                          /* errno of a failure             */
+    time_t expires;                     /* 0: no answer yet               */
+    struct mk_net_addr addr;
+
+    int pending;                        /* a lookup is in flight          */
+    struct mk_list waiters;
+    struct mk_list _head;               /* worker cache, LRU order        */
+};
+
+struct mk_resolver_job {
+    char *host;
+    int port;
+    int status;
+    int error;
+    uint64_t queued_at;
+    struct mk_net_addr addr;
+    struct mk_resolver_entry *entry;
+    struct mk_resolver_worker *worker;  /* owner worker                   */
+    struct mk_list _head;               /* link to pool or done queue     */
+};
+
+/* Counters, latencies in microseconds */
+struct mk_resolver_stats {
+    uint64_t lookups;
+    uint64_t literals;                  /* numeric, no lookup needed      */
+    uint64_t hits;
+    uint64_t stale;                     /* expired, served on refresh     */
+    uint64_t misses;
+    uint64_t coalesced;                 /* joined a lookup in flight      */
+    uint64_t failures;
+    uint64_t resolved;                  /* lookups done by the helpers    */
+    uint64_t latency_usec;
+    uint64_t latency_max;
+};
+
+/* Per worker context, the event must be the first field */
+struct mk_resolver_worker {
+    struct mk_event event;              /* completion notification        */
+    int ch_r;
+    int ch_w;
+    pthread_mutex_t lock;
+    struct mk_list done;                /* completed jobs (locked)        */
+    int entries;
+    struct mk_list cache;               /* least recently used first      */
+    struct mk_resolver_stats stats;
+    struct mk_list _head;
+};
+
+struct mk_server;
+
+int mk_resolver_init(struct mk_server *server);
+int mk_resolver_worker_init(struct mk_event_loop *evl);
+int mk_resolver_lookup(const char *host, int port, struct mk_net_addr *addr,
+                       mk_resolver_cb cb, void *data);
+void mk_resolver_cancel(void *data);
+void mk_resolver_stats(struct mk_resolver_stats *stats);
+void mk_resolver_exit();
+
+#endif
@@ -116,10 +116,11 @@ struct mk_sched_conn
     int status;                        /* connection status            */
     uint32_t properties;
     char is_timeout_on;                /* registered to timeout queue? */
-    time_t arrive_time;                /* arrive time                  */
+    uint64_t arrive_time;              /* arrive time (msec, monotonic) */
     struct mk_sched_handler *protocol; /* protocol handler             */
     struct mk_server_listen *server_listen;
     struct mk_plugin_network *net;     /* I/O network layer            */
+    struct mk_socket_addr peer;        /* remote address               */
     struct mk_channel channel;         /* stream channel               */
     struct mk_list timeout_head;       /* link to the timeout queue    */
     void *data;                        /* optional ref for protocols   */
@@ -131,6 +132,9 @@ struct mk_sched_conn
 /* Connection properties */
 #define MK_SCHED_CONN_PROP(conn) conn->server_listen->listen->flags
 
+/* Connection status flags (conn->properties) */
+#define MK_SCHED_CONN_HANDSHAKE  1   /* transport handshake in progress */
+
 /*
  * It defines a Handler for a connection in questions. This struct
  * is used inside mk_sched_conn to define which protocol/handler
@@ -327,6 +331,8 @@ static inline void mk_sched_conn_timeout_del(struct mk_sched_conn *conn)
     ch->io->writev(ch->fd, iov)
 #define mk_sched_conn_sendfile(ch, f_fd, f_offs, f_count)   \
     ch->io->send_file(ch->fd, f_fd, f_offs, f_count)
+#define mk_sched_conn_splice(ch, p_fd, p_count)             \
+    ch->io->splice(ch->fd, p_fd, p_count)
 
 #define mk_sched_switch_protocol(conn, cap)     \
     conn->protocol = mk_sched_handler_cap(cap)
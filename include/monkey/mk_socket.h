@@ -56,11 +56,26 @@
 
 #define TCP_CORKING_PATH  "/proc/sys/net/ipv4/tcp_autocorking"
 
+/*
+ * Remote address of a connection. accept(2) fills it for free, so it's
+ * kept on the connection instead of calling getpeername(2) per request.
+ */
+struct mk_socket_addr {
+    socklen_t len;                     /* 0 if unknown */
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } addr;
+};
+
 int mk_socket_set_cork_flag(int fd, int state);
 int mk_socket_set_tcp_fastopen(int sockfd);
 int mk_socket_set_tcp_nodelay(int sockfd);
 int mk_socket_set_tcp_defer_accept(int sockfd);
 int mk_socket_set_tcp_reuseport(int sockfd);
+int mk_socket_set_tcp_notsent_lowat(int sockfd, int bytes);
+int mk_socket_tcp_cwnd(int sockfd);
 int mk_socket_set_nonblocking(int sockfd);
 
 int mk_socket_create(int domain, int type, int protocol);
@@ -74,23 +89,32 @@ int mk_socket_server(char *port, char *listen_addr,
                      int reuse_port, struct mk_server *server);
 
 int mk_socket_ip_str(int socket_fd, char **buf, int size, unsigned long *len);
+int mk_socket_addr_str(struct mk_socket_addr *peer, char *buf, int size,
+                       unsigned long *len);
+int mk_socket_addr_port(struct mk_socket_addr *peer);
 
 
-static inline int mk_socket_accept(int server_fd)
+static inline int mk_socket_accept(int server_fd, struct mk_socket_addr *peer)
 {
     int remote_fd;
 
-    struct sockaddr sock_addr;
-    socklen_t socket_size = sizeof(struct sockaddr);
+    peer->len = sizeof(peer->addr);
 
 #ifdef MK_HAVE_ACCEPT4
-    remote_fd = accept4(server_fd, &sock_addr, &socket_size,
+    remote_fd = accept4(server_fd, &peer->addr.sa, &peer->len,
                         SOCK_NONBLOCK | SOCK_CLOEXEC);
 #else
-    remote_fd = accept(server_fd, &sock_addr, &socket_size);
+    remote_fd = accept(server_fd, &peer->addr.sa, &peer->len);
     mk_socket_set_nonblocking(remote_fd);
 #endif
 
+    /* Unix sockets or a truncated address: let users fall back */
+    if (peer->len > sizeof(peer->addr) ||
+        (peer->addr.sa.sa_family != AF_INET &&
+         peer->addr.sa.sa_family != AF_INET6)) {
+        peer->len = 0;
+    }
+
     return remote_fd;
 }
 
@@ -32,6 +32,8 @@
 #define MK_STREAM_IOV       1  /* mk_iov struct        */
 #define MK_STREAM_FILE      2  /* opened file          */
 #define MK_STREAM_SOCKET    3  /* socket, scared..     */
+#define MK_STREAM_COPYBUF   4  /* raw data copied into the stream */
+#define MK_STREAM_PIPE      5  /* pipe, moved with splice(2)      */
 
 /* Channel return values for write event */
 #define MK_CHANNEL_OK       0  /* channel is ok (channel->status) */
@@ -41,16 +43,19 @@
 #define MK_CHANNEL_EMPTY    8  /* no streams available         */
 #define MK_CHANNEL_BUSY    16  /* cannot write, busy (EAGAIN)  */
 #define MK_CHANNEL_UNKNOWN 32  /* unhandled                    */
+#define MK_CHANNEL_WAIT    64  /* sleeping, waiting for data   */
 
 /* Channel status */
 #define MK_CHANNEL_DISABLED 0 /* channel is sleeping */
 #define MK_CHANNEL_ENABLED  1 /* channel enabled, have some data */
 
 /*
- * Channel types: by default the only channel supported
- * is a direct write to the network layer.
+ * Channel types: by default the channel is a direct write to the
+ * network layer. A HTTP/2 stream channel is virtual: its data is
+ * framed by the HTTP/2 session owning the connection.
  */
 #define MK_CHANNEL_SOCKET 0
+#define MK_CHANNEL_HTTP2  1
 
 /*
  * A channel represents an end-point of a stream, for short
@@ -67,6 +72,10 @@ struct mk_channel {
     struct mk_plugin_network *io;
     struct mk_list streams;
     void *thread;
+
+    int metrics;           /* stamp first_out, metrics enabled */
+    uint64_t bytes_out;    /* bytes written so far             */
+    uint64_t first_out;    /* usec of the first write, or 0    */
 };
 
 /* Stream input source */
@@ -78,6 +87,10 @@ struct mk_stream_input {
     size_t bytes_total;    /* Total of data from the input    */
     off_t  bytes_offset;   /* Data already sent               */
 
+    /* Files: check page cache residency before send (mk_prefetch.c) */
+    int    prefetch;
+    off_t  prefetch_ready; /* data known to be resident       */
+
     /*
      * Based on the stream input type, 'data' could reference a RAW buffer
      * or a mk_iov struct.
@@ -131,6 +144,12 @@ static inline int mk_channel_is_empty(struct mk_channel *channel)
     return mk_list_is_empty(&channel->streams);
 }
 
+static inline int mk_channel_can_splice(struct mk_channel *channel)
+{
+    return (channel->type == MK_CHANNEL_SOCKET && channel->io &&
+            channel->io->splice != NULL);
+}
+
 static inline void mk_channel_append_stream(struct mk_channel *channel,
                                             struct mk_stream *stream)
 {
@@ -169,6 +188,8 @@ static inline int mk_stream_input(struct mk_stream *stream,
     in->fd           = fd;
     in->type         = type;
     in->bytes_offset = offset;
+    in->prefetch     = MK_FALSE;
+    in->prefetch_ready = 0;
     in->buffer       = buffer;
     in->cb_consumed  = cb_consumed;
     in->cb_finished  = cb_finished;
@@ -232,6 +253,56 @@ static inline int mk_stream_in_raw(struct mk_stream *stream,
                            cb_consumed, cb_finished);
 }
 
+/*
+ * Data available on a pipe, spliced to the channel: only valid when the
+ * channel network layer implements splice (mk_channel_can_splice()).
+ */
+static inline int mk_stream_in_pipe(struct mk_stream *stream,
+                                    struct mk_stream_input *in, int fd,
+                                    size_t length,
+                                    void (*cb_consumed)(struct mk_stream_input *, long),
+                                    void (*cb_finished)(struct mk_stream_input *))
+{
+    return mk_stream_input(stream,
+                           in,
+                           MK_STREAM_PIPE,
+                           fd,
+                           NULL, length,
+                           0,
+                           cb_consumed, cb_finished);
+}
+
+/*
+ * Like mk_stream_in_raw() but the data is copied, so the caller can reuse
+ * its buffer right away. The copy is released with the input.
+ */
+static inline int mk_stream_in_cbuf(struct mk_stream *stream,
+                                    struct mk_stream_input *in,
+                                    char *buf, size_t length,
+                                    void (*cb_consumed)(struct mk_stream_input *, long),
+                                    void (*cb_finished)(struct mk_stream_input *))
+{
+    int ret;
+    char *copy;
+
+    copy = mk_mem_alloc(length);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, buf, length);
+
+    ret = mk_stream_input(stream,
+                          in,
+                          MK_STREAM_COPYBUF,
+                          -1,
+                          copy, length,
+                          0,
+                          cb_consumed, cb_finished);
+    if (ret != 0) {
+        mk_mem_free(copy);
+    }
+    return ret;
+}
 
 static inline void mk_stream_release(struct mk_stream *stream)
 {
@@ -324,6 +395,9 @@ static inline void mk_stream_input_consume(struct mk_stream_input *in, long byte
     else if (in->type == MK_STREAM_COPYBUF) {
         fmt = "[INPUT_CBUF %p] bytes consumed %lu/%lu";
     }
+    else if (in->type == MK_STREAM_PIPE) {
+        fmt = "[INPUT_PIPE %p] bytes consumed %lu/%lu";
+    }
     else {
         fmt = "[INPUT_UNKW %p] bytes consumed %lu/%lu";
     }
@@ -366,6 +440,9 @@ static inline void mk_channel_debug(struct mk_channel *channel)
             case MK_STREAM_COPYBUF:
                 printf("     in.%i] %p COPYBUF: ", i_input, in);
                 break;
+            case MK_STREAM_PIPE:
+                printf("     in.%i] %p PIPE   : ", i_input, in);
+                break;
             case MK_STREAM_EOF:
                 printf("%i) [%p] STREAM EOF    : ", i, stream);
                 break;
@@ -33,6 +33,7 @@ extern __thread struct mk_gmt_cache *mk_tls_cache_gmtext;
 
 /* mk_vhost.c */
 extern __thread struct mk_list *mk_tls_vhost_fdt;
+extern __thread struct mk_vhost_route_cache *mk_tls_vhost_route_cache;
 
 /* mk_scheduler.c */
 extern __thread struct rb_root *mk_tls_sched_cs;
@@ -40,6 +41,18 @@ extern __thread struct mk_list *mk_tls_sched_cs_incomplete;
 extern __thread struct mk_sched_notif *mk_tls_sched_worker_notif;
 extern __thread struct mk_sched_worker *mk_tls_sched_worker_node;
 
+/* mk_clock.c */
+extern __thread struct mk_clock *mk_tls_clock;
+
+/* mk_prefetch.c */
+extern __thread struct mk_prefetch_worker *mk_tls_prefetch_worker;
+
+/* mk_resolver.c */
+extern __thread struct mk_resolver_worker *mk_tls_resolver_worker;
+
+/* mk_metrics.c */
+extern __thread struct mk_metrics *mk_tls_metrics;
+
 /* mk_server.c */
 extern __thread struct mk_list *mk_tls_server_listen;
 extern __thread struct mk_server_timeout *mk_tls_server_timeout;
@@ -60,6 +73,7 @@ pthread_key_t mk_tls_cache_gmtext;
 
 /* mk_vhost.c */
 pthread_key_t mk_tls_vhost_fdt;
+pthread_key_t mk_tls_vhost_route_cache;
 
 /* mk_scheduler.c */
 pthread_key_t mk_tls_sched_cs;
@@ -67,6 +81,18 @@ pthread_key_t mk_tls_sched_cs_incomplete;
 pthread_key_t mk_tls_sched_worker_notif;
 pthread_key_t mk_tls_sched_worker_node;
 
+/* mk_clock.c */
+pthread_key_t mk_tls_clock;
+
+/* mk_prefetch.c */
+pthread_key_t mk_tls_prefetch_worker;
+
+/* mk_resolver.c */
+pthread_key_t mk_tls_resolver_worker;
+
+/* mk_metrics.c */
+pthread_key_t mk_tls_metrics;
+
 /* mk_server.c */
 pthread_key_t mk_tls_server_listen;
 pthread_key_t mk_tls_server_timeout;
@@ -83,6 +109,7 @@ pthread_key_t mk_tls_server_timeout;
                                                                 \
     /* mk_vhost.c */                                            \
     pthread_key_create(&mk_tls_vhost_fdt, NULL);                \
+    pthread_key_create(&mk_tls_vhost_route_cache, NULL);        \
                                                                 \
     /* mk_scheduler.c */                                        \
     pthread_key_create(&mk_tls_sched_cs, NULL);                 \
@@ -90,6 +117,18 @@ pthread_key_t mk_tls_server_timeout;
     pthread_key_create(&mk_tls_sched_worker_notif, NULL);       \
     pthread_key_create(&mk_tls_sched_worker_node, NULL);        \
                                                                 \
+    /* mk_clock.c */                                            \
+    pthread_key_create(&mk_tls_clock, NULL);                    \
+                                                                \
+    /* mk_prefetch.c */                                         \
+    pthread_key_create(&mk_tls_prefetch_worker, NULL);          \
+                                                                \
+    /* mk_resolver.c */                                         \
+    pthread_key_create(&mk_tls_resolver_worker, NULL);          \
+                                                                \
+    /* mk_metrics.c */                                          \
+    pthread_key_create(&mk_tls_metrics, NULL);                  \
+                                                                \
     /* mk_server.c */                                           \
     pthread_key_create(&mk_tls_server_listen, NULL);            \
     pthread_key_create(&mk_tls_server_timeout, NULL);
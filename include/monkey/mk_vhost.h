@@ -37,8 +37,22 @@ struct mk_vhost_handler_param {
     struct mk_list _head;
 };
 
+/*
+ * Handler match rules are compiled by mk_vhost_map_handlers(): rules that
+ * are plain literals with optional anchors skip regexec(3).
+ */
+#define MK_VHOST_MATCH_REGEX     0         /* full POSIX regex               */
+#define MK_VHOST_MATCH_EXACT     1         /* ^literal$                      */
+#define MK_VHOST_MATCH_PREFIX    2         /* ^literal                       */
+#define MK_VHOST_MATCH_SUFFIX    3         /* literal$                       */
+#define MK_VHOST_MATCH_CONTAINS  4         /* literal                        */
+
 struct mk_vhost_handler {
     void *match;                           /* regex match rule               */
+    char *rule;                            /* match rule as configured       */
+    int match_type;                        /* MK_VHOST_MATCH_*               */
+    int index;                             /* position in vhost->handlers    */
+    mk_ptr_t literal;                      /* literal for non-regex rules    */
     char *name;                            /* plugin handler name            */
     int n_params;                          /* number of parameters           */
 
@@ -51,6 +65,52 @@ struct mk_vhost_handler {
     struct mk_list _head;                  /* link to vhost->handlers        */
 };
 
+/* Literal rule indexed by the routing table */
+struct mk_vhost_route_entry {
+    int type;
+    unsigned int hash;
+    struct mk_vhost_handler *handler;      /* first handler with the rule   */
+    struct mk_vhost_route_entry *next;
+};
+
+/* Per virtual host routing table, built by mk_vhost_map_handlers() */
+struct mk_vhost_routes {
+    unsigned int mask;
+    struct mk_vhost_route_entry **table;   /* exact, prefix and suffix      */
+    struct mk_vhost_route_entry *entries;
+
+    /* distinct literal lengths of prefix and suffix rules */
+    int n_prefix_lens;
+    int n_suffix_lens;
+    int *prefix_lens;
+    int *suffix_lens;
+
+    /* 'contains' and regex rules, evaluated in configuration order */
+    int n_scan;
+    struct mk_vhost_handler **scan;
+};
+
+/* Per worker cache of routing decisions, set associative with LRU */
+#define MK_VHOST_ROUTE_CACHE_SETS    64
+#define MK_VHOST_ROUTE_CACHE_WAYS     4
+#define MK_VHOST_ROUTE_CACHE_URI    128
+
+struct mk_vhost_route_cache_entry {
+    struct mk_vhost *host;
+    struct mk_vhost_handler *handler;      /* NULL: no handler matched      */
+    unsigned int hash;
+    unsigned int tick;                     /* last use, for LRU eviction    */
+    int len;
+    char uri[MK_VHOST_ROUTE_CACHE_URI];
+};
+
+struct mk_vhost_route_cache {
+    unsigned int tick;
+    unsigned int generation;
+    struct mk_vhost_route_cache_entry entries[MK_VHOST_ROUTE_CACHE_SETS *
+                                              MK_VHOST_ROUTE_CACHE_WAYS];
+};
+
 struct mk_vhost
 {
     int id;
@@ -68,6 +128,7 @@ struct mk_vhost
 
     /* content handlers */
     struct mk_list handlers;
+    struct mk_vhost_routes *routes;
 
     /* link node */
     struct mk_list _head;
@@ -82,6 +143,31 @@ struct mk_vhost_alias
 };
 
 
+/*
+ * Virtual host lookup table: every server name is indexed in a hash
+ * table (case-insensitive). Wildcard names like '*.example.com' are
+ * indexed by their suffix ('.example.com') in a second table.
+ */
+struct mk_vhost_hash_entry {
+    unsigned int hash;
+    unsigned int len;
+    char *name;                            /* lowercase name or suffix    */
+    struct mk_vhost *host;
+    struct mk_vhost_alias *alias;
+    struct mk_vhost_hash_entry *next;      /* collision chain             */
+};
+
+struct mk_vhost_table {
+    unsigned int mask;                     /* buckets - 1 (power of two)  */
+    int n_wildcards;
+    struct mk_vhost_hash_entry **exact;
+    struct mk_vhost_hash_entry **wildcard;
+    struct mk_vhost_hash_entry *entries;
+
+    /* previous table, released on mk_vhost_free_all() */
+    struct mk_vhost_table *retired;
+};
+
 #define VHOST_FDT_HASHTABLE_SIZE   64
 #define VHOST_FDT_HASHTABLE_CHAINS  8
 
@@ -111,13 +197,19 @@ int mk_vhost_get(mk_ptr_t host, struct mk_vhost **vhost, struct
                  struct mk_server *server);
 void mk_vhost_set_single(char *path, struct mk_server *server);
 void mk_vhost_init(char *path, struct mk_server *server);
+int mk_vhost_table_build(struct mk_server *server);
 
 int mk_vhost_fdt_worker_init(struct mk_server *server);
 int mk_vhost_fdt_worker_exit(struct mk_server *server);
+int mk_vhost_route_worker_init();
+int mk_vhost_route_worker_exit();
 int mk_vhost_open(struct mk_http_request *sr, struct mk_server *server);
 int mk_vhost_close(struct mk_http_request *sr, struct mk_server *server);
 void mk_vhost_free_all(struct mk_server *server);
 int mk_vhost_map_handlers(struct mk_server *server);
+struct mk_vhost_handler *mk_vhost_handler_find(struct mk_vhost *host,
+                                               char *uri, int len,
+                                               struct mk_vhost_handler *prev);
 struct mk_vhost_handler *mk_vhost_handler_match(char *match,
                                                 void (*cb)(struct mk_http_request *,
                                                            void *),
@@ -27,6 +27,7 @@
 #include <monkey/mk_core.h>
 
 __thread struct mk_list *mk_tls_vhost_fdt;
+__thread struct mk_vhost_route_cache *mk_tls_vhost_route_cache;
 
 #endif /* MK_VHOST_TLS_H */
 #endif /* MK_HAVE_C_TLS  */
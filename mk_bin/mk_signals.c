@@ -59,13 +59,12 @@ static void mk_signal_handler(int signo, siginfo_t *si, void *context UNUSED_PAR
         break;
     case SIGHUP:
         /*
-         * TODO:
-         * we should implement the httpd config reload here (not in SIGUSR2).
-         * Daemon processes “overload” this signal with a mechanism to instruct them to
-         * reload their configuration files. Sending SIGHUP to Apache, for example,
-         * instructs it to reread httpd.conf.
+         * Reopen the log files (eg: after logrotate), the log writers
+         * notice the new value on their next wake up.
+         *
+         * TODO: reload the configuration as well, like other daemons.
          */
-        mk_signal_exit();
+        server_context->reopen_logs++;
         break;
     case SIGBUS:
     case SIGSEGV:
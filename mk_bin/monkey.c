@@ -318,10 +318,16 @@ int main(int argc, char **argv)
     /* Server loop, let's listen for incomming clients */
     mk_server_loop(server);
 
-    /* Hang here, basically do nothing as threads are doing the job. */
+    /*
+     * Hang here, basically do nothing as threads are doing the job. The
+     * handlers that must stop the server exit by themselves, SIGHUP just
+     * returns.
+     */
     sigset_t mask;
     sigprocmask(0, NULL, &mask);
-    sigsuspend(&mask);
+    while (1) {
+        sigsuspend(&mask);
+    }
 
     return 0;
 }
@@ -0,0 +1,922 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mk_core/mk_memory.h>
+#include <mk_core/mk_pthread.h>
+#include <mk_core/mk_hpack.h>
+
+#define HPACK_ENTRY(n, v)  { n, sizeof(n) - 1, v, sizeof(v) - 1 }
+
+/* RFC 7541 Appendix A: static table, index 1 is the first entry */
+static const struct {
+    const char *name;
+    uint32_t name_len;
+    const char *value;
+    uint32_t value_len;
+} hpack_static[MK_HPACK_STATIC_SIZE] = {
+    HPACK_ENTRY(":authority", ""),
+    HPACK_ENTRY(":method", "GET"),
+    HPACK_ENTRY(":method", "POST"),
+    HPACK_ENTRY(":path", "/"),
+    HPACK_ENTRY(":path", "/index.html"),
+    HPACK_ENTRY(":scheme", "http"),
+    HPACK_ENTRY(":scheme", "https"),
+    HPACK_ENTRY(":status", "200"),
+    HPACK_ENTRY(":status", "204"),
+    HPACK_ENTRY(":status", "206"),
+    HPACK_ENTRY(":status", "304"),
+    HPACK_ENTRY(":status", "400"),
+    HPACK_ENTRY(":status", "404"),
+    HPACK_ENTRY(":status", "500"),
+    HPACK_ENTRY("accept-charset", ""),
+    HPACK_ENTRY("accept-encoding", "gzip, deflate"),
+    HPACK_ENTRY("accept-language", ""),
+    HPACK_ENTRY("accept-ranges", ""),
+    HPACK_ENTRY("accept", ""),
+    HPACK_ENTRY("access-control-allow-origin", ""),
+    HPACK_ENTRY("age", ""),
+    HPACK_ENTRY("allow", ""),
+    HPACK_ENTRY("authorization", ""),
+    HPACK_ENTRY("cache-control", ""),
+    HPACK_ENTRY("content-disposition", ""),
+    HPACK_ENTRY("content-encoding", ""),
+    HPACK_ENTRY("content-language", ""),
+    HPACK_ENTRY("content-length", ""),
+    HPACK_ENTRY("content-location", ""),
+    HPACK_ENTRY("content-range", ""),
+    HPACK_ENTRY("content-type", ""),
+    HPACK_ENTRY("cookie", ""),
+    HPACK_ENTRY("date", ""),
+    HPACK_ENTRY("etag", ""),
+    HPACK_ENTRY("expect", ""),
+    HPACK_ENTRY("expires", ""),
+    HPACK_ENTRY("from", ""),
+    HPACK_ENTRY("host", ""),
+    HPACK_ENTRY("if-match", ""),
+    HPACK_ENTRY("if-modified-since", ""),
+    HPACK_ENTRY("if-none-match", ""),
+    HPACK_ENTRY("if-range", ""),
+    HPACK_ENTRY("if-unmodified-since", ""),
+    HPACK_ENTRY("last-modified", ""),
+    HPACK_ENTRY("link", ""),
+    HPACK_ENTRY("location", ""),
+    HPACK_ENTRY("max-forwards", ""),
+    HPACK_ENTRY("proxy-authenticate", ""),
+    HPACK_ENTRY("proxy-authorization", ""),
+    HPACK_ENTRY("range", ""),
+    HPACK_ENTRY("referer", ""),
+    HPACK_ENTRY("refresh", ""),
+    HPACK_ENTRY("retry-after", ""),
+    HPACK_ENTRY("server", ""),
+    HPACK_ENTRY("set-cookie", ""),
+    HPACK_ENTRY("strict-transport-security", ""),
+    HPACK_ENTRY("transfer-encoding", ""),
+    HPACK_ENTRY("user-agent", ""),
+    HPACK_ENTRY("vary", ""),
+    HPACK_ENTRY("via", ""),
+    HPACK_ENTRY("www-authenticate", ""),
+};
+
+/*
+ * Perfect hash of the 52 distinct static table names: the length and the
+ * 2nd, last and next to last characters are packed in 32 bits and reduced
+ * by a multiplicative hash to 7 bits. Every slot keeps the lowest static
+ * index for that name (0 means empty). Generated offline.
+ */
+#define HPACK_STATIC_HASH_MUL    0x3ac5b7b9u
+#define HPACK_STATIC_HASH_SHIFT  25
+
+static const uint8_t hpack_static_hash[128] = {
+    38,  0,  0, 19,  0,  0,  0, 59,  0,  0,  0,  0,  0,  0,  4,  0,
+     0,  0, 33,  0, 21, 43, 22, 54,  0,  0,  0,  0,  0,  0,  0, 25,
+     0,  0,  0, 60,  0, 45,  0,  0, 16, 27, 53,  0,  0, 52, 57,  0,
+     0,  0,  0, 37, 28, 51,  0,  0,  0,  0,  0, 47, 32, 20, 48,  0,
+    23,  8,  0, 34, 42,  0,  0, 29, 49,  0,  0,  0,  0,  0,  0, 24,
+    30,  0,  0, 44,  0, 55,  6,  0,  0,  0, 40,  0, 46,  0,  0,  0,
+     0,  0,  2,  0,  0, 39,  0, 36, 26, 17,  0,  0, 35, 58,  0,  0,
+     1,  0, 61, 31, 15,  0,  0,  0, 41,  0,  0, 18,  0, 50,  0, 56,
+};
+
+/* Returns the first static index for 'name' or 0 */
+static inline int hpack_static_find(const char *name, size_t len)
+{
+    int i;
+    uint32_t key;
+
+    if (len < 2) {
+        return 0;
+    }
+
+    key = (uint32_t) len |
+        ((uint32_t) (uint8_t) name[1] << 8) |
+        ((uint32_t) (uint8_t) name[len - 1] << 16) |
+        ((uint32_t) (uint8_t) name[len - 2] << 24);
+    i = hpack_static_hash[(uint32_t) (key * HPACK_STATIC_HASH_MUL) >>
+                          HPACK_STATIC_HASH_SHIFT];
+
+    if (i > 0 && hpack_static[i - 1].name_len == len &&
+        memcmp(hpack_static[i - 1].name, name, len) == 0) {
+        return i;
+    }
+    return 0;
+}
+
+/*
+ * RFC 7541 Appendix B. The Huffman code is canonical: codes of the same
+ * length are consecutive and sorted by symbol, so the whole code is given
+ * by the symbols ordered by (length, symbol) plus the first code, the
+ * number of codes and the offset into that list for every length.
+ */
+static const uint16_t huff_sym[257] = {
+     48,  49,  50,  97,  99, 101, 105, 111, 115, 116,  32,  37,
+     45,  46,  47,  51,  52,  53,  54,  55,  56,  57,  61,  65,
+     95,  98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+     58,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,
+     77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,
+    106, 107, 113, 118, 119, 120, 121, 122,  38,  42,  44,  59,
+     88,  90,  33,  34,  40,  41,  63,  39,  43, 124,  35,  62,
+      0,  36,  64,  91,  93, 126,  94, 125,  60,  96, 123,  92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233,   1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239,   9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254,   2,   3,   4,   5,
+      6,   7,   8,  11,  12,  14,  15,  16,  17,  18,  19,  20,
+     21,  23,  24,  25,  26,  27,  28,  29,  30,  31, 127, 220,
+    249,  10,  13,  22, 256,
+};
+
+static const struct {
+    uint32_t first;
+    uint16_t count;
+    uint16_t offset;
+} huff_len[26] = {
+    {          0,  10,   0 }, /*  5 bits */
+    {         20,  26,  10 }, /*  6 bits */
+    {         92,  32,  36 }, /*  7 bits */
+    {        248,   6,  68 }, /*  8 bits */
+    {          0,   0,   0 }, /*  9 bits */
+    {       1016,   5,  74 }, /* 10 bits */
+    {       2042,   3,  79 }, /* 11 bits */
+    {       4090,   2,  82 }, /* 12 bits */
+    {       8184,   6,  84 }, /* 13 bits */
+    {      16380,   2,  90 }, /* 14 bits */
+    {      32764,   3,  92 }, /* 15 bits */
+    {          0,   0,   0 }, /* 16 bits */
+    {          0,   0,   0 }, /* 17 bits */
+    {          0,   0,   0 }, /* 18 bits */
+    {     524272,   3,  95 }, /* 19 bits */
+    {    1048550,   8,  98 }, /* 20 bits */
+    {    2097116,  13, 106 }, /* 21 bits */
+    {    4194258,  26, 119 }, /* 22 bits */
+    {    8388568,  29, 145 }, /* 23 bits */
+    {   16777194,  12, 174 }, /* 24 bits */
+    {   33554412,   4, 186 }, /* 25 bits */
+    {   67108832,  15, 190 }, /* 26 bits */
+    {  134217694,  19, 205 }, /* 27 bits */
+    {  268435426,  29, 224 }, /* 28 bits */
+    {          0,   0,   0 }, /* 29 bits */
+    { 1073741820,   4, 253 }, /* 30 bits */
+};
+
+#define HUFF_MIN_BITS     5
+#define HUFF_EOS        256
+
+/* Decoding state machine flags */
+#define HUFF_SYMBOLS    0x03    /* symbols emitted by this byte (0-2) */
+#define HUFF_ACCEPT     0x04    /* the input may end here             */
+#define HUFF_FAIL       0x08    /* EOS found in the input             */
+
+/*
+ * Byte at a time decoder: a state is an internal node of the code tree
+ * (there are exactly 256 of them) and every transition consumes a whole
+ * input byte, emitting up to two symbols since the shortest code has
+ * five bits.
+ */
+struct hpack_huff_state {
+    uint8_t state;
+    uint8_t flags;
+    uint8_t sym[2];
+};
+
+static struct hpack_huff_state huff_dec[256][256];
+static uint32_t huff_code[257];
+static uint8_t huff_bits[257];
+static pthread_once_t huff_once = PTHREAD_ONCE_INIT;
+
+static void hpack_huffman_init(void)
+{
+    int i;
+    int k;
+    int s;
+    int b;
+    int bit;
+    int node;
+    int nodes = 1;
+    int sym;
+    int nsym;
+    int flags;
+    uint32_t code;
+    int16_t tree[256][2];
+    uint8_t accept[256];
+    struct hpack_huff_state *e;
+
+    /*
+     * Build the tree from the canonical code. Children are internal node
+     * indexes (> 0, the root is never a child) or leaves -(symbol + 1).
+     */
+    memset(tree, '\0', sizeof(tree));
+    for (i = 0; i < 26; i++) {
+        for (k = 0; k < huff_len[i].count; k++) {
+            sym  = huff_sym[huff_len[i].offset + k];
+            code = huff_len[i].first + k;
+            huff_code[sym] = code;
+            huff_bits[sym] = i + HUFF_MIN_BITS;
+
+            node = 0;
+            for (bit = i + HUFF_MIN_BITS - 1; bit > 0; bit--) {
+                b = (code >> bit) & 0x1;
+                if (tree[node][b] == 0) {
+                    tree[node][b] = nodes++;
+                }
+                node = tree[node][b];
+            }
+            tree[node][code & 0x1] = -(sym + 1);
+        }
+    }
+
+    /* Valid padding: up to 7 bits, all set (a prefix of EOS) */
+    memset(accept, '\0', sizeof(accept));
+    node = 0;
+    for (i = 0; i < 8; i++) {
+        accept[node] = 1;
+        node = tree[node][1];
+    }
+
+    for (s = 0; s < 256; s++) {
+        for (b = 0; b < 256; b++) {
+            e = &huff_dec[s][b];
+            node = s;
+            nsym = 0;
+            flags = 0;
+
+            for (bit = 7; bit >= 0; bit--) {
+                node = tree[node][(b >> bit) & 0x1];
+                if (node < 0) {
+                    sym = -node - 1;
+                    if (sym == HUFF_EOS) {
+                        flags |= HUFF_FAIL;
+                        break;
+                    }
+                    e->sym[nsym++] = sym;
+                    node = 0;
+                }
+            }
+
+            if (!(flags & HUFF_FAIL)) {
+                e->state = node;
+                flags |= nsym;
+                if (accept[node]) {
+                    flags |= HUFF_ACCEPT;
+                }
+            }
+            e->flags = flags;
+        }
+    }
+}
+
+size_t mk_hpack_huffman_length(const char *str, size_t len)
+{
+    size_t i;
+    size_t bits = 0;
+
+    pthread_once(&huff_once, hpack_huffman_init);
+
+    for (i = 0; i < len; i++) {
+        bits += huff_bits[(uint8_t) str[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+int mk_hpack_huffman_encode(uint8_t *out, size_t size,
+                            const char *str, size_t len)
+{
+    int bits = 0;
+    size_t i;
+    size_t n = 0;
+    uint8_t sym;
+    uint64_t acc = 0;
+
+    pthread_once(&huff_once, hpack_huffman_init);
+
+    for (i = 0; i < len; i++) {
+        sym = str[i];
+        acc = (acc << huff_bits[sym]) | huff_code[sym];
+        bits += huff_bits[sym];
+
+        while (bits >= 8) {
+            if (n >= size) {
+                return -1;
+            }
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+
+    if (bits > 0) {
+        if (n >= size) {
+            return -1;
+        }
+        /* pad with the most significant bits of EOS */
+        out[n++] = (acc << (8 - bits)) | (0xff >> bits);
+    }
+
+    return n;
+}
+
+/* Returns the decoded length, 'dst' must fit (len * 8 / 5) bytes */
+int mk_hpack_huffman_decode(uint8_t *src, size_t len, char *dst)
+{
+    int n = 0;
+    int state = 0;
+    int flags = HUFF_ACCEPT;
+    size_t i;
+    const struct hpack_huff_state *e;
+
+    pthread_once(&huff_once, hpack_huffman_init);
+
+    for (i = 0; i < len; i++) {
+        e = &huff_dec[state][src[i]];
+        flags = e->flags;
+        if (flags & HUFF_FAIL) {
+            return -1;
+        }
+
+        if (flags & HUFF_SYMBOLS) {
+            dst[n++] = e->sym[0];
+            if ((flags & HUFF_SYMBOLS) == 2) {
+                dst[n++] = e->sym[1];
+            }
+        }
+        state = e->state;
+    }
+
+    if (!(flags & HUFF_ACCEPT)) {
+        return -1;
+    }
+    return n;
+}
+
+static int hpack_int_decode(uint8_t **p, uint8_t *end, int prefix,
+                            uint32_t *out)
+{
+    int shift = 0;
+    uint32_t max = (1 << prefix) - 1;
+    uint32_t val;
+    uint8_t *b = *p;
+
+    val = *b++ & max;
+    if (val == max) {
+        do {
+            if (b >= end || shift > 21) {
+                return -1;
+            }
+            val += (uint32_t) (*b & 0x7f) << shift;
+            shift += 7;
+        } while (*b++ & 0x80);
+    }
+
+    *p = b;
+    *out = val;
+    return 0;
+}
+
+static int hpack_string_decode(struct mk_hpack *ctx, uint8_t **p,
+                               uint8_t *end, size_t *scratch,
+                               char **out, size_t *out_len)
+{
+    int ret;
+    int huffman;
+    uint32_t len;
+
+    if (*p >= end) {
+        return -1;
+    }
+
+    huffman = (**p & 0x80);
+    if (hpack_int_decode(p, end, 7, &len) == -1 ||
+        len > (size_t) (end - *p)) {
+        return -1;
+    }
+
+    if (!huffman) {
+        *out = (char *) *p;
+        *out_len = len;
+    }
+    else {
+        ret = mk_hpack_huffman_decode(*p, len, ctx->buf + *scratch);
+        if (ret < 0) {
+            return -1;
+        }
+        *out = ctx->buf + *scratch;
+        *out_len = ret;
+        *scratch += ret;
+    }
+
+    *p += len;
+    return 0;
+}
+
+/*
+ * Dynamic table
+ * -------------
+ * Entries live in a circular array (index 0 is the newest one) and their
+ * names and values in a byte ring of twice the table size, so inserting a
+ * field never allocates. An entry is always contiguous: when it does not
+ * fit before the end it goes to the start, and in the rare case neither
+ * gap is large enough the live entries are compacted.
+ */
+static inline struct mk_hpack_entry *hpack_dynamic_get(struct mk_hpack *ctx,
+                                                       int i)
+{
+    return &ctx->entries[(ctx->head - i + ctx->capacity) % ctx->capacity];
+}
+
+/* Bytes used in the ring, empty entries take one to keep offsets ordered */
+static inline uint32_t hpack_entry_bytes(uint32_t len)
+{
+    return len > 0 ? len : 1;
+}
+
+static void hpack_evict(struct mk_hpack *ctx, uint32_t limit)
+{
+    struct mk_hpack_entry *e;
+
+    while (ctx->count > 0 && ctx->size > limit) {
+        e = hpack_dynamic_get(ctx, ctx->count - 1);
+        ctx->size -= (e->name_len + e->value_len + MK_HPACK_ENTRY_OVERHEAD);
+        ctx->count--;
+    }
+
+    if (ctx->count == 0) {
+        ctx->data_pos = 0;
+    }
+}
+
+/* Find room for 'len' bytes, -1 if the ring must be compacted first */
+static int hpack_data_place(struct mk_hpack *ctx, uint32_t len,
+                            uint32_t *offset)
+{
+    uint32_t tail;
+    struct mk_hpack_entry *oldest;
+    struct mk_hpack_entry *newest;
+
+    if (ctx->count == 0) {
+        *offset = 0;
+        return 0;
+    }
+
+    oldest = hpack_dynamic_get(ctx, ctx->count - 1);
+    newest = hpack_dynamic_get(ctx, 0);
+    tail = oldest->offset;
+
+    if (newest->offset >= tail) {
+        /* live data is [tail, pos) */
+        if (ctx->data_pos + len <= ctx->data_size) {
+            *offset = ctx->data_pos;
+            return 0;
+        }
+        if (len <= tail) {
+            *offset = 0;
+            return 0;
+        }
+    }
+    else if (ctx->data_pos + len <= tail) {
+        /* wrapped, live data is [tail, end) and [0, pos) */
+        *offset = ctx->data_pos;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Move the live entries to a new ring, the caller releases the old one */
+static int hpack_data_compact(struct mk_hpack *ctx)
+{
+    int i;
+    uint32_t pos = 0;
+    uint32_t len;
+    char *data;
+    struct mk_hpack_entry *e;
+
+    data = mk_mem_alloc(ctx->data_size);
+    if (!data) {
+        return -1;
+    }
+
+    for (i = ctx->count - 1; i >= 0; i--) {
+        e = hpack_dynamic_get(ctx, i);
+        len = e->name_len + e->value_len;
+        memcpy(data + pos, ctx->data + e->offset, len);
+        e->offset = pos;
+        pos += hpack_entry_bytes(len);
+    }
+
+    ctx->data = data;
+    ctx->data_pos = pos;
+    return 0;
+}
+
+static int hpack_table_get(struct mk_hpack *ctx, uint32_t index,
+                           char **name, size_t *name_len,
+                           char **value, size_t *value_len)
+{
+    struct mk_hpack_entry *e;
+
+    if (index == 0) {
+        return -1;
+    }
+
+    if (index <= MK_HPACK_STATIC_SIZE) {
+        *name = (char *) hpack_static[index - 1].name;
+        *name_len = hpack_static[index - 1].name_len;
+        *value = (char *) hpack_static[index - 1].value;
+        *value_len = hpack_static[index - 1].value_len;
+        return 0;
+    }
+
+    index -= (MK_HPACK_STATIC_SIZE + 1);
+    if (index >= (uint32_t) ctx->count) {
+        return -1;
+    }
+
+    e = hpack_dynamic_get(ctx, index);
+    *name = ctx->data + e->offset;
+    *name_len = e->name_len;
+    *value = *name + e->name_len;
+    *value_len = e->value_len;
+    return 0;
+}
+
+static int hpack_table_add(struct mk_hpack *ctx,
+                           char *name, size_t name_len,
+                           char *value, size_t value_len)
+{
+    uint32_t size;
+    uint32_t bytes;
+    uint32_t offset;
+    char *old = NULL;
+    struct mk_hpack_entry *e;
+
+    size = name_len + value_len + MK_HPACK_ENTRY_OVERHEAD;
+    if (size > ctx->max_size) {
+        /* RFC 7541 4.4: not an error, the table just gets emptied */
+        hpack_evict(ctx, 0);
+        return 0;
+    }
+    hpack_evict(ctx, ctx->max_size - size);
+
+    if (!ctx->data) {
+        ctx->data_size = ctx->settings_max * 2;
+        ctx->data = mk_mem_alloc(ctx->data_size);
+        if (!ctx->data) {
+            return -1;
+        }
+        ctx->data_pos = 0;
+    }
+
+    bytes = hpack_entry_bytes(name_len + value_len);
+    if (hpack_data_place(ctx, bytes, &offset) == -1) {
+        old = ctx->data;
+        if (hpack_data_compact(ctx) == -1) {
+            return -1;
+        }
+        offset = ctx->data_pos;
+    }
+
+    /*
+     * The name may reference an entry just evicted (or moved by the
+     * compaction), the old ring is released once it has been copied.
+     */
+    memmove(ctx->data + offset, name, name_len);
+    memcpy(ctx->data + offset + name_len, value, value_len);
+    if (old) {
+        mk_mem_free(old);
+    }
+
+    ctx->head = (ctx->head + 1) % ctx->capacity;
+    e = &ctx->entries[ctx->head];
+    e->offset = offset;
+    e->name_len = name_len;
+    e->value_len = value_len;
+
+    ctx->data_pos = offset + bytes;
+    ctx->count++;
+    ctx->size += size;
+    return 0;
+}
+
+int mk_hpack_init(struct mk_hpack *ctx, uint32_t max_size)
+{
+    pthread_once(&huff_once, hpack_huffman_init);
+
+    /* Every entry takes at least 32 octets, the array never grows */
+    ctx->capacity = (max_size / MK_HPACK_ENTRY_OVERHEAD) + 1;
+    ctx->entries = mk_mem_alloc_z(sizeof(struct mk_hpack_entry) *
+                                  ctx->capacity);
+    if (!ctx->entries) {
+        return -1;
+    }
+    ctx->head = ctx->capacity - 1;
+    ctx->count = 0;
+    ctx->data = NULL;
+    ctx->data_size = 0;
+    ctx->data_pos = 0;
+    ctx->size = 0;
+    ctx->max_size = max_size;
+    ctx->settings_max = max_size;
+    ctx->buf = NULL;
+    ctx->buf_size = 0;
+    return 0;
+}
+
+void mk_hpack_destroy(struct mk_hpack *ctx)
+{
+    mk_mem_free(ctx->entries);
+    ctx->entries = NULL;
+    if (ctx->data) {
+        mk_mem_free(ctx->data);
+        ctx->data = NULL;
+    }
+    if (ctx->buf) {
+        mk_mem_free(ctx->buf);
+        ctx->buf = NULL;
+    }
+}
+
+/*
+ * Decode a complete header block. For every field the callback 'cb' is
+ * invoked, the name and value references are only valid during the call.
+ * Returns 0 on success, -1 on a decoding (COMPRESSION_ERROR) failure or
+ * the non-zero value returned by the callback.
+ */
+int mk_hpack_decode(struct mk_hpack *ctx, uint8_t *block, size_t len,
+                    mk_hpack_cb cb, void *data)
+{
+    int ret;
+    int fields = 0;
+    uint8_t b;
+    uint8_t *p = block;
+    uint8_t *end = block + len;
+    uint32_t index;
+    size_t need;
+    size_t scratch;
+    size_t name_len;
+    size_t value_len;
+    char *name;
+    char *value;
+    char *tmp;
+
+    /* Huffman output is at most 8/5 of its input */
+    need = (len * 8 / 5) + 1;
+    if (ctx->buf_size < need) {
+        tmp = mk_mem_realloc(ctx->buf, need);
+        if (!tmp) {
+            return -1;
+        }
+        ctx->buf = tmp;
+        ctx->buf_size = need;
+    }
+
+    while (p < end) {
+        b = *p;
+        scratch = 0;
+
+        if (b & 0x80) {
+            /* Indexed Header Field */
+            if (hpack_int_decode(&p, end, 7, &index) == -1 ||
+                hpack_table_get(ctx, index, &name, &name_len,
+                                &value, &value_len) == -1) {
+                return -1;
+            }
+        }
+        else if ((b & 0xe0) == 0x20) {
+            /* Dynamic Table Size Update, only before the first field */
+            if (fields > 0 ||
+                hpack_int_decode(&p, end, 5, &index) == -1 ||
+                index > ctx->settings_max) {
+                return -1;
+            }
+            ctx->max_size = index;
+            hpack_evict(ctx, index);
+            continue;
+        }
+        else {
+            /*
+             * Literal Header Field: with incremental indexing (01),
+             * without indexing (0000) or never indexed (0001).
+             */
+            ret = hpack_int_decode(&p, end, (b & 0x40) ? 6 : 4, &index);
+            if (ret == -1) {
+                return -1;
+            }
+
+            if (index == 0) {
+                ret = hpack_string_decode(ctx, &p, end, &scratch,
+                                          &name, &name_len);
+            }
+            else {
+                ret = hpack_table_get(ctx, index, &name, &name_len,
+                                      &value, &value_len);
+            }
+            if (ret == -1) {
+                return -1;
+            }
+
+            if (hpack_string_decode(ctx, &p, end, &scratch,
+                                    &value, &value_len) == -1) {
+                return -1;
+            }
+        }
+
+        fields++;
+        ret = cb(data, name, name_len, value, value_len);
+        if (ret != 0) {
+            return ret;
+        }
+
+        if ((b & 0xc0) == 0x40) {
+            if (hpack_table_add(ctx, name, name_len,
+                                value, value_len) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int hpack_int_encode(uint8_t *out, size_t size, uint8_t flags,
+                            int prefix, uint32_t val)
+{
+    int n = 1;
+    uint32_t max = (1 << prefix) - 1;
+
+    if (size < 1) {
+        return -1;
+    }
+
+    if (val < max) {
+        out[0] = flags | val;
+        return 1;
+    }
+
+    out[0] = flags | max;
+    val -= max;
+    while (val >= 0x80) {
+        if ((size_t) n >= size) {
+            return -1;
+        }
+        out[n++] = (val & 0x7f) | 0x80;
+        val >>= 7;
+    }
+    if ((size_t) n >= size) {
+        return -1;
+    }
+    out[n++] = val;
+    return n;
+}
+
+/* String literal, Huffman coded when it is shorter */
+static int hpack_string_encode(uint8_t *out, size_t size,
+                               const char *str, size_t len)
+{
+    int n;
+    int ret;
+    size_t hlen;
+
+    hlen = mk_hpack_huffman_length(str, len);
+    if (hlen < len) {
+        n = hpack_int_encode(out, size, 0x80, 7, hlen);
+        if (n == -1) {
+            return -1;
+        }
+        ret = mk_hpack_huffman_encode(out + n, size - n, str, len);
+        if (ret == -1) {
+            return -1;
+        }
+        return n + ret;
+    }
+
+    n = hpack_int_encode(out, size, 0x00, 7, len);
+    if (n == -1 || len > size - n) {
+        return -1;
+    }
+    memcpy(out + n, str, len);
+    return n + len;
+}
+
+int mk_hpack_encode_status(uint8_t *out, size_t size, int status)
+{
+    int i;
+    char tmp[4];
+
+    /* Indexed field when the static table has it */
+    switch (status) {
+    case 200: i =  8; break;
+    case 204: i =  9; break;
+    case 206: i = 10; break;
+    case 304: i = 11; break;
+    case 400: i = 12; break;
+    case 404: i = 13; break;
+    case 500: i = 14; break;
+    default:  i =  0; break;
+    }
+    if (i > 0) {
+        return hpack_int_encode(out, size, 0x80, 7, i);
+    }
+
+    if (size < 1 || status < 100 || status > 999) {
+        return -1;
+    }
+
+    /* Literal without indexing, indexed name ':status' */
+    snprintf(tmp, sizeof(tmp), "%03i", status);
+    out[0] = 0x08;
+    i = hpack_string_encode(out + 1, size - 1, tmp, 3);
+    if (i == -1) {
+        return -1;
+    }
+    return i + 1;
+}
+
+/*
+ * Encode a field, 'name' must be lowercase. Fields fully present in the
+ * static table are indexed, any other one is sent as a literal without
+ * indexing so the peer table is never used.
+ */
+int mk_hpack_encode_header(uint8_t *out, size_t size,
+                           char *name, size_t name_len,
+                           char *value, size_t value_len)
+{
+    int i;
+    int n;
+    int ret;
+
+    i = hpack_static_find(name, name_len);
+    if (i > 0) {
+        /* entries sharing a name are consecutive */
+        for (ret = i; ret <= MK_HPACK_STATIC_SIZE &&
+                 hpack_static[ret - 1].name_len == name_len &&
+                 memcmp(hpack_static[ret - 1].name, name, name_len) == 0;
+             ret++) {
+            if (hpack_static[ret - 1].value_len == value_len &&
+                memcmp(hpack_static[ret - 1].value, value, value_len) == 0) {
+                return hpack_int_encode(out, size, 0x80, 7, ret);
+            }
+        }
+        n = hpack_int_encode(out, size, 0x00, 4, i);
+    }
+    else {
+        n = hpack_int_encode(out, size, 0x00, 4, 0);
+        if (n != -1) {
+            ret = hpack_string_encode(out + n, size - n, name, name_len);
+            n = (ret == -1) ? -1 : n + ret;
+        }
+    }
+    if (n == -1) {
+        return -1;
+    }
+
+    ret = hpack_string_encode(out + n, size - n, value, value_len);
+    if (ret == -1) {
+        return -1;
+    }
+    return n + ret;
+}
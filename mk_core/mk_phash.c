@@ -0,0 +1,291 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <mk_core/mk_memory.h>
+#include <mk_core/mk_phash.h>
+
+#define MK_PHASH_MAX_DISP   0x10000
+
+static inline int phash_lower(int c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/*
+ * Case-insensitive 64 bits FNV-1a: the lower half selects the bucket and
+ * the upper half is mixed with the bucket displacement to get the slot,
+ * so a lookup only walks the key once.
+ */
+static inline uint64_t phash_hash(const char *key, int len)
+{
+    int i;
+    uint64_t h = 14695981039346656037ULL;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) phash_lower(key[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Map a 32 bits value to [0, n) without a division */
+static inline unsigned int phash_reduce(uint32_t x, unsigned int n)
+{
+    return (unsigned int) (((uint64_t) x * n) >> 32);
+}
+
+static inline uint32_t phash_mix(uint32_t x)
+{
+    /* murmur3 finalizer */
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x;
+}
+
+static inline unsigned int phash_bucket(uint64_t h, unsigned int n)
+{
+    return phash_reduce(phash_mix((uint32_t) h), n);
+}
+
+static inline unsigned int phash_slot(uint64_t h, int d, unsigned int n)
+{
+    return phash_reduce(phash_mix((uint32_t) (h >> 32) ^
+                                  ((uint32_t) d * 0x9e3779b9u)), n);
+}
+
+struct phash_bucket {
+    int id;
+    int count;
+    int *keys;
+};
+
+static int phash_bucket_cmp(const void *a, const void *b)
+{
+    const struct phash_bucket *x = a;
+    const struct phash_bucket *y = b;
+
+    return y->count - x->count;
+}
+
+static void phash_buckets_free(struct phash_bucket *buckets, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        mk_mem_free(buckets[i].keys);
+    }
+    mk_mem_free(buckets);
+}
+
+/*
+ * Build the table: keys are spread in 'n' buckets, then starting from the
+ * biggest bucket we look for a displacement that places all its keys in
+ * free slots. Buckets with a single key take any free slot directly and
+ * store it as a negative displacement. Duplicated keys are not allowed,
+ * the caller must filter them.
+ */
+struct mk_phash *mk_phash_create(char **keys, int *lens, void **data, int n)
+{
+    int i;
+    int j;
+    int k;
+    int d;
+    int slot;
+    int free_slot = 0;
+    int *slots = NULL;
+    uint64_t *hashes = NULL;
+    char *key;
+    char *used = NULL;
+    struct mk_phash_entry *e;
+    struct phash_bucket *b;
+    struct phash_bucket *buckets = NULL;
+    struct mk_phash *ph;
+
+    ph = mk_mem_alloc_z(sizeof(struct mk_phash));
+    if (!ph) {
+        return NULL;
+    }
+    ph->size = n;
+    if (n == 0) {
+        return ph;
+    }
+
+    ph->disp    = mk_mem_alloc_z(sizeof(int) * n);
+    ph->entries = mk_mem_alloc_z(sizeof(struct mk_phash_entry) * n);
+    buckets     = mk_mem_alloc_z(sizeof(struct phash_bucket) * n);
+    used        = mk_mem_alloc_z(n);
+    slots       = mk_mem_alloc_z(sizeof(int) * n);
+    hashes      = mk_mem_alloc(sizeof(uint64_t) * n);
+    if (!ph->disp || !ph->entries || !buckets || !used || !slots ||
+        !hashes) {
+        goto error;
+    }
+
+    for (i = 0; i < n; i++) {
+        buckets[i].id = i;
+    }
+    for (i = 0; i < n; i++) {
+        hashes[i] = phash_hash(keys[i], lens[i]);
+        b = &buckets[phash_bucket(hashes[i], n)];
+        b->keys = mk_mem_realloc(b->keys, sizeof(int) * (b->count + 1));
+        if (!b->keys) {
+            goto error;
+        }
+        b->keys[b->count++] = i;
+    }
+    qsort(buckets, n, sizeof(struct phash_bucket), phash_bucket_cmp);
+
+    for (i = 0; i < n && buckets[i].count > 1; i++) {
+        b = &buckets[i];
+        for (d = 1; d < MK_PHASH_MAX_DISP; d++) {
+            for (j = 0; j < b->count; j++) {
+                slot = phash_slot(hashes[b->keys[j]], d, n);
+                if (used[slot]) {
+                    break;
+                }
+                for (k = 0; k < j && slots[k] != slot; k++);
+                if (k < j) {
+                    break;
+                }
+                slots[j] = slot;
+            }
+            if (j == b->count) {
+                break;
+            }
+        }
+        if (d == MK_PHASH_MAX_DISP) {
+            goto error;
+        }
+
+        ph->disp[b->id] = d;
+        for (j = 0; j < b->count; j++) {
+            used[slots[j]] = 1;
+            ph->entries[slots[j]].data = data[b->keys[j]];
+            ph->entries[slots[j]].len  = lens[b->keys[j]];
+            ph->entries[slots[j]].key  = (char *) keys[b->keys[j]];
+        }
+    }
+
+    /* Single key buckets */
+    for (; i < n && buckets[i].count == 1; i++) {
+        b = &buckets[i];
+        while (used[free_slot]) {
+            free_slot++;
+        }
+        used[free_slot] = 1;
+        ph->disp[b->id] = -free_slot - 1;
+        ph->entries[free_slot].data = data[b->keys[0]];
+        ph->entries[free_slot].len  = lens[b->keys[0]];
+        ph->entries[free_slot].key  = (char *) keys[b->keys[0]];
+    }
+
+    /* Keep our own lower case copy of the keys */
+    for (i = 0; i < n; i++) {
+        e = &ph->entries[i];
+        key = mk_mem_alloc(e->len + 1);
+        if (!key) {
+            for (j = 0; j < i; j++) {
+                mk_mem_free(ph->entries[j].key);
+            }
+            goto error;
+        }
+        for (j = 0; j < e->len; j++) {
+            key[j] = phash_lower(e->key[j]);
+        }
+        key[e->len] = '\0';
+        e->key = key;
+    }
+
+    phash_buckets_free(buckets, n);
+    mk_mem_free(used);
+    mk_mem_free(slots);
+    mk_mem_free(hashes);
+    return ph;
+
+ error:
+    if (buckets) {
+        phash_buckets_free(buckets, n);
+    }
+    mk_mem_free(used);
+    mk_mem_free(slots);
+    mk_mem_free(hashes);
+    mk_mem_free(ph->disp);
+    mk_mem_free(ph->entries);
+    mk_mem_free(ph);
+    return NULL;
+}
+
+void *mk_phash_lookup(struct mk_phash *ph, const char *key, int len)
+{
+    int i;
+    int d;
+    uint64_t h;
+    unsigned int slot;
+    struct mk_phash_entry *e;
+
+    if (ph->size == 0) {
+        return NULL;
+    }
+
+    h = phash_hash(key, len);
+    d = ph->disp[phash_bucket(h, ph->size)];
+    if (d < 0) {
+        slot = -d - 1;
+    }
+    else {
+        slot = phash_slot(h, d, ph->size);
+    }
+
+    e = &ph->entries[slot];
+    if (e->len != len) {
+        return NULL;
+    }
+    for (i = 0; i < len; i++) {
+        if (e->key[i] != phash_lower(key[i])) {
+            return NULL;
+        }
+    }
+
+    return e->data;
+}
+
+void mk_phash_destroy(struct mk_phash *ph)
+{
+    unsigned int i;
+
+    if (!ph) {
+        return;
+    }
+
+    if (ph->entries) {
+        for (i = 0; i < ph->size; i++) {
+            mk_mem_free(ph->entries[i].key);
+        }
+    }
+    mk_mem_free(ph->entries);
+    mk_mem_free(ph->disp);
+    mk_mem_free(ph);
+}
@@ -26,124 +26,164 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_config.h>
 #include <monkey/mk_clock.h>
+#include <monkey/mk_clock_tls.h>
 #include <monkey/mk_utils.h>
 
-time_t log_current_utime;
-time_t monkey_init_time;
+/* Prefer the coarse clocks, they are served by the vDSO without a syscall */
+#ifdef CLOCK_REALTIME_COARSE
+#define MK_CLOCK_REALTIME   CLOCK_REALTIME_COARSE
+#else
+#define MK_CLOCK_REALTIME   CLOCK_REALTIME
+#endif
 
-mk_ptr_t log_current_time = { NULL, LOG_TIME_BUFFER_SIZE - 2 };
-mk_ptr_t headers_preset = { NULL, HEADER_PRESET_SIZE - 1 };
+#ifdef CLOCK_MONOTONIC_COARSE
+#define MK_CLOCK_MONOTONIC  CLOCK_MONOTONIC_COARSE
+#else
+#define MK_CLOCK_MONOTONIC  CLOCK_MONOTONIC
+#endif
 
-static char *log_time_buffers[2];
-static char *header_time_buffers[2];
+time_t monkey_init_time;
 
-/*
- * The mk_ptr_ts have two buffers for avoid in half-way access from
- * another thread while a buffer is being modified. The function below returns
- * one of two buffers to work with.
- */
-static inline char *_next_buffer(mk_ptr_t *pointer, char **buffers)
-{
-    if (pointer->data == buffers[0]) {
-        return buffers[1];
-    }
-    else {
-        return buffers[0];
-    }
-}
+/* Server context, used to compose the Server header */
+static struct mk_server *mk_clock_server;
+
+/* Clocks created on demand for threads without a worker loop */
+static struct mk_list mk_clock_lazy_list;
+static pthread_mutex_t mk_clock_lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static void mk_clock_log_set_time(time_t utime)
+static void mk_clock_log_set_time(struct mk_clock *clk, char *buffer)
 {
-    char *time_string;
     struct tm result;
 
-    time_string = _next_buffer(&log_current_time, log_time_buffers);
-    log_current_utime = utime;
+    strftime(buffer, LOG_TIME_BUFFER_SIZE, "[%d/%b/%G %T %z]",
+             localtime_r(&clk->utime, &result));
 
-    strftime(time_string, LOG_TIME_BUFFER_SIZE, "[%d/%b/%G %T %z]",
-             localtime_r(&utime, &result));
-
-    log_current_time.data = time_string;
+    clk->log_time.data = buffer;
+    clk->log_time.len  = LOG_TIME_BUFFER_SIZE - 2;
 }
 
-static void mk_clock_headers_preset(time_t utime, struct mk_server *server)
+static void mk_clock_headers_preset(struct mk_clock *clk, char *buffer)
 {
     int len1;
     int len2;
     struct tm *gmt_tm;
     struct tm result;
-    char *buffer;
-
-    buffer = _next_buffer(&headers_preset, header_time_buffers);
 
-    gmt_tm = gmtime_r(&utime, &result);
+    gmt_tm = gmtime_r(&clk->utime, &result);
 
     len1 = snprintf(buffer,
                     HEADER_TIME_BUFFER_SIZE,
                     "%s",
-                    server->server_signature_header);
+                    mk_clock_server->server_signature_header);
 
     len2 = strftime(buffer + len1,
                     HEADER_PRESET_SIZE - len1,
                     MK_CLOCK_GMT_DATEFORMAT,
                     gmt_tm);
 
-    headers_preset.data = buffer;
-    headers_preset.len  = len1 + len2;
+    clk->headers_preset.data = buffer;
+    clk->headers_preset.len  = len1 + len2;
 }
 
-void *mk_clock_worker_init(void *data)
+void mk_clock_update(struct mk_clock *clk)
 {
-    time_t cur_time;
-    struct mk_server *server = data;
+    struct timespec ts;
 
-    mk_utils_worker_rename("monkey: clock");
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (clock_gettime(MK_CLOCK_MONOTONIC, &ts) == 0) {
+        clk->msec = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
 
-    mk_clock_tid = pthread_self();
+    if (clock_gettime(MK_CLOCK_REALTIME, &ts) != 0 ||
+        ts.tv_sec == clk->utime) {
+        return;
+    }
 
-    while (1) {
-        cur_time = time(NULL);
+    /* The second changed: format the strings on the other buffers */
+    clk->utime = ts.tv_sec;
+    clk->idx ^= 1;
+    mk_clock_log_set_time(clk, clk->log_buf[clk->idx]);
+    mk_clock_headers_preset(clk, clk->header_buf[clk->idx]);
+}
+
+static struct mk_clock *mk_clock_create()
+{
+    struct mk_clock *clk;
 
-        if(cur_time != ((time_t)-1)) {
-            mk_clock_log_set_time(cur_time);
-            mk_clock_headers_preset(cur_time, server);
-        }
-        sleep(1);
+    clk = mk_mem_alloc_z(sizeof(struct mk_clock));
+    if (!clk) {
+        return NULL;
     }
 
-    return NULL;
+    mk_clock_update(clk);
+    MK_TLS_SET(mk_tls_clock, clk);
+
+    return clk;
 }
 
-void mk_clock_exit()
+/* Per worker clock, refreshed by the worker loop through mk_clock_refresh() */
+int mk_clock_worker_init()
 {
-    pthread_cancel(mk_clock_tid);
-    pthread_join(mk_clock_tid, NULL);
-
-    mk_mem_free(header_time_buffers[0]);
-    mk_mem_free(header_time_buffers[1]);
-    mk_mem_free(log_time_buffers[0]);
-    mk_mem_free(log_time_buffers[1]);
+    if (!mk_clock_create()) {
+        return -1;
+    }
+    return 0;
 }
 
-/* This function must be called before any threads are created */
-void mk_clock_sequential_init(struct mk_server *server)
+void mk_clock_worker_exit()
 {
-    /* Time when monkey was started */
-    monkey_init_time = time(NULL);
+    struct mk_clock *clk;
 
-    header_time_buffers[0] = mk_mem_alloc_z(HEADER_PRESET_SIZE);
-    header_time_buffers[1] = mk_mem_alloc_z(HEADER_PRESET_SIZE);
+    clk = MK_TLS_GET(mk_tls_clock);
+    if (clk && !clk->lazy) {
+        mk_mem_free(clk);
+    }
+    MK_TLS_SET(mk_tls_clock, NULL);
+}
 
-    log_time_buffers[0] = mk_mem_alloc_z(LOG_TIME_BUFFER_SIZE);
-    log_time_buffers[1] = mk_mem_alloc_z(LOG_TIME_BUFFER_SIZE);
+/*
+ * A thread that does not run a worker loop (e.g: master or plugins
+ * threads) asked for the time: create a clock that is refreshed on every
+ * access. It's released on mk_clock_exit().
+ */
+struct mk_clock *mk_clock_lazy_create()
+{
+    struct mk_clock *clk;
 
+    clk = mk_clock_create();
+    if (!clk) {
+        mk_err("[clock] could not allocate thread clock");
+        exit(EXIT_FAILURE);
+    }
+    clk->lazy = MK_TRUE;
 
-    /* Set the time once */
-    time_t cur_time = time(NULL);
+    pthread_mutex_lock(&mk_clock_lazy_mutex);
+    mk_list_add(&clk->_head, &mk_clock_lazy_list);
+    pthread_mutex_unlock(&mk_clock_lazy_mutex);
+
+    return clk;
+}
 
-    if (cur_time != ((time_t)-1)) {
-        mk_clock_log_set_time(cur_time);
-        mk_clock_headers_preset(cur_time, server);
+void mk_clock_exit()
+{
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_clock *clk;
+
+    pthread_mutex_lock(&mk_clock_lazy_mutex);
+    mk_list_foreach_safe(head, tmp, &mk_clock_lazy_list) {
+        clk = mk_list_entry(head, struct mk_clock, _head);
+        mk_list_del(&clk->_head);
+        mk_mem_free(clk);
     }
+    pthread_mutex_unlock(&mk_clock_lazy_mutex);
+}
+
+/* This function must be called before any threads are created */
+void mk_clock_sequential_init(struct mk_server *server)
+{
+    /* Time when monkey was started */
+    monkey_init_time = time(NULL);
+
+    mk_clock_server = server;
+    mk_list_init(&mk_clock_lazy_list);
 }
@@ -214,7 +214,7 @@ int mk_config_listen_parse(char *value, struct mk_server *server)
     /* Check extra properties of the listener */
     flags = MK_CAP_HTTP;
     if (mk_config_key_have(list, "!http")) {
-        flags |= ~MK_CAP_HTTP;
+        flags &= ~MK_CAP_HTTP;
     }
 
     if (mk_config_key_have(list, "h2")) {
@@ -438,7 +438,7 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
     mk_mem_free(tmp);
     tmp = mk_rconf_section_get_key(section, "DefaultMimeType", MK_RCONF_STR);
     if (tmp) {
-        mk_string_build(&server->mimetype_default_str, &len, "%s\r\n", tmp);
+        server->mimetype_default_str = mk_string_dup(tmp);
     }
 
     /* File Descriptor Table (FDT) */
@@ -484,6 +484,13 @@ void mk_config_signature(struct mk_server *server)
                    sizeof(server->server_signature_header) - 1,
                    "Server: %s\r\n", server->server_signature);
     server->server_signature_header_len = len;
+
+    /* HTTP/2: the field never changes, encode it once */
+    server->server_signature_hpack_len =
+        mk_hpack_encode_header((uint8_t *) server->server_signature_hpack,
+                               sizeof(server->server_signature_hpack),
+                               "server", 6, server->server_signature,
+                               strlen(server->server_signature));
 }
 
 /* read main configuration from monkey.conf */
@@ -162,6 +162,26 @@ static void cb_stream_iov_extended_free(struct mk_stream_input *in)
     mk_iov_free(iov);
 }
 
+/*
+ * HTTP/2 streams frame their headers once other responses were prepared
+ * on the same worker, values from the per-thread caches must be copied.
+ */
+static inline void mk_header_iov_add_cached(struct mk_http_session *cs,
+                                            struct mk_iov *iov, mk_ptr_t *ptr)
+{
+    char *buf;
+
+    if (cs->channel->type == MK_CHANNEL_HTTP2) {
+        buf = mk_mem_alloc(ptr->len);
+        if (buf) {
+            memcpy(buf, ptr->data, ptr->len);
+            mk_iov_add(iov, buf, ptr->len, MK_TRUE);
+            return;
+        }
+    }
+    mk_iov_add(iov, ptr->data, ptr->len, MK_FALSE);
+}
+
 /* Send response headers */
 int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                       struct mk_server *server)
@@ -172,6 +192,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
     mk_ptr_t response;
     struct response_headers *sh;
     struct mk_iov *iov;
+    struct mk_clock *clk;
 
     sh = &sr->headers;
     iov = &sh->headers_iov;
@@ -202,9 +223,10 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
      * - Server
      * - Date
      */
+    clk = mk_clock_get();
     mk_iov_add(iov,
-               headers_preset.data,
-               headers_preset.len,
+               clk->headers_preset.data,
+               clk->headers_preset.len,
                MK_FALSE);
 
     /* Last-Modified */
@@ -216,10 +238,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                    mk_header_last_modified.data,
                    mk_header_last_modified.len,
                    MK_FALSE);
-        mk_iov_add(iov,
-                   lm->data,
-                   lm->len,
-                   MK_FALSE);
+        mk_header_iov_add_cached(cs, iov, lm);
     }
 
     /* Connection */
@@ -320,10 +339,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                    mk_header_content_length.data,
                    mk_header_content_length.len,
                    MK_FALSE);
-        mk_iov_add(iov,
-                   cl->data,
-                   cl->len,
-                   MK_FALSE);
+        mk_header_iov_add_cached(cs, iov, cl);
     }
 
     if ((sh->content_length != 0 && (sh->ranges[0] >= 0 || sh->ranges[1] >= 0)) &&
@@ -31,6 +31,7 @@
 #include <monkey/mk_user.h>
 #include <monkey/mk_core.h>
 #include <monkey/mk_http.h>
+#include <monkey/mk_http2.h>
 #include <monkey/mk_http_status.h>
 #include <monkey/mk_http_thread.h>
 #include <monkey/mk_clock.h>
@@ -43,6 +44,8 @@
 #include <monkey/mk_vhost.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
+#include <monkey/mk_prefetch.h>
+#include <monkey/mk_metrics.h>
 
 const mk_ptr_t mk_http_method_get_p = mk_ptr_init(MK_METHOD_GET_STR);
 const mk_ptr_t mk_http_method_post_p = mk_ptr_init(MK_METHOD_POST_STR);
@@ -77,6 +80,7 @@ void mk_http_request_init(struct mk_http_session *session,
     request->vhost_fdt_enabled = MK_FALSE;
     request->host.data = NULL;
     request->stage30_blocked = MK_FALSE;
+    request->stage30_handler = NULL;
     request->session = session;
     request->host_conf = mk_list_entry_first(host_list, struct mk_vhost, _head);
     request->uri_processed.data = NULL;
@@ -86,6 +90,12 @@ void mk_http_request_init(struct mk_http_session *session,
     /* Response Headers */
     mk_header_response_reset(&request->headers);
 
+    /* What the channel writes from now on belongs to this request */
+    if (session->channel) {
+        request->bytes_out = session->channel->bytes_out;
+        session->channel->first_out = 0;
+    }
+
     /* Reset callbacks for headers stream */
     mk_stream_set(&request->stream,
                   session->channel,
@@ -112,9 +122,9 @@ static inline int mk_http_point_header(mk_ptr_t *h,
     return -1;
 }
 
-static int mk_http_request_prepare(struct mk_http_session *cs,
-                                   struct mk_http_request *sr,
-                                   struct mk_server *server)
+int mk_http_request_prepare(struct mk_http_session *cs,
+                            struct mk_http_request *sr,
+                            struct mk_server *server)
 {
     int ret;
     int status = 0;
@@ -123,6 +133,8 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
     struct mk_list *alias;
     struct mk_http_header *header;
 
+    sr->start = mk_clock_usec();
+
     /*
      * Process URI, if it contains ASCII encoded strings like '%20',
      * it will return a new memory buffer with the decoded string, otherwise
@@ -346,6 +358,10 @@ int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs,
         return -1;
     }
 
+    if (server->metrics == MK_TRUE && cs->begin == 0) {
+        cs->begin = mk_clock_usec();
+    }
+
     if (bytes > max_read) {
         MK_TRACE("[FD %i] Buffer still have data: %i",
                  socket, bytes - max_read);
@@ -627,9 +643,8 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
 {
     int ret;
     int ret_file;
+    uint64_t start = 0;
     struct mk_mimetype *mime;
-    struct mk_list *head;
-    struct mk_list *handlers;
     struct mk_plugin *plugin;
     struct mk_vhost_handler *h_handler;
     struct mk_http_thread *mth = NULL;
@@ -683,11 +698,13 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             /*
              * This is a HTTP/2.0 upgrade, we need to validate that we
              * have at least the 'Upgrade' and 'HTTP2-Settings' headers.
+             * Over TLS HTTP/2 is only negotiated through ALPN (3.3).
              */
             struct mk_http_header *p;
             p = &cs->parser.headers[MK_HEADER_HTTP2_SETTINGS];
             if (cs->parser.header_upgrade == MK_HTTP_PARSER_UPGRADE_H2C &&
-                p->key.data) {
+                p->key.data &&
+                !(MK_SCHED_CONN_PROP(cs->conn) & MK_CAP_SOCK_TLS)) {
                 /*
                  * Switch protocols and invoke the callback upgrade to prepare
                  * the new protocol internals.
@@ -717,8 +734,13 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
 
     ret_file = mk_file_get_info(sr->real_path.data, &sr->file_info, MK_FILE_READ);
 
-    /* Manually set the headers input streams */
+    /*
+     * Manually set the headers input streams, the buffer is set once the
+     * headers are prepared (a plugin may take a while to do it).
+     */
     sr->in_headers.type        = MK_STREAM_IOV;
+    sr->in_headers.buffer      = NULL;
+    sr->in_headers.bytes_total = 0;
     sr->in_headers.dynamic     = MK_FALSE;
     sr->in_headers.cb_consumed = NULL;
     sr->in_headers.cb_finished = NULL;
@@ -728,14 +750,11 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     /* Plugin Stage 30: look for handlers for this request */
     if (sr->stage30_blocked == MK_FALSE) {
         sr->uri_processed.data[sr->uri_processed.len] = '\0';
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_vhost_handler, _head);
-            if (regexec(h_handler->match,
-                        sr->uri_processed.data, 0, NULL, 0) != 0) {
-                continue;
-            }
-
+        h_handler = NULL;
+        while ((h_handler = mk_vhost_handler_find(sr->host_conf,
+                                                  sr->uri_processed.data,
+                                                  sr->uri_processed.len,
+                                                  h_handler))) {
             if (h_handler->cb) {
                 /* Create coroutine/thread context */
                 sr->headers.content_length = 0;
@@ -756,13 +775,24 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                 }
                 plugin = h_handler->handler;
                 sr->stage30_handler = h_handler->handler;
+                if (server->metrics == MK_TRUE) {
+                    start = mk_clock_usec();
+                }
                 ret = plugin->stage->stage30(plugin, cs, sr,
                                              h_handler->n_params,
                                              &h_handler->params);
-                mk_header_prepare(cs, sr, server);
+                if (server->metrics == MK_TRUE) {
+                    mk_metrics_stage(MK_METRICS_STAGE_30, start);
+                }
+                if (ret == MK_PLUGIN_RET_END) {
+                    mk_header_prepare(cs, sr, server);
+                }
             }
 
             MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
+            if (ret != MK_PLUGIN_RET_CONTINUE) {
+                sr->stage30_handler = NULL;
+            }
             switch (ret) {
             case MK_PLUGIN_RET_CONTINUE:
                 /* FIXME: PLUGINS DISABLED
@@ -863,21 +893,26 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             uri = sr->real_path.data + index_bytes;
         }
 
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_vhost_handler, _head);
-            if (regexec(h_handler->match,
-                        uri, 0, NULL, 0) != 0) {
-                continue;
-            }
-
+        h_handler = NULL;
+        while ((h_handler = mk_vhost_handler_find(sr->host_conf,
+                                                  uri, strlen(uri),
+                                                  h_handler))) {
             plugin = h_handler->handler;
             sr->stage30_handler = h_handler->handler;
+            if (server->metrics == MK_TRUE) {
+                start = mk_clock_usec();
+            }
             ret = plugin->stage->stage30(plugin, cs, sr,
                                          h_handler->n_params,
                                          &h_handler->params);
+            if (server->metrics == MK_TRUE) {
+                mk_metrics_stage(MK_METRICS_STAGE_30, start);
+            }
 
             MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
+            if (ret != MK_PLUGIN_RET_CONTINUE) {
+                sr->stage30_handler = NULL;
+            }
             switch (ret) {
             case MK_PLUGIN_RET_CONTINUE:
                 return MK_PLUGIN_RET_CONTINUE;
@@ -1033,6 +1068,11 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_POST) {
         /* Note: bytes and offsets are set after the Range check */
         sr->in_file.type = MK_STREAM_FILE;
+#ifdef MK_HAVE_PREADV2_NOWAIT
+        /* Large files: do not let sendfile(2) block on cold pages */
+        sr->in_file.prefetch = (sr->file_info.size >= MK_PREFETCH_MIN_SIZE);
+        sr->in_file.prefetch_ready = 0;
+#endif
         mk_stream_append(&sr->in_file, &sr->stream);
     }
 
@@ -1104,7 +1144,7 @@ static inline void mk_http_request_ka_next(struct mk_http_session *cs)
     cs->counter_connections++;
 
     /* Update data for scheduler */
-    cs->init_time = log_current_utime;
+    cs->init_time = mk_clock_utime();
     cs->status = MK_REQUEST_STATUS_INCOMPLETE;
 
     /* Initialize parser */
@@ -1118,6 +1158,11 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
     int len;
     struct mk_http_request *sr = NULL;
 
+    /* A HTTP/2 stream: the session finishes it once the response is out */
+    if (cs->channel->type == MK_CHANNEL_HTTP2) {
+        return mk_http2_request_end(cs, server);
+    }
+
     if (server->max_keep_alive_request <= cs->counter_connections) {
         cs->close_now = MK_TRUE;
         goto shutdown;
@@ -1402,7 +1447,10 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn,
     cs->conn = conn;
 
     /* creation time in unix time */
-    cs->init_time = conn->arrive_time;
+    cs->init_time = mk_clock_utime();
+    if (server->metrics == MK_TRUE) {
+        cs->begin = mk_clock_usec();
+    }
 
     /* alloc space for body content */
     if (conn->net->buffer_size > MK_REQUEST_CHUNK) {
@@ -1603,6 +1651,14 @@ int mk_http_sched_done(struct mk_sched_conn *conn,
     cs = mk_http_session_get(conn);
     sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
 
+    /*
+     * A plugin still owns the response, the channel just ran out of data
+     * for now. The plugin ends the request through mk_api->http_request_end.
+     */
+    if (sr->stage30_handler) {
+        return 0;
+    }
+
     mk_plugin_stage_run_40(cs, sr, server);
 
     return mk_http_request_end(cs, server);
@@ -20,11 +20,19 @@
 #define _GNU_SOURCE
 
 #include <inttypes.h>
+#include <ctype.h>
 
 #include <monkey/mk_http2.h>
 #include <monkey/mk_http2_settings.h>
+#include <monkey/mk_http_parser.h>
+#include <monkey/mk_http_status.h>
 #include <monkey/mk_header.h>
+#include <monkey/mk_mimetype.h>
 #include <monkey/mk_scheduler.h>
+#include <monkey/mk_socket.h>
+#include <monkey/mk_plugin.h>
+#include <monkey/mk_plugin_stage.h>
+#include <monkey/mk_clock.h>
 
 /* HTTP/2 Connection Preface */
 #define MK_HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
@@ -33,293 +41,2396 @@ static mk_ptr_t http2_preface = {
     .len  = sizeof(MK_HTTP2_PREFACE) - 1
 };
 
-static inline void buffer_consume(struct mk_http2_session *h2s, int bytes)
+const struct mk_http2_settings MK_HTTP2_SETTINGS_DEFAULT =
+    {
+        .header_table_size      = 4096,
+        .enable_push            = 1,
+        .max_concurrent_streams = 64,
+        .initial_window_size    = 65535,
+        .max_frame_size         = 16384, /* 6.5.2 -> 2^14 */
+        .max_header_list_size   = UINT32_MAX
+    };
+
+/* Headers that only make sense for a HTTP/1.x connection (8.1.2.2) */
+static mk_ptr_t http2_conn_headers[] = {
+    mk_ptr_init("connection"),
+    mk_ptr_init("keep-alive"),
+    mk_ptr_init("proxy-connection"),
+    mk_ptr_init("transfer-encoding"),
+    mk_ptr_init("upgrade"),
+    mk_ptr_init("http2-settings"),
+    { NULL, 0 }
+};
+
+static int http2_stream_destroy(struct mk_http2_stream *s, int abort);
+
+static inline uint32_t http2_get32(uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline void http2_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void http2_frame_header(uint8_t *p, uint32_t length,
+                                      uint8_t type, uint8_t flags,
+                                      uint32_t stream_id)
+{
+    p[0] = length >> 16;
+    p[1] = length >> 8;
+    p[2] = length;
+    p[3] = type;
+    p[4] = flags;
+    http2_put32(p + 5, stream_id & 0x7fffffff);
+}
+
+static int http2_conn_header(char *name, size_t len)
+{
+    mk_ptr_t *h;
+
+    for (h = http2_conn_headers; h->data; h++) {
+        if (h->len == len && strncasecmp(h->data, name, len) == 0) {
+            return MK_TRUE;
+        }
+    }
+    return MK_FALSE;
+}
+
+/*
+ * Output buffer
+ * -------------
+ * Every frame is serialized into h2s->out, the pump flushes it to the
+ * socket. DATA frames only use the free room, control frames may grow the
+ * buffer up to MK_HTTP2_OUT_MAX.
+ */
+static uint8_t *http2_out_reserve(struct mk_http2_session *h2s, size_t size)
+{
+    size_t new_size;
+    char *tmp;
+
+    if (h2s->out_len + size <= h2s->out_size) {
+        return (uint8_t *) h2s->out + h2s->out_len;
+    }
+
+    if (h2s->out_offset > 0) {
+        memmove(h2s->out, h2s->out + h2s->out_offset,
+                h2s->out_len - h2s->out_offset);
+        h2s->out_len -= h2s->out_offset;
+        h2s->out_offset = 0;
+        if (h2s->out_len + size <= h2s->out_size) {
+            return (uint8_t *) h2s->out + h2s->out_len;
+        }
+    }
+
+    new_size = h2s->out_size;
+    while (new_size < h2s->out_len + size) {
+        new_size += MK_HTTP2_OUT_SIZE;
+    }
+    if (new_size > MK_HTTP2_OUT_MAX) {
+        return NULL;
+    }
+
+    tmp = mk_mem_realloc(h2s->out, new_size);
+    if (!tmp) {
+        return NULL;
+    }
+    h2s->out = tmp;
+    h2s->out_size = new_size;
+
+    return (uint8_t *) h2s->out + h2s->out_len;
+}
+
+static int http2_send_frame(struct mk_http2_session *h2s, uint8_t type,
+                            uint8_t flags, uint32_t stream_id,
+                            void *payload, size_t len)
+{
+    uint8_t *p;
+
+    p = http2_out_reserve(h2s, MK_HTTP2_HEADER_SIZE + len);
+    if (!p) {
+        return -1;
+    }
+
+    http2_frame_header(p, len, type, flags, stream_id);
+    if (len > 0) {
+        memcpy(p + MK_HTTP2_HEADER_SIZE, payload, len);
+    }
+    h2s->out_len += MK_HTTP2_HEADER_SIZE + len;
+
+    return 0;
+}
+
+static int http2_send_raw(struct mk_http2_session *h2s, char *buf, size_t len)
+{
+    uint8_t *p;
+
+    p = http2_out_reserve(h2s, len);
+    if (!p) {
+        return -1;
+    }
+    memcpy(p, buf, len);
+    h2s->out_len += len;
+
+    return 0;
+}
+
+static int http2_send_rst(struct mk_http2_session *h2s, uint32_t stream_id,
+                          uint32_t code)
+{
+    uint8_t payload[4];
+
+    MK_H2_TRACE(h2s->conn, "RST_STREAM stream=%" PRIu32 " code=%" PRIu32,
+                stream_id, code);
+    http2_put32(payload, code);
+    return http2_send_frame(h2s, MK_HTTP2_RST_STREAM, 0, stream_id,
+                            payload, 4);
+}
+
+static int http2_send_window_update(struct mk_http2_session *h2s,
+                                    uint32_t stream_id, uint32_t increment)
+{
+    uint8_t payload[4];
+
+    http2_put32(payload, increment);
+    return http2_send_frame(h2s, MK_HTTP2_WINDOW_UPDATE, 0, stream_id,
+                            payload, 4);
+}
+
+/*
+ * Connection error (5.4.1): send a GOAWAY and stop processing incoming
+ * frames, the connection is closed once the output is flushed.
+ */
+static int http2_conn_error(struct mk_http2_session *h2s, uint32_t code)
+{
+    uint8_t payload[8];
+
+    MK_H2_TRACE(h2s->conn, "GOAWAY code=%" PRIu32, code);
+
+    if (h2s->status == MK_HTTP2_CLOSING) {
+        return 0;
+    }
+    h2s->status = MK_HTTP2_CLOSING;
+
+    http2_put32(payload, h2s->last_stream_id);
+    http2_put32(payload + 4, code);
+    if (http2_send_frame(h2s, MK_HTTP2_GOAWAY, 0, 0, payload, 8) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Register the event mask we need, the loop reuses event->mask as output */
+static void http2_events(struct mk_http2_session *h2s, int mask)
+{
+    struct mk_sched_conn *conn = h2s->conn;
+
+    if (h2s->events == mask) {
+        return;
+    }
+
+    mk_event_add(mk_sched_loop(), conn->event.fd,
+                 MK_EVENT_CONNECTION, mask, &conn->event);
+    h2s->events = mask;
+}
+
+/*
+ * Streams
+ * -------
+ */
+static struct mk_http2_stream *http2_stream_get(struct mk_http2_session *h2s,
+                                                uint32_t stream_id)
+{
+    struct mk_list *head;
+    struct mk_http2_stream *s;
+
+    mk_list_foreach(head, &h2s->streams) {
+        s = mk_list_entry(head, struct mk_http2_stream, _head);
+        if (s->id == stream_id) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Scheduler
+ * ---------
+ * Streams are queued by urgency (RFC 9218). Within a level the non
+ * incremental streams are served one after the other in stream order and
+ * the incremental ones share the remaining bandwidth in round robin.
+ */
+static void http2_sched_add(struct mk_http2_stream *s)
+{
+    struct mk_list *head;
+    struct mk_list *queue = &s->h2s->sched[s->urgency];
+    struct mk_http2_stream *entry;
+
+    if (s->incremental == MK_TRUE) {
+        mk_list_add(&s->_sched, queue);
+        return;
+    }
+
+    mk_list_foreach(head, queue) {
+        entry = mk_list_entry(head, struct mk_http2_stream, _sched);
+        if (entry->incremental == MK_TRUE || entry->id > s->id) {
+            break;
+        }
+    }
+
+    /* insert before 'head', the queue tail if none was found */
+    __mk_list_add(&s->_sched, head->prev, head);
+}
+
+static void http2_sched_update(struct mk_http2_stream *s,
+                               int urgency, int incremental)
+{
+    if (s->urgency == urgency && s->incremental == incremental) {
+        return;
+    }
+
+    mk_list_del(&s->_sched);
+    s->urgency = urgency;
+    s->incremental = incremental;
+    http2_sched_add(s);
+}
+
+/*
+ * Parse a Priority field value (RFC 9218, Section 4). It is a structured
+ * field dictionary where 'u' is the urgency and 'i' the incremental flag,
+ * unknown or invalid members are ignored.
+ */
+static void http2_priority_parse(char *value, size_t len,
+                                 int *urgency, int *incremental)
+{
+    char *p = value;
+    char *end = value + len;
+    char *key;
+    size_t key_len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        key = p;
+        while (p < end && (islower((unsigned char) *p) ||
+                           isdigit((unsigned char) *p) ||
+                           *p == '_' || *p == '-' || *p == '.' || *p == '*')) {
+            p++;
+        }
+        key_len = p - key;
+
+        if (key_len == 1 && *key == 'u') {
+            if (end - p >= 2 && p[0] == '=' && p[1] >= '0' && p[1] <= '7' &&
+                (end - p == 2 || !isdigit((unsigned char) p[2]))) {
+                *urgency = p[1] - '0';
+            }
+        }
+        else if (key_len == 1 && *key == 'i') {
+            if (p == end || *p != '=') {
+                *incremental = MK_TRUE;
+            }
+            else if (end - p >= 3 && p[1] == '?' &&
+                     (p[2] == '0' || p[2] == '1')) {
+                *incremental = (p[2] == '1');
+            }
+        }
+
+        /* next member */
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+}
+
+static struct mk_http2_stream *http2_stream_create(struct mk_http2_session *h2s,
+                                                   uint32_t stream_id)
+{
+    struct mk_http2_stream *s;
+    struct mk_sched_conn *conn = h2s->conn;
+
+    s = mk_mem_alloc_z(sizeof(struct mk_http2_stream));
+    if (!s) {
+        return NULL;
+    }
+
+    s->id = stream_id;
+    s->state = MK_HTTP2_STATE_IDLE;
+    s->send_window = h2s->settings.initial_window_size;
+    s->recv_window = MK_HTTP2_SETTINGS_DEFAULT.initial_window_size;
+    s->content_length = -1;
+    s->urgency = MK_HTTP2_URGENCY_DEFAULT;
+    s->incremental = MK_FALSE;
+    s->h2s = h2s;
+
+    /* Virtual channel where the HTTP core queues the response */
+    s->channel.type   = MK_CHANNEL_HTTP2;
+    s->channel.fd     = conn->event.fd;
+    s->channel.status = MK_CHANNEL_OK;
+    s->channel.io     = conn->net;
+    s->channel.event  = &s->event;
+    s->channel.metrics = h2s->server->metrics;
+    mk_list_init(&s->channel.streams);
+
+    mk_list_add(&s->_head, &h2s->streams);
+    http2_sched_add(s);
+    h2s->streams_active++;
+
+    /* An active stream is not an idle connection */
+    mk_sched_conn_timeout_del(conn);
+
+    return s;
+}
+
+static int http2_stream_append(struct mk_http2_stream *s,
+                               char *buf, size_t len)
+{
+    size_t size;
+    char *tmp;
+
+    if (s->req_len + len > s->req_size) {
+        size = s->req_size ? s->req_size : 512;
+        while (size < s->req_len + len) {
+            size *= 2;
+        }
+        tmp = mk_mem_realloc(s->req, size);
+        if (!tmp) {
+            return -1;
+        }
+        s->req = tmp;
+        s->req_size = size;
+    }
+
+    memcpy(s->req + s->req_len, buf, len);
+    s->req_len += len;
+
+    return 0;
+}
+
+/* Append a 'name: value' line to the request being composed */
+static int http2_stream_header_add(struct mk_http2_stream *s,
+                                   char *name, size_t name_len,
+                                   char *value, size_t value_len)
+{
+    if (http2_stream_append(s, name, name_len) == -1 ||
+        http2_stream_append(s, ": ", 2) == -1 ||
+        http2_stream_append(s, value, value_len) == -1 ||
+        http2_stream_append(s, "\r\n", 2) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int http2_pseudo_set(struct mk_http2_stream *s, mk_ptr_t *ptr,
+                            char *value, size_t len)
+{
+    if (ptr->data) {
+        /* duplicated pseudo header */
+        s->malformed = MK_TRUE;
+        return 0;
+    }
+
+    ptr->data = mk_mem_alloc(len + 1);
+    if (!ptr->data) {
+        return -1;
+    }
+    memcpy(ptr->data, value, len);
+    ptr->data[len] = '\0';
+    ptr->len = len;
+
+    return 0;
+}
+
+/*
+ * HPACK callback: validate every request header field (8.1.2) and turn it
+ * into its HTTP/1.x form. Stream level problems only flag the stream as
+ * malformed, the block must be decoded to the end to keep the dynamic
+ * table in sync.
+ */
+static int http2_request_header(void *data,
+                                char *name, size_t name_len,
+                                char *value, size_t value_len)
+{
+    size_t i;
+    size_t len;
+    size_t size;
+    int urgency;
+    int incremental;
+    char *tmp;
+    struct mk_http2_stream *s = data;
+
+    if (s->malformed || s->error) {
+        return 0;
+    }
+
+    if (name_len == 0 || memchr(value, '\r', value_len) ||
+        memchr(value, '\n', value_len) || memchr(value, '\0', value_len)) {
+        s->malformed = MK_TRUE;
+        return 0;
+    }
+
+    /* Pseudo header fields */
+    if (name[0] == ':') {
+        if (s->regular == MK_TRUE || memchr(value, ' ', value_len)) {
+            s->malformed = MK_TRUE;
+            return 0;
+        }
+
+        if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+            return http2_pseudo_set(s, &s->method, value, value_len);
+        }
+        else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+            return http2_pseudo_set(s, &s->path, value, value_len);
+        }
+        else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+            return http2_pseudo_set(s, &s->authority, value, value_len);
+        }
+        else if (name_len != 7 || memcmp(name, ":scheme", 7) != 0) {
+            s->malformed = MK_TRUE;
+        }
+        return 0;
+    }
+
+    s->regular = MK_TRUE;
+    for (i = 0; i < name_len; i++) {
+        if (isupper((unsigned char) name[i]) ||
+            name[i] == ':' || name[i] <= ' ') {
+            s->malformed = MK_TRUE;
+            return 0;
+        }
+    }
+
+    if (http2_conn_header(name, name_len) == MK_TRUE) {
+        s->malformed = MK_TRUE;
+        return 0;
+    }
+    else if (name_len == 2 && memcmp(name, "te", 2) == 0) {
+        if (value_len != 8 || memcmp(value, "trailers", 8) != 0) {
+            s->malformed = MK_TRUE;
+        }
+        return 0;
+    }
+    else if (name_len == 4 && memcmp(name, "host", 4) == 0 &&
+             s->authority.data) {
+        return 0;
+    }
+    else if (name_len == 14 && memcmp(name, "content-length", 14) == 0) {
+        if (value_len == 0 || value_len > 18) {
+            s->malformed = MK_TRUE;
+            return 0;
+        }
+        s->content_length = 0;
+        for (i = 0; i < value_len; i++) {
+            if (!isdigit((unsigned char) value[i])) {
+                s->malformed = MK_TRUE;
+                return 0;
+            }
+            s->content_length = (s->content_length * 10) + (value[i] - '0');
+        }
+        return 0;
+    }
+    else if (name_len == 6 && memcmp(name, "cookie", 6) == 0) {
+        /*
+         * Cookie crumbs are joined back with '; ' (8.1.2.5). They count
+         * toward the request size like any other header, indexed crumbs
+         * are cheap on the wire but not here.
+         */
+        len = s->cookie_len + value_len + 2;
+        if (s->req_len + len > (size_t) s->h2s->server->max_request_size) {
+            s->error = MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+            return 0;
+        }
+        if (len > s->cookie_size) {
+            size = s->cookie_size ? s->cookie_size : 256;
+            while (size < len) {
+                size *= 2;
+            }
+            tmp = mk_mem_realloc(s->cookie, size);
+            if (!tmp) {
+                return -1;
+            }
+            s->cookie = tmp;
+            s->cookie_size = size;
+        }
+        if (s->cookie_len > 0) {
+            s->cookie[s->cookie_len++] = ';';
+            s->cookie[s->cookie_len++] = ' ';
+        }
+        memcpy(s->cookie + s->cookie_len, value, value_len);
+        s->cookie_len += value_len;
+        return 0;
+    }
+
+    /* Priority is also kept for the handlers */
+    if (name_len == 8 && memcmp(name, "priority", 8) == 0) {
+        urgency = s->urgency;
+        incremental = s->incremental;
+        http2_priority_parse(value, value_len, &urgency, &incremental);
+        http2_sched_update(s, urgency, incremental);
+    }
+
+    if (s->req_len + s->cookie_len + name_len + value_len + 4 >
+        (size_t) s->h2s->server->max_request_size) {
+        s->error = MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+        return 0;
+    }
+
+    return http2_stream_header_add(s, name, name_len, value, value_len);
+}
+
+/* HPACK callback for header blocks we do not use: refused streams, trailers */
+static int http2_discard_header(void *data,
+                                char *name, size_t name_len,
+                                char *value, size_t value_len)
+{
+    (void) data;
+    (void) name;
+    (void) name_len;
+    (void) value;
+    (void) value_len;
+
+    return 0;
+}
+
+static int http2_stream_reset(struct mk_http2_stream *s, uint32_t code)
+{
+    int ret;
+
+    ret = http2_send_rst(s->h2s, s->id, code);
+    http2_stream_destroy(s, MK_TRUE);
+
+    return ret;
+}
+
+/*
+ * The request is complete: compose its HTTP/1.0 representation and hand it
+ * to the HTTP core. HTTP/1.0 is used so handlers never apply a chunked
+ * transfer encoding, the framing is done by the HTTP/2 layer.
+ */
+static int http2_stream_dispatch(struct mk_http2_stream *s)
+{
+    int ret;
+    int status;
+    size_t size;
+    size_t body_len;
+    char clen[32];
+    int clen_len = 0;
+    char *p;
+    struct mk_http2_session *h2s = s->h2s;
+    struct mk_server *server = h2s->server;
+    struct mk_http_session *cs = &s->cs;
+    struct mk_http_request *sr = &cs->sr_fixed;
+
+    if (s->malformed || !s->method.data) {
+        return http2_stream_reset(s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (s->method.len == 7 && memcmp(s->method.data, "CONNECT", 7) == 0) {
+        if (!s->authority.data || s->path.data) {
+            return http2_stream_reset(s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        s->path.data = mk_string_dup(s->authority.data);
+        s->path.len = s->authority.len;
+        s->error = MK_SERVER_NOT_IMPLEMENTED;
+    }
+    else if (!s->path.data || s->path.len == 0) {
+        return http2_stream_reset(s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    body_len = s->req_len - s->req_headers;
+    if (s->error == 0) {
+        if (s->content_length >= 0 &&
+            (size_t) s->content_length != body_len) {
+            return http2_stream_reset(s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        if (body_len > 0 || s->content_length >= 0) {
+            clen_len = snprintf(clen, sizeof(clen),
+                                "Content-Length: %zu\r\n", body_len);
+        }
+    }
+    else {
+        body_len = 0;
+    }
+
+    MK_H2_TRACE(h2s->conn, "dispatch stream=%" PRIu32 " %s %s",
+                s->id, s->method.data, s->path.data);
+
+    s->dispatched = MK_TRUE;
+
+    mk_http_session_init(cs, h2s->conn, server);
+    if (cs->body != cs->body_fixed) {
+        mk_mem_free(cs->body);
+    }
+    cs->channel = &s->channel;
+
+    size = s->method.len + 1 + s->path.len + 11 + s->req_headers +
+        clen_len + 2 + body_len;
+    if (s->authority.data) {
+        size += 6 + s->authority.len + 2;
+    }
+    if (s->cookie) {
+        size += 8 + s->cookie_len + 2;
+    }
+
+    if (size + 1 <= MK_REQUEST_CHUNK) {
+        cs->body = cs->body_fixed;
+        cs->body_size = MK_REQUEST_CHUNK;
+    }
+    else {
+        cs->body = mk_mem_alloc(size + 1);
+        if (!cs->body) {
+            cs->body = cs->body_fixed;
+            cs->_sched_init = MK_FALSE;
+            s->dispatched = MK_FALSE;
+            return http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+        }
+        cs->body_size = size;
+    }
+
+    p = cs->body;
+    p += sprintf(p, "%s %s HTTP/1.0\r\n", s->method.data, s->path.data);
+    if (s->authority.data) {
+        p += sprintf(p, "Host: %s\r\n", s->authority.data);
+    }
+    if (s->cookie) {
+        memcpy(p, "Cookie: ", 8);
+        memcpy(p + 8, s->cookie, s->cookie_len);
+        p += 8 + s->cookie_len;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    memcpy(p, s->req, s->req_headers);
+    p += s->req_headers;
+    memcpy(p, clen, clen_len);
+    p += clen_len;
+    *p++ = '\r';
+    *p++ = '\n';
+    if (body_len > 0) {
+        memcpy(p, s->req + s->req_headers, body_len);
+        p += body_len;
+    }
+    *p = '\0';
+    cs->body_length = p - cs->body;
+
+    /* The request buffer is not longer needed */
+    mk_mem_free(s->req);
+    s->req = NULL;
+    s->req_len = s->req_size = s->req_headers = 0;
+
+    mk_list_add(&sr->_head, &cs->request_list);
+    mk_http_request_init(cs, sr, server);
+
+    status = mk_http_parser(sr, &cs->parser, cs->body, cs->body_length,
+                            server);
+    if (status != MK_HTTP_PARSER_OK) {
+        if (sr->headers.sent == MK_FALSE) {
+            mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr, server);
+        }
+        s->req_end = MK_TRUE;
+        return 0;
+    }
+
+    if (s->error > 0) {
+        mk_http_error(s->error, cs, sr, server);
+        s->req_end = MK_TRUE;
+        return 0;
+    }
+
+    ret = mk_http_request_prepare(cs, sr, server);
+    if (ret == MK_PLUGIN_RET_CONTINUE || sr->thread) {
+        /* the handler calls mk_http_request_end() once done */
+        s->async = MK_TRUE;
+    }
+    else {
+        s->req_end = MK_TRUE;
+    }
+
+    return 0;
+}
+
+/*
+ * Release a stream. A normal end runs the request end stage as the
+ * HTTP/1.x scheduler does, an abort (reset or connection close) notifies
+ * the handlers through the session hangup.
+ */
+static int http2_stream_destroy(struct mk_http2_stream *s, int abort)
+{
+    struct mk_http2_session *h2s = s->h2s;
+    struct mk_sched_conn *conn = h2s->conn;
+    struct mk_server *server = h2s->server;
+    struct mk_http_session *cs = &s->cs;
+    struct mk_http_request *sr;
+
+    MK_H2_TRACE(conn, "stream=%" PRIu32 " destroy (abort=%i)", s->id, abort);
+
+    if (s->dispatched && cs->_sched_init == MK_TRUE) {
+        if (abort == MK_TRUE) {
+            s->channel.status = MK_CHANNEL_ERROR;
+            mk_http_session_remove(cs, server);
+        }
+        else {
+            if (s->async == MK_FALSE &&
+                mk_list_is_empty(&cs->request_list) != 0) {
+                sr = mk_list_entry_first(&cs->request_list,
+                                         struct mk_http_request, _head);
+                mk_plugin_stage_run_40(cs, sr, server);
+            }
+            mk_http_request_free_list(cs, server);
+            if (cs->body != cs->body_fixed) {
+                mk_mem_free(cs->body);
+            }
+            mk_list_del(&cs->request_list);
+            cs->_sched_init = MK_FALSE;
+        }
+    }
+    mk_channel_clean(&s->channel);
+
+    mk_ptr_free(&s->method);
+    mk_ptr_free(&s->path);
+    mk_ptr_free(&s->authority);
+    if (s->req) {
+        mk_mem_free(s->req);
+    }
+    if (s->cookie) {
+        mk_mem_free(s->cookie);
+    }
+    if (s->head) {
+        mk_mem_free(s->head);
+    }
+    if (s->pending) {
+        mk_mem_free(s->pending);
+    }
+
+    mk_list_del(&s->_head);
+    mk_list_del(&s->_sched);
+    if (h2s->sched_current == s) {
+        h2s->sched_current = NULL;
+    }
+    h2s->streams_active--;
+    mk_mem_free(s);
+
+    /* Idle connection, let the scheduler time it out */
+    if (mk_list_is_empty(&h2s->streams) == 0) {
+        conn->arrive_time = mk_clock_msec();
+        mk_sched_conn_timeout_add(conn, mk_sched_get_thread_conf());
+    }
+
+    return 0;
+}
+
+/*
+ * Incoming frames
+ * ---------------
+ */
+
+/* Keep the peer sending: refill a receive window below its half */
+static int http2_window_refill(struct mk_http2_session *h2s,
+                               struct mk_http2_stream *s)
+{
+    int32_t initial = MK_HTTP2_SETTINGS_DEFAULT.initial_window_size;
+
+    if (h2s->recv_window < initial / 2) {
+        if (http2_send_window_update(h2s, 0,
+                                     initial - h2s->recv_window) == -1) {
+            return -1;
+        }
+        h2s->recv_window = initial;
+    }
+
+    if (s && s->state == MK_HTTP2_STATE_OPEN &&
+        s->recv_window < initial / 2) {
+        if (http2_send_window_update(h2s, s->id,
+                                     initial - s->recv_window) == -1) {
+            return -1;
+        }
+        s->recv_window = initial;
+    }
+
+    return 0;
+}
+
+static int http2_frame_data(struct mk_http2_session *h2s, uint8_t flags,
+                            uint32_t stream_id, uint8_t *payload,
+                            uint32_t len)
+{
+    uint32_t pad = 0;
+    uint32_t data_len = len;
+    struct mk_http2_stream *s;
+    struct mk_server *server = h2s->server;
+
+    if (stream_id == 0) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    /* Flow control accounts the whole payload, padding included */
+    if ((int32_t) len > h2s->recv_window) {
+        return http2_conn_error(h2s, MK_HTTP2_FLOW_CONTROL_ERROR);
+    }
+    h2s->recv_window -= len;
+
+    if (flags & MK_HTTP2_PADDED) {
+        if (len < 1 || payload[0] >= len) {
+            return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        pad = payload[0];
+        payload++;
+        data_len = len - 1 - pad;
+    }
+
+    s = http2_stream_get(h2s, stream_id);
+    if (!s) {
+        if (stream_id > h2s->last_stream_id) {
+            return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        if (http2_send_rst(h2s, stream_id, MK_HTTP2_STREAM_CLOSED) == -1) {
+            return -1;
+        }
+        return http2_window_refill(h2s, NULL);
+    }
+
+    if (s->state != MK_HTTP2_STATE_OPEN) {
+        return http2_stream_reset(s, MK_HTTP2_STREAM_CLOSED);
+    }
+
+    if ((int32_t) len > s->recv_window) {
+        return http2_stream_reset(s, MK_HTTP2_FLOW_CONTROL_ERROR);
+    }
+    s->recv_window -= len;
+
+    if (s->error == 0 && data_len > 0) {
+        if (s->req_len - s->req_headers + data_len >
+            (size_t) server->max_request_size) {
+            /* keep reading (and discarding) until the end of the stream */
+            s->error = MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+        }
+        else if (http2_stream_append(s, (char *) payload, data_len) == -1) {
+            return http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+        }
+    }
+
+    if (flags & MK_HTTP2_END_STREAM) {
+        s->state = MK_HTTP2_STATE_HALF_CLOSED_REMOTE;
+        if (http2_window_refill(h2s, NULL) == -1) {
+            return -1;
+        }
+        return http2_stream_dispatch(s);
+    }
+
+    return http2_window_refill(h2s, s);
+}
+
+/* A complete header block (HEADERS + CONTINUATION) is available */
+static int http2_headers_end(struct mk_http2_session *h2s)
+{
+    int ret;
+    uint32_t stream_id = h2s->cont_stream_id;
+    struct mk_http2_stream *s;
+
+    h2s->cont_stream_id = 0;
+
+    s = http2_stream_get(h2s, stream_id);
+    if (!s || s->state != MK_HTTP2_STATE_IDLE) {
+        /* refused stream or trailers: keep the HPACK context only */
+        ret = mk_hpack_decode(&h2s->hpack, (uint8_t *) h2s->hblock,
+                              h2s->hblock_len, http2_discard_header, NULL);
+        if (ret != 0) {
+            return http2_conn_error(h2s, MK_HTTP2_COMPRESSION_ERROR);
+        }
+
+        if (!s) {
+            return http2_send_rst(h2s, stream_id, MK_HTTP2_REFUSED_STREAM);
+        }
+        if (h2s->cont_error) {
+            return http2_stream_reset(s, h2s->cont_error);
+        }
+
+        s->state = MK_HTTP2_STATE_HALF_CLOSED_REMOTE;
+        return http2_stream_dispatch(s);
+    }
+
+    ret = mk_hpack_decode(&h2s->hpack, (uint8_t *) h2s->hblock,
+                          h2s->hblock_len, http2_request_header, s);
+    if (ret != 0) {
+        return http2_conn_error(h2s, MK_HTTP2_COMPRESSION_ERROR);
+    }
+    s->req_headers = s->req_len;
+
+    if (h2s->cont_end_stream) {
+        s->state = MK_HTTP2_STATE_HALF_CLOSED_REMOTE;
+        return http2_stream_dispatch(s);
+    }
+
+    s->state = MK_HTTP2_STATE_OPEN;
+    if (s->malformed) {
+        return http2_stream_reset(s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    return 0;
+}
+
+static int http2_hblock_append(struct mk_http2_session *h2s,
+                               uint8_t *buf, size_t len)
+{
+    size_t size;
+    char *tmp;
+
+    if (h2s->hblock_len + len > MK_HTTP2_HEAD_MAX) {
+        return -1;
+    }
+
+    if (h2s->hblock_len + len > h2s->hblock_size) {
+        size = h2s->hblock_size ? h2s->hblock_size : 1024;
+        while (size < h2s->hblock_len + len) {
+            size *= 2;
+        }
+        tmp = mk_mem_realloc(h2s->hblock, size);
+        if (!tmp) {
+            return -1;
+        }
+        h2s->hblock = tmp;
+        h2s->hblock_size = size;
+    }
+
+    memcpy(h2s->hblock + h2s->hblock_len, buf, len);
+    h2s->hblock_len += len;
+
+    return 0;
+}
+
+static int http2_frame_headers(struct mk_http2_session *h2s, uint8_t flags,
+                               uint32_t stream_id, uint8_t *payload,
+                               uint32_t len)
+{
+    uint32_t pad = 0;
+    struct mk_http2_stream *s;
+
+    /* Client initiated streams use odd identifiers (5.1.1) */
+    if (stream_id == 0 || (stream_id & 1) == 0) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (flags & MK_HTTP2_PADDED) {
+        if (len < 1) {
+            return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        pad = payload[0];
+        payload++;
+        len--;
+    }
+
+    if (flags & MK_HTTP2_PRIORITY_FLAG) {
+        if (len < 5) {
+            return http2_conn_error(h2s, MK_HTTP2_FRAME_SIZE_ERROR);
+        }
+        payload += 5;
+        len -= 5;
+    }
+
+    if (pad > len) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+    len -= pad;
+
+    /*
+     * A block that ends in a stream error is still decoded, the HPACK
+     * context is shared by the whole connection (4.3).
+     */
+    h2s->cont_error = 0;
+
+    s = http2_stream_get(h2s, stream_id);
+    if (!s) {
+        if (stream_id <= h2s->last_stream_id) {
+            return http2_conn_error(h2s, MK_HTTP2_STREAM_CLOSED);
+        }
+        h2s->last_stream_id = stream_id;
+
+        /* Over the limit the block is decoded and the stream refused */
+        if (h2s->streams_active <
+            (int) MK_HTTP2_SETTINGS_DEFAULT.max_concurrent_streams) {
+            s = http2_stream_create(h2s, stream_id);
+            if (!s) {
+                return -1;
+            }
+        }
+    }
+    else if (s->state != MK_HTTP2_STATE_OPEN) {
+        h2s->cont_error = MK_HTTP2_STREAM_CLOSED;
+    }
+    else if ((flags & MK_HTTP2_END_STREAM) == 0) {
+        /* trailers must end the stream */
+        h2s->cont_error = MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    h2s->cont_stream_id = stream_id;
+    h2s->cont_end_stream = (flags & MK_HTTP2_END_STREAM);
+    h2s->hblock_len = 0;
+
+    if (http2_hblock_append(h2s, payload, len) == -1) {
+        return http2_conn_error(h2s, MK_HTTP2_ENHANCE_YOUR_CALM);
+    }
+
+    if (flags & MK_HTTP2_END_HEADERS) {
+        return http2_headers_end(h2s);
+    }
+
+    return 0;
+}
+
+static int http2_frame_continuation(struct mk_http2_session *h2s,
+                                    uint8_t flags, uint32_t stream_id,
+                                    uint8_t *payload, uint32_t len)
+{
+    if (h2s->cont_stream_id == 0 || h2s->cont_stream_id != stream_id) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (http2_hblock_append(h2s, payload, len) == -1) {
+        return http2_conn_error(h2s, MK_HTTP2_ENHANCE_YOUR_CALM);
+    }
+
+    if (flags & MK_HTTP2_END_HEADERS) {
+        return http2_headers_end(h2s);
+    }
+
+    return 0;
+}
+
+static int http2_frame_rst_stream(struct mk_http2_session *h2s,
+                                  uint32_t stream_id, uint32_t len)
+{
+    struct mk_http2_stream *s;
+
+    if (len != 4) {
+        return http2_conn_error(h2s, MK_HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    if (stream_id == 0 || stream_id > h2s->last_stream_id) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    s = http2_stream_get(h2s, stream_id);
+    if (s) {
+        http2_stream_destroy(s, MK_TRUE);
+    }
+
+    return 0;
+}
+
+/*
+ * Apply a SETTINGS payload, used by SETTINGS frames and by the
+ * HTTP2-Settings header of an upgrade request. Returns an error code.
+ */
+static int http2_settings_apply(struct mk_http2_session *h2s,
+                                uint8_t *payload, uint32_t len)
+{
+    uint32_t i;
+    int32_t delta;
+    uint16_t setting_id;
+    uint32_t setting_value;
+    uint8_t *p;
+    struct mk_list *head;
+    struct mk_http2_stream *s;
+
+    /*
+     * Iterate our SETTINGS payload, it may contain many entries in the
+     * following format:
+     *
+     * +-------------------------------+
+     * |       Identifier (16)         |
+     * +-------------------------------+-------------------------------+
+     * |                        Value (32)                             |
+     * +---------------------------------------------------------------+
+     *
+     * 48 bits = 6 bytes
+     */
+    for (i = 0; i < len; i += 6) {
+        p = payload + i;
+
+        setting_id = p[0] << 8 | p[1];
+        setting_value = http2_get32(p + 2);
+        MK_H2_TRACE(h2s->conn, "[Setting] ID=%" PRIu16 " VAL=%" PRIu32,
+                    setting_id, setting_value);
+
+        switch (setting_id) {
+        case MK_HTTP2_SETTINGS_HEADER_TABLE_SIZE:
+            /* our encoder never indexes, nothing to resize */
+            h2s->settings.header_table_size = setting_value;
+            break;
+        case MK_HTTP2_SETTINGS_ENABLE_PUSH:
+            if (setting_value != 0 && setting_value != 1) {
+                return MK_HTTP2_PROTOCOL_ERROR;
+            }
+            h2s->settings.enable_push = setting_value;
+            break;
+        case MK_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS:
+            h2s->settings.max_concurrent_streams = setting_value;
+            break;
+        case MK_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (setting_value > MK_HTTP2_MAX_WINDOW) {
+                return MK_HTTP2_FLOW_CONTROL_ERROR;
+            }
+
+            /* The change applies to every open stream (6.9.2) */
+            delta = setting_value - h2s->settings.initial_window_size;
+            mk_list_foreach(head, &h2s->streams) {
+                s = mk_list_entry(head, struct mk_http2_stream, _head);
+                if ((int64_t) s->send_window + delta > MK_HTTP2_MAX_WINDOW) {
+                    return MK_HTTP2_FLOW_CONTROL_ERROR;
+                }
+                s->send_window += delta;
+            }
+            h2s->settings.initial_window_size = setting_value;
+            break;
+        case MK_HTTP2_SETTINGS_MAX_FRAME_SIZE:
+            if (setting_value < 16384 || setting_value > 16777215) {
+                return MK_HTTP2_PROTOCOL_ERROR;
+            }
+            h2s->settings.max_frame_size = setting_value;
+            break;
+        case MK_HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE:
+            h2s->settings.max_header_list_size = setting_value;
+            break;
+        default:
+            /*
+             * 5.5 Extending HTTP/2: ...Implementations MUST ignore unknown
+             * or unsupported values in all extensible protocol elements...
+             */
+            break;
+        }
+    }
+
+    return MK_HTTP2_NO_ERROR;
+}
+
+static int http2_frame_settings(struct mk_http2_session *h2s, uint8_t flags,
+                                uint32_t stream_id, uint8_t *payload,
+                                uint32_t len)
+{
+    int ret;
+
+    if (stream_id != 0) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (flags & MK_HTTP2_SETTINGS_ACK) {
+        /* The peer acknowledged our SETTINGS, the payload must be empty */
+        if (len > 0) {
+            return http2_conn_error(h2s, MK_HTTP2_FRAME_SIZE_ERROR);
+        }
+        return 0;
+    }
+
+    if (len % 6 != 0) {
+        return http2_conn_error(h2s, MK_HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    ret = http2_settings_apply(h2s, payload, len);
+    if (ret != MK_HTTP2_NO_ERROR) {
+        return http2_conn_error(h2s, ret);
+    }
+    h2s->peer_settings = MK_TRUE;
+
+    return http2_send_raw(h2s, MK_HTTP2_SETTINGS_ACK_FRAME,
+                          sizeof(MK_HTTP2_SETTINGS_ACK_FRAME) - 1);
+}
+
+static int http2_frame_window_update(struct mk_http2_session *h2s,
+                                     uint32_t stream_id, uint8_t *payload,
+                                     uint32_t len)
+{
+    uint32_t increment;
+    struct mk_http2_stream *s;
+
+    if (len != 4) {
+        return http2_conn_error(h2s, MK_HTTP2_FRAME_SIZE_ERROR);
+    }
+    increment = http2_get32(payload) & 0x7fffffff;
+
+    if (stream_id == 0) {
+        if (increment == 0) {
+            return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        if ((int64_t) h2s->send_window + increment > MK_HTTP2_MAX_WINDOW) {
+            return http2_conn_error(h2s, MK_HTTP2_FLOW_CONTROL_ERROR);
+        }
+        h2s->send_window += increment;
+        return 0;
+    }
+
+    s = http2_stream_get(h2s, stream_id);
+    if (!s) {
+        if (stream_id > h2s->last_stream_id) {
+            return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        return 0;
+    }
+
+    if (increment == 0) {
+        return http2_stream_reset(s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+    if ((int64_t) s->send_window + increment > MK_HTTP2_MAX_WINDOW) {
+        return http2_stream_reset(s, MK_HTTP2_FLOW_CONTROL_ERROR);
+    }
+    s->send_window += increment;
+
+    return 0;
+}
+
+/* Reprioritization of a request (RFC 9218, Section 7.1) */
+static int http2_frame_priority_update(struct mk_http2_session *h2s,
+                                       uint32_t stream_id, uint8_t *payload,
+                                       uint32_t len)
+{
+    int urgency;
+    int incremental;
+    uint32_t id;
+    struct mk_http2_stream *s;
+
+    if (stream_id != 0) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+    if (len < 4) {
+        return http2_conn_error(h2s, MK_HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    /* Only client streams can be prioritized, we never push */
+    id = http2_get32(payload) & 0x7fffffff;
+    if (id == 0 || (id & 1) == 0) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    /* Updates for closed or not yet opened streams are dropped */
+    s = http2_stream_get(h2s, id);
+    if (!s) {
+        return 0;
+    }
+
+    urgency = s->urgency;
+    incremental = s->incremental;
+    http2_priority_parse((char *) payload + 4, len - 4,
+                         &urgency, &incremental);
+    http2_sched_update(s, urgency, incremental);
+
+    return 0;
+}
+
+static int http2_frame_run(struct mk_http2_session *h2s, uint8_t *frame,
+                           uint32_t len)
+{
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream_id;
+    uint8_t *payload;
+    struct mk_http2_stream *s;
+
+    type      = frame[3];
+    flags     = frame[4];
+    stream_id = http2_get32(frame + 5) & 0x7fffffff;
+    payload   = frame + MK_HTTP2_HEADER_SIZE;
+
+    MK_H2_TRACE(h2s->conn, "frame type=%i flags=%i stream=%" PRIu32
+                " length=%" PRIu32, type, flags, stream_id, len);
+
+    /* A header block must not be interleaved with other frames (6.10) */
+    if (h2s->cont_stream_id && type != MK_HTTP2_CONTINUATION) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    /* The client preface ends with a SETTINGS frame (3.5) */
+    if (h2s->peer_settings == MK_FALSE &&
+        (type != MK_HTTP2_SETTINGS || (flags & MK_HTTP2_SETTINGS_ACK))) {
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+    case MK_HTTP2_DATA:
+        return http2_frame_data(h2s, flags, stream_id, payload, len);
+    case MK_HTTP2_HEADERS:
+        return http2_frame_headers(h2s, flags, stream_id, payload, len);
+    case MK_HTTP2_PRIORITY:
+        if (stream_id == 0) {
+            return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        if (len != 5) {
+            s = http2_stream_get(h2s, stream_id);
+            if (s) {
+                return http2_stream_reset(s, MK_HTTP2_FRAME_SIZE_ERROR);
+            }
+            return http2_send_rst(h2s, stream_id, MK_HTTP2_FRAME_SIZE_ERROR);
+        }
+        /* RFC 7540 priorities are deprecated, see RFC 9218 */
+        return 0;
+    case MK_HTTP2_RST_STREAM:
+        return http2_frame_rst_stream(h2s, stream_id, len);
+    case MK_HTTP2_SETTINGS:
+        return http2_frame_settings(h2s, flags, stream_id, payload, len);
+    case MK_HTTP2_PUSH_PROMISE:
+        /* Clients cannot push */
+        return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+    case MK_HTTP2_PING:
+        if (stream_id != 0) {
+            return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        if (len != 8) {
+            return http2_conn_error(h2s, MK_HTTP2_FRAME_SIZE_ERROR);
+        }
+        if (flags & MK_HTTP2_PING_ACK) {
+            return 0;
+        }
+        return http2_send_frame(h2s, MK_HTTP2_PING, MK_HTTP2_PING_ACK, 0,
+                                payload, 8);
+    case MK_HTTP2_GOAWAY:
+        if (stream_id != 0) {
+            return http2_conn_error(h2s, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        if (len < 8) {
+            return http2_conn_error(h2s, MK_HTTP2_FRAME_SIZE_ERROR);
+        }
+        /* Finish the streams in progress, then close */
+        h2s->goaway = MK_TRUE;
+        h2s->goaway_id = http2_get32(payload) & 0x7fffffff;
+        return 0;
+    case MK_HTTP2_WINDOW_UPDATE:
+        return http2_frame_window_update(h2s, stream_id, payload, len);
+    case MK_HTTP2_CONTINUATION:
+        return http2_frame_continuation(h2s, flags, stream_id, payload, len);
+    case MK_HTTP2_PRIORITY_UPDATE:
+        return http2_frame_priority_update(h2s, stream_id, payload, len);
+    default:
+        /* Unknown frame types are ignored (5.5) */
+        return 0;
+    }
+}
+
+/* Process the preface and every complete frame in the read buffer */
+static int http2_process(struct mk_http2_session *h2s)
+{
+    int ret;
+    uint32_t len;
+    size_t offset = 0;
+    uint8_t *p;
+    struct mk_http2_stream *s;
+
+    /* Upgraded connections from HTTP/1.x requires the preface */
+    if (h2s->status == MK_HTTP2_UPGRADED) {
+        if (h2s->buffer_length < http2_preface.len) {
+            if (memcmp(h2s->buffer, http2_preface.data,
+                       h2s->buffer_length) != 0) {
+                MK_H2_TRACE(h2s->conn, "Invalid HTTP/2 preface");
+                return -1;
+            }
+            return 0;
+        }
+
+        if (memcmp(h2s->buffer, http2_preface.data, http2_preface.len) != 0) {
+            MK_H2_TRACE(h2s->conn, "Invalid HTTP/2 preface");
+            return -1;
+        }
+
+        MK_H2_TRACE(h2s->conn, "HTTP/2 preface OK");
+        offset = http2_preface.len;
+        h2s->status = MK_HTTP2_OK;
+        h2s->conn->arrive_time = mk_clock_msec();
+
+        /* The upgraded request can be served now */
+        s = http2_stream_get(h2s, 1);
+        if (s && s->dispatched == MK_FALSE) {
+            ret = http2_stream_dispatch(s);
+            if (ret == -1) {
+                return -1;
+            }
+        }
+    }
+
+    while (h2s->status == MK_HTTP2_OK &&
+           h2s->buffer_length - offset >= MK_HTTP2_HEADER_SIZE) {
+        p = (uint8_t *) h2s->buffer + offset;
+        len = (p[0] << 16) | (p[1] << 8) | p[2];
+
+        if (len > MK_HTTP2_SETTINGS_DEFAULT.max_frame_size) {
+            if (http2_conn_error(h2s, MK_HTTP2_FRAME_SIZE_ERROR) == -1) {
+                return -1;
+            }
+            break;
+        }
+
+        if (h2s->buffer_length - offset < MK_HTTP2_HEADER_SIZE + len) {
+            break;
+        }
+
+        ret = http2_frame_run(h2s, p, len);
+        if (ret == -1) {
+            return -1;
+        }
+        offset += MK_HTTP2_HEADER_SIZE + len;
+    }
+
+    if (h2s->status == MK_HTTP2_CLOSING) {
+        h2s->buffer_length = 0;
+        return 0;
+    }
+
+    if (offset > 0) {
+        memmove(h2s->buffer, h2s->buffer + offset,
+                h2s->buffer_length - offset);
+        h2s->buffer_length -= offset;
+    }
+
+    return 0;
+}
+
+/*
+ * Outgoing data
+ * -------------
+ */
+
+/* Copy bytes out of an IOV input, adjusting it as a write would do */
+static size_t http2_iov_copy(struct mk_iov *iov, char *buf, size_t size)
+{
+    int i;
+    size_t n;
+    size_t total = 0;
+
+    for (i = 0; i < iov->iov_idx && total < size; i++) {
+        n = iov->io[i].iov_len;
+        if (n == 0) {
+            continue;
+        }
+        if (n > size - total) {
+            n = size - total;
+        }
+        memcpy(buf + total, iov->io[i].iov_base, n);
+        iov->io[i].iov_base = (char *) iov->io[i].iov_base + n;
+        iov->io[i].iov_len -= n;
+        total += n;
+    }
+    iov->total_len -= total;
+
+    return total;
+}
+
+/*
+ * Pull up to 'size' bytes of the response from the stream virtual channel,
+ * consuming the inputs the same way mk_channel_write() does.
+ */
+static ssize_t http2_stream_pull(struct mk_http2_stream *s,
+                                 char *buf, size_t size)
+{
+    ssize_t n;
+    struct mk_list *head;
+    struct mk_stream *stream;
+    struct mk_stream_input *in;
+
+    mk_list_foreach(head, &s->channel.streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+
+        while (mk_list_is_empty(&stream->inputs) != 0) {
+            in = mk_list_entry_first(&stream->inputs,
+                                     struct mk_stream_input, _head);
+            if (in->bytes_total == 0) {
+                mk_stream_in_release(in);
+                continue;
+            }
+
+            n = (in->bytes_total < size) ? in->bytes_total : size;
+            if (in->type == MK_STREAM_RAW || in->type == MK_STREAM_COPYBUF) {
+                memcpy(buf, (char *) in->buffer + in->bytes_offset, n);
+                in->bytes_offset += n;
+            }
+            else if (in->type == MK_STREAM_IOV) {
+                n = http2_iov_copy(in->buffer, buf, n);
+                if (n == 0) {
+                    /* the IOV is shorter than announced */
+                    in->bytes_total = 0;
+                    continue;
+                }
+            }
+            else if (in->type == MK_STREAM_FILE) {
+                n = pread(in->fd, buf, n, in->bytes_offset);
+                if (n <= 0) {
+                    return -1;
+                }
+                in->bytes_offset += n;
+            }
+            else {
+                return -1;
+            }
+
+            mk_stream_input_consume(in, n);
+            if (stream->cb_bytes_consumed) {
+                stream->cb_bytes_consumed(stream, n);
+            }
+            if (in->cb_consumed) {
+                in->cb_consumed(in, n);
+            }
+            if (in->bytes_total == 0) {
+                mk_stream_in_release(in);
+                if (mk_list_is_empty(&stream->inputs) == 0 &&
+                    stream->cb_finished) {
+                    stream->cb_finished(stream);
+                }
+            }
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+/* Nothing else queued by the handler for this stream */
+static int http2_stream_drained(struct mk_http2_stream *s)
+{
+    struct mk_list *head;
+    struct mk_stream *stream;
+
+    if (s->pending_offset < s->pending_len) {
+        return MK_FALSE;
+    }
+
+    mk_list_foreach(head, &s->channel.streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        if (mk_list_is_empty(&stream->inputs) != 0) {
+            return MK_FALSE;
+        }
+    }
+
+    return MK_TRUE;
+}
+
+/* The last frame of the response was queued */
+static void http2_stream_end(struct mk_http2_stream *s)
+{
+    if (s->state == MK_HTTP2_STATE_OPEN) {
+        /*
+         * The response was sent before the request ended, the remaining
+         * of the request is not needed (8.1).
+         */
+        http2_send_rst(s->h2s, s->id, MK_HTTP2_NO_ERROR);
+    }
+    s->state = MK_HTTP2_STATE_CLOSED;
+    http2_stream_destroy(s, MK_FALSE);
+}
+
+/* Encode the response head produced by the HTTP core into a header block */
+static int http2_head_encode(struct mk_http2_stream *s, uint8_t *out,
+                             size_t size)
+{
+    int ret;
+    int status = 200;
+    size_t n = 0;
+    size_t i;
+    char *p;
+    char *end;
+    char *eol;
+    char *colon;
+    char *value;
+    char *field;
+    size_t field_len = 0;
+    size_t name_len;
+    size_t value_len;
+    struct mk_mimetype *mime;
+    struct mk_server *server = s->h2s->server;
+
+    p = s->head;
+    end = s->head + s->head_len;
+
+    /* Status line, CGI responses may override it with a Status header */
+    if (s->head_len > 9 && memcmp(p, "HTTP/", 5) == 0) {
+        colon = memchr(p, ' ', s->head_len);
+        if (colon) {
+            status = atoi(colon + 1);
+        }
+        eol = memchr(p, '\n', s->head_len);
+        p = eol ? eol + 1 : end;
+    }
+
+    for (eol = p; eol + 7 < end; eol++) {
+        if ((eol == p || eol[-1] == '\n') &&
+            strncasecmp(eol, "status:", 7) == 0) {
+            status = atoi(eol + 7);
+            break;
+        }
+    }
+
+    ret = mk_hpack_encode_status(out, size, status);
+    if (ret == -1) {
+        return -1;
+    }
+    n = ret;
+
+    while (p < end) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        colon = memchr(p, ':', eol - p);
+        if (!colon || colon == p) {
+            p = eol + 1;
+            continue;
+        }
+
+        name_len = colon - p;
+        for (i = 0; i < name_len; i++) {
+            p[i] = tolower(p[i]);
+        }
+
+        value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        value_len = eol - value;
+        while (value_len > 0 &&
+               (value[value_len - 1] == '\r' || value[value_len - 1] == ' ')) {
+            value_len--;
+        }
+
+        if (http2_conn_header(p, name_len) == MK_TRUE ||
+            (name_len == 6 && memcmp(p, "status", 6) == 0)) {
+            p = eol + 1;
+            continue;
+        }
+
+        /* Server and Content-Type fields are encoded once at startup */
+        field = NULL;
+        if (name_len == 6 && memcmp(p, "server", 6) == 0 &&
+            server->server_signature_hpack_len > 0 &&
+            value_len == strlen(server->server_signature) &&
+            memcmp(value, server->server_signature, value_len) == 0) {
+            field = server->server_signature_hpack;
+            field_len = server->server_signature_hpack_len;
+        }
+        else if (name_len == 12 && memcmp(p, "content-type", 12) == 0) {
+            mime = mk_mimetype_type_lookup(server, value, value_len);
+            if (mime && mime->hpack_type.len > 0) {
+                field = mime->hpack_type.data;
+                field_len = mime->hpack_type.len;
+            }
+        }
+
+        if (field) {
+            if (field_len > size - n) {
+                return -1;
+            }
+            memcpy(out + n, field, field_len);
+            n += field_len;
+        }
+        else {
+            ret = mk_hpack_encode_header(out + n, size - n,
+                                         p, name_len, value, value_len);
+            if (ret == -1) {
+                return -1;
+            }
+            n += ret;
+        }
+        p = eol + 1;
+    }
+
+    return n;
+}
+
+/*
+ * Headers phase: collect the HTTP/1.x response head generated by the core
+ * (up to the blank line) and send it as HEADERS + CONTINUATION frames.
+ */
+static int http2_stream_headers(struct mk_http2_stream *s)
+{
+    int ret;
+    int flags;
+    size_t start;
+    size_t chunk;
+    size_t block_len;
+    size_t max;
+    ssize_t n;
+    char *tmp;
+    char *eoh = NULL;
+    uint8_t *block;
+    uint8_t *p;
+    struct mk_http2_session *h2s = s->h2s;
+    struct mk_http_request *sr = &s->cs.sr_fixed;
+    struct mk_stream_input *in;
+
+    if (sr->headers.sent == MK_FALSE) {
+        if (s->req_end == MK_TRUE) {
+            /* the handler finished without a response */
+            http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+            return 1;
+        }
+        return 0;
+    }
+
+    /* Errors raised before mk_http_init() leave the head input unlinked */
+    in = &sr->in_headers;
+    if (in->stream == NULL) {
+        in->type        = MK_STREAM_IOV;
+        in->dynamic     = MK_FALSE;
+        in->cb_consumed = NULL;
+        in->stream      = &sr->stream;
+        __mk_list_add(&in->_head, &sr->stream.inputs, sr->stream.inputs.next);
+    }
+
+    while (!eoh) {
+        if (s->head_size - s->head_len < 1024) {
+            if (s->head_size >= MK_HTTP2_HEAD_MAX) {
+                http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+                return 1;
+            }
+            tmp = mk_mem_realloc(s->head, s->head_size + 2048);
+            if (!tmp) {
+                http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+                return 1;
+            }
+            s->head = tmp;
+            s->head_size += 2048;
+        }
+
+        n = http2_stream_pull(s, s->head + s->head_len, 1024);
+        if (n < 0) {
+            http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+            return 1;
+        }
+        else if (n == 0) {
+            break;
+        }
+
+        start = (s->head_len > 3) ? s->head_len - 3 : 0;
+        s->head_len += n;
+        eoh = memmem(s->head + start, s->head_len - start, "\r\n\r\n", 4);
+    }
+
+    if (!eoh) {
+        if (s->req_end == MK_TRUE && http2_stream_drained(s)) {
+            http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+            return 1;
+        }
+        return 0;
+    }
+
+    /* Body bytes that came in the same buffer (e.g: error pages) */
+    start = (eoh - s->head) + 4;
+    if (start < s->head_len) {
+        s->pending_len = s->head_len - start;
+        s->pending = mk_mem_alloc(s->pending_len);
+        if (!s->pending) {
+            http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+            return 1;
+        }
+        memcpy(s->pending, s->head + start, s->pending_len);
+        s->pending_offset = 0;
+    }
+    s->head_len = (eoh - s->head) + 2;
+
+    /* Literal fields are never larger than the text plus their prefixes */
+    max = (s->head_len * 2) + 64;
+    block = mk_mem_alloc(max);
+    if (!block) {
+        http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+        return 1;
+    }
+
+    ret = http2_head_encode(s, block, max);
+    mk_mem_free(s->head);
+    s->head = NULL;
+    s->head_len = s->head_size = 0;
+    if (ret == -1) {
+        mk_mem_free(block);
+        http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+        return 1;
+    }
+    block_len = ret;
+
+    /* HEADERS plus as many CONTINUATION frames as required */
+    chunk = h2s->settings.max_frame_size;
+    p = http2_out_reserve(h2s, block_len +
+                          ((block_len / chunk) + 1) * MK_HTTP2_HEADER_SIZE);
+    if (!p) {
+        mk_mem_free(block);
+        return -1;
+    }
+
+    flags = 0;
+    if (s->req_end == MK_TRUE && http2_stream_drained(s)) {
+        flags |= MK_HTTP2_END_STREAM;
+    }
+
+    start = 0;
+    do {
+        n = block_len - start;
+        if ((size_t) n > chunk) {
+            n = chunk;
+        }
+        if (start + n == block_len) {
+            flags |= MK_HTTP2_END_HEADERS;
+        }
+        http2_frame_header(p, n,
+                           start == 0 ? MK_HTTP2_HEADERS : MK_HTTP2_CONTINUATION,
+                           flags, s->id);
+        memcpy(p + MK_HTTP2_HEADER_SIZE, block + start, n);
+        p += MK_HTTP2_HEADER_SIZE + n;
+        h2s->out_len += MK_HTTP2_HEADER_SIZE + n;
+        start += n;
+        flags &= ~MK_HTTP2_END_STREAM;
+    } while (start < block_len);
+
+    mk_mem_free(block);
+    s->headers_sent = MK_TRUE;
+
+    if (s->req_end == MK_TRUE && http2_stream_drained(s)) {
+        http2_stream_end(s);
+    }
+
+    return 1;
+}
+
+/* Data phase: one DATA frame limited by the flow control windows */
+static int http2_stream_data(struct mk_http2_stream *s)
+{
+    int flags = 0;
+    ssize_t n = 0;
+    ssize_t max;
+    uint8_t *p;
+    struct mk_http2_session *h2s = s->h2s;
+
+    max = h2s->out_size - h2s->out_len - MK_HTTP2_HEADER_SIZE;
+    if (max < 0) {
+        return 0;
+    }
+    if (max > (ssize_t) h2s->frame_size) {
+        max = h2s->frame_size;
+    }
+    if (max > s->send_window) {
+        max = s->send_window;
+    }
+    if (max > h2s->send_window) {
+        max = h2s->send_window;
+    }
+
+    p = (uint8_t *) h2s->out + h2s->out_len;
+    if (max > 0) {
+        if (s->pending_offset < s->pending_len) {
+            n = s->pending_len - s->pending_offset;
+            if (n > max) {
+                n = max;
+            }
+            memcpy(p + MK_HTTP2_HEADER_SIZE,
+                   s->pending + s->pending_offset, n);
+            s->pending_offset += n;
+        }
+        else {
+            n = http2_stream_pull(s, (char *) p + MK_HTTP2_HEADER_SIZE, max);
+            if (n < 0) {
+                http2_stream_reset(s, MK_HTTP2_INTERNAL_ERROR);
+                return 1;
+            }
+        }
+    }
+
+    if (s->req_end == MK_TRUE && http2_stream_drained(s)) {
+        flags = MK_HTTP2_END_STREAM;
+    }
+    else if (n == 0) {
+        return 0;
+    }
+
+    http2_frame_header(p, n, MK_HTTP2_DATA, flags, s->id);
+    h2s->out_len += MK_HTTP2_HEADER_SIZE + n;
+    s->send_window -= n;
+    h2s->send_window -= n;
+
+    if (flags & MK_HTTP2_END_STREAM) {
+        http2_stream_end(s);
+    }
+
+    return 1;
+}
+
+static int http2_stream_produce(struct mk_http2_stream *s)
 {
-    memmove(h2s->buffer,
-            h2s->buffer + bytes,
-            h2s->buffer_length - bytes);
+    if (s->dispatched == MK_FALSE) {
+        return 0;
+    }
+
+    if (s->headers_sent == MK_FALSE) {
+        return http2_stream_headers(s);
+    }
 
-    MK_TRACE("[h2] consume buffer length from %i to %i",
-             h2s->buffer_length, h2s->buffer_length - bytes);
-    h2s->buffer_length -= bytes;
+    return http2_stream_data(s);
 }
 
-static struct mk_http2_session *mk_http2_session_create()
+/*
+ * Size DATA frames after the congestion window: while it is small (slow
+ * start, recovery) shorter frames let urgent streams interleave sooner.
+ */
+static void http2_frame_size(struct mk_http2_session *h2s)
 {
-    struct mk_http2_session *h2s;
+    int cwnd;
+    uint32_t size = h2s->settings.max_frame_size;
 
-    h2s = mk_mem_alloc(sizeof(struct mk_http2_session));
-    if (!h2s) {
-        return NULL;
+    cwnd = mk_socket_tcp_cwnd(h2s->conn->event.fd);
+    if (cwnd > 0) {
+        if (cwnd < MK_HTTP2_FRAME_MIN) {
+            cwnd = MK_HTTP2_FRAME_MIN;
+        }
+        if ((uint32_t) cwnd < size) {
+            size = cwnd;
+        }
     }
-    h2s->buffer = NULL;
-    h2s->buffer_length = 0;
-    h2s->buffer_size = sizeof(h2s->buffer_fixed);
-    h2s->buffer = h2s->buffer_fixed;
-    h2s->settings = MK_HTTP2_SETTINGS_DEFAULT;
+    h2s->frame_size = size;
+}
 
-    return h2s;
+/*
+ * Fill the output buffer one frame at a time, every frame goes to the
+ * first stream in urgency order that has something to send.
+ */
+static int http2_fill(struct mk_http2_session *h2s)
+{
+    int u;
+    int ret;
+    int progress;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http2_stream *s;
+
+    http2_frame_size(h2s);
+
+    do {
+        progress = MK_FALSE;
+
+        for (u = 0; u < MK_HTTP2_URGENCY_LEVELS && !progress; u++) {
+            mk_list_foreach_safe(head, tmp, &h2s->sched[u]) {
+                if (h2s->out_size - h2s->out_len <= MK_HTTP2_HEADER_SIZE) {
+                    return 0;
+                }
+
+                s = mk_list_entry(head, struct mk_http2_stream, _sched);
+                h2s->sched_current = s;
+                ret = http2_stream_produce(s);
+                if (ret == -1) {
+                    h2s->sched_current = NULL;
+                    return -1;
+                }
+                else if (ret == 0) {
+                    continue;
+                }
+
+                /* The stream may be gone, incremental ones take turns */
+                s = h2s->sched_current;
+                if (s && s->incremental == MK_TRUE) {
+                    mk_list_del(&s->_sched);
+                    mk_list_add(&s->_sched, &h2s->sched[s->urgency]);
+                }
+                progress = MK_TRUE;
+                break;
+            }
+        }
+    } while (progress == MK_TRUE);
+
+    h2s->sched_current = NULL;
+    return 0;
 }
 
-/* FIXME
-static int mk_http2_session_destroy(struct mk_http2_session *h2s)
+/* Serialize pending frames and write them to the socket */
+static int http2_pump(struct mk_http2_session *h2s)
 {
-    if (h2s->buffer != h2s->buffer_fixed) {
-        mk_mem_free(h2s->buffer);
+    int ret = 0;
+    ssize_t bytes;
+    size_t total = 0;
+    int mask = MK_EVENT_READ;
+    struct mk_sched_conn *conn = h2s->conn;
+
+    if (h2s->pumping == MK_TRUE) {
+        return 0;
     }
-    mk_mem_free(h2s);
-    return 0;
+    h2s->pumping = MK_TRUE;
+
+    while (1) {
+        if (h2s->out_offset > 0) {
+            memmove(h2s->out, h2s->out + h2s->out_offset,
+                    h2s->out_len - h2s->out_offset);
+            h2s->out_len -= h2s->out_offset;
+            h2s->out_offset = 0;
+        }
+
+        if (h2s->status != MK_HTTP2_CLOSING && http2_fill(h2s) == -1) {
+            ret = -1;
+            break;
+        }
+
+        if (h2s->out_len == 0) {
+            break;
+        }
+
+        bytes = conn->net->write(conn->event.fd, h2s->out, h2s->out_len);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EAGAIN) {
+                mask |= MK_EVENT_WRITE;
+            }
+            else {
+                ret = -1;
+            }
+            break;
+        }
+
+        h2s->out_offset = bytes;
+        total += bytes;
+        if (h2s->out_offset < h2s->out_len) {
+            mask |= MK_EVENT_WRITE;
+            break;
+        }
+        h2s->out_offset = h2s->out_len = 0;
+
+        /* Give other connections a chance, continue on the next round */
+        if (total >= MK_HTTP2_OUT_SIZE * 4) {
+            mask |= MK_EVENT_WRITE;
+            break;
+        }
+    }
+
+    h2s->pumping = MK_FALSE;
+    if (ret == 0) {
+        http2_events(h2s, mask);
+    }
+    return ret;
 }
 
-static int mk_http2_frame_header(char *buf, uint32_t length, uint8_t type,
-                                 uint32_t flags, void *data)
+/* The connection can be closed */
+static int http2_finished(struct mk_http2_session *h2s)
 {
-    struct mk_http2_frame *f = (struct mk_http2_frame *) buf;
+    if (h2s->out_len > h2s->out_offset) {
+        return MK_FALSE;
+    }
+
+    if (h2s->status == MK_HTTP2_CLOSING) {
+        return MK_TRUE;
+    }
 
-    f->len_type = (length << 8 | type);
-    f->flags    = flags;
-    f->payload  = data;
+    if (h2s->goaway == MK_TRUE && mk_list_is_empty(&h2s->streams) == 0) {
+        return MK_TRUE;
+    }
 
-    return sizeof(struct mk_http2_frame);
+    return MK_FALSE;
 }
 
-*/
+/*
+ * Virtual channel hooks
+ * ---------------------
+ */
 
-/* Handle an upgraded session */
-static int mk_http2_upgrade(void *cs, void *sr, struct mk_server *server)
+/* A handler flushed data on a stream channel */
+int mk_http2_channel_flush(struct mk_channel *channel)
 {
-    struct mk_http_session *s = cs;
-    struct mk_http_request *r = sr;
+    struct mk_http2_stream *s;
     struct mk_http2_session *h2s;
 
-    mk_header_set_http_status(r, MK_INFO_SWITCH_PROTOCOL);
-    r->headers.connection = MK_HEADER_CONN_UPGRADED;
-    r->headers.upgrade = MK_HEADER_UPGRADED_H2C;
-    mk_header_prepare(s, r, server);
+    s = mk_list_entry(channel, struct mk_http2_stream, channel);
+    h2s = s->h2s;
 
-    h2s = mk_http2_session_create();
-    if (!h2s) {
-        return -1;
+    if (channel->status != MK_CHANNEL_OK) {
+        return MK_CHANNEL_ERROR;
     }
 
-    h2s->status = MK_HTTP2_UPGRADED;
-    s->conn->data = h2s;
+    /* A finished stream may be released by the pump, defer it */
+    if (s->req_end == MK_TRUE) {
+        http2_events(h2s, MK_EVENT_READ | MK_EVENT_WRITE);
+        return MK_CHANNEL_FLUSH;
+    }
+
+    if (http2_pump(h2s) == -1) {
+        h2s->status = MK_HTTP2_CLOSING;
+        return MK_CHANNEL_ERROR;
+    }
 
-    return MK_HTTP_OK;
+    if (http2_stream_drained(s)) {
+        return MK_CHANNEL_DONE;
+    }
+    return MK_CHANNEL_FLUSH;
 }
 
-/* FIXME Decode a frame header, no more... no less
-static inline void mk_http2_frame_decode_header(uint8_t *buf,
-                                                struct mk_http2_frame *frame)
+/* The request handler is done, the stream ends once its data is framed */
+int mk_http2_request_end(struct mk_http_session *cs, struct mk_server *server)
 {
-    struct mk_http2_session *h2s;
-    (void) h2s;
+    struct mk_http2_stream *s;
+    (void) server;
 
-    frame->len_type  = mk_http2_bitdec_32u(buf);
-    frame->flags     = buf[4];
-    frame->stream_id = mk_http2_bitdec_stream_id(buf + 5);
-    frame->payload   = buf + 9;
+    s = mk_list_entry(cs, struct mk_http2_stream, cs);
+    s->req_end = MK_TRUE;
+    http2_events(s->h2s, MK_EVENT_READ | MK_EVENT_WRITE);
 
-#ifdef TRACE
-    MK_TRACE("Frame Header");
-    printf(" length=%i, type=%i, stream_id=%i\n",
-           mk_http2_frame_len(frame),
-           mk_http2_frame_type(frame),
-           frame->stream_id);
-#endif
+    return 0;
 }
-*/
 
-static inline int mk_http2_handle_settings(struct mk_sched_conn *conn,
-                                           struct mk_http2_frame *frame)
+/*
+ * Session
+ * -------
+ */
+static struct mk_http2_session *mk_http2_session_create(struct mk_sched_conn *conn,
+                                                        struct mk_server *server)
 {
     int i;
-    int frame_len;
-    int settings;
-    int setting_size = 6; /* 16 bits identifier + 32 bits value = 6 bytes */
-    uint16_t setting_id;
-    uint32_t setting_value;
-    uint8_t *p;
     struct mk_http2_session *h2s;
 
-    h2s = conn->data;
-    frame_len = mk_http2_frame_len(frame);
-    if (frame->flags == MK_HTTP2_SETTINGS_ACK) {
-        /*
-         * Nothing to do, the peer just received our SETTINGS and it's
-         * sending an acknowledge.
-         *
-         * note: validate that frame length is zero.
-         */
-        if (frame_len > 0) {
-            /*
-             * This must he handled as a connection error, we must reply
-             * with a FRAME_SIZE_ERROR. ref:
-             *
-             *  https://httpwg.github.io/specs/rfc7540.html#SETTINGS
-             */
+    h2s = mk_mem_alloc_z(sizeof(struct mk_http2_session));
+    if (!h2s) {
+        return NULL;
+    }
 
-            /* FIXME: send a GOAWAY error frame */
-            MK_TRACE("FRAME SIZE ERR: %i\n", frame_len);
-            return -1;
+    h2s->out = mk_mem_alloc(MK_HTTP2_OUT_SIZE);
+    if (!h2s->out) {
+        mk_mem_free(h2s);
+        return NULL;
+    }
+    h2s->out_size = MK_HTTP2_OUT_SIZE;
 
-        }
-        return 0;
+    if (mk_hpack_init(&h2s->hpack,
+                      MK_HTTP2_SETTINGS_DEFAULT.header_table_size) != 0) {
+        mk_mem_free(h2s->out);
+        mk_mem_free(h2s);
+        return NULL;
     }
 
-    /*
-     * Iterate our SETTINGS payload, it may contain many entries in the
-     * following format:
-     *
-     * +-------------------------------+
-     * |       Identifier (16)         |
-     * +-------------------------------+-------------------------------+
-     * |                        Value (32)                             |
-     * +---------------------------------------------------------------+
-     *
-     * 48 bits = 6 bytes
-     */
-    settings = (frame_len / setting_size);
-    for (i = 0; i < settings; i++ ) {
-        /* Seek payload per SETTINGS entry */
-        p = frame->payload + (setting_size * i);
+    h2s->status = MK_HTTP2_UPGRADED;
+    h2s->buffer_length = 0;
+    h2s->buffer_size = sizeof(h2s->buffer_fixed);
+    h2s->buffer = h2s->buffer_fixed;
+    h2s->settings = MK_HTTP2_SETTINGS_DEFAULT;
+    h2s->send_window = MK_HTTP2_SETTINGS_DEFAULT.initial_window_size;
+    h2s->recv_window = MK_HTTP2_SETTINGS_DEFAULT.initial_window_size;
+    h2s->events = MK_EVENT_READ;
+    h2s->conn = conn;
+    h2s->server = server;
+    h2s->frame_size = h2s->settings.max_frame_size;
+    mk_list_init(&h2s->streams);
+    for (i = 0; i < MK_HTTP2_URGENCY_LEVELS; i++) {
+        mk_list_init(&h2s->sched[i]);
+    }
 
-        setting_id = p[0] << 8 | p[1];
-        setting_value = p[2] << 24 | p[3] << 16 | p[4] << 8  | p[5];
-        MK_H2_TRACE(conn, "[Setting] ID=%" PRIu16 " VAL=%" PRIu32,
-                    setting_id, setting_value);
+    /* Keep the socket queue short so priorities apply to what is sent */
+    mk_socket_set_tcp_notsent_lowat(conn->event.fd, MK_HTTP2_NOTSENT_LOWAT);
 
-        switch (setting_id) {
-        case MK_HTTP2_SETTINGS_HEADER_TABLE_SIZE:
-            /* unhandled */
-            break;
-        case MK_HTTP2_SETTINGS_ENABLE_PUSH:
-            if (setting_value != 0 && setting_value != 1) {
-                /* FIXME: PROTOCOL_ERROR */
-                MK_H2_TRACE(conn, "Invalid SETTINGS_ENABLE_PUSH");
-                return -1;
-            }
-            h2s->settings.enable_push = setting_value;
-            break;
-        case MK_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS:
-            if (setting_value < 64) {
-                h2s->settings.max_concurrent_streams = setting_value;
-            }
-            else {
-                h2s->settings.max_concurrent_streams = 64;
-            }
-            MK_H2_TRACE(conn, "SETTINGS MAX_CONCURRENT_STREAMS=%i",
-                        setting_value);
-            break;
-        case MK_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
-            if (setting_value < 65535 || setting_value > 2147483647) {
-                /* FIXME: send FLOW_CONTROL_ERROR */
-                MK_H2_TRACE(conn, "Invalid INITIAL_WINDOW_SIZE");
-                return -1;
-            }
-            h2s->settings.initial_window_size = setting_value;
-            break;
-        case MK_HTTP2_SETTINGS_MAX_FRAME_SIZE:
-            if (setting_value < 16384 || setting_value > 2147483647) {
-                /* FIXME: send PROTOCOL_ERROR */
-                return -1;
-            }
-            h2s->settings.max_frame_size = setting_value;
-            break;
-        case MK_HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE:
-            /* Unhandled */
-            break;
-        default:
-            /*
-             * 5.5 Extending HTTP/2: ...Implementations MUST ignore unknown
-             * or unsupported values in all extensible protocol elements...
-             */
+    conn->data = h2s;
+
+    return h2s;
+}
+
+static void mk_http2_session_destroy(struct mk_http2_session *h2s)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http2_stream *s;
+
+    mk_list_foreach_safe(head, tmp, &h2s->streams) {
+        s = mk_list_entry(head, struct mk_http2_stream, _head);
+        http2_stream_destroy(s, MK_TRUE);
+    }
+    mk_sched_conn_timeout_del(h2s->conn);
+
+    mk_hpack_destroy(&h2s->hpack);
+    if (h2s->buffer != h2s->buffer_fixed) {
+        mk_mem_free(h2s->buffer);
+    }
+    if (h2s->hblock) {
+        mk_mem_free(h2s->hblock);
+    }
+    mk_mem_free(h2s->out);
+    h2s->conn->data = NULL;
+    mk_mem_free(h2s);
+}
+
+/* Decode a base64url string (no padding), returns the decoded length */
+static int http2_base64url_decode(char *src, size_t len, uint8_t *out)
+{
+    int v;
+    int bits = 0;
+    uint32_t acc = 0;
+    size_t i;
+    int n = 0;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] >= 'A' && src[i] <= 'Z') {
+            v = src[i] - 'A';
+        }
+        else if (src[i] >= 'a' && src[i] <= 'z') {
+            v = src[i] - 'a' + 26;
+        }
+        else if (src[i] >= '0' && src[i] <= '9') {
+            v = src[i] - '0' + 52;
+        }
+        else if (src[i] == '-' || src[i] == '+') {
+            v = 62;
+        }
+        else if (src[i] == '_' || src[i] == '/') {
+            v = 63;
+        }
+        else if (src[i] == '=') {
             break;
         }
+        else {
+            return -1;
+        }
+
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = (acc >> bits) & 0xff;
+        }
     }
 
-    /* FIXME // No errors, send the ACK
-    mk_http2_send_raw(conn, MK_HTTP2_SETTINGS_ACK_FRAME,
-                      sizeof(MK_HTTP2_SETTINGS_ACK_FRAME) - 1);
-    */
-    return 0;
+    return n;
 }
 
-
-static inline int mk_http2_frame_run(struct mk_sched_conn *conn,
-                                     struct mk_sched_worker *worker)
+/*
+ * Handle an upgraded session (3.2): reply 101, send our SETTINGS and turn
+ * the HTTP/1.1 request into stream 1, served once the preface arrives.
+ */
+static int mk_http2_upgrade(void *cs, void *sr, struct mk_server *server)
 {
-    int ret;
-    struct mk_http2_frame frame;
+    int i;
+    int len;
+    char *end;
+    uint8_t *settings;
+    struct mk_list *head;
+    struct mk_http_header *header;
+    struct mk_http_session *hs = cs;
+    struct mk_http_request *r = sr;
     struct mk_http2_session *h2s;
-    (void) worker;
+    struct mk_http2_stream *s;
+    struct mk_sched_conn *conn = hs->conn;
+    struct mk_iov *iov;
 
-    h2s = conn->data;
+    h2s = mk_http2_session_create(conn, server);
+    if (!h2s) {
+        return -1;
+    }
 
-    /* Decode the frame header */
-    //FIXME mk_http2_frame_decode_header(h2s->buffer, &frame);
+    /* HTTP2-Settings works as an implicit SETTINGS frame, no ACK */
+    header = &hs->parser.headers[MK_HEADER_HTTP2_SETTINGS];
+    settings = mk_mem_alloc(header->val.len);
+    if (settings) {
+        len = http2_base64url_decode(header->val.data, header->val.len,
+                                     settings);
+        if (len > 0 && len % 6 == 0) {
+            http2_settings_apply(h2s, settings, len);
+        }
+        mk_mem_free(settings);
+    }
 
-    /* Do some validations */
-    if (h2s->buffer_length < (MK_HTTP2_HEADER_SIZE + (frame.len_type >> 8))) {
-        /* FIXME: need more data */
-        return 0;
+    /* 101 Switching Protocols */
+    mk_header_set_http_status(r, MK_INFO_SWITCH_PROTOCOL);
+    r->headers.connection = MK_HEADER_CONN_UPGRADED;
+    r->headers.upgrade = MK_HEADER_UPGRADED_H2C;
+    mk_header_prepare(hs, r, server);
+
+    iov = &r->headers.headers_iov;
+    for (i = 0; i < iov->iov_idx; i++) {
+        http2_send_raw(h2s, iov->io[i].iov_base, iov->io[i].iov_len);
     }
+    mk_iov_free_marked(iov);
 
-    /* Do some work based on the frame type */
-    if (mk_http2_frame_type(&frame) == MK_HTTP2_SETTINGS) {
-        ret = mk_http2_handle_settings(conn, &frame);
-        /* FIXME: send our MK_HTTP2_SETTINGS_ACK_FRAME */
-        return ret;
+    http2_send_raw(h2s, MK_HTTP2_SETTINGS_DEFAULT_FRAME,
+                   sizeof(MK_HTTP2_SETTINGS_DEFAULT_FRAME) - 1);
+
+    /* Stream 1 carries the original request, half closed by the client */
+    s = http2_stream_create(h2s, 1);
+    if (!s) {
+        return -1;
     }
+    s->state = MK_HTTP2_STATE_HALF_CLOSED_REMOTE;
+    h2s->last_stream_id = 1;
 
-    return 0;
+    http2_pseudo_set(s, &s->method, r->method_p.data, r->method_p.len);
+
+    /* The request target includes the query string */
+    end = r->uri.data;
+    while (*end != ' ' && *end != '\r' && *end != '\n' && *end != '\0') {
+        end++;
+    }
+    http2_pseudo_set(s, &s->path, r->uri.data, end - r->uri.data);
+
+    header = &hs->parser.headers[MK_HEADER_HOST];
+    if (header->type == MK_HEADER_HOST) {
+        http2_pseudo_set(s, &s->authority, header->val.data, header->val.len);
+    }
+
+    mk_list_foreach(head, &hs->parser.header_list) {
+        header = mk_list_entry(head, struct mk_http_header, _head);
+        if (header->type == MK_HEADER_HOST ||
+            header->type == MK_HEADER_CONTENT_LENGTH ||
+            http2_conn_header(header->key.data, header->key.len)) {
+            continue;
+        }
+        http2_stream_header_add(s, header->key.data, header->key.len,
+                                header->val.data, header->val.len);
+    }
+    s->req_headers = s->req_len;
+
+    if (r->data.data && r->data.len > 0) {
+        http2_stream_append(s, r->data.data, r->data.len);
+        s->content_length = r->data.len;
+    }
+
+    /* The HTTP/1.x session is not longer used */
+    mk_http_session_remove(hs, server);
+
+    if (http2_pump(h2s) == -1) {
+        return -1;
+    }
+
+    return MK_EXIT_OK;
 }
 
 static int mk_http2_sched_read(struct mk_sched_conn *conn,
                                struct mk_sched_worker *worker,
                                struct mk_server *server)
 {
+    int ret;
     int bytes;
     int new_size;
-    int available;
     char *tmp;
     struct mk_http2_session *h2s;
     (void) worker;
-    (void) server;
 
     h2s = conn->data;
-    available = h2s->buffer_size - h2s->buffer_length;
-    if (available == 0) {
+    if (!h2s) {
+        /* Prior knowledge (3.4): our SETTINGS go first */
+        h2s = mk_http2_session_create(conn, server);
+        if (!h2s) {
+            return -1;
+        }
+        http2_send_raw(h2s, MK_HTTP2_SETTINGS_DEFAULT_FRAME,
+                       sizeof(MK_HTTP2_SETTINGS_DEFAULT_FRAME) - 1);
+    }
+
+    if (h2s->buffer_length == h2s->buffer_size) {
         new_size = h2s->buffer_size + MK_HTTP2_CHUNK;
         if (h2s->buffer == h2s->buffer_fixed) {
-            h2s->buffer = mk_mem_alloc(new_size);
-            if (!h2s->buffer) {
-                /* FIXME: send internal server error ? */
+            tmp = mk_mem_alloc(new_size);
+            if (!tmp) {
                 return -1;
             }
-            memcpy(h2s->buffer, h2s->buffer_fixed, h2s->buffer_length);
-            MK_TRACE("[FD %i] Buffer new size: %i, length: %i",
-                     conn->event.fd, new_size, h2s->buffer_length);
+            memcpy(tmp, h2s->buffer_fixed, h2s->buffer_length);
         }
         else {
-            MK_TRACE("[FD %i] Buffer realloc from %i to %i",
-                     conn->event.fd, h2s->buffer_size, new_size);
             tmp = mk_mem_realloc(h2s->buffer, new_size);
-            if (tmp) {
-                h2s->buffer = tmp;
-                h2s->buffer_size = new_size;
-            }
-            else {
-                /* FIXME: send internal server error ? */
+            if (!tmp) {
                 return -1;
             }
-
         }
+        MK_TRACE("[FD %i] Buffer new size: %i, length: %i",
+                 conn->event.fd, new_size, h2s->buffer_length);
+        h2s->buffer = tmp;
+        h2s->buffer_size = new_size;
     }
 
     /* Read the incoming data */
     bytes = mk_sched_conn_read(conn,
-                               h2s->buffer,
+                               h2s->buffer + h2s->buffer_length,
                                h2s->buffer_size - h2s->buffer_length);
     if (bytes == 0) {
         errno = 0;
@@ -328,57 +2439,76 @@ static int mk_http2_sched_read(struct mk_sched_conn *conn,
     else if (bytes == -1) {
         return -1;
     }
-
     h2s->buffer_length += bytes;
 
-    /* Upgraded connections from HTTP/1.x requires the preface */
-    if (h2s->status == MK_HTTP2_UPGRADED) {
-        if (h2s->buffer_length >= http2_preface.len) {
-            if (memcmp(h2s->buffer,
-                       http2_preface.data, http2_preface.len) != 0) {
-                MK_H2_TRACE(conn, "Invalid HTTP/2 preface");
-                return 0;
-            }
+    ret = http2_process(h2s);
+    if (ret == -1) {
+        return -1;
+    }
+
+    if (http2_pump(h2s) == -1 || http2_finished(h2s)) {
+        errno = 0;
+        return -1;
+    }
 
-            MK_H2_TRACE(conn, "HTTP/2 preface OK");
+    return bytes;
+}
 
-            buffer_consume(h2s, http2_preface.len);
-            h2s->status = MK_HTTP2_OK;
+/* The connection channel is empty: continue with our own output */
+static int mk_http2_sched_done(struct mk_sched_conn *conn,
+                               struct mk_sched_worker *worker,
+                               struct mk_server *server)
+{
+    struct mk_http2_session *h2s;
+    (void) worker;
+    (void) server;
 
-            /* Send out our default settings
-            mk_stream_set(&h2s->stream_settings,
-                          MK_STREAM_RAW,
-                          &conn->channel,
-                          MK_HTTP2_SETTINGS_DEFAULT_FRAME,
-                          sizeof(MK_HTTP2_SETTINGS_DEFAULT_FRAME) - 1,
-                          NULL,
-                          NULL, NULL, NULL);
-            */
-        }
-        else {
-            /* We need more data */
-            return 0;
-        }
+    h2s = conn->data;
+    if (!h2s) {
+        return 0;
     }
 
-    /* Check that we have a minimum header size */
-    if (h2s->buffer_length < MK_HTTP2_HEADER_SIZE) {
-        MK_TRACE("HEADER FRAME incomplete %i/%i bytes",
-                 h2s->buffer_length, MK_HTTP2_HEADER_SIZE);
-        return 0;
+    if (http2_pump(h2s) == -1 || http2_finished(h2s)) {
+        return -1;
     }
 
-    /* We have at least one frame */
-    return mk_http2_frame_run(conn, worker);
+    /* events are managed by the session */
+    return 1;
 }
 
+static int mk_http2_sched_close(struct mk_sched_conn *conn,
+                                struct mk_sched_worker *worker,
+                                int type, struct mk_server *server)
+{
+    uint8_t goaway[MK_HTTP2_HEADER_SIZE + 8];
+    struct mk_http2_session *h2s;
+    (void) worker;
+    (void) server;
+
+    h2s = conn->data;
+    if (!h2s) {
+        return 0;
+    }
+
+    /* Idle timeout: say goodbye, best effort */
+    if (type == MK_SCHED_CONN_TIMEOUT && h2s->status == MK_HTTP2_OK &&
+        h2s->out_len == h2s->out_offset) {
+        http2_frame_header(goaway, 8, MK_HTTP2_GOAWAY, 0, 0);
+        http2_put32(goaway + MK_HTTP2_HEADER_SIZE, h2s->last_stream_id);
+        http2_put32(goaway + MK_HTTP2_HEADER_SIZE + 4, MK_HTTP2_NO_ERROR);
+        conn->net->write(conn->event.fd, goaway, sizeof(goaway));
+    }
+
+    mk_http2_session_destroy(h2s);
+    return 0;
+}
 
 struct mk_sched_handler mk_http2_handler = {
     .name             = "http2",
     .cb_read          = mk_http2_sched_read,
-    .cb_close         = NULL,
-    .cb_done          = NULL,
+    .cb_close         = mk_http2_sched_close,
+    .cb_done          = mk_http2_sched_done,
     .cb_upgrade       = mk_http2_upgrade,
-    .sched_extra_size = sizeof(struct mk_http2_session),
+    .sched_extra_size = 0,
     .capabilities     = MK_CAP_HTTP2
 };
@@ -194,7 +194,7 @@ static inline int header_lookup(struct mk_http_parser *p, char *buffer)
 
     len = (p->header_sep - p->header_key);
 
-    for (i = p->header_min; i <= p->header_max; i++) {
+    for (i = p->header_min; i >= 0 && i <= p->header_max; i++) {
         h = &mk_headers_table[i];
 
         /* Check string length first */
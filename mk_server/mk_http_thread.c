@@ -76,13 +76,15 @@ static inline void thread_cb_init_vars()
         channel = request->session->channel;
         sched = mk_sched_get_thread_conf();
 
-        MK_EVENT_NEW(channel->event);
-        ret = mk_event_add(sched->loop,
-                           channel->fd,
-                           MK_EVENT_CONNECTION,
-                           MK_EVENT_READ, channel->event);
-        if (ret == -1) {
-            //return -1;
+        if (channel->type == MK_CHANNEL_SOCKET) {
+            MK_EVENT_NEW(channel->event);
+            ret = mk_event_add(sched->loop,
+                               channel->fd,
+                               MK_EVENT_CONNECTION,
+                               MK_EVENT_READ, channel->event);
+            if (ret == -1) {
+                //return -1;
+            }
         }
 
         mk_http_request_end(session, session->server);
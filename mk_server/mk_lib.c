@@ -53,6 +53,7 @@ mk_ctx_t *mk_create()
     if (!ctx) {
         return NULL;
     }
+    ctx->started = MK_FALSE;
 
     /* Create Monkey server instance */
     ctx->server = mk_server_create();
@@ -97,6 +98,11 @@ static inline int mk_lib_yield(mk_request_t *req)
     th = pthread_getspecific(mk_thread_key);
     channel = req->session->channel;
 
+    /* HTTP/2 streams are framed by the session, nothing to wait for */
+    if (channel->type == MK_CHANNEL_HTTP2) {
+        return 0;
+    }
+
     channel->thread = th;
 
     ret = mk_event_add(sched->loop,
@@ -179,6 +185,11 @@ int mk_start(mk_ctx_t *ctx)
 
     server = ctx->server;
 
+    /* Index the virtual hosts set up so far, just once */
+    if (mk_vhost_table_build(server) != 0) {
+        return -1;
+    }
+
     ret = mk_utils_worker_spawn(mk_lib_worker, ctx, &tid);
     if (ret == -1) {
         return -1;
@@ -195,6 +206,7 @@ int mk_start(mk_ctx_t *ctx)
         }
 
         if (val == MK_SERVER_SIGNAL_START) {
+            ctx->started = MK_TRUE;
             return 0;
         }
         else {
@@ -240,7 +252,6 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
     int b;
     int ret;
     int num;
-    unsigned long len;
 
     if (config_eq(k, "Listen") == 0) {
         ret = mk_config_listen_parse(v, server);
@@ -323,7 +334,7 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         server->symlink = b;
     }
     else if (config_eq(k, "DefaultMimeType") == 0) {
-        mk_string_build(&server->mimetype_default_str, &len, "%s\r\n", v);
+        server->mimetype_default_str = mk_string_dup(v);
     }
     else if (config_eq(k, "FDT") == 0) {
         b = bool_val(v);
@@ -410,14 +421,21 @@ int mk_vhost_create(mk_ctx_t *ctx, char *name)
     else {
         halias->name = mk_string_dup(name);
     }
+    halias->len = strlen(halias->name);
     mk_list_add(&halias->_head, &h->server_names);
     mk_list_add(&h->_head, &ctx->server->hosts);
 
+    /* Once running, refresh the lookup table (mk_start() builds it) */
+    if (ctx->started == MK_TRUE) {
+        mk_vhost_table_build(ctx->server);
+    }
+
     /* Return the host id, that number is enough for further operations */
     return h->id;
 }
 
-static int mk_vhost_set_property(struct mk_vhost *vh, char *k, char *v)
+static int mk_vhost_set_property(mk_ctx_t *ctx, struct mk_vhost *vh,
+                                 char *k, char *v)
 {
     struct mk_vhost_alias *ha;
 
@@ -429,6 +447,9 @@ static int mk_vhost_set_property(struct mk_vhost *vh, char *k, char *v)
         ha->name = mk_string_dup(v);
         ha->len  = strlen(v);
         mk_list_add(&ha->_head, &vh->server_names);
+        if (ctx->started == MK_TRUE) {
+            mk_vhost_table_build(ctx->server);
+        }
     }
     else if (config_eq(k, "DocumentRoot") == 0) {
         vh->documentroot.data = mk_string_dup(v);
@@ -461,7 +482,7 @@ int mk_vhost_set(mk_ctx_t *ctx, int vid, ...)
             return -1;
         }
 
-        ret = mk_vhost_set_property(vh, key, value);
+        ret = mk_vhost_set_property(ctx, vh, key, value);
         if (ret != 0) {
             va_end(va);
             return -1;
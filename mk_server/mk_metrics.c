@@ -0,0 +1,225 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_tls.h>
+#include <monkey/mk_server.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_plugin.h>
+#include <monkey/mk_metrics.h>
+#include <monkey/mk_metrics_tls.h>
+
+/* Workers metrics, the list only changes when a worker starts */
+static pthread_mutex_t mk_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mk_list mk_metrics_workers;
+
+int mk_metrics_init(struct mk_server *server)
+{
+    mk_list_init(&mk_metrics_workers);
+
+    /* Without the plugin nothing is timed nor recorded */
+    if (mk_plugin_lookup("metrics", server)) {
+        server->metrics = MK_TRUE;
+    }
+    else {
+        server->metrics = MK_FALSE;
+    }
+    return 0;
+}
+
+int mk_metrics_worker_init(struct mk_server *server)
+{
+    struct mk_metrics *m;
+
+    m = mk_mem_alloc_z(sizeof(struct mk_metrics));
+    if (!m) {
+        return -1;
+    }
+
+    /* Virtual hosts are all known once the workers start */
+    m->vhosts = mk_list_size(&server->hosts);
+    m->vhost_requests = mk_mem_alloc_z(sizeof(uint64_t) * (m->vhosts + 1));
+    if (!m->vhost_requests) {
+        mk_mem_free(m);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mk_metrics_lock);
+    mk_list_add(&m->_head, &mk_metrics_workers);
+    pthread_mutex_unlock(&mk_metrics_lock);
+
+    MK_TLS_SET(mk_tls_metrics, m);
+    return 0;
+}
+
+/* Time spent in a plugin stage since 'start' */
+void mk_metrics_stage(int stage, uint64_t start)
+{
+    struct mk_metrics *m = MK_TLS_GET(mk_tls_metrics);
+
+    if (m) {
+        mk_metrics_add(&m->stage[stage], mk_clock_usec() - start);
+    }
+}
+
+/* A request is over, called before the stage 40 plugins */
+void mk_metrics_request(struct mk_http_session *cs,
+                        struct mk_http_request *sr)
+{
+    int status;
+    uint64_t now;
+    uint64_t begin;
+    uint64_t first;
+    uint64_t bytes = 0;
+    struct mk_metrics *m = MK_TLS_GET(mk_tls_metrics);
+
+    if (!m) {
+        return;
+    }
+
+    now = mk_clock_usec();
+
+    /* A pipelined request begins when it's parsed */
+    begin = cs->begin ? cs->begin : sr->start;
+    cs->begin = 0;
+    if (begin == 0 || begin > now) {
+        begin = now;
+    }
+
+    /* Nothing went through the channel (e.g: HTTP/2 streams) */
+    first = now;
+    if (cs->channel) {
+        if (cs->channel->first_out >= begin) {
+            first = cs->channel->first_out;
+        }
+        bytes = cs->channel->bytes_out - sr->bytes_out;
+    }
+    if (bytes == 0 && sr->headers.content_length > 0) {
+        bytes = sr->headers.content_length;
+    }
+
+    mk_metrics_add(&m->first_byte, first - begin);
+    mk_metrics_add(&m->done, now - first);
+    mk_metrics_add(&m->size, bytes);
+
+    status = sr->headers.status / 100;
+    if (status < 1 || status > 5) {
+        status = MK_METRICS_STATUS_CLASSES;
+    }
+    mk_metrics_inc(&m->status[status - 1]);
+
+    if (sr->host_conf && sr->host_conf->id >= 0 &&
+        sr->host_conf->id < m->vhosts) {
+        mk_metrics_inc(&m->vhost_requests[sr->host_conf->id]);
+    }
+}
+
+static void mk_metrics_merge(struct mk_metrics_histogram *dst,
+                             struct mk_metrics_histogram *src)
+{
+    int i;
+
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    for (i = 0; i < MK_METRICS_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i],
+                                           __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Add up the metrics of every worker. The workers are not stopped, what
+ * they record meanwhile may or may not be part of the result.
+ */
+struct mk_metrics *mk_metrics_collect()
+{
+    int i;
+    struct mk_list *head;
+    struct mk_metrics *m;
+    struct mk_metrics *all;
+
+    all = mk_mem_alloc_z(sizeof(struct mk_metrics));
+    if (!all) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mk_metrics_lock);
+    mk_list_foreach(head, &mk_metrics_workers) {
+        m = mk_list_entry(head, struct mk_metrics, _head);
+        if (m->vhosts > all->vhosts) {
+            all->vhosts = m->vhosts;
+        }
+    }
+
+    all->vhost_requests = mk_mem_alloc_z(sizeof(uint64_t) * (all->vhosts + 1));
+    if (!all->vhost_requests) {
+        pthread_mutex_unlock(&mk_metrics_lock);
+        mk_mem_free(all);
+        return NULL;
+    }
+
+    mk_list_foreach(head, &mk_metrics_workers) {
+        m = mk_list_entry(head, struct mk_metrics, _head);
+
+        mk_metrics_merge(&all->first_byte, &m->first_byte);
+        mk_metrics_merge(&all->done, &m->done);
+        mk_metrics_merge(&all->size, &m->size);
+        for (i = 0; i < MK_METRICS_STAGES; i++) {
+            mk_metrics_merge(&all->stage[i], &m->stage[i]);
+        }
+        for (i = 0; i < MK_METRICS_STATUS_CLASSES; i++) {
+            all->status[i] += __atomic_load_n(&m->status[i],
+                                              __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < m->vhosts; i++) {
+            all->vhost_requests[i] += __atomic_load_n(&m->vhost_requests[i],
+                                                      __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&mk_metrics_lock);
+
+    return all;
+}
+
+void mk_metrics_free(struct mk_metrics *m)
+{
+    mk_mem_free(m->vhost_requests);
+    mk_mem_free(m);
+}
+
+/* Must be called once the workers are gone */
+void mk_metrics_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_metrics *m;
+
+    pthread_mutex_lock(&mk_metrics_lock);
+    mk_list_foreach_safe(head, tmp, &mk_metrics_workers) {
+        m = mk_list_entry(head, struct mk_metrics, _head);
+        mk_list_del(&m->_head);
+        mk_metrics_free(m);
+    }
+    pthread_mutex_unlock(&mk_metrics_lock);
+}
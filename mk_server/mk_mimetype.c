@@ -35,41 +35,127 @@
 
 struct mk_mimetype *mimetype_default;
 
-static int rbtree_compare(const void *lhs, const void *rhs)
+/* Match mime type for requested resource */
+inline struct mk_mimetype *mk_mimetype_lookup(struct mk_server *server, char *name)
 {
-    return strcmp((const char *)lhs, (const char *)rhs);
+    if (!server->mimetype_hash) {
+        return NULL;
+    }
+    return mk_phash_lookup(server->mimetype_hash, name, strlen(name));
 }
 
-/* Match mime type for requested resource */
-inline struct mk_mimetype *mk_mimetype_lookup(struct mk_server *server, char *name)
+/* Find a mime type by its exact value, e.g: 'text/html' */
+struct mk_mimetype *mk_mimetype_type_lookup(struct mk_server *server,
+                                            char *type, int len)
+{
+    struct mk_mimetype *mime;
+
+    if (!server->mimetype_type_hash) {
+        return NULL;
+    }
+
+    mime = mk_phash_lookup(server->mimetype_type_hash, type, len);
+    if (!mime || mime->type.len - 2 != (unsigned long) len ||
+        memcmp(mime->type.data, type, len) != 0) {
+        return NULL;
+    }
+    return mime;
+}
+
+/*
+ * Build the perfect hash tables used for lookups, it must be called once
+ * all the mime types have been registered. If an extension is defined
+ * more than once, the first definition wins. A second table indexes the
+ * types themselves.
+ */
+int mk_mimetype_index(struct mk_server *server)
 {
-    int cmp;
-    struct rb_tree_node *node = server->mimetype_rb_head.root;
-
-    while (node) {
-        struct mk_mimetype *entry = container_of(node, struct mk_mimetype, _rb_head);
-        cmp = strcmp(name, entry->name);
-        if (cmp < 0)
-            node = node->left;
-        else if (cmp > 0)
-            node = node->right;
-        else {
-            return entry;
+    int i;
+    int n = 0;
+    int ret = 0;
+    int total;
+    int *lens;
+    char **keys;
+    void **data;
+    struct mk_list *head;
+    struct mk_mimetype *mime;
+    struct mk_phash *ph;
+
+    total = mk_list_size(&server->mimetype_list);
+    keys = mk_mem_alloc(sizeof(char *) * (total + 1));
+    lens = mk_mem_alloc(sizeof(int) * (total + 1));
+    data = mk_mem_alloc(sizeof(void *) * (total + 1));
+    if (!keys || !lens || !data) {
+        ret = -1;
+        goto exit;
+    }
+
+    mk_list_foreach(head, &server->mimetype_list) {
+        mime = mk_list_entry(head, struct mk_mimetype, _head);
+        for (i = 0; i < n; i++) {
+            if (strcasecmp(keys[i], mime->name) == 0) {
+                break;
+            }
         }
+        if (i < n) {
+            continue;
+        }
+        keys[n] = mime->name;
+        lens[n] = strlen(mime->name);
+        data[n] = mime;
+        n++;
+    }
+
+    ph = mk_phash_create(keys, lens, data, n);
+    if (!ph) {
+        mk_err("[mime] could not build mime types table");
+        ret = -1;
+        goto exit;
+    }
+
+    mk_phash_destroy(server->mimetype_hash);
+    server->mimetype_hash = ph;
+
+    n = 0;
+    mk_list_foreach(head, &server->mimetype_list) {
+        mime = mk_list_entry(head, struct mk_mimetype, _head);
+        for (i = 0; i < n; i++) {
+            if (lens[i] == (int) mime->type.len - 2 &&
+                strncasecmp(keys[i], mime->type.data, lens[i]) == 0) {
+                break;
+            }
+        }
+        if (i < n) {
+            continue;
+        }
+        keys[n] = mime->type.data;
+        lens[n] = mime->type.len - 2;
+        data[n] = mime;
+        n++;
     }
-    return NULL;
+
+    ph = mk_phash_create(keys, lens, data, n);
+    if (!ph) {
+        mk_err("[mime] could not build mime types table");
+        ret = -1;
+        goto exit;
+    }
+
+    mk_phash_destroy(server->mimetype_type_hash);
+    server->mimetype_type_hash = ph;
+
+ exit:
+    mk_mem_free(keys);
+    mk_mem_free(lens);
+    mk_mem_free(data);
+    return ret;
 }
 
 int mk_mimetype_add(struct mk_server *server, char *name, const char *type)
 {
     int len = strlen(type) + 3;
-    char *p;
     struct mk_mimetype *new_mime;
 
-    /* make sure we register the extension in lower case */
-    p = name;
-    for ( ; *p; ++p) *p = tolower(*p);
-
     new_mime = mk_mem_alloc_z(sizeof(struct mk_mimetype));
     new_mime->name = mk_string_dup(name);
     new_mime->type.data = mk_mem_alloc(len);
@@ -83,9 +169,12 @@ int mk_mimetype_add(struct mk_server *server, char *name, const char *type)
     strcat(new_mime->type.data, MK_CRLF);
     new_mime->type.data[len-1] = '\0';
 
-    /* Insert the node into the RBT */
-    rb_tree_insert(&server->mimetype_rb_head,
-                   new_mime->name, &new_mime->_rb_head);
+    /* HTTP/2 field, Huffman coded: never larger than the raw literal */
+    new_mime->hpack_type.data = mk_mem_alloc(len + 16);
+    new_mime->hpack_type.len =
+        mk_hpack_encode_header((uint8_t *) new_mime->hpack_type.data,
+                               len + 16, "content-type", 12,
+                               (char *) type, len - 3);
 
     /* Add to linked list head */
     mk_list_add(&new_mime->_head, &server->mimetype_list);
@@ -99,7 +188,8 @@ int mk_mimetype_init(struct mk_server *server)
 
     /* Initialize the heads */
     mk_list_init(&server->mimetype_list);
-    rb_tree_new(&server->mimetype_rb_head, rbtree_compare);
+    server->mimetype_hash = NULL;
+    server->mimetype_type_hash = NULL;
 
     name = mk_string_dup(MIMETYPE_DEFAULT_NAME);
     if (server->mimetype_default_str) {
@@ -112,7 +202,8 @@ int mk_mimetype_init(struct mk_server *server)
                                                    struct mk_mimetype,
                                                    _head);
     mk_mem_free(name);
-    return 0;
+
+    return mk_mimetype_index(server);
 }
 
 /* Load the two mime arrays into memory */
@@ -166,25 +257,34 @@ int mk_mimetype_read_config(struct mk_server *server)
 
     mk_rconf_free(cnf);
 
-    return 0;
+    return mk_mimetype_index(server);
 }
 
 struct mk_mimetype *mk_mimetype_find(struct mk_server *server, mk_ptr_t *filename)
 {
     int j, len;
+    char c;
 
     j = len = filename->len;
 
-    /* looking for extension */
-    while (j >= 0 && filename->data[j] != '.') {
-        j--;
+    /* looking for extension, it can't go beyond the last path component */
+    while (--j >= 0) {
+        c = filename->data[j];
+        if (c == '.') {
+            break;
+        }
+        if (c == '/') {
+            return NULL;
+        }
     }
 
-    if (j <= 0) {
+    if (j <= 0 || !server->mimetype_hash) {
         return NULL;
     }
 
-    return mk_mimetype_lookup(server, filename->data + j + 1);
+    j++;
+    return mk_phash_lookup(server->mimetype_hash,
+                           filename->data + j, len - j);
 }
 
 void mk_mimetype_free_all(struct mk_server *server)
@@ -198,6 +298,12 @@ void mk_mimetype_free_all(struct mk_server *server)
         mk_ptr_free(&mime->type);
         mk_mem_free(mime->name);
         mk_mem_free(mime->header_type.data);
+        mk_mem_free(mime->hpack_type.data);
         mk_mem_free(mime);
     }
+
+    mk_phash_destroy(server->mimetype_hash);
+    server->mimetype_hash = NULL;
+    mk_phash_destroy(server->mimetype_type_hash);
+    server->mimetype_type_hash = NULL;
 }
@@ -19,121 +19,331 @@
 
 #include <monkey/mk_core.h>
 #include <monkey/mk_net.h>
+#include <monkey/mk_socket.h>
 #include <monkey/mk_scheduler.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_thread.h>
+#include <monkey/mk_resolver.h>
 
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stddef.h>
+
+/*
+ * Parse a literal address: '/path' or 'unix:/path' for a Unix socket,
+ * '@name' (or 'unix:@name') for a Linux abstract socket, or a numeric IPv4
+ * or IPv6 address, brackets allowed. Host names are not looked up here,
+ * see mk_net_addr_resolve().
+ */
+int mk_net_addr_parse(const char *host, int port, struct mk_net_addr *addr)
+{
+    size_t len;
+    char buf[INET6_ADDRSTRLEN];
+
+    memset(addr, '\0', sizeof(struct mk_net_addr));
+
+    if (strncmp(host, "unix:", 5) == 0) {
+        host += 5;
+    }
+    else if (host[0] != '/' && host[0] != '@') {
+        goto inet;
+    }
+
+    len = strlen(host);
+    if (len == 0 || len >= sizeof(addr->addr.un.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    addr->family = AF_UNIX;
+    addr->addr.un.sun_family = AF_UNIX;
+    memcpy(addr->addr.un.sun_path, host, len);
+
+    if (host[0] == '@') {
+        /* Abstract: no trailing NUL, the length tells the name size */
+        addr->addr.un.sun_path[0] = '\0';
+        addr->len = offsetof(struct sockaddr_un, sun_path) + len;
+    }
+    else {
+        addr->len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+    }
+    return 0;
 
-/* Connect to a TCP socket server */
-static int mk_net_fd_connect(int fd, char *host, unsigned long port)
+ inet:
+    if (host[0] == '[') {
+        len = strlen(host);
+        if (len < 3 || host[len - 1] != ']' || len - 2 >= sizeof(buf)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(buf, host + 1, len - 2);
+        buf[len - 2] = '\0';
+        host = buf;
+    }
+
+    if (inet_pton(AF_INET, host, &addr->addr.in.sin_addr) == 1) {
+        addr->family = AF_INET;
+        addr->addr.in.sin_family = AF_INET;
+        addr->addr.in.sin_port = htons(port);
+        addr->len = sizeof(struct sockaddr_in);
+        return 0;
+    }
+
+    if (inet_pton(AF_INET6, host, &addr->addr.in6.sin6_addr) == 1) {
+        addr->family = AF_INET6;
+        addr->addr.in6.sin6_family = AF_INET6;
+        addr->addr.in6.sin6_port = htons(port);
+        addr->len = sizeof(struct sockaddr_in6);
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/* Like mk_net_addr_parse(), looking up host names (blocking) */
+int mk_net_addr_resolve(const char *host, int port, struct mk_net_addr *addr)
 {
     int ret;
+    char _port[6];
     struct addrinfo hints;
     struct addrinfo *res;
-    char _port[6];
+
+    ret = mk_net_addr_parse(host, port, addr);
+    if (ret == 0) {
+        return 0;
+    }
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    snprintf(_port, sizeof(_port), "%lu", port);
+    snprintf(_port, sizeof(_port), "%i", port);
     ret = getaddrinfo(host, _port, &hints, &res);
     if (ret != 0) {
+        errno = EHOSTUNREACH;
         return -1;
     }
 
-    ret = connect(fd, res->ai_addr, res->ai_addrlen);
+    if (res->ai_addrlen > sizeof(addr->addr)) {
+        freeaddrinfo(res);
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    addr->family = res->ai_family;
+    addr->len = res->ai_addrlen;
+    memcpy(&addr->addr, res->ai_addr, res->ai_addrlen);
     freeaddrinfo(res);
 
-    return ret;
+    return 0;
 }
 
-struct mk_net_connection *mk_net_conn_create(char *addr, int port)
+/* Printable form of the address, for logs */
+int mk_net_addr_str(struct mk_net_addr *addr, char *buf, size_t size)
+{
+    char ip[INET6_ADDRSTRLEN];
+    const char *path;
+    size_t len;
+
+    switch (addr->family) {
+    case AF_UNIX:
+        path = addr->addr.un.sun_path;
+        len = addr->len - offsetof(struct sockaddr_un, sun_path);
+        if (path[0] == '\0') {
+            return snprintf(buf, size, "@%.*s", (int) len - 1, path + 1);
+        }
+        return snprintf(buf, size, "unix:%s", path);
+    case AF_INET:
+        inet_ntop(AF_INET, &addr->addr.in.sin_addr, ip, sizeof(ip));
+        return snprintf(buf, size, "%s:%i", ip,
+                        ntohs(addr->addr.in.sin_port));
+    case AF_INET6:
+        inet_ntop(AF_INET6, &addr->addr.in6.sin6_addr, ip, sizeof(ip));
+        return snprintf(buf, size, "[%s]:%i", ip,
+                        ntohs(addr->addr.in6.sin6_port));
+    }
+
+    return snprintf(buf, size, "unknown");
+}
+
+/*
+ * Start a non-blocking connection. It returns the socket once connected or
+ * while the connection is in progress: wait for it to be writable and check
+ * mk_net_connect_status(). A Unix socket connects right away or fails, with
+ * EAGAIN if the server listen backlog is full.
+ */
+int mk_net_connect(struct mk_net_addr *addr)
 {
     int fd;
+    int ret;
+    int err;
+
+    fd = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (addr->family != AF_UNIX) {
+        mk_socket_set_tcp_nodelay(fd);
+    }
+
+    ret = connect(fd, &addr->addr.sa, addr->len);
+    if (ret == -1 && errno != EINPROGRESS) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Result of a connection in progress: 0 once connected, -1 and errno set */
+int mk_net_connect_status(int fd)
+{
     int ret;
     int error = 0;
     socklen_t len = sizeof(error);
+
+    ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (ret == -1) {
+        return -1;
+    }
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The socket of a connection in progress is writable, resume the caller */
+static int mk_net_conn_event(void *data)
+{
+    struct mk_net_connection *conn = data;
+
+    mk_thread_resume(conn->thread);
+    return 0;
+}
+
+/* Coroutine waiting for a host name to resolve */
+struct mk_net_resolve_wait {
+    void *thread;
+    int status;
+    int error;
+    struct mk_net_addr *addr;
+};
+
+static void mk_net_conn_resolved(void *data, int status,
+                                 struct mk_net_addr *addr)
+{
+    struct mk_net_resolve_wait *wait = data;
+
+    wait->status = status;
+    wait->error = errno;
+    if (status == 0) {
+        *wait->addr = *addr;
+    }
+    mk_thread_resume(wait->thread);
+}
+
+static void mk_net_conn_free(struct mk_net_connection *conn)
+{
+    if (conn->fd != -1) {
+        close(conn->fd);
+    }
+    if (conn->host) {
+        mk_mem_free(conn->host);
+    }
+    mk_mem_free(conn);
+}
+
+/*
+ * Connect to 'addr' (a Unix socket path or abstract name, an IP address or
+ * a host name) from a coroutine: it yields until the name is resolved and
+ * the connection is done.
+ */
+struct mk_net_connection *mk_net_conn_create(char *addr, int port)
+{
+    int ret;
+    struct mk_net_addr net;
     struct mk_sched_worker *sched;
     struct mk_net_connection *conn;
+    struct mk_net_resolve_wait wait;
+
+    /* Host names are looked up off the worker loop, wait for it */
+    wait.thread = pthread_getspecific(mk_thread_key);
+    wait.addr = &net;
+    ret = mk_resolver_lookup(addr, port, &net,
+                             wait.thread ? mk_net_conn_resolved : NULL, &wait);
+    if (ret == MK_RESOLVER_WAIT) {
+        mk_thread_yield(wait.thread);
+        ret = wait.status;
+        errno = wait.error;
+    }
+    if (ret == -1) {
+        mk_warn("[net] cannot resolve %s: %s", addr, strerror(errno));
+        return NULL;
+    }
 
     /* Allocate connection context */
-    conn = mk_mem_alloc(sizeof(struct mk_net_connection));
+    conn = mk_mem_alloc_z(sizeof(struct mk_net_connection));
     if (!conn) {
         return NULL;
     }
+    conn->host = mk_string_dup(addr);
+    conn->port = port;
 
-    /* Create socket */
-    fd = mk_socket_create(AF_INET, SOCK_STREAM, 0);
-    if (fd == -1) {
-        mk_mem_free(conn);
+    conn->fd = mk_net_connect(&net);
+    if (conn->fd == -1) {
+        mk_net_conn_free(conn);
         return NULL;
     }
 
-    /* Make socket async */
-    mk_socket_set_nonblocking(fd);
-    conn->fd = fd;
-
-    ret = mk_net_fd_connect(conn->fd, addr, port);
-    if (ret == -1) {
-        if (errno != EINPROGRESS) {
-            close(fd);
-            mk_mem_free(conn);
-            return NULL;
-        }
-
-        MK_EVENT_NEW(&conn->event);
+    /* Unix sockets connect right away */
+    if (net.family == AF_UNIX) {
+        return conn;
+    }
 
-        sched = mk_sched_get_thread_conf();
-        // FIXME: not including the thread
-        //conn->thread = mk_thread_get();
-        ret = mk_event_add(sched->loop, conn->fd, MK_EVENT_THREAD,
-                           MK_EVENT_WRITE, &conn->event);
-        if (ret == -1) {
-            close(fd);
-            mk_mem_free(conn);
-            return NULL;
-        }
+    /* Wait for the connection without blocking the worker */
+    conn->thread = pthread_getspecific(mk_thread_key);
+    sched = mk_sched_get_thread_conf();
+    if (!conn->thread || !sched) {
+        mk_net_conn_free(conn);
+        return NULL;
+    }
 
-        /*
-         * Return the control to the parent caller, we need to wait for
-         * the event loop to get back to us.
-         */
-        mk_thread_yield(conn->thread);
+    MK_EVENT_INIT(&conn->event, conn->fd, conn, mk_net_conn_event);
+    ret = mk_event_add(sched->loop, conn->fd, MK_EVENT_CUSTOM,
+                       MK_EVENT_WRITE, &conn->event);
+    if (ret == -1) {
+        mk_net_conn_free(conn);
+        return NULL;
+    }
 
-        /* We got a notification, remove the event registered */
-        ret = mk_event_del(sched->loop, &conn->event);
+    /*
+     * Return the control to the parent caller, we need to wait for
+     * the event loop to get back to us.
+     */
+    mk_thread_yield(conn->thread);
 
-        /* Check the connection status */
-        if (conn->event.mask & MK_EVENT_WRITE) {
-            ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
-            if (ret == -1) {
-                close(fd);
-                mk_mem_free(conn);
-                return NULL;
-            }
+    /* We got a notification, remove the event registered */
+    mk_event_del(sched->loop, &conn->event);
 
-            if (error != 0) {
-                /* Connection is broken, not much to do here */
-                fprintf(stderr, "Async connection failed %s:%i\n",
-                        conn->host, conn->port);
-                close(fd);
-                mk_mem_free(conn);
-                return NULL;
-            }
-            MK_EVENT_NEW(&conn->event);
-            return conn;
-        }
-        else {
-            close(fd);
-            mk_mem_free(conn);
-            return NULL;
-        }
+    ret = mk_net_connect_status(conn->fd);
+    if (ret == -1) {
+        mk_warn("[net] async connection to %s:%i failed: %s",
+                conn->host, conn->port, strerror(errno));
+        mk_net_conn_free(conn);
+        return NULL;
     }
 
-    return NULL;
+    MK_EVENT_NEW(&conn->event);
+    return conn;
 }
 
 int mk_net_conn_write(struct mk_channel *channel,
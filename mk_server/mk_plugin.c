@@ -332,9 +332,23 @@ void mk_plugin_api_init(struct mk_server *server)
     api->socket_set_nonblocking = mk_socket_set_nonblocking;
     api->socket_create = mk_socket_create;
     api->socket_ip_str = mk_socket_ip_str;
+    api->socket_addr_str = mk_socket_addr_str;
+    api->socket_addr_port = mk_socket_addr_port;
 
     /* Async network */
     api->net_conn_create = mk_net_conn_create;
+    api->net_addr_parse = mk_net_addr_parse;
+    api->net_addr_resolve = mk_net_addr_resolve;
+    api->net_addr_str = mk_net_addr_str;
+    api->net_connect = mk_net_connect;
+    api->net_connect_status = mk_net_connect_status;
+    api->net_resolve = mk_resolver_lookup;
+    api->net_resolve_cancel = mk_resolver_cancel;
+    api->net_resolve_stats = mk_resolver_stats;
+
+    /* Metrics */
+    api->metrics_collect = mk_metrics_collect;
+    api->metrics_free = mk_metrics_free;
 
     /* Config Callbacks */
     api->config_create = mk_rconf_create;
@@ -375,6 +389,9 @@ void mk_plugin_api_init(struct mk_server *server)
 
     /* handler */
     api->handler_param_get = mk_handler_param_get;
+
+    /* Virtual hosts */
+    api->vhost_get = mk_vhost_get;
 }
 
 void mk_plugin_load_static(struct mk_server *server)
@@ -620,6 +637,7 @@ int mk_plugin_http_request_end(struct mk_plugin *plugin,
 {
     int ret;
     int con;
+    struct mk_channel *channel;
     struct mk_http_request *sr;
     struct mk_server *server = plugin->server_ctx;
 
@@ -632,12 +650,30 @@ int mk_plugin_http_request_end(struct mk_plugin *plugin,
     }
 
     sr = mk_list_entry_last(&cs->request_list, struct mk_http_request, _head);
-    mk_plugin_stage_run_40(cs, sr, server);
 
+    /* The plugin is done with the request */
+    sr->stage30_handler = NULL;
     if (close == MK_TRUE) {
         cs->close_now = MK_TRUE;
     }
 
+    /*
+     * Some of the response is still queued: the scheduler finishes the
+     * request once the channel is flushed (mk_http_sched_done).
+     */
+    channel = cs->channel;
+    if (channel->type == MK_CHANNEL_SOCKET &&
+        mk_channel_is_empty(channel) != 0) {
+        if ((channel->event->mask & MK_EVENT_WRITE) == 0) {
+            mk_event_add(mk_sched_loop(), channel->fd,
+                         MK_EVENT_CONNECTION, MK_EVENT_WRITE,
+                         channel->event);
+        }
+        return 0;
+    }
+
+    mk_plugin_stage_run_40(cs, sr, server);
+
     /* Let's check if we should ask to finalize the connection or not */
     ret = mk_http_request_end(cs, server);
     MK_TRACE("[FD %i] HTTP session end = %i", cs->socket, ret);
@@ -652,6 +688,14 @@ int mk_plugin_http_request_end(struct mk_plugin *plugin,
         }
     }
 
+    /* Wait for the next request, or send the pipelined one */
+    if (channel->type == MK_CHANNEL_SOCKET) {
+        mk_event_add(mk_sched_loop(), channel->fd,
+                     MK_EVENT_CONNECTION,
+                     ret == 0 ? MK_EVENT_READ : MK_EVENT_WRITE,
+                     channel->event);
+    }
+
     return ret;
 }
 
@@ -672,12 +716,12 @@ void mk_plugin_event_bad_return(const char *hook, int ret)
 
 int mk_plugin_time_now_unix()
 {
-    return log_current_utime;
+    return mk_clock_utime();
 }
 
 mk_ptr_t *mk_plugin_time_now_human()
 {
-    return &log_current_time;
+    return &mk_clock_get()->log_time;
 }
 
 int mk_plugin_sched_remove_client(int socket, struct mk_server *server)
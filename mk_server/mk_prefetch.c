@@ -0,0 +1,389 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_prefetch.h>
+#include <monkey/mk_prefetch_tls.h>
+
+#ifdef MK_HAVE_PREADV2_NOWAIT
+
+/* I/O helpers pool */
+static int mk_prefetch_stop = MK_FALSE;
+static int mk_prefetch_n_threads = 0;
+static pthread_t mk_prefetch_tids[MK_PREFETCH_THREADS];
+static pthread_mutex_t mk_prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mk_prefetch_cond = PTHREAD_COND_INITIALIZER;
+static struct mk_list mk_prefetch_queue;
+static struct mk_list mk_prefetch_workers;
+
+/*
+ * Load the job window into the page cache: let the kernel start the
+ * readahead for the whole window and then wait for it through plain
+ * reads on this helper thread.
+ */
+static void mk_prefetch_job_run(struct mk_prefetch_job *job, char *buf,
+                                size_t size)
+{
+    ssize_t bytes;
+    off_t offset = job->offset;
+    off_t end = job->offset + job->length;
+
+    posix_fadvise(job->fd, job->offset, job->length, POSIX_FADV_WILLNEED);
+
+    while (offset < end) {
+        bytes = pread(job->fd, buf, size, offset);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        offset += bytes;
+    }
+}
+
+static void *mk_prefetch_helper(void *data)
+{
+    int ret;
+    char *buf;
+    uint64_t val = 1;
+    struct mk_prefetch_job *job;
+    struct mk_prefetch_worker *worker;
+    (void) data;
+
+    mk_utils_worker_rename("monkey: prefetch");
+
+    buf = mk_mem_alloc(MK_PREFETCH_WINDOW / 8);
+    if (!buf) {
+        return NULL;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&mk_prefetch_lock);
+        while (mk_list_is_empty(&mk_prefetch_queue) == 0 &&
+               mk_prefetch_stop == MK_FALSE) {
+            pthread_cond_wait(&mk_prefetch_cond, &mk_prefetch_lock);
+        }
+        if (mk_prefetch_stop == MK_TRUE) {
+            pthread_mutex_unlock(&mk_prefetch_lock);
+            break;
+        }
+        job = mk_list_entry_first(&mk_prefetch_queue,
+                                  struct mk_prefetch_job, _head);
+        mk_list_del(&job->_head);
+        pthread_mutex_unlock(&mk_prefetch_lock);
+
+        mk_prefetch_job_run(job, buf, MK_PREFETCH_WINDOW / 8);
+
+        /* Hand the job back to its worker */
+        worker = job->worker;
+        pthread_mutex_lock(&worker->lock);
+        mk_list_add(&job->_head, &worker->done);
+        pthread_mutex_unlock(&worker->lock);
+
+        ret = write(worker->ch_w, &val, sizeof(val));
+        if (ret <= 0) {
+            mk_libc_error("write");
+        }
+    }
+
+    mk_mem_free(buf);
+    return NULL;
+}
+
+/* Worker side: resume the connections whose data is now resident */
+static int mk_prefetch_worker_handler(void *data)
+{
+    int ret;
+    uint64_t val;
+    struct mk_list done;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_prefetch_job *job;
+    struct mk_prefetch_worker *worker = data;
+    struct mk_sched_worker *sched;
+
+    ret = read(worker->ch_r, &val, sizeof(val));
+    if (ret <= 0) {
+        return -1;
+    }
+
+    mk_list_init(&done);
+    pthread_mutex_lock(&worker->lock);
+    mk_list_foreach_safe(head, tmp, &worker->done) {
+        job = mk_list_entry(head, struct mk_prefetch_job, _head);
+        mk_list_del(&job->_head);
+        mk_list_add(&job->_head, &done);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    sched = mk_sched_get_thread_conf();
+    mk_list_foreach_safe(head, tmp, &done) {
+        job = mk_list_entry(head, struct mk_prefetch_job, _head);
+        mk_list_del(&job->_head);
+        mk_list_del(&job->_head_pending);
+
+        if (job->conn) {
+            job->in->prefetch_ready = job->offset + job->length;
+            mk_event_add(sched->loop, job->conn->event.fd,
+                         MK_EVENT_CONNECTION, MK_EVENT_WRITE,
+                         &job->conn->event);
+        }
+        close(job->fd);
+        mk_mem_free(job);
+    }
+
+    return 0;
+}
+
+/*
+ * Check if the bytes at 'offset' are in the page cache: returns 0 if
+ * they are, 1 if a read would block or -1 if the check is not supported.
+ */
+static inline int mk_prefetch_probe(int fd, off_t offset)
+{
+    char c;
+    ssize_t ret;
+    struct iovec iov = {&c, 1};
+
+    ret = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+    if (ret >= 0) {
+        return 0;
+    }
+    else if (errno == EAGAIN) {
+        return 1;
+    }
+    return -1;
+}
+
+static int mk_prefetch_submit(struct mk_channel *channel,
+                              struct mk_stream_input *in,
+                              off_t offset, size_t length)
+{
+    int fd;
+    struct mk_prefetch_job *job;
+    struct mk_prefetch_worker *worker;
+
+    worker = MK_TLS_GET(mk_tls_prefetch_worker);
+    if (!worker || mk_prefetch_n_threads == 0) {
+        return -1;
+    }
+
+    /* The file descriptor may be closed or shared (fdt) meanwhile */
+    fd = dup(in->fd);
+    if (fd == -1) {
+        return -1;
+    }
+
+    job = mk_mem_alloc(sizeof(struct mk_prefetch_job));
+    if (!job) {
+        close(fd);
+        return -1;
+    }
+    job->fd     = fd;
+    job->offset = offset;
+    job->length = length;
+    job->conn   = mk_list_entry(channel, struct mk_sched_conn, channel);
+    job->in     = in;
+    job->worker = worker;
+    mk_list_add(&job->_head_pending, &worker->pending);
+
+    /*
+     * Take the connection out of the event loop until the job finish,
+     * otherwise the socket would keep reporting it's writable.
+     */
+    mk_event_del(mk_sched_loop(), channel->event);
+
+    pthread_mutex_lock(&mk_prefetch_lock);
+    mk_list_add(&job->_head, &mk_prefetch_queue);
+    pthread_cond_signal(&mk_prefetch_cond);
+    pthread_mutex_unlock(&mk_prefetch_lock);
+
+    return 0;
+}
+
+/*
+ * Called before writing a file stream input to the channel, it returns
+ * MK_PREFETCH_WAIT if the connection was put to sleep until the next
+ * window of the file is loaded.
+ */
+int mk_prefetch_check(struct mk_channel *channel, struct mk_stream_input *in)
+{
+    int ret;
+    off_t end;
+    size_t length;
+
+    if (in->prefetch == MK_FALSE || in->bytes_offset < in->prefetch_ready) {
+        return MK_PREFETCH_READY;
+    }
+
+    length = in->bytes_total;
+    if (length > MK_PREFETCH_WINDOW) {
+        length = MK_PREFETCH_WINDOW;
+    }
+    end = in->bytes_offset + length;
+
+    /* Sample the first and last page of the window */
+    ret = mk_prefetch_probe(in->fd, in->bytes_offset);
+    if (ret == 0 && length > 1) {
+        ret = mk_prefetch_probe(in->fd, end - 1);
+    }
+
+    if (ret == 0) {
+        in->prefetch_ready = end;
+        return MK_PREFETCH_READY;
+    }
+    else if (ret == 1 &&
+             mk_prefetch_submit(channel, in, in->bytes_offset, length) == 0) {
+        return MK_PREFETCH_WAIT;
+    }
+
+    /* Not supported, let sendfile(2) do the work */
+    in->prefetch = MK_FALSE;
+    return MK_PREFETCH_READY;
+}
+
+/* A connection is being released, detach it from the jobs in flight */
+void mk_prefetch_cancel(struct mk_sched_conn *conn)
+{
+    struct mk_list *head;
+    struct mk_prefetch_job *job;
+    struct mk_prefetch_worker *worker;
+
+    worker = MK_TLS_GET(mk_tls_prefetch_worker);
+    if (!worker || mk_list_is_empty(&worker->pending) == 0) {
+        return;
+    }
+
+    mk_list_foreach(head, &worker->pending) {
+        job = mk_list_entry(head, struct mk_prefetch_job, _head_pending);
+        if (job->conn == conn) {
+            job->conn = NULL;
+        }
+    }
+}
+
+int mk_prefetch_worker_init(struct mk_event_loop *evl)
+{
+    int ret;
+    struct mk_prefetch_worker *worker;
+
+    worker = mk_mem_alloc_z(sizeof(struct mk_prefetch_worker));
+    if (!worker) {
+        return -1;
+    }
+
+    ret = mk_event_channel_create(evl, &worker->ch_r, &worker->ch_w, worker);
+    if (ret != 0) {
+        mk_mem_free(worker);
+        return -1;
+    }
+    worker->event.type    = MK_EVENT_CUSTOM;
+    worker->event.handler = mk_prefetch_worker_handler;
+
+    pthread_mutex_init(&worker->lock, NULL);
+    mk_list_init(&worker->done);
+    mk_list_init(&worker->pending);
+
+    /* The pool owns the worker contexts, helpers may still reference them */
+    pthread_mutex_lock(&mk_prefetch_lock);
+    mk_list_add(&worker->_head, &mk_prefetch_workers);
+    pthread_mutex_unlock(&mk_prefetch_lock);
+
+    MK_TLS_SET(mk_tls_prefetch_worker, worker);
+    return 0;
+}
+
+int mk_prefetch_init(struct mk_server *server)
+{
+    int i;
+    (void) server;
+
+    mk_list_init(&mk_prefetch_queue);
+    mk_list_init(&mk_prefetch_workers);
+
+    for (i = 0; i < MK_PREFETCH_THREADS; i++) {
+        if (pthread_create(&mk_prefetch_tids[i], NULL,
+                           mk_prefetch_helper, NULL) != 0) {
+            mk_warn("[prefetch] could not create I/O helper thread");
+            break;
+        }
+        mk_prefetch_n_threads++;
+    }
+
+    return 0;
+}
+
+/* Must be called once the workers are gone */
+void mk_prefetch_exit()
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *j_tmp;
+    struct mk_list *j_head;
+    struct mk_prefetch_job *job;
+    struct mk_prefetch_worker *worker;
+
+    pthread_mutex_lock(&mk_prefetch_lock);
+    mk_prefetch_stop = MK_TRUE;
+    pthread_cond_broadcast(&mk_prefetch_cond);
+    pthread_mutex_unlock(&mk_prefetch_lock);
+
+    for (i = 0; i < mk_prefetch_n_threads; i++) {
+        pthread_join(mk_prefetch_tids[i], NULL);
+    }
+    mk_prefetch_n_threads = 0;
+
+    mk_list_foreach_safe(head, tmp, &mk_prefetch_queue) {
+        job = mk_list_entry(head, struct mk_prefetch_job, _head);
+        mk_list_del(&job->_head);
+        close(job->fd);
+        mk_mem_free(job);
+    }
+
+    mk_list_foreach_safe(head, tmp, &mk_prefetch_workers) {
+        worker = mk_list_entry(head, struct mk_prefetch_worker, _head);
+        mk_list_foreach_safe(j_head, j_tmp, &worker->done) {
+            job = mk_list_entry(j_head, struct mk_prefetch_job, _head);
+            mk_list_del(&job->_head);
+            close(job->fd);
+            mk_mem_free(job);
+        }
+        close(worker->ch_r);
+        close(worker->ch_w);
+        pthread_mutex_destroy(&worker->lock);
+        mk_list_del(&worker->_head);
+        mk_mem_free(worker);
+    }
+}
+
+#endif
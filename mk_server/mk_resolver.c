@@ -0,0 +1,594 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_tls.h>
+#include <monkey/mk_net.h>
+#include <monkey/mk_resolver.h>
+#include <monkey/mk_resolver_tls.h>
+
+/* Helpers pool, started on the first lookup */
+static int mk_resolver_stop = MK_FALSE;
+static int mk_resolver_n_threads = 0;
+static pthread_t mk_resolver_tids[MK_RESOLVER_THREADS];
+static pthread_once_t mk_resolver_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mk_resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mk_resolver_cond = PTHREAD_COND_INITIALIZER;
+static struct mk_list mk_resolver_queue;
+static struct mk_list mk_resolver_workers;
+
+static inline uint64_t mk_resolver_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint32_t mk_resolver_hash(const char *host, int port)
+{
+    uint32_t hash = 2166136261u;
+
+    /* FNV-1a */
+    while (*host) {
+        hash ^= (unsigned char) *host++;
+        hash *= 16777619;
+    }
+    return hash ^ port;
+}
+
+static void *mk_resolver_helper(void *data)
+{
+    int ret;
+    uint64_t val = 1;
+    struct mk_resolver_job *job;
+    struct mk_resolver_worker *worker;
+    (void) data;
+
+    mk_utils_worker_rename("monkey: resolver");
+
+    while (1) {
+        pthread_mutex_lock(&mk_resolver_lock);
+        while (mk_list_is_empty(&mk_resolver_queue) == 0 &&
+               mk_resolver_stop == MK_FALSE) {
+            pthread_cond_wait(&mk_resolver_cond, &mk_resolver_lock);
+        }
+        if (mk_resolver_stop == MK_TRUE) {
+            pthread_mutex_unlock(&mk_resolver_lock);
+            break;
+        }
+        job = mk_list_entry_first(&mk_resolver_queue,
+                                  struct mk_resolver_job, _head);
+        mk_list_del(&job->_head);
+        pthread_mutex_unlock(&mk_resolver_lock);
+
+        job->status = mk_net_addr_resolve(job->host, job->port, &job->addr);
+        job->error = (job->status == -1) ? errno : 0;
+
+        /* Hand the answer back to its worker */
+        worker = job->worker;
+        pthread_mutex_lock(&worker->lock);
+        mk_list_add(&job->_head, &worker->done);
+        pthread_mutex_unlock(&worker->lock);
+
+        ret = write(worker->ch_w, &val, sizeof(val));
+        if (ret <= 0) {
+            mk_libc_error("write");
+        }
+    }
+
+    return NULL;
+}
+
+static void mk_resolver_start()
+{
+    int i;
+
+    for (i = 0; i < MK_RESOLVER_THREADS; i++) {
+        if (pthread_create(&mk_resolver_tids[i], NULL,
+                           mk_resolver_helper, NULL) != 0) {
+            mk_warn("[resolver] could not create helper thread");
+            break;
+        }
+        mk_resolver_n_threads++;
+    }
+}
+
+static void mk_resolver_entry_free(struct mk_resolver_worker *worker,
+                                   struct mk_resolver_entry *entry)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_resolver_waiter *waiter;
+
+    mk_list_foreach_safe(head, tmp, &entry->waiters) {
+        waiter = mk_list_entry(head, struct mk_resolver_waiter, _head);
+        mk_list_del(&waiter->_head);
+        mk_mem_free(waiter);
+    }
+
+    mk_list_del(&entry->_head);
+    worker->entries--;
+    mk_mem_free(entry->host);
+    mk_mem_free(entry);
+}
+
+static struct mk_resolver_entry *mk_resolver_entry_get(
+                                      struct mk_resolver_worker *worker,
+                                      const char *host, int port,
+                                      uint32_t hash)
+{
+    struct mk_list *head;
+    struct mk_resolver_entry *entry;
+
+    mk_list_foreach(head, &worker->cache) {
+        entry = mk_list_entry(head, struct mk_resolver_entry, _head);
+        if (entry->hash == hash && entry->port == port &&
+            strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static struct mk_resolver_entry *mk_resolver_entry_new(
+                                      struct mk_resolver_worker *worker,
+                                      const char *host, int port,
+                                      uint32_t hash)
+{
+    struct mk_list *head;
+    struct mk_resolver_entry *entry;
+
+    /* Full: drop the least recently used answer not being looked up */
+    if (worker->entries >= MK_RESOLVER_CACHE_SIZE) {
+        mk_list_foreach(head, &worker->cache) {
+            entry = mk_list_entry(head, struct mk_resolver_entry, _head);
+            if (entry->pending == MK_FALSE) {
+                mk_resolver_entry_free(worker, entry);
+                break;
+            }
+        }
+    }
+
+    entry = mk_mem_alloc_z(sizeof(struct mk_resolver_entry));
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->host = mk_string_dup(host);
+    if (!entry->host) {
+        mk_mem_free(entry);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->port = port;
+    mk_list_init(&entry->waiters);
+    mk_list_add(&entry->_head, &worker->cache);
+    worker->entries++;
+
+    return entry;
+}
+
+/* Queue the lookup of the entry to the helpers */
+static int mk_resolver_submit(struct mk_resolver_worker *worker,
+                              struct mk_resolver_entry *entry)
+{
+    struct mk_resolver_job *job;
+
+    pthread_once(&mk_resolver_once, mk_resolver_start);
+    if (mk_resolver_n_threads == 0) {
+        return -1;
+    }
+
+    job = mk_mem_alloc_z(sizeof(struct mk_resolver_job));
+    if (!job) {
+        return -1;
+    }
+
+    job->host = mk_string_dup(entry->host);
+    if (!job->host) {
+        mk_mem_free(job);
+        return -1;
+    }
+    job->port = entry->port;
+    job->entry = entry;
+    job->worker = worker;
+    job->queued_at = mk_resolver_clock();
+    entry->pending = MK_TRUE;
+
+    pthread_mutex_lock(&mk_resolver_lock);
+    mk_list_add(&job->_head, &mk_resolver_queue);
+    pthread_cond_signal(&mk_resolver_cond);
+    pthread_mutex_unlock(&mk_resolver_lock);
+
+    return 0;
+}
+
+/* Worker side: store the answers and run the callbacks waiting for them */
+static int mk_resolver_worker_handler(void *data)
+{
+    int ret;
+    int status;
+    int error;
+    uint64_t val;
+    uint64_t usec;
+    time_t now;
+    struct mk_net_addr addr;
+    struct mk_list done;
+    struct mk_list waiters;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *w_tmp;
+    struct mk_list *w_head;
+    struct mk_resolver_job *job;
+    struct mk_resolver_entry *entry;
+    struct mk_resolver_waiter *waiter;
+    struct mk_resolver_worker *worker = data;
+
+    ret = read(worker->ch_r, &val, sizeof(val));
+    if (ret <= 0) {
+        return -1;
+    }
+
+    mk_list_init(&done);
+    pthread_mutex_lock(&worker->lock);
+    mk_list_foreach_safe(head, tmp, &worker->done) {
+        job = mk_list_entry(head, struct mk_resolver_job, _head);
+        mk_list_del(&job->_head);
+        mk_list_add(&job->_head, &done);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    mk_list_foreach_safe(head, tmp, &done) {
+        job = mk_list_entry(head, struct mk_resolver_job, _head);
+        mk_list_del(&job->_head);
+
+        usec = mk_resolver_clock() - job->queued_at;
+        worker->stats.resolved++;
+        worker->stats.latency_usec += usec;
+        if (usec > worker->stats.latency_max) {
+            worker->stats.latency_max = usec;
+        }
+
+        now = mk_resolver_clock() / 1000000;
+        entry = job->entry;
+        entry->pending = MK_FALSE;
+
+        if (job->status == 0) {
+            entry->status = 0;
+            entry->error = 0;
+            entry->addr = job->addr;
+            entry->expires = now + MK_RESOLVER_TTL;
+        }
+        else {
+            worker->stats.failures++;
+            if (entry->status == 0 && entry->expires > 0) {
+                /* Keep the last good answer, the name server may be down */
+                mk_warn("[resolver] cannot refresh %s: %s, keep last answer",
+                        entry->host, strerror(job->error));
+                entry->expires = now + MK_RESOLVER_TTL_FAIL;
+            }
+            else {
+                entry->status = -1;
+                entry->error = job->error;
+                entry->expires = now + MK_RESOLVER_TTL_FAIL;
+            }
+        }
+
+        mk_mem_free(job->host);
+        mk_mem_free(job);
+
+        /*
+         * The callbacks may look up other names and evict this entry,
+         * hand them a copy of the answer.
+         */
+        status = entry->status;
+        error = entry->error;
+        addr = entry->addr;
+
+        mk_list_init(&waiters);
+        mk_list_foreach_safe(w_head, w_tmp, &entry->waiters) {
+            waiter = mk_list_entry(w_head, struct mk_resolver_waiter, _head);
+            mk_list_del(&waiter->_head);
+            mk_list_add(&waiter->_head, &waiters);
+        }
+
+        mk_list_foreach_safe(w_head, w_tmp, &waiters) {
+            waiter = mk_list_entry(w_head, struct mk_resolver_waiter, _head);
+            mk_list_del(&waiter->_head);
+            if (waiter->cb) {
+                errno = error;
+                waiter->cb(waiter->data, status, &addr);
+            }
+            mk_mem_free(waiter);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Resolve 'host' (see mk_net_addr_parse() for the literal forms) without
+ * blocking the worker. It returns MK_RESOLVER_DONE with 'addr' set if the
+ * answer is known, MK_RESOLVER_WAIT if 'cb' will get it later on the
+ * worker event loop, or -1 with errno set if the name does not resolve.
+ * Out of a worker the lookup is done in place.
+ */
+int mk_resolver_lookup(const char *host, int port, struct mk_net_addr *addr,
+                       mk_resolver_cb cb, void *data)
+{
+    int ret;
+    time_t now;
+    uint32_t hash;
+    struct mk_resolver_entry *entry;
+    struct mk_resolver_waiter *waiter;
+    struct mk_resolver_worker *worker;
+
+    worker = MK_TLS_GET(mk_tls_resolver_worker);
+
+    ret = mk_net_addr_parse(host, port, addr);
+    if (ret == 0) {
+        if (worker) {
+            worker->stats.lookups++;
+            worker->stats.literals++;
+        }
+        return MK_RESOLVER_DONE;
+    }
+
+    if (!worker || !cb) {
+        ret = mk_net_addr_resolve(host, port, addr);
+        return (ret == 0) ? MK_RESOLVER_DONE : -1;
+    }
+
+    worker->stats.lookups++;
+    now = mk_resolver_clock() / 1000000;
+    hash = mk_resolver_hash(host, port);
+
+    entry = mk_resolver_entry_get(worker, host, port, hash);
+    if (entry) {
+        /* Most recently used go last */
+        mk_list_del(&entry->_head);
+        mk_list_add(&entry->_head, &worker->cache);
+
+        if (entry->expires > now) {
+            worker->stats.hits++;
+            if (entry->status == -1) {
+                errno = entry->error;
+                return -1;
+            }
+            *addr = entry->addr;
+            return MK_RESOLVER_DONE;
+        }
+
+        /* Expired: a good answer is still used while it's refreshed */
+        if (entry->expires > 0 && entry->status == 0) {
+            worker->stats.stale++;
+            if (entry->pending == MK_FALSE) {
+                mk_resolver_submit(worker, entry);
+            }
+            *addr = entry->addr;
+            return MK_RESOLVER_DONE;
+        }
+
+        if (entry->pending == MK_TRUE) {
+            worker->stats.coalesced++;
+        }
+        else {
+            worker->stats.misses++;
+        }
+    }
+    else {
+        worker->stats.misses++;
+        entry = mk_resolver_entry_new(worker, host, port, hash);
+        if (!entry) {
+            return -1;
+        }
+    }
+
+    waiter = mk_mem_alloc(sizeof(struct mk_resolver_waiter));
+    if (!waiter) {
+        return -1;
+    }
+    waiter->cb = cb;
+    waiter->data = data;
+
+    if (entry->pending == MK_FALSE) {
+        ret = mk_resolver_submit(worker, entry);
+        if (ret == -1) {
+            /* No helpers: resolve in place */
+            mk_mem_free(waiter);
+            ret = mk_net_addr_resolve(host, port, addr);
+            return (ret == 0) ? MK_RESOLVER_DONE : -1;
+        }
+    }
+
+    mk_list_add(&waiter->_head, &entry->waiters);
+    return MK_RESOLVER_WAIT;
+}
+
+/* The caller is gone, its callbacks must not run */
+void mk_resolver_cancel(void *data)
+{
+    struct mk_list *head;
+    struct mk_list *w_head;
+    struct mk_resolver_entry *entry;
+    struct mk_resolver_waiter *waiter;
+    struct mk_resolver_worker *worker;
+
+    worker = MK_TLS_GET(mk_tls_resolver_worker);
+    if (!worker) {
+        return;
+    }
+
+    mk_list_foreach(head, &worker->cache) {
+        entry = mk_list_entry(head, struct mk_resolver_entry, _head);
+        if (entry->pending == MK_FALSE) {
+            continue;
+        }
+        mk_list_foreach(w_head, &entry->waiters) {
+            waiter = mk_list_entry(w_head, struct mk_resolver_waiter, _head);
+            if (waiter->data == data) {
+                waiter->cb = NULL;
+            }
+        }
+    }
+}
+
+/* Counters added up across workers */
+void mk_resolver_stats(struct mk_resolver_stats *stats)
+{
+    struct mk_list *head;
+    struct mk_resolver_stats *s;
+    struct mk_resolver_worker *worker;
+
+    memset(stats, '\0', sizeof(struct mk_resolver_stats));
+
+    pthread_mutex_lock(&mk_resolver_lock);
+    mk_list_foreach(head, &mk_resolver_workers) {
+        worker = mk_list_entry(head, struct mk_resolver_worker, _head);
+        s = &worker->stats;
+        stats->lookups      += s->lookups;
+        stats->literals     += s->literals;
+        stats->hits         += s->hits;
+        stats->stale        += s->stale;
+        stats->misses       += s->misses;
+        stats->coalesced    += s->coalesced;
+        stats->failures     += s->failures;
+        stats->resolved     += s->resolved;
+        stats->latency_usec += s->latency_usec;
+        if (s->latency_max > stats->latency_max) {
+            stats->latency_max = s->latency_max;
+        }
+    }
+    pthread_mutex_unlock(&mk_resolver_lock);
+}
+
+int mk_resolver_worker_init(struct mk_event_loop *evl)
+{
+    int ret;
+    struct mk_resolver_worker *worker;
+
+    worker = mk_mem_alloc_z(sizeof(struct mk_resolver_worker));
+    if (!worker) {
+        return -1;
+    }
+
+    ret = mk_event_channel_create(evl, &worker->ch_r, &worker->ch_w, worker);
+    if (ret != 0) {
+        mk_mem_free(worker);
+        return -1;
+    }
+    worker->event.type    = MK_EVENT_CUSTOM;
+    worker->event.handler = mk_resolver_worker_handler;
+
+    pthread_mutex_init(&worker->lock, NULL);
+    mk_list_init(&worker->done);
+    mk_list_init(&worker->cache);
+
+    /* The pool owns the worker contexts, helpers may still reference them */
+    pthread_mutex_lock(&mk_resolver_lock);
+    mk_list_add(&worker->_head, &mk_resolver_workers);
+    pthread_mutex_unlock(&mk_resolver_lock);
+
+    MK_TLS_SET(mk_tls_resolver_worker, worker);
+    return 0;
+}
+
+int mk_resolver_init(struct mk_server *server)
+{
+    (void) server;
+
+    mk_list_init(&mk_resolver_queue);
+    mk_list_init(&mk_resolver_workers);
+
+    return 0;
+}
+
+static void mk_resolver_job_free(struct mk_resolver_job *job)
+{
+    mk_list_del(&job->_head);
+    mk_mem_free(job->host);
+    mk_mem_free(job);
+}
+
+/* Must be called once the workers are gone */
+void mk_resolver_exit()
+{
+    int i;
+    uint64_t hits;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *e_tmp;
+    struct mk_list *e_head;
+    struct mk_resolver_stats stats;
+    struct mk_resolver_entry *entry;
+    struct mk_resolver_worker *worker;
+
+    mk_resolver_stats(&stats);
+    if (stats.lookups > stats.literals) {
+        hits = stats.hits + stats.stale;
+        mk_info("[resolver] %lu lookups, %lu%% cached (%lu stale), "
+                "%lu resolved, %lu failures, latency avg %lu max %lu us",
+                stats.lookups - stats.literals,
+                hits * 100 / (stats.lookups - stats.literals), stats.stale,
+                stats.resolved, stats.failures,
+                stats.resolved ? stats.latency_usec / stats.resolved : 0,
+                stats.latency_max);
+    }
+
+    pthread_mutex_lock(&mk_resolver_lock);
+    mk_resolver_stop = MK_TRUE;
+    pthread_cond_broadcast(&mk_resolver_cond);
+    pthread_mutex_unlock(&mk_resolver_lock);
+
+    for (i = 0; i < mk_resolver_n_threads; i++) {
+        pthread_join(mk_resolver_tids[i], NULL);
+    }
+    mk_resolver_n_threads = 0;
+
+    mk_list_foreach_safe(head, tmp, &mk_resolver_queue) {
+        mk_resolver_job_free(mk_list_entry(head, struct mk_resolver_job,
+                                           _head));
+    }
+
+    mk_list_foreach_safe(head, tmp, &mk_resolver_workers) {
+        worker = mk_list_entry(head, struct mk_resolver_worker, _head);
+        mk_list_foreach_safe(e_head, e_tmp, &worker->done) {
+            mk_resolver_job_free(mk_list_entry(e_head, struct mk_resolver_job,
+                                               _head));
+        }
+        mk_list_foreach_safe(e_head, e_tmp, &worker->cache) {
+            entry = mk_list_entry(e_head, struct mk_resolver_entry, _head);
+            mk_resolver_entry_free(worker, entry);
+        }
+        close(worker->ch_r);
+        close(worker->ch_w);
+        pthread_mutex_destroy(&worker->lock);
+        mk_list_del(&worker->_head);
+        mk_mem_free(worker);
+    }
+}
@@ -33,6 +33,9 @@
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
 #include <monkey/mk_http_thread.h>
+#include <monkey/mk_prefetch.h>
+#include <monkey/mk_resolver.h>
+#include <monkey/mk_metrics.h>
 
 #include <signal.h>
 #include <sys/syscall.h>
@@ -129,7 +132,9 @@ void mk_sched_worker_free(struct mk_server *server)
     /* External */
     mk_plugin_exit_worker();
     mk_vhost_fdt_worker_exit(server);
+    mk_vhost_route_worker_exit();
     mk_cache_worker_exit();
+    mk_clock_worker_exit();
 
     /* Scheduler stuff */
     tid = pthread_self();
@@ -210,17 +215,23 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     event->type         = MK_EVENT_CONNECTION;
     event->mask         = MK_EVENT_EMPTY;
     event->status       = MK_EVENT_NONE;
-    conn->arrive_time   = log_current_utime;
+    conn->arrive_time   = mk_clock_msec();
     conn->protocol      = handler;
     conn->net           = listener->network->network;
     conn->is_timeout_on = MK_FALSE;
     conn->server_listen = listener;
 
+    /* The protocol may be negotiated by the network layer (e.g: ALPN) */
+    if (conn->net->handshake) {
+        conn->properties |= MK_SCHED_CONN_HANDSHAKE;
+    }
+
     /* Stream channel */
     conn->channel.type  = MK_CHANNEL_SOCKET;    /* channel type     */
     conn->channel.fd    = remote_fd;            /* socket conn      */
     conn->channel.io    = conn->net;            /* network layer    */
     conn->channel.event = event;                /* parent event ref */
+    conn->channel.metrics = server->metrics;    /* time responses   */
     mk_list_init(&conn->channel.streams);
 
     /*
@@ -329,9 +340,11 @@ void *mk_sched_launch_worker_loop(void *data)
     /* Init specific thread cache */
     mk_sched_thread_lists_init();
     mk_cache_worker_init();
+    mk_clock_worker_init();
 
     /* Virtual hosts: initialize per thread-vhost data */
     mk_vhost_fdt_worker_init(server);
+    mk_vhost_route_worker_init();
 
     /* Register working thread */
     wid = mk_sched_register_thread(server);
@@ -359,6 +372,23 @@ void *mk_sched_launch_worker_loop(void *data)
         exit(EXIT_FAILURE);
     }
 
+#ifdef MK_HAVE_PREADV2_NOWAIT
+    /* Static files prefetch completion channel */
+    if (mk_prefetch_worker_init(sched->loop) != 0) {
+        mk_warn("[sched] could not initialize prefetch on worker");
+    }
+#endif
+
+    /* Host names resolver completion channel */
+    if (mk_resolver_worker_init(sched->loop) != 0) {
+        mk_warn("[sched] could not initialize resolver on worker");
+    }
+
+    if (server->metrics == MK_TRUE &&
+        mk_metrics_worker_init(server) != 0) {
+        mk_warn("[sched] could not initialize metrics on worker");
+    }
+
     mk_list_init(&sched->event_free_queue);
     mk_list_init(&sched->threads);
     mk_list_init(&sched->threads_purge);
@@ -464,7 +494,7 @@ int mk_sched_init(struct mk_server *server)
     }
 
     size = (sizeof(struct mk_sched_worker) * server->workers);
-    ctx->workers = mk_mem_alloc(size);
+    ctx->workers = mk_mem_alloc_z(size);
     if (!ctx->workers) {
         mk_libc_error("malloc");
         mk_mem_free(ctx);
@@ -519,6 +549,10 @@ int mk_sched_remove_client(struct mk_sched_conn *conn,
 
     mk_event_del(sched->loop, event);
 
+#ifdef MK_HAVE_PREADV2_NOWAIT
+    mk_prefetch_cancel(conn);
+#endif
+
     /* Invoke plugins in stage 50 */
     mk_plugin_stage_run_50(event->fd, server);
 
@@ -564,11 +598,14 @@ int mk_sched_drop_connection(struct mk_sched_conn *conn,
 int mk_sched_check_timeouts(struct mk_sched_worker *sched,
                             struct mk_server *server)
 {
-    int client_timeout;
+    uint64_t now;
+    uint64_t client_timeout;
     struct mk_sched_conn *conn;
     struct mk_list *head;
     struct mk_list *temp;
 
+    now = mk_clock_msec();
+
     /* PENDING CONN TIMEOUT */
     mk_list_foreach_safe(head, temp, &sched->timeout_queue) {
         conn = mk_list_entry(head, struct mk_sched_conn, timeout_head);
@@ -576,10 +613,10 @@ int mk_sched_check_timeouts(struct mk_sched_worker *sched,
             continue;
         }
 
-        client_timeout = conn->arrive_time + server->timeout;
+        client_timeout = conn->arrive_time + server->timeout * 1000;
 
         /* Check timeout */
-        if (client_timeout <= log_current_utime) {
+        if (client_timeout <= now) {
             MK_TRACE("Scheduler, closing fd %i due TIMEOUT",
                      conn->event.fd);
             MK_LT_SCHED(conn->event.fd, "TIMEOUT_CONN_PENDING");
@@ -608,6 +645,35 @@ int mk_sched_threads_purge(struct mk_sched_worker *sched)
     return c;
 }
 
+/*
+ * Complete the network layer handshake and switch the connection to the
+ * protocol negotiated, otherwise the listener default is kept.
+ */
+static int mk_sched_conn_handshake(struct mk_sched_conn *conn)
+{
+    int ret;
+    int cap = 0;
+
+    ret = conn->net->handshake(conn->event.fd, MK_SCHED_CONN_PROP(conn), &cap,
+                               &conn->event);
+    if (ret == -1) {
+        if (errno == EAGAIN) {
+            MK_TRACE("[FD %i] EAGAIN: handshake in progress", conn->event.fd);
+            return 1;
+        }
+        return -1;
+    }
+    conn->properties &= ~MK_SCHED_CONN_HANDSHAKE;
+
+    if (cap != 0 && cap != MK_SCHED_CONN_CAP(conn) &&
+        (MK_SCHED_CONN_PROP(conn) & cap)) {
+        MK_TRACE("[FD %i] Switch protocol to %i", conn->event.fd, cap);
+        mk_sched_switch_protocol(conn, cap);
+    }
+
+    return 0;
+}
+
 /*
  * Scheduler events handler: lookup for event handler and invoke
  * proper callbacks.
@@ -630,7 +696,17 @@ int mk_sched_event_read(struct mk_sched_conn *conn,
      *
      *  - plain sockets through liana will use just read(2)
      *  - ssl though mbedtls should use mk_mbedtls_read(..)
+     *
+     * Data may arrive with the end of the handshake, so the protocol
+     * handler is invoked right after it.
      */
+    if (conn->properties & MK_SCHED_CONN_HANDSHAKE) {
+        ret = mk_sched_conn_handshake(conn);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
     ret = conn->protocol->cb_read(conn, sched, server);
     if (ret == -1) {
         if (errno == EAGAIN) {
@@ -653,8 +729,19 @@ int mk_sched_event_write(struct mk_sched_conn *conn,
 
     MK_TRACE("[FD %i] Connection Handler / write", conn->event.fd);
 
+    /* A handshake step waiting for socket space */
+    if (conn->properties & MK_SCHED_CONN_HANDSHAKE) {
+        ret = mk_sched_conn_handshake(conn);
+        if (ret == 0) {
+            mk_event_add(sched->loop, conn->event.fd,
+                         MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
+        }
+        return ret > 0 ? 0 : ret;
+    }
+
     ret = mk_channel_write(&conn->channel, &count);
-    if (ret == MK_CHANNEL_FLUSH || ret == MK_CHANNEL_BUSY) {
+    if (ret == MK_CHANNEL_FLUSH || ret == MK_CHANNEL_BUSY ||
+        ret == MK_CHANNEL_WAIT) {
         return 0;
     }
     else if (ret == MK_CHANNEL_DONE || ret == MK_CHANNEL_EMPTY) {
@@ -29,6 +29,7 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_fifo.h>
 #include <monkey/mk_http_thread.h>
+#include <monkey/mk_clock.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -72,10 +73,11 @@ struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
 {
     int ret;
     int client_fd = -1;
+    struct mk_socket_addr peer;
     struct mk_sched_conn *conn;
     struct mk_server_listen *listener = data;
 
-    client_fd = mk_socket_accept(listener->server_fd);
+    client_fd = mk_socket_accept(listener->server_fd, &peer);
     if (mk_unlikely(client_fd == -1)) {
         MK_TRACE("[server] Accept connection failed: %s", strerror(errno));
         goto error;
@@ -85,6 +87,7 @@ struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
     if (mk_unlikely(!conn)) {
         goto error;
     }
+    conn->peer = peer;
 
     ret = mk_event_add(sched->loop, client_fd,
                        MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
@@ -191,6 +194,7 @@ struct mk_list *mk_server_listen_init(struct mk_server *server)
             /* continue with listener setup and linking */
             listener->server_fd = server_fd;
             listener->listen    = listen;
+            listener->protocol  = NULL;
 
             if (listen->flags & MK_CAP_HTTP) {
                 protocol = mk_sched_handler_cap(MK_CAP_HTTP);
@@ -201,7 +205,13 @@ struct mk_list *mk_server_listen_init(struct mk_server *server)
                 listener->protocol = protocol;
             }
 
-            if (listen->flags & MK_CAP_HTTP2) {
+            /*
+             * Over TLS the client picks the protocol through ALPN, a
+             * client not using it gets HTTP/1.1 when available.
+             */
+            if ((listen->flags & MK_CAP_HTTP2) &&
+                !((listen->flags & MK_CAP_SOCK_TLS) &&
+                  (listen->flags & MK_CAP_HTTP))) {
                 protocol = mk_sched_handler_cap(MK_CAP_HTTP2);
                 if (!protocol) {
                     mk_err("HTTP2 protocol not supported");
@@ -210,6 +220,12 @@ struct mk_list *mk_server_listen_init(struct mk_server *server)
                 listener->protocol = protocol;
             }
 
+            if (!listener->protocol) {
+                mk_err("[server] No protocol enabled for listener %s",
+                       listen->port);
+                exit(EXIT_FAILURE);
+            }
+
             listener->network = mk_plugin_cap(MK_CAP_SOCK_PLAIN, server);
 
             if (listen->flags & MK_CAP_SOCK_TLS) {
@@ -432,6 +448,7 @@ void mk_server_worker_loop(struct mk_server *server)
 
     while (1) {
         mk_event_wait(evl);
+        mk_clock_refresh();
         mk_event_foreach(event, evl) {
             ret = 0;
             if (event->type & MK_EVENT_IDLE) {
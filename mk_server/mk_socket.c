@@ -97,6 +97,40 @@ int mk_socket_set_tcp_defer_accept(int sockfd)
 #endif
 }
 
+/*
+ * Limit the amount of unsent data the kernel accepts, the socket is not
+ * writable until the queue drains below 'bytes' (Linux >= 3.12).
+ */
+int mk_socket_set_tcp_notsent_lowat(int sockfd, int bytes)
+{
+#if defined (TCP_NOTSENT_LOWAT)
+    return setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                      &bytes, sizeof(bytes));
+#else
+    (void) sockfd;
+    (void) bytes;
+    return -1;
+#endif
+}
+
+/* Current congestion window in bytes, -1 if not available */
+int mk_socket_tcp_cwnd(int sockfd)
+{
+#if defined (__linux__)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1 ||
+        info.tcpi_snd_mss == 0) {
+        return -1;
+    }
+    return info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+#else
+    (void) sockfd;
+    return -1;
+#endif
+}
+
 int mk_socket_set_tcp_reuseport(int sockfd)
 {
     int on = 1;
@@ -363,3 +397,40 @@ int mk_socket_ip_str(int socket_fd, char **buf, int size, unsigned long *len)
     *len = strlen(*buf);
     return 0;
 }
+
+/* Text form of an address taken at accept time, no system call involved */
+int mk_socket_addr_str(struct mk_socket_addr *peer, char *buf, int size,
+                       unsigned long *len)
+{
+    const void *addr;
+
+    if (peer->len == 0) {
+        return -1;
+    }
+
+    if (peer->addr.sa.sa_family == AF_INET) {
+        addr = &peer->addr.in.sin_addr;
+    }
+    else {
+        addr = &peer->addr.in6.sin6_addr;
+    }
+
+    if (!inet_ntop(peer->addr.sa.sa_family, addr, buf, size)) {
+        return -1;
+    }
+
+    *len = strlen(buf);
+    return 0;
+}
+
+int mk_socket_addr_port(struct mk_socket_addr *peer)
+{
+    if (peer->len == 0) {
+        return -1;
+    }
+
+    if (peer->addr.sa.sa_family == AF_INET) {
+        return ntohs(peer->addr.in.sin_port);
+    }
+    return ntohs(peer->addr.in6.sin6_port);
+}
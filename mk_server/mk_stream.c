@@ -19,6 +19,9 @@
 
 #include <monkey/monkey.h>
 #include <monkey/mk_stream.h>
+#include <monkey/mk_prefetch.h>
+#include <monkey/mk_http2.h>
+#include <monkey/mk_clock.h>
 #include <assert.h>
 
 /* Create a new channel */
@@ -30,24 +33,45 @@ struct mk_channel *mk_channel_new(int type, int fd)
     channel->type   = type;
     channel->fd     = fd;
     channel->status = MK_CHANNEL_OK;
+    channel->metrics = MK_FALSE;
+    channel->bytes_out = 0;
+    channel->first_out = 0;
     mk_list_init(&channel->streams);
 
     return channel;
 }
 
+/* Request metrics: bytes out and when the response started to go out */
+static inline void mk_channel_sent(struct mk_channel *channel, ssize_t bytes)
+{
+    if (channel->metrics == MK_TRUE && channel->first_out == 0) {
+        channel->first_out = mk_clock_usec();
+    }
+    channel->bytes_out += bytes;
+}
+
 static inline size_t channel_write_in_file(struct mk_channel *channel,
                                            struct mk_stream_input *in)
 {
     ssize_t bytes = 0;
+    size_t count = in->bytes_total;
 
     MK_TRACE("[CH %i] STREAM_FILE [fd=%i], bytes=%lu",
              channel->fd, in->fd, in->bytes_total);
 
+#ifdef MK_HAVE_PREADV2_NOWAIT
+    /* Do not go beyond the data known to be in the page cache */
+    if (in->prefetch == MK_TRUE && in->prefetch_ready > in->bytes_offset &&
+        (size_t) (in->prefetch_ready - in->bytes_offset) < count) {
+        count = in->prefetch_ready - in->bytes_offset;
+    }
+#endif
+
     /* Direct write */
     bytes = mk_sched_conn_sendfile(channel,
                                    in->fd,
                                    &in->bytes_offset,
-                                   in->bytes_total
+                                   count
                                    );
     MK_TRACE("[CH=%d] [FD=%i] WRITE STREAM FILE: %lu bytes",
              channel->fd, in->fd, bytes);
@@ -55,6 +79,18 @@ static inline size_t channel_write_in_file(struct mk_channel *channel,
     return bytes;
 }
 
+static inline ssize_t channel_write_in_pipe(struct mk_channel *channel,
+                                            struct mk_stream_input *in)
+{
+    ssize_t bytes;
+
+    bytes = mk_sched_conn_splice(channel, in->fd, in->bytes_total);
+    MK_TRACE("[CH=%d] [FD=%i] WRITE STREAM PIPE: %ld bytes",
+             channel->fd, in->fd, bytes);
+
+    return bytes;
+}
+
 /*
  * It 'intent' to write a few streams over the channel and alter the
  * channel notification side if required: READ -> WRITE.
@@ -64,7 +100,12 @@ int mk_channel_flush(struct mk_channel *channel)
     int ret = 0;
     size_t count = 0;
     size_t total = 0;
-    uint32_t stop = (MK_CHANNEL_DONE | MK_CHANNEL_ERROR | MK_CHANNEL_EMPTY);
+    uint32_t stop = (MK_CHANNEL_DONE | MK_CHANNEL_ERROR | MK_CHANNEL_EMPTY |
+                     MK_CHANNEL_WAIT);
+
+    if (channel->type == MK_CHANNEL_HTTP2) {
+        return mk_http2_channel_flush(channel);
+    }
 
     do {
         ret = mk_channel_write(channel, &count);
@@ -108,6 +149,10 @@ int mk_stream_in_release(struct mk_stream_input *in)
         in->cb_finished(in);
     }
 
+    if (in->type == MK_STREAM_COPYBUF) {
+        mk_mem_free(in->buffer);
+    }
+
     mk_stream_input_unlink(in);
     if (in->dynamic == MK_TRUE) {
         mk_mem_free(in);
@@ -132,6 +177,11 @@ int mk_channel_stream_write(struct mk_stream *stream, size_t *count)
         return -MK_CHANNEL_ERROR;
     }
 
+    if (channel->type == MK_CHANNEL_HTTP2) {
+        *count = 0;
+        return mk_http2_channel_flush(channel);
+    }
+
     /* Iterate inputs and process stream */
     mk_list_foreach_safe(head, tmp, &stream->inputs) {
         input = mk_list_entry(head, struct mk_stream_input, _head);
@@ -153,15 +203,25 @@ int mk_channel_stream_write(struct mk_stream *stream, size_t *count)
                 mk_iov_consume(iov, bytes);
             }
         }
-        else if (input->type == MK_STREAM_RAW) {
+        else if (input->type == MK_STREAM_PIPE) {
+            bytes = channel_write_in_pipe(channel, input);
+        }
+        else if (input->type == MK_STREAM_RAW ||
+                 input->type == MK_STREAM_COPYBUF) {
             bytes = mk_sched_conn_write(channel,
-                                        input->buffer, input->bytes_total);
+                                        (char *) input->buffer +
+                                        input->bytes_offset,
+                                        input->bytes_total);
             MK_TRACE("[CH %i] STREAM_RAW, bytes=%lu/%lu\n",
                      channel->fd, bytes, input->bytes_total);
+            if (bytes > 0) {
+                input->bytes_offset += bytes;
+            }
         }
 
         if (bytes > 0) {
             *count = bytes;
+            mk_channel_sent(channel, bytes);
             mk_stream_input_consume(input, bytes);
 
             /* notification callback, optional */
@@ -202,6 +262,11 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
 
     errno = 0;
 
+    if (channel->type == MK_CHANNEL_HTTP2) {
+        *count = 0;
+        return mk_http2_channel_flush(channel);
+    }
+
     if (mk_list_is_empty(&channel->streams) == 0) {
         MK_TRACE("[CH %i] CHANNEL_EMPTY", channel->fd);
         return MK_CHANNEL_EMPTY;
@@ -220,6 +285,12 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
      */
     if (channel->type == MK_CHANNEL_SOCKET) {
         if (input->type == MK_STREAM_FILE) {
+#ifdef MK_HAVE_PREADV2_NOWAIT
+            if (mk_prefetch_check(channel, input) == MK_PREFETCH_WAIT) {
+                MK_TRACE("[CH %i] CHANNEL_WAIT", channel->fd);
+                return MK_CHANNEL_WAIT;
+            }
+#endif
             bytes = channel_write_in_file(channel, input);
         }
         else if (input->type == MK_STREAM_IOV) {
@@ -237,18 +308,25 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
                 mk_iov_consume(iov, bytes);
             }
         }
-        else if (input->type == MK_STREAM_RAW) {
+        else if (input->type == MK_STREAM_PIPE) {
+            bytes = channel_write_in_pipe(channel, input);
+        }
+        else if (input->type == MK_STREAM_RAW ||
+                 input->type == MK_STREAM_COPYBUF) {
             bytes = mk_sched_conn_write(channel,
-                                        input->buffer, input->bytes_total);
+                                        (char *) input->buffer +
+                                        input->bytes_offset,
+                                        input->bytes_total);
             MK_TRACE("[CH %i] STREAM_RAW, bytes=%lu/%lu",
                      channel->fd, bytes, input->bytes_total);
             if (bytes > 0) {
-                /* DEPRECATED: consume_raw(input, bytes); */
+                input->bytes_offset += bytes;
             }
         }
 
         if (bytes > 0) {
             *count = bytes;
+            mk_channel_sent(channel, bytes);
             mk_stream_input_consume(input, bytes);
 
             /* notification callback, optional */
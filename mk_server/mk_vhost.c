@@ -27,6 +27,7 @@
 #include <monkey/mk_info.h>
 
 #include <regex.h>
+#include <ctype.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -55,6 +56,25 @@ static int str_to_regex(char *str, regex_t *reg)
     return 0;
 }
 
+/* Case-insensitive FNV-1a hash used to index host names */
+static inline unsigned int vhost_name_hash(const char *name, unsigned int len)
+{
+    unsigned int i;
+    unsigned int h = 2166136261u;
+    unsigned char c;
+
+    for (i = 0; i < len; i++) {
+        c = name[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        h ^= c;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
 /*
  * This function is triggered upon thread creation (inside the thread
  * context), here we configure per-thread data.
@@ -326,6 +346,10 @@ struct mk_vhost_handler *mk_vhost_handler_match(char *match,
     h->name  = NULL;
     h->cb    = cb;
     h->data  = data;
+    h->handler  = NULL;
+    h->n_params = 0;
+    h->literal.data = NULL;
+    h->match_type = MK_VHOST_MATCH_REGEX;
     h->match = mk_mem_alloc(sizeof(regex_t));
     if (!h->match) {
         mk_mem_free(h);
@@ -333,8 +357,13 @@ struct mk_vhost_handler *mk_vhost_handler_match(char *match,
     }
     mk_list_init(&h->params);
 
+    /* str_to_regex() modifies the string, keep the original rule */
+    h->rule = mk_string_dup(match);
+
     ret = str_to_regex(match, h->match);
     if (ret == -1) {
+        mk_mem_free(h->rule);
+        mk_mem_free(h->match);
         mk_mem_free(h);
         return NULL;
     }
@@ -519,6 +548,13 @@ struct mk_vhost *mk_vhost_read(char *path)
                 exit(EXIT_FAILURE);
             }
             h_handler->cb = NULL;
+            h_handler->handler = NULL;
+            h_handler->literal.data = NULL;
+            h_handler->match_type = MK_VHOST_MATCH_REGEX;
+            h_handler->match = mk_mem_alloc(sizeof(regex_t));
+            if (!h_handler->match) {
+                exit(EXIT_FAILURE);
+            }
             mk_list_init(&h_handler->params);
 
             i = 0;
@@ -527,6 +563,7 @@ struct mk_vhost *mk_vhost_read(char *path)
                 entry = mk_list_entry(head_line, struct mk_string_line, _head);
                 switch (i) {
                 case 0:
+                    h_handler->rule = mk_string_dup(entry->val);
                     ret = str_to_regex(entry->val, h_handler->match);
                     if (ret == -1) {
                         return NULL;
@@ -560,9 +597,403 @@ struct mk_vhost *mk_vhost_read(char *path)
     return host;
 }
 
+/*
+ * Compile the handler match rule: a rule made of literal characters with
+ * optional anchors ('^', '$') and a leading/trailing '.*' is matched
+ * without regexec(3). Anything else falls back to the compiled regex.
+ */
+static void vhost_rule_compile(struct mk_vhost_handler *h)
+{
+    int i;
+    int n;
+    int len;
+    int bs;
+    int anchor_start = MK_FALSE;
+    int anchor_end = MK_FALSE;
+    char c;
+    char *p;
+    char *lit;
+
+    h->match_type   = MK_VHOST_MATCH_REGEX;
+    h->literal.data = NULL;
+    h->literal.len  = 0;
+
+    if (!h->rule) {
+        return;
+    }
+
+    p = h->rule;
+    len = strlen(p);
+
+    /*
+     * str_to_regex() turns every space into '|', escaped or not: a rule
+     * with spaces is an alternation, never a literal.
+     */
+    if (memchr(p, ' ', len)) {
+        return;
+    }
+
+    if (len > 0 && p[0] == '^') {
+        anchor_start = MK_TRUE;
+        p++;
+        len--;
+    }
+
+    /* a leading '.*' makes the start anchor meaningless */
+    if (len >= 2 && p[0] == '.' && p[1] == '*') {
+        anchor_start = MK_FALSE;
+        p += 2;
+        len -= 2;
+    }
+
+    /* count backslashes before the last char to know if it's escaped */
+    bs = 0;
+    for (i = len - 2; i >= 0 && p[i] == '\\'; i--) {
+        bs++;
+    }
+
+    if (len > 0 && p[len - 1] == '$' && (bs % 2) == 0) {
+        anchor_end = MK_TRUE;
+        len--;
+    }
+    else if (len >= 2 && p[len - 2] == '.' && p[len - 1] == '*' &&
+             (bs % 2) == 0) {
+        /* a trailing '.*' without end anchor is a no-op */
+        len -= 2;
+    }
+
+    if (len <= 0) {
+        return;
+    }
+
+    lit = mk_mem_alloc(len + 1);
+    if (!lit) {
+        return;
+    }
+
+    for (i = 0, n = 0; i < len; i++) {
+        c = p[i];
+        if (c == '\\') {
+            /* only escaped punctuation is a literal, '\w' and co. are not */
+            if (i + 1 >= len || isalnum((unsigned char) p[i + 1])) {
+                mk_mem_free(lit);
+                return;
+            }
+            lit[n++] = p[++i];
+        }
+        else if (strchr(".[]()*+?{}|^$", c)) {
+            mk_mem_free(lit);
+            return;
+        }
+        else {
+            lit[n++] = c;
+        }
+    }
+    lit[n] = '\0';
+
+    h->literal.data = lit;
+    h->literal.len  = n;
+
+    if (anchor_start == MK_TRUE && anchor_end == MK_TRUE) {
+        h->match_type = MK_VHOST_MATCH_EXACT;
+    }
+    else if (anchor_start == MK_TRUE) {
+        h->match_type = MK_VHOST_MATCH_PREFIX;
+    }
+    else if (anchor_end == MK_TRUE) {
+        h->match_type = MK_VHOST_MATCH_SUFFIX;
+    }
+    else {
+        h->match_type = MK_VHOST_MATCH_CONTAINS;
+    }
+}
+
+/* Match a single handler rule, 'uri' must be NULL terminated */
+static inline int vhost_rule_match(struct mk_vhost_handler *h,
+                                   char *uri, int len)
+{
+    int off;
+    unsigned long lit_len = h->literal.len;
+
+    switch (h->match_type) {
+    case MK_VHOST_MATCH_EXACT:
+        return (len == (int) lit_len &&
+                strncasecmp(uri, h->literal.data, lit_len) == 0);
+    case MK_VHOST_MATCH_PREFIX:
+        return (len >= (int) lit_len &&
+                strncasecmp(uri, h->literal.data, lit_len) == 0);
+    case MK_VHOST_MATCH_SUFFIX:
+        off = len - lit_len;
+        return (off >= 0 &&
+                strncasecmp(uri + off, h->literal.data, lit_len) == 0);
+    case MK_VHOST_MATCH_CONTAINS:
+        return (mk_string_search_n(uri, h->literal.data,
+                                   MK_STR_INSENSITIVE, len) >= 0);
+    }
+
+    return (regexec(h->match, uri, 0, NULL, 0) == 0);
+}
+
+static void vhost_routes_free(struct mk_vhost_routes *r)
+{
+    if (!r) {
+        return;
+    }
+
+    mk_mem_free(r->table);
+    mk_mem_free(r->entries);
+    mk_mem_free(r->prefix_lens);
+    mk_mem_free(r->suffix_lens);
+    mk_mem_free(r->scan);
+    mk_mem_free(r);
+}
+
+static inline
+struct mk_vhost_handler *vhost_routes_find(struct mk_vhost_routes *r, int type,
+                                           char *str, int len)
+{
+    unsigned int hash;
+    struct mk_vhost_route_entry *e;
+
+    hash = vhost_name_hash(str, len);
+    for (e = r->table[hash & r->mask]; e; e = e->next) {
+        if (e->type == type && e->hash == hash &&
+            e->handler->literal.len == (unsigned long) len &&
+            strncasecmp(e->handler->literal.data, str, len) == 0) {
+            return e->handler;
+        }
+    }
+
+    return NULL;
+}
+
+static inline void vhost_routes_add_len(int *lens, int *n, int len)
+{
+    int i;
+
+    for (i = 0; i < *n; i++) {
+        if (lens[i] == len) {
+            return;
+        }
+    }
+    lens[(*n)++] = len;
+}
+
+/* Build the routing table for the handlers of a virtual host */
+static struct mk_vhost_routes *vhost_routes_create(struct mk_vhost *host,
+                                                   int n_handlers)
+{
+    int n = 0;
+    unsigned int id;
+    unsigned int size = 8;
+    struct mk_list *head;
+    struct mk_vhost_handler *h;
+    struct mk_vhost_routes *r;
+    struct mk_vhost_route_entry *e;
+
+    while (size < (unsigned int) n_handlers * 2) {
+        size <<= 1;
+    }
+
+    r = mk_mem_alloc_z(sizeof(struct mk_vhost_routes));
+    if (!r) {
+        return NULL;
+    }
+    r->mask        = size - 1;
+    r->table       = mk_mem_alloc_z(sizeof(struct mk_vhost_route_entry *) * size);
+    r->entries     = mk_mem_alloc_z(sizeof(struct mk_vhost_route_entry) * n_handlers);
+    r->prefix_lens = mk_mem_alloc_z(sizeof(int) * n_handlers);
+    r->suffix_lens = mk_mem_alloc_z(sizeof(int) * n_handlers);
+    r->scan        = mk_mem_alloc_z(sizeof(struct mk_vhost_handler *) * n_handlers);
+    if (!r->table || !r->entries || !r->prefix_lens ||
+        !r->suffix_lens || !r->scan) {
+        vhost_routes_free(r);
+        return NULL;
+    }
+
+    mk_list_foreach(head, &host->handlers) {
+        h = mk_list_entry(head, struct mk_vhost_handler, _head);
+
+        if (h->match_type == MK_VHOST_MATCH_REGEX ||
+            h->match_type == MK_VHOST_MATCH_CONTAINS) {
+            r->scan[r->n_scan++] = h;
+            continue;
+        }
+
+        /* The first handler defined for a rule wins */
+        if (vhost_routes_find(r, h->match_type,
+                              h->literal.data, h->literal.len)) {
+            continue;
+        }
+
+        e = &r->entries[n++];
+        e->type    = h->match_type;
+        e->hash    = vhost_name_hash(h->literal.data, h->literal.len);
+        e->handler = h;
+        id = e->hash & r->mask;
+        e->next = r->table[id];
+        r->table[id] = e;
+
+        if (h->match_type == MK_VHOST_MATCH_PREFIX) {
+            vhost_routes_add_len(r->prefix_lens, &r->n_prefix_lens,
+                                 h->literal.len);
+        }
+        else if (h->match_type == MK_VHOST_MATCH_SUFFIX) {
+            vhost_routes_add_len(r->suffix_lens, &r->n_suffix_lens,
+                                 h->literal.len);
+        }
+    }
+
+    return r;
+}
+
+#define vhost_route_min(a, b)  ((!a || (b && b->index < a->index)) ? b : a)
+
+/* Lookup the first handler (configuration order) matching the URI */
+static struct mk_vhost_handler *vhost_routes_lookup(struct mk_vhost_routes *r,
+                                                    char *uri, int len)
+{
+    int i;
+    int l;
+    struct mk_vhost_handler *h;
+    struct mk_vhost_handler *best;
+
+    best = vhost_routes_find(r, MK_VHOST_MATCH_EXACT, uri, len);
+
+    for (i = 0; i < r->n_prefix_lens; i++) {
+        l = r->prefix_lens[i];
+        if (l <= len) {
+            h = vhost_routes_find(r, MK_VHOST_MATCH_PREFIX, uri, l);
+            best = vhost_route_min(best, h);
+        }
+    }
+
+    for (i = 0; i < r->n_suffix_lens; i++) {
+        l = r->suffix_lens[i];
+        if (l <= len) {
+            h = vhost_routes_find(r, MK_VHOST_MATCH_SUFFIX, uri + len - l, l);
+            best = vhost_route_min(best, h);
+        }
+    }
+
+    /* Only rules defined before the best literal match are worth a try */
+    for (i = 0; i < r->n_scan; i++) {
+        h = r->scan[i];
+        if (best && h->index > best->index) {
+            break;
+        }
+        if (vhost_rule_match(h, uri, len)) {
+            return h;
+        }
+    }
+
+    return best;
+}
+
+/* Routing tables generation, per worker caches are reset when it changes */
+static unsigned int mk_vhost_routes_generation = 0;
+
+int mk_vhost_route_worker_init()
+{
+    struct mk_vhost_route_cache *cache;
+
+    cache = mk_mem_alloc_z(sizeof(struct mk_vhost_route_cache));
+    if (!cache) {
+        return -1;
+    }
+    cache->generation = __atomic_load_n(&mk_vhost_routes_generation,
+                                        __ATOMIC_ACQUIRE);
+    MK_TLS_SET(mk_tls_vhost_route_cache, cache);
+    return 0;
+}
+
+int mk_vhost_route_worker_exit()
+{
+    mk_mem_free(MK_TLS_GET(mk_tls_vhost_route_cache));
+    MK_TLS_SET(mk_tls_vhost_route_cache, NULL);
+    return 0;
+}
+
+/*
+ * Return the handler that must process the URI. If 'prev' is set, the
+ * lookup continues after that handler (e.g: it returned NOT_ME), so it
+ * walks the rules in order; otherwise the decision is taken from the
+ * per worker cache or the routing table.
+ */
+struct mk_vhost_handler *mk_vhost_handler_find(struct mk_vhost *host,
+                                               char *uri, int len,
+                                               struct mk_vhost_handler *prev)
+{
+    int i;
+    unsigned int hash;
+    unsigned int generation;
+    struct mk_list *head;
+    struct mk_vhost_handler *h;
+    struct mk_vhost_route_cache *cache;
+    struct mk_vhost_route_cache_entry *set;
+    struct mk_vhost_route_cache_entry *e;
+    struct mk_vhost_route_cache_entry *victim;
+
+    if (mk_list_is_empty(&host->handlers) == 0) {
+        return NULL;
+    }
+
+    if (prev || !host->routes) {
+        head = prev ? prev->_head.next : host->handlers.next;
+        for (; head != &host->handlers; head = head->next) {
+            h = mk_list_entry(head, struct mk_vhost_handler, _head);
+            if (vhost_rule_match(h, uri, len)) {
+                return h;
+            }
+        }
+        return NULL;
+    }
+
+    cache = MK_TLS_GET(mk_tls_vhost_route_cache);
+    if (!cache || len >= MK_VHOST_ROUTE_CACHE_URI) {
+        return vhost_routes_lookup(host->routes, uri, len);
+    }
+
+    generation = __atomic_load_n(&mk_vhost_routes_generation, __ATOMIC_ACQUIRE);
+    if (mk_unlikely(cache->generation != generation)) {
+        memset(cache->entries, '\0', sizeof(cache->entries));
+        cache->generation = generation;
+    }
+
+    hash = mk_utils_gen_hash(uri, len);
+    set  = &cache->entries[(hash & (MK_VHOST_ROUTE_CACHE_SETS - 1)) *
+                           MK_VHOST_ROUTE_CACHE_WAYS];
+    victim = set;
+    cache->tick++;
+
+    for (i = 0; i < MK_VHOST_ROUTE_CACHE_WAYS; i++) {
+        e = &set[i];
+        if (e->host == host && e->hash == hash && e->len == len &&
+            memcmp(e->uri, uri, len) == 0) {
+            e->tick = cache->tick;
+            return e->handler;
+        }
+        if (e->tick < victim->tick) {
+            victim = e;
+        }
+    }
+
+    /* Miss: evict the least recently used entry of the set */
+    h = vhost_routes_lookup(host->routes, uri, len);
+    victim->host    = host;
+    victim->handler = h;
+    victim->hash    = hash;
+    victim->len     = len;
+    victim->tick    = cache->tick;
+    memcpy(victim->uri, uri, len);
+
+    return h;
+}
+
 int mk_vhost_map_handlers(struct mk_server *server)
 {
     int n = 0;
+    int index;
     struct mk_list *head;
     struct mk_list *head_handler;
     struct mk_vhost *host;
@@ -571,10 +1002,23 @@ int mk_vhost_map_handlers(struct mk_server *server)
 
     mk_list_foreach(head, &server->hosts) {
         host = mk_list_entry(head, struct mk_vhost, _head);
+        index = 0;
         mk_list_foreach(head_handler, &host->handlers) {
             h_handler = mk_list_entry(head_handler,
                                       struct mk_vhost_handler, _head);
 
+            /* Compile the match rule */
+            if (h_handler->literal.data) {
+                mk_mem_free(h_handler->literal.data);
+            }
+            h_handler->index = index++;
+            vhost_rule_compile(h_handler);
+
+            /* Library mode handlers are callbacks, not plugins */
+            if (h_handler->cb) {
+                continue;
+            }
+
             /* Lookup plugin by name */
             p = mk_plugin_lookup(h_handler->name, server);
             if (!p) {
@@ -590,8 +1034,18 @@ int mk_vhost_map_handlers(struct mk_server *server)
             h_handler->handler = p;
             n++;
         }
+
+        /* Routing table for this host */
+        vhost_routes_free(host->routes);
+        host->routes = NULL;
+        if (index > 0) {
+            host->routes = vhost_routes_create(host, index);
+        }
     }
 
+    /* Invalidate the per worker routing caches */
+    __atomic_add_fetch(&mk_vhost_routes_generation, 1, __ATOMIC_RELEASE);
+
     return n;
 }
 
@@ -609,6 +1063,7 @@ void mk_vhost_set_single(char *path, struct mk_server *server)
     /* Prepare the unique alias */
     halias = mk_mem_alloc_z(sizeof(struct mk_vhost_alias));
     halias->name = mk_string_dup("127.0.0.1");
+    halias->len  = strlen(halias->name);
     mk_list_add(&halias->_head, &host->server_names);
 
     host->documentroot.data = mk_string_dup(path);
@@ -624,8 +1079,11 @@ void mk_vhost_set_single(char *path, struct mk_server *server)
         mk_err("DocumentRoot variable in %s has an invalid directory path", path);
         exit(EXIT_FAILURE);
     }
+    host->id = 0;
     mk_list_add(&host->_head, &server->hosts);
     mk_list_init(&host->handlers);
+
+    mk_vhost_table_build(server);
 }
 
 /* Given a configuration directory, start reading the virtual host entries */
@@ -661,6 +1119,7 @@ void mk_vhost_init(char *path, struct mk_server *server)
     if (!p_host) {
         mk_err("Error parsing main configuration file 'default'");
     }
+    p_host->id = server->nhosts;
     mk_list_add(&p_host->_head, &server->hosts);
     server->nhosts++;
     mk_mem_free(buf);
@@ -697,38 +1156,213 @@ void mk_vhost_init(char *path, struct mk_server *server)
             continue;
         }
         else {
+            p_host->id = server->nhosts;
             mk_list_add(&p_host->_head, &server->hosts);
             server->nhosts++;
         }
     }
     closedir(dir);
     mk_mem_free(sites);
+
+    /* Index server names for lookups */
+    if (mk_vhost_table_build(server) != 0) {
+        mk_err("[vhost] could not build the virtual hosts lookup table");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static inline
+struct mk_vhost_hash_entry *vhost_table_find(struct mk_vhost_hash_entry *e,
+                                             unsigned int hash,
+                                             const char *name, unsigned int len)
+{
+    while (e) {
+        if (e->hash == hash && e->len == len &&
+            strncasecmp(e->name, name, len) == 0) {
+            return e;
+        }
+        e = e->next;
+    }
+
+    return NULL;
+}
+
+static void vhost_table_free(struct mk_vhost_table *table)
+{
+    struct mk_vhost_table *prev;
+
+    while (table) {
+        prev = table->retired;
+        mk_mem_free(table->exact);
+        mk_mem_free(table->wildcard);
+        mk_mem_free(table->entries);
+        mk_mem_free(table);
+        table = prev;
+    }
 }
 
+/*
+ * Build the hash index for every server name registered in the virtual
+ * hosts list. The new table is published with release semantics so it
+ * can be swapped while workers perform lookups; the previous table is
+ * kept around (retired) until mk_vhost_free_all().
+ */
+int mk_vhost_table_build(struct mk_server *server)
+{
+    int n = 0;
+    int i = 0;
+    unsigned int id;
+    unsigned int len;
+    unsigned int hash;
+    unsigned int size = 16;
+    char *name;
+    struct mk_list *head;
+    struct mk_list *head_alias;
+    struct mk_vhost *host;
+    struct mk_vhost_alias *alias;
+    struct mk_vhost_table *table;
+    struct mk_vhost_hash_entry *e;
+    struct mk_vhost_hash_entry **bucket;
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        n += mk_list_size(&host->server_names);
+    }
+
+    /* Keep the load factor under 0.5 */
+    while (size < (unsigned int) n * 2) {
+        size <<= 1;
+    }
+
+    table = mk_mem_alloc_z(sizeof(struct mk_vhost_table));
+    if (!table) {
+        return -1;
+    }
+    table->mask     = size - 1;
+    table->exact    = mk_mem_alloc_z(sizeof(struct mk_vhost_hash_entry *) * size);
+    table->wildcard = mk_mem_alloc_z(sizeof(struct mk_vhost_hash_entry *) * size);
+    table->entries  = mk_mem_alloc_z(sizeof(struct mk_vhost_hash_entry) *
+                                     (n > 0 ? n : 1));
+    if (!table->exact || !table->wildcard || !table->entries) {
+        vhost_table_free(table);
+        return -1;
+    }
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        mk_list_foreach(head_alias, &host->server_names) {
+            alias = mk_list_entry(head_alias, struct mk_vhost_alias, _head);
+            if (!alias->name) {
+                continue;
+            }
+
+            name = alias->name;
+            len  = alias->len > 0 ? alias->len : strlen(name);
+
+            /* Wildcard '*.example.com' is indexed by '.example.com' */
+            if (len > 2 && name[0] == '*' && name[1] == '.') {
+                name++;
+                len--;
+                bucket = table->wildcard;
+            }
+            else {
+                bucket = table->exact;
+            }
+
+            hash = vhost_name_hash(name, len);
+            id   = hash & table->mask;
+
+            /* Keep the old behavior: first definition wins */
+            if (vhost_table_find(bucket[id], hash, name, len)) {
+                continue;
+            }
+
+            e = &table->entries[i++];
+            e->hash  = hash;
+            e->len   = len;
+            e->name  = name;
+            e->host  = host;
+            e->alias = alias;
+            e->next  = bucket[id];
+            bucket[id] = e;
+
+            if (bucket == table->wildcard) {
+                table->n_wildcards++;
+            }
+        }
+    }
+
+    table->retired = __atomic_load_n(&server->vhost_table, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&server->vhost_table, table, __ATOMIC_RELEASE);
+
+    MK_TRACE("[vhost] lookup table: %i names, %u buckets, %i wildcards",
+             i, size, table->n_wildcards);
+    return 0;
+}
 
 /* Lookup a registered virtual host based on the given 'host' input */
 int mk_vhost_get(mk_ptr_t host, struct mk_vhost **vhost,
                  struct mk_vhost_alias **alias,
                  struct mk_server *server)
 {
-    struct mk_vhost *entry_host;
-    struct mk_vhost_alias *entry_alias;
-    struct mk_list *head_vhost, *head_alias;
-
-    mk_list_foreach(head_vhost, &server->hosts) {
-        entry_host = mk_list_entry(head_vhost, struct mk_vhost, _head);
-        mk_list_foreach(head_alias, &entry_host->server_names) {
-            entry_alias = mk_list_entry(head_alias, struct mk_vhost_alias, _head);
-            if (entry_alias->len == host.len &&
-                strncmp(entry_alias->name, host.data, host.len) == 0) {
-                *vhost = entry_host;
-                *alias = entry_alias;
-                return 0;
+    unsigned int i;
+    unsigned int len;
+    unsigned int hash;
+    char *p;
+    struct mk_vhost_table *table;
+    struct mk_vhost_hash_entry *e;
+
+    table = __atomic_load_n(&server->vhost_table, __ATOMIC_ACQUIRE);
+    if (mk_unlikely(!table || !host.data)) {
+        return -1;
+    }
+
+    /* Strip the port, if any: 'host:port' or '[ipv6]:port' */
+    len = host.len;
+    if (len > 0 && host.data[0] == '[') {
+        p = memchr(host.data, ']', len);
+        if (p) {
+            len = (p - host.data) + 1;
+        }
+    }
+    else {
+        p = memchr(host.data, ':', len);
+        if (p) {
+            len = (p - host.data);
+        }
+    }
+
+    hash = vhost_name_hash(host.data, len);
+    e = vhost_table_find(table->exact[hash & table->mask],
+                         hash, host.data, len);
+
+    /*
+     * Wildcard lookup: try every suffix starting at a dot, the longest
+     * one first, so 'a.b.example.com' prefers '*.b.example.com' over
+     * '*.example.com'.
+     */
+    if (!e && table->n_wildcards > 0) {
+        for (i = 1; i < len; i++) {
+            if (host.data[i] != '.') {
+                continue;
+            }
+            hash = vhost_name_hash(host.data + i, len - i);
+            e = vhost_table_find(table->wildcard[hash & table->mask],
+                                 hash, host.data + i, len - i);
+            if (e) {
+                break;
             }
         }
     }
 
-    return -1;
+    if (!e) {
+        return -1;
+    }
+
+    *vhost = e->host;
+    *alias = e->alias;
+    return 0;
 }
 
 static void mk_vhost_handler_free(struct mk_vhost_handler *h)
@@ -747,6 +1381,8 @@ static void mk_vhost_handler_free(struct mk_vhost_handler *h)
 
     regfree(h->match);
     mk_mem_free(h->match);
+    mk_mem_free(h->rule);
+    mk_mem_free(h->literal.data);
     mk_mem_free(h->name);
     mk_mem_free(h);
 }
@@ -778,6 +1414,7 @@ void mk_vhost_free_all(struct mk_server *server)
             host_handler = mk_list_entry(head2, struct mk_vhost_handler, _head);
             mk_vhost_handler_free(host_handler);
         }
+        vhost_routes_free(host->routes);
 
         /* Free error pages */
         mk_list_foreach_safe(head2, tmp2, &host->error_pages) {
@@ -798,4 +1435,7 @@ void mk_vhost_free_all(struct mk_server *server)
         mk_mem_free(host->file);
         mk_mem_free(host);
     }
+
+    vhost_table_free(server->vhost_table);
+    server->vhost_table = NULL;
 }
@@ -24,6 +24,9 @@
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_mimetype.h>
+#include <monkey/mk_prefetch.h>
+#include <monkey/mk_resolver.h>
+#include <monkey/mk_metrics.h>
 
 void mk_server_info(struct mk_server *server)
 {
@@ -133,9 +136,6 @@ struct mk_server *mk_server_create()
 
 int mk_server_setup(struct mk_server *server)
 {
-    int ret;
-    pthread_t tid;
-
     /* Core and Scheduler setup */
     mk_config_start_configure(server);
     mk_config_signature(server);
@@ -146,15 +146,9 @@ int mk_server_setup(struct mk_server *server)
     mk_clock_sequential_init(server);
 
     /* Load plugins */
-    mk_plugin_api_init();
+    mk_plugin_api_init(server);
     mk_plugin_load_all(server);
 
-    /* Workers: logger and clock */
-    ret = mk_utils_worker_spawn((void *) mk_clock_worker_init, server, &tid);
-    if (ret != 0) {
-        return -1;
-    }
-
     /* Init thread keys */
     mk_thread_keys_init();
 
@@ -164,6 +158,17 @@ int mk_server_setup(struct mk_server *server)
     /* Invoke Plugin PRCTX hooks */
     mk_plugin_core_process(server);
 
+#ifdef MK_HAVE_PREADV2_NOWAIT
+    /* I/O helpers for static files prefetch */
+    mk_prefetch_init(server);
+#endif
+
+    /* Host names resolver for outbound connections */
+    mk_resolver_init(server);
+
+    /* Workers histograms and counters */
+    mk_metrics_init(server);
+
     /* Launch monkey http workers */
     MK_TLS_INIT();
     mk_server_launch_workers(server);
@@ -190,6 +195,12 @@ void mk_exit_all(struct mk_server *server)
     /* Wait for all workers to finish */
     mk_sched_workers_join(server);
 
+#ifdef MK_HAVE_PREADV2_NOWAIT
+    mk_prefetch_exit();
+#endif
+    mk_resolver_exit();
+    mk_metrics_exit();
+
     /* Continue exiting */
     mk_plugin_exit_all(server);
     mk_clock_exit();
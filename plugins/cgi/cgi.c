@@ -33,6 +33,10 @@ void cgi_finish(struct cgi_request *r)
      * thread event loop, otherwise we may get unexpected notifications.
      */
     mk_api->ev_del(mk_api->sched_loop(), (struct mk_event *) r);
+    if (r->splicing) {
+        mk_stream_input_unlink(&r->splice_in);
+        r->splicing = MK_FALSE;
+    }
     close(r->fd);
     if (r->chunked && r->active == MK_TRUE) {
         PLUGIN_TRACE("CGI sending Chunked EOF");
@@ -99,6 +103,72 @@ static void cgi_write_post(void *p)
     close(in->fd);
 }
 
+/*
+ * Runs in the child process: stdin and stdout are the given pipes, stderr
+ * goes to /dev/null. It does not return.
+ */
+void cgi_exec(int fd_in, int fd_out, const char *file,
+              char *interpreter, char **env)
+{
+    int devnull;
+    sigset_t mask;
+    char *argv[3] = { NULL };
+
+    /* Our stdin is the read end of monkey's writing */
+    if (dup2(fd_in, 0) < 0) {
+        mk_err("dup2 failed");
+        _exit(1);
+    }
+    close(fd_in);
+
+    /* Our stdout is the write end of monkey's reading */
+    if (dup2(fd_out, 1) < 0) {
+        mk_err("dup2 failed");
+        _exit(1);
+    }
+    close(fd_out);
+
+    /* Our stderr goes to /dev/null */
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull == -1) {
+        perror("open");
+        _exit(1);
+    }
+
+    if (dup2(devnull, 2) < 0) {
+        mk_err("dup2 failed");
+        _exit(1);
+    }
+    close(devnull);
+
+    char *tmp = mk_api->str_dup(file);
+    if (chdir(dirname(tmp)))
+        _exit(1);
+
+    char *tmp2 = mk_api->str_dup(file);
+    argv[0] = basename(tmp2);
+
+    /* Restore signals for the child */
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    if (!interpreter) {
+        execve(file, argv, env);
+    }
+    else {
+        argv[0] = basename(interpreter);
+        argv[1] = (char *) file;
+        execve(interpreter, argv, env);
+    }
+    /* Exec failed, return */
+    _exit(1);
+}
+
 static int do_cgi(const char *const __restrict__ file,
                   const char *const __restrict__ url,
                   struct mk_http_request *sr,
@@ -108,7 +178,6 @@ static int do_cgi(const char *const __restrict__ file,
                   char *mimetype)
 {
     int ret;
-    int devnull;
     const int socket = cs->socket;
     struct file_info finfo;
     struct cgi_request *r = NULL;
@@ -135,7 +204,7 @@ static int do_cgi(const char *const __restrict__ file,
     char script_name[PATHLEN];
     char query_string[PATHLEN];
     char remote_addr[INET6_ADDRSTRLEN+SHORTLEN];
-    char tmpaddr[INET6_ADDRSTRLEN], *ptr = tmpaddr;
+    char tmpaddr[INET6_ADDRSTRLEN];
     char remote_port[SHORTLEN];
     char content_length[SHORTLEN];
     char content_type[SHORTLEN];
@@ -198,12 +267,15 @@ static int do_cgi(const char *const __restrict__ file,
         mk_api->mem_free(query);
     }
 
-    if (mk_api->socket_ip_str(socket, &ptr, INET6_ADDRSTRLEN, &len) < 0)
+    if (!cs->conn ||
+        mk_api->socket_addr_str(&cs->conn->peer, tmpaddr,
+                                INET6_ADDRSTRLEN, &len) < 0)
         tmpaddr[0] = '\0';
     snprintf(remote_addr, INET6_ADDRSTRLEN+SHORTLEN, "REMOTE_ADDR=%s", tmpaddr);
     env[envpos++] = remote_addr;
 
-    snprintf(remote_port, SHORTLEN, "REMOTE_PORT=%ld", sr->port);
+    snprintf(remote_port, SHORTLEN, "REMOTE_PORT=%d",
+             cs->conn ? mk_api->socket_addr_port(&cs->conn->peer) : -1);
     env[envpos++] = remote_port;
 
     if (sr->data.len) {
@@ -226,67 +298,32 @@ static int do_cgi(const char *const __restrict__ file,
         return 403;
     }
 
-    pid_t pid = vfork();
-    if (pid < 0) {
-        mk_err("Failed to fork");
-        return 403;
-    }
+    pid_t pid = 0;
+    uint32_t spawn_id = 0;
 
-    /* Child */
-    if (pid == 0) {
+    /* Launch it through the spawner if there is one */
+    ret = cgi_spawn_request(file, interpreter, env,
+                            writepipe[0], readpipe[1], &spawn_id);
+    if (ret == CGI_SPAWN_FULL) {
+        close(writepipe[0]);
         close(writepipe[1]);
         close(readpipe[0]);
-
-        /* Our stdin is the read end of monkey's writing */
-        if (dup2(writepipe[0], 0) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(writepipe[0]);
-
-        /* Our stdout is the write end of monkey's reading */
-        if (dup2(readpipe[1], 1) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
         close(readpipe[1]);
-
-        /* Our stderr goes to /dev/null */
-        devnull = open("/dev/null", O_WRONLY);
-        if (devnull == -1) {
-            perror("open");
-            _exit(1);
-        }
-
-        if (dup2(devnull, 2) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
+        return MK_SERVER_SERVICE_UNAV;
+    }
+    else if (ret == CGI_SPAWN_UNAVAILABLE) {
+        pid = vfork();
+        if (pid < 0) {
+            mk_err("Failed to fork");
+            return 403;
         }
-        close(devnull);
-
-        char *argv[3] = { NULL };
-
-        char *tmp = mk_api->str_dup(file);
-        if (chdir(dirname(tmp)))
-            _exit(1);
 
-        char *tmp2 = mk_api->str_dup(file);
-        argv[0] = basename(tmp2);
-
-        /* Restore signals for the child */
-        signal(SIGPIPE, SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
-
-        if (!interpreter) {
-            execve(file, argv, env);
-        }
-        else {
-            argv[0] = basename(interpreter);
-            argv[1] = (char *) file;
-            execve(interpreter, argv, env);
+        /* Child */
+        if (pid == 0) {
+            close(writepipe[1]);
+            close(readpipe[0]);
+            cgi_exec(writepipe[0], readpipe[1], file, interpreter, env);
         }
-        /* Exec failed, return */
-        _exit(1);
     }
 
     /* Yay me */
@@ -316,6 +353,7 @@ static int do_cgi(const char *const __restrict__ file,
         return 403;
     }
     r->child = pid;
+    r->spawn_id = spawn_id;
 
     /*
      * Hang up?: by default Monkey assumes the CGI scripts generate
@@ -364,7 +402,6 @@ static int do_cgi(const char *const __restrict__ file,
 int mk_cgi_plugin_init(struct plugin_api **api, char *confdir)
 {
     struct rlimit lim;
-    (void) confdir;
 
     mk_api = *api;
     mk_list_init(&cgi_global_matches);
@@ -382,11 +419,19 @@ int mk_cgi_plugin_init(struct plugin_api **api, char *confdir)
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, SIG_IGN);
 
+    /* Scripts launcher, optional */
+    if (cgi_spawn_config(confdir) == 0 && cgi_spawn_conf.enabled == MK_TRUE) {
+        if (cgi_spawn_start() == -1) {
+            mk_warn("[cgi] could not start the spawner, forking per request");
+        }
+    }
+
     return 0;
 }
 
 int mk_cgi_plugin_exit()
 {
+    cgi_spawn_exit();
     regfree(&match_regex);
     mk_api->mem_free(requests_by_socket);
 
@@ -472,6 +517,10 @@ void mk_cgi_worker_init()
 
     mk_list_init(list);
     pthread_setspecific(cgi_request_list, (void *) list);
+
+    if (cgi_spawn_worker_init() == -1) {
+        mk_warn("[cgi] could not reach the spawner, forking per request");
+    }
 }
 
 
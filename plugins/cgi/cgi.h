@@ -80,9 +80,15 @@ struct cgi_request {
     int   hangup;       /* Should close connection when done ? */
     int   active;       /* Active session ?  */
     pid_t child;        /* child process ID  */
+    uint32_t spawn_id;  /* spawner reply pending ? */
+    unsigned char eof;  /* output ended before the reply */
+    unsigned char splicing;  /* body queued on the channel ? */
     unsigned char status_done;
     unsigned char all_headers_done;
     unsigned char chunked;
+
+    /* Response body moved from the pipe to the client by splice(2) */
+    struct mk_stream_input splice_in;
 };
 
 /* Global list per worker */
@@ -94,6 +100,8 @@ void cgi_finish(struct cgi_request *r);
 
 int swrite(const int fd, const void *buf, const size_t count);
 int channel_write(struct cgi_request *r, void *buf, size_t count);
+void cgi_exec(int fd_in, int fd_out, const char *file,
+              char *interpreter, char **env);
 
 struct cgi_request *cgi_req_create(int fd, int socket,
                                    struct mk_plugin *plugin,
@@ -128,6 +136,81 @@ static inline struct cgi_request *cgi_req_get_by_fd(int fd)
     return NULL;
 }
 
+// Get the CGI request waiting for the spawner reply 'id'
+static inline struct cgi_request *cgi_req_get_by_spawn(uint32_t id)
+{
+    struct mk_list *list, *node;
+    struct cgi_request *r;
+
+    list = pthread_getspecific(cgi_request_list);
+    mk_list_foreach(node, list) {
+        r = mk_list_entry(node, struct cgi_request, _head);
+        if (r->spawn_id == id)
+            return r;
+    }
+
+    return NULL;
+}
+
 int cb_cgi_read(void *data);
 
+/*
+ * Spawner
+ * -------
+ * Scripts are launched by a small helper process forked when the plugin
+ * starts, so the workers don't fork the whole server for every request.
+ * It bounds the number of scripts running and queues the requests over it.
+ */
+#define CGI_SPAWN_MSG_MAX      16384
+#define CGI_SPAWN_CHANNELS     256    /* workers                        */
+#define CGI_SPAWN_QUEUE_MAX    1024
+
+/* cgi_spawn_request() return values */
+#define CGI_SPAWN_QUEUED       0
+#define CGI_SPAWN_FULL         1
+#define CGI_SPAWN_UNAVAILABLE  -1
+
+struct cgi_spawn_conf {
+    int enabled;
+    int max_procs;              /* scripts running, 0 is no limit   */
+    int queue_timeout;          /* seconds waiting for a slot       */
+};
+
+/* Worker -> spawner, followed by the strings, the pipes go along */
+struct cgi_spawn_req {
+    uint32_t id;
+    uint16_t n_env;
+    uint16_t interpreter;
+};
+
+/* Spawner -> worker, pid is -1 if the script could not be started */
+struct cgi_spawn_reply {
+    uint32_t id;
+    int32_t  pid;
+};
+
+struct cgi_spawn_stats {
+    uint64_t requests;
+    uint64_t spawned;
+    uint64_t queued;            /* waited for a slot                */
+    uint64_t timeouts;
+    uint64_t rejected;
+};
+
+/* Per worker channel to the spawner, the event must be the first field */
+struct cgi_spawn_worker {
+    struct mk_event event;
+    int fd;
+    uint32_t next_id;
+};
+
+extern struct cgi_spawn_conf cgi_spawn_conf;
+
+int cgi_spawn_config(char *confdir);
+int cgi_spawn_start();
+int cgi_spawn_worker_init();
+int cgi_spawn_request(const char *file, char *interpreter, char **env,
+                      int fd_in, int fd_out, uint32_t *id);
+void cgi_spawn_exit();
+
 #endif
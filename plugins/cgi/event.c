@@ -20,6 +20,8 @@
 
 #include "cgi.h"
 
+#include <sys/ioctl.h>
+
 /*
  * The reason for this function is that some CGI apps
  *
@@ -142,6 +144,79 @@ int process_cgi_data(struct cgi_request *r)
     return MK_PLUGIN_RET_EVENT_OWNED;
 }
 
+/* The pipe returned end of file or an error */
+static int cgi_read_end(struct cgi_request *r, int n)
+{
+    /* The spawner did not tell the child process ID yet, wait for it */
+    if (n == 0 && r->spawn_id != 0) {
+        mk_api->ev_del(mk_api->sched_loop(), (struct mk_event *) r);
+        r->eof = 1;
+        return 0;
+    }
+
+    /* It most of cases this means the child process finished */
+    cgi_finish(r);
+    return MK_PLUGIN_RET_EVENT_CLOSE;
+}
+
+#ifdef MK_HAVE_SPLICE
+/* The spliced body left the pipe, wait for more output */
+static void cb_cgi_splice_done(struct mk_stream_input *in)
+{
+    struct cgi_request *r = in->context;
+
+    r->splicing = MK_FALSE;
+    mk_api->ev_add(mk_api->sched_loop(), r->fd,
+                   MK_EVENT_CUSTOM, MK_EVENT_READ, r);
+}
+
+/*
+ * Once the headers are done the body is not read: what the pipe holds is
+ * queued on the channel as a pipe input and spliced to the socket. The
+ * pipe leaves the event loop until the channel consumed it, a slow client
+ * makes the script block on a full pipe instead of growing our buffers.
+ */
+static int cgi_splice(struct cgi_request *r)
+{
+    int ret;
+    int len;
+    int avail;
+    char tmp[16];
+    struct mk_stream *stream = &r->sr->stream;
+
+    if (ioctl(r->fd, FIONREAD, &avail) == -1) {
+        return -1;
+    }
+    else if (avail == 0) {
+        return 0;
+    }
+
+    if (r->chunked) {
+        len = snprintf(tmp, sizeof(tmp), "%x\r\n", avail);
+        mk_stream_in_cbuf(stream, NULL, tmp, len, NULL, NULL);
+    }
+
+    mk_stream_in_pipe(stream, &r->splice_in, r->fd, avail,
+                      NULL, cb_cgi_splice_done);
+    r->splice_in.context = r;
+    r->splicing = MK_TRUE;
+
+    if (r->chunked) {
+        mk_stream_in_raw(stream, NULL, MK_CRLF, 2, NULL, NULL);
+    }
+
+    mk_api->ev_del(mk_api->sched_loop(), (struct mk_event *) r);
+    ret = mk_api->channel_flush(r->sr->session->channel);
+    if (ret & MK_CHANNEL_ERROR) {
+        r->active = MK_FALSE;
+        cgi_finish(r);
+        return -1;
+    }
+
+    return avail;
+}
+#endif
+
 int cb_cgi_read(void *data)
 {
     int n;
@@ -151,6 +226,21 @@ int cb_cgi_read(void *data)
         return -1;
     }
 
+#ifdef MK_HAVE_SPLICE
+    if (r->all_headers_done &&
+        mk_channel_can_splice(r->sr->session->channel)) {
+        n = cgi_splice(r);
+        PLUGIN_TRACE("FD=%i CGI SPLICE=%d", r->fd, n);
+        if (n > 0) {
+            return 0;
+        }
+        else if (n == -1 && r->active == MK_FALSE) {
+            return MK_PLUGIN_RET_EVENT_CLOSE;
+        }
+        return cgi_read_end(r, n);
+    }
+#endif
+
     if ((BUFLEN - r->in_len) < 1) {
         PLUGIN_TRACE("CLOSE BY SIZE");
         cgi_finish(r);
@@ -160,9 +250,7 @@ int cb_cgi_read(void *data)
     n = read(r->fd, r->in_buf + r->in_len, BUFLEN - r->in_len);
     PLUGIN_TRACE("FD=%i CGI READ=%d", r->fd, n);
     if (n <= 0) {
-        /* It most of cases this means the child process finished */
-        cgi_finish(r);
-        return MK_PLUGIN_RET_EVENT_CLOSE;
+        return cgi_read_end(r, n);
     }
     r->in_len += n;
     process_cgi_data(r);
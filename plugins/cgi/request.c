@@ -61,12 +61,12 @@ int cgi_req_del(struct cgi_request *r)
                  r->fd, r->child);
 
     mk_list_del(&r->_head);
-    if (r->active == MK_FALSE) {
-        mk_api->sched_event_free(&r->event);
-    }
-    else {
-        mk_mem_free(r);
-    }
+
+    /*
+     * The pipe or the spawner reply may still have a notification pending
+     * in the current loop iteration, release the request once it's done.
+     */
+    mk_api->sched_event_free(&r->event);
 
     return 0;
 }
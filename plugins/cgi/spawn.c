@@ -0,0 +1,938 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cgi.h"
+
+#include <poll.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+
+/*
+ * Every worker owns a SOCK_SEQPACKET channel to the spawner, each request
+ * is a single message carrying the script, the environment and the two
+ * pipes of the request. The reply is the process ID of the script, so the
+ * worker can kill it if the client goes away.
+ *
+ * The spawner never blocks on a worker: a reply that does not fit in the
+ * channel waits in the channel queue until the worker reads the previous
+ * ones.
+ */
+
+struct cgi_spawn_conf cgi_spawn_conf;
+
+static pthread_key_t cgi_spawn_key;
+static int cgi_spawn_ctl = -1;          /* master side of the control link */
+
+/* Spawner process state */
+struct cgi_spawn_channel {
+    int fd;
+    struct mk_list replies;     /* not sent yet, the worker is busy */
+};
+
+struct cgi_spawn_pending {
+    struct cgi_spawn_reply reply;
+    struct mk_list _head;
+};
+
+struct cgi_spawn_job {
+    struct cgi_spawn_channel *channel;
+    int fds[2];
+    uint32_t id;
+    uint64_t deadline;
+    size_t len;
+    struct mk_list _head;
+    char msg[];
+};
+
+static int spawn_running;
+static int spawn_queue_len;
+static int spawn_channels_count;
+static struct cgi_spawn_channel *spawn_channels[CGI_SPAWN_CHANNELS];
+static struct mk_list spawn_queue;
+static struct cgi_spawn_stats spawn_stats;
+
+/* Numeric key, -1 when it is not set or not a number */
+static long cgi_spawn_conf_num(struct mk_rconf_section *section, char *key)
+{
+    long val;
+    char *end;
+    char *str;
+
+    str = mk_api->config_section_get_key(section, key, MK_RCONF_STR);
+    if (!str) {
+        return -1;
+    }
+
+    val = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || val < 0) {
+        val = -1;
+    }
+    mk_api->mem_free(str);
+    return val;
+}
+
+int cgi_spawn_config(char *confdir)
+{
+    char *file = NULL;
+    char *enabled;
+    long num;
+    unsigned long len;
+    struct mk_rconf *conf;
+    struct mk_rconf_section *section;
+
+    cgi_spawn_conf.enabled = MK_FALSE;
+    cgi_spawn_conf.max_procs = 64;
+    cgi_spawn_conf.queue_timeout = 5;
+
+    mk_api->str_build(&file, &len, "%scgi.conf", confdir);
+    conf = mk_api->config_open(file);
+    mk_api->mem_free(file);
+    if (!conf) {
+        return -1;
+    }
+
+    section = mk_api->config_section_get(conf, "CGI");
+    if (!section) {
+        mk_api->config_free(conf);
+        return -1;
+    }
+
+    enabled = mk_api->config_section_get_key(section, "Spawner", MK_RCONF_STR);
+    if (enabled) {
+        if (strcasecmp(enabled, "on") == 0) {
+            cgi_spawn_conf.enabled = MK_TRUE;
+        }
+        mk_api->mem_free(enabled);
+    }
+
+    num = cgi_spawn_conf_num(section, "MaxProcesses");
+    if (num >= 0) {
+        cgi_spawn_conf.max_procs = num;
+    }
+
+    num = cgi_spawn_conf_num(section, "QueueTimeout");
+    if (num > 0) {
+        cgi_spawn_conf.queue_timeout = num;
+    }
+
+    mk_api->config_free(conf);
+    return 0;
+}
+
+static inline uint64_t cgi_spawn_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Send a message, optionally with file descriptors (-1 if unused) */
+static int cgi_spawn_send(int fd, void *buf, size_t len, int fd_a, int fd_b)
+{
+    int n = 0;
+    int *fds;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+
+    memset(&msg, '\0', sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd_a != -1) {
+        n = (fd_b != -1) ? 2 : 1;
+        memset(control, '\0', sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        fds = (int *) CMSG_DATA(cmsg);
+        fds[0] = fd_a;
+        if (n == 2) {
+            fds[1] = fd_b;
+        }
+    }
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t) len) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Receive a message and up to two file descriptors, -1 if not given */
+static ssize_t cgi_spawn_recv(int fd, void *buf, size_t size, int *fds,
+                              int flags)
+{
+    int i;
+    int n;
+    ssize_t bytes;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+
+    fds[0] = fds[1] = -1;
+
+    memset(&msg, '\0', sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | flags);
+    if (bytes <= 0) {
+        return bytes;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n && i < 2; i++) {
+            fds[i] = ((int *) CMSG_DATA(cmsg))[i];
+        }
+    }
+
+    /* A truncated message is useless */
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        if (fds[0] != -1) {
+            close(fds[0]);
+        }
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return bytes;
+}
+
+/*
+ * The next functions run in the spawner process and its children.
+ */
+
+/* Close every inherited file descriptor but the standard ones and 'keep' */
+static void cgi_spawn_close_fds(int keep_a, int keep_b)
+{
+    int fd;
+    int dir_fd;
+    DIR *dir;
+    struct dirent *ent;
+
+    dir = opendir("/proc/self/fd");
+    if (!dir) {
+        return;
+    }
+
+    dir_fd = dirfd(dir);
+    while ((ent = readdir(dir)) != NULL) {
+        fd = atoi(ent->d_name);
+        if (fd > 2 && fd != dir_fd && fd != keep_a && fd != keep_b) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+/* Exec the script described by the request message */
+static void cgi_spawn_child(char *msg, size_t len, int fd_in, int fd_out)
+{
+    int i;
+    char *p;
+    char *end;
+    char *file;
+    char *interpreter = NULL;
+    char *env[64];
+    struct cgi_spawn_req req;
+
+    memcpy(&req, msg, sizeof(req));
+    p = msg + sizeof(req);
+    end = msg + len;
+
+    /* The strings must be within the message */
+    if (len == 0 || end[-1] != '\0' || req.n_env >= 64) {
+        _exit(1);
+    }
+
+    file = p;
+    p += strlen(p) + 1;
+
+    if (req.interpreter) {
+        if (p >= end) {
+            _exit(1);
+        }
+        interpreter = p;
+        p += strlen(p) + 1;
+    }
+
+    for (i = 0; i < req.n_env; i++) {
+        if (p >= end) {
+            _exit(1);
+        }
+        env[i] = p;
+        p += strlen(p) + 1;
+    }
+    env[i] = NULL;
+
+    cgi_exec(fd_in, fd_out, file, interpreter, env);
+}
+
+/* Queue the reply if the worker did not read the previous ones yet */
+static void cgi_spawn_reply(struct cgi_spawn_channel *ch,
+                            uint32_t id, pid_t pid)
+{
+    struct cgi_spawn_reply reply;
+    struct cgi_spawn_pending *pending;
+
+    reply.id = id;
+    reply.pid = pid;
+
+    if (mk_list_is_empty(&ch->replies) == 0) {
+        if (send(ch->fd, &reply, sizeof(reply),
+                 MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(reply)) {
+            return;
+        }
+        if (errno != EAGAIN) {
+            /* The worker is gone, so is the request */
+            if (pid > 0) {
+                kill(pid, SIGKILL);
+            }
+            return;
+        }
+    }
+
+    pending = mk_api->mem_alloc(sizeof(struct cgi_spawn_pending));
+    if (!pending) {
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+        }
+        return;
+    }
+    pending->reply = reply;
+    mk_list_add(&pending->_head, &ch->replies);
+}
+
+/* Send the queued replies, -1 once the worker is gone */
+static int cgi_spawn_reply_flush(struct cgi_spawn_channel *ch)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct cgi_spawn_pending *pending;
+
+    mk_list_foreach_safe(head, tmp, &ch->replies) {
+        pending = mk_list_entry(head, struct cgi_spawn_pending, _head);
+        if (send(ch->fd, &pending->reply, sizeof(pending->reply),
+                 MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(pending->reply)) {
+            return (errno == EAGAIN) ? 0 : -1;
+        }
+        mk_list_del(&pending->_head);
+        mk_api->mem_free(pending);
+    }
+
+    return 0;
+}
+
+static void cgi_spawn_job_free(struct cgi_spawn_job *job)
+{
+    close(job->fds[0]);
+    close(job->fds[1]);
+    mk_api->mem_free(job);
+}
+
+/* Start the script of the job */
+static void cgi_spawn_launch(struct cgi_spawn_job *job)
+{
+    pid_t pid;
+
+    /* The spawner descriptors are close-on-exec, vfork(2) is enough */
+    pid = vfork();
+    if (pid == 0) {
+        cgi_spawn_child(job->msg, job->len, job->fds[0], job->fds[1]);
+    }
+    else if (pid > 0) {
+        spawn_running++;
+        spawn_stats.spawned++;
+    }
+
+    cgi_spawn_reply(job->channel, job->id, pid);
+    cgi_spawn_job_free(job);
+}
+
+/* Launch queued requests while there are free slots, expire the old ones */
+static void cgi_spawn_dispatch(uint64_t now)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct cgi_spawn_job *job;
+
+    mk_list_foreach_safe(head, tmp, &spawn_queue) {
+        job = mk_list_entry(head, struct cgi_spawn_job, _head);
+        if (cgi_spawn_conf.max_procs > 0 &&
+            spawn_running >= cgi_spawn_conf.max_procs) {
+            if (job->deadline > now) {
+                break;
+            }
+            spawn_stats.timeouts++;
+            mk_list_del(&job->_head);
+            spawn_queue_len--;
+            cgi_spawn_reply(job->channel, job->id, -1);
+            cgi_spawn_job_free(job);
+            continue;
+        }
+
+        mk_list_del(&job->_head);
+        spawn_queue_len--;
+        cgi_spawn_launch(job);
+    }
+}
+
+static void cgi_spawn_reap(int sfd)
+{
+    struct signalfd_siginfo si;
+
+    while (read(sfd, &si, sizeof(si)) == sizeof(si));
+
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        spawn_running--;
+    }
+}
+
+/* A request from a worker, -1 once the worker is gone */
+static int cgi_spawn_channel_read(struct cgi_spawn_channel *ch, uint64_t now)
+{
+    int fds[2];
+    ssize_t len;
+    char msg[CGI_SPAWN_MSG_MAX];
+    struct cgi_spawn_req req;
+    struct cgi_spawn_job *job;
+
+    len = cgi_spawn_recv(ch->fd, msg, sizeof(msg), fds, MSG_DONTWAIT);
+    if (len == 0) {
+        return -1;
+    }
+    else if (len == -1) {
+        return (errno == EAGAIN || errno == EMSGSIZE) ? 0 : -1;
+    }
+
+    if (len <= (ssize_t) sizeof(req) || fds[0] == -1 || fds[1] == -1) {
+        if (fds[0] != -1) {
+            close(fds[0]);
+        }
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        return 0;
+    }
+
+    memcpy(&req, msg, sizeof(req));
+    spawn_stats.requests++;
+
+    if (spawn_queue_len >= CGI_SPAWN_QUEUE_MAX) {
+        spawn_stats.rejected++;
+        cgi_spawn_reply(ch, req.id, -1);
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    job = mk_api->mem_alloc(sizeof(struct cgi_spawn_job) + len);
+    if (!job) {
+        cgi_spawn_reply(ch, req.id, -1);
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    job->channel = ch;
+    job->fds[0] = fds[0];
+    job->fds[1] = fds[1];
+    job->id = req.id;
+    job->deadline = now + cgi_spawn_conf.queue_timeout * 1000;
+    job->len = len;
+    memcpy(job->msg, msg, len);
+
+    if (cgi_spawn_conf.max_procs > 0 &&
+        spawn_running >= cgi_spawn_conf.max_procs) {
+        spawn_stats.queued++;
+    }
+
+    mk_list_add(&job->_head, &spawn_queue);
+    spawn_queue_len++;
+    return 0;
+}
+
+static void cgi_spawn_channel_close(int i)
+{
+    struct cgi_spawn_channel *ch = spawn_channels[i];
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct cgi_spawn_job *job;
+    struct cgi_spawn_pending *pending;
+
+    mk_list_foreach_safe(head, tmp, &spawn_queue) {
+        job = mk_list_entry(head, struct cgi_spawn_job, _head);
+        if (job->channel == ch) {
+            mk_list_del(&job->_head);
+            spawn_queue_len--;
+            cgi_spawn_job_free(job);
+        }
+    }
+
+    /* Nobody is left to stop these scripts */
+    mk_list_foreach_safe(head, tmp, &ch->replies) {
+        pending = mk_list_entry(head, struct cgi_spawn_pending, _head);
+        if (pending->reply.pid > 0) {
+            kill(pending->reply.pid, SIGKILL);
+        }
+        mk_list_del(&pending->_head);
+        mk_api->mem_free(pending);
+    }
+
+    close(ch->fd);
+    mk_api->mem_free(ch);
+    spawn_channels[i] = spawn_channels[--spawn_channels_count];
+}
+
+/* Control link: workers register their channels, EOF means exit */
+static int cgi_spawn_ctl_read(int ctl)
+{
+    int fds[2];
+    char buf[8];
+    ssize_t len;
+    struct cgi_spawn_channel *ch;
+
+    len = cgi_spawn_recv(ctl, buf, sizeof(buf), fds, MSG_DONTWAIT);
+    if (len == 0) {
+        return -1;
+    }
+    else if (len == -1) {
+        return (errno == EAGAIN) ? 0 : -1;
+    }
+
+    if (fds[1] != -1) {
+        close(fds[1]);
+    }
+    if (fds[0] == -1) {
+        return 0;
+    }
+
+    if (spawn_channels_count == CGI_SPAWN_CHANNELS) {
+        close(fds[0]);
+        return 0;
+    }
+
+    ch = mk_api->mem_alloc(sizeof(struct cgi_spawn_channel));
+    if (!ch) {
+        close(fds[0]);
+        return 0;
+    }
+    ch->fd = fds[0];
+    mk_list_init(&ch->replies);
+    spawn_channels[spawn_channels_count++] = ch;
+    return 0;
+}
+
+static void cgi_spawn_main(int ctl)
+{
+    int i;
+    int n;
+    int ret;
+    int sfd;
+    int timeout;
+    uint64_t now;
+    sigset_t mask;
+    struct cgi_spawn_job *job;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct pollfd pfd[CGI_SPAWN_CHANNELS + 2];
+
+    mk_api->worker_rename("monkey: cgi");
+
+    /* Terminal signals are for the server, this one exits along with it */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd == -1) {
+        _exit(1);
+    }
+
+    cgi_spawn_close_fds(ctl, sfd);
+    mk_list_init(&spawn_queue);
+
+    while (1) {
+        timeout = -1;
+        if (spawn_queue_len > 0) {
+            job = mk_list_entry_first(&spawn_queue, struct cgi_spawn_job, _head);
+            now = cgi_spawn_clock();
+            timeout = (job->deadline > now) ? (int) (job->deadline - now) : 0;
+        }
+
+        pfd[0].fd = ctl;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = sfd;
+        pfd[1].events = POLLIN;
+        for (i = 0; i < spawn_channels_count; i++) {
+            pfd[i + 2].fd = spawn_channels[i]->fd;
+            pfd[i + 2].events = POLLIN;
+            if (mk_list_is_empty(&spawn_channels[i]->replies) != 0) {
+                pfd[i + 2].events |= POLLOUT;
+            }
+        }
+        n = spawn_channels_count + 2;
+
+        ret = poll(pfd, n, timeout);
+        if (ret == -1 && errno != EINTR) {
+            break;
+        }
+
+        now = cgi_spawn_clock();
+        if (ret > 0) {
+            if (pfd[1].revents) {
+                cgi_spawn_reap(sfd);
+            }
+
+            /* Backwards, a closed channel is replaced by the last one */
+            for (i = n - 1; i >= 2; i--) {
+                if (pfd[i].revents == 0) {
+                    continue;
+                }
+                if (cgi_spawn_reply_flush(spawn_channels[i - 2]) == -1 ||
+                    cgi_spawn_channel_read(spawn_channels[i - 2], now) == -1) {
+                    cgi_spawn_channel_close(i - 2);
+                }
+            }
+
+            if (pfd[0].revents && cgi_spawn_ctl_read(ctl) == -1) {
+                break;
+            }
+        }
+
+        cgi_spawn_dispatch(now);
+    }
+
+    mk_list_foreach_safe(head, tmp, &spawn_queue) {
+        job = mk_list_entry(head, struct cgi_spawn_job, _head);
+        mk_list_del(&job->_head);
+        cgi_spawn_job_free(job);
+    }
+
+    ret = write(ctl, &spawn_stats, sizeof(spawn_stats));
+    _exit(0);
+}
+
+/*
+ * Fork the spawner while the server is still a single process: later it
+ * holds threads, memory and file descriptors the scripts don't need.
+ */
+int cgi_spawn_start()
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        mk_libc_error("socketpair");
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        mk_libc_error("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    else if (pid == 0) {
+        cgi_spawn_main(sv[1]);
+        _exit(0);
+    }
+
+    close(sv[1]);
+    cgi_spawn_ctl = sv[0];
+    pthread_key_create(&cgi_spawn_key, NULL);
+
+    return 0;
+}
+
+/* The request failed to start, reply with an error if possible */
+static void cgi_spawn_failed(struct cgi_request *r)
+{
+    struct mk_http_request *sr = r->sr;
+
+    if (r->active == MK_TRUE && !r->status_done) {
+        mk_api->header_set_http_status(sr, MK_SERVER_SERVICE_UNAV);
+        sr->headers.content_length = 0;
+        sr->headers.transfer_encoding = -1;
+        r->chunked = 0;
+        mk_api->header_prepare(r->plugin, r->cs, sr);
+        mk_api->channel_flush(r->cs->channel);
+        r->status_done = 1;
+    }
+
+    cgi_finish(r);
+}
+
+static void cgi_spawn_worker_close(struct cgi_spawn_worker *w)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *list;
+    struct cgi_request *r;
+
+    mk_warn("[cgi] spawner is gone, forking per request");
+
+    mk_api->ev_del(mk_api->sched_loop(), &w->event);
+    close(w->fd);
+    pthread_setspecific(cgi_spawn_key, NULL);
+
+    /* Its event may still be pending in the current loop iteration */
+    mk_api->sched_event_free(&w->event);
+
+    /* No reply will come */
+    list = pthread_getspecific(cgi_request_list);
+    mk_list_foreach_safe(head, tmp, list) {
+        r = mk_list_entry(head, struct cgi_request, _head);
+        if (r->spawn_id == 0) {
+            continue;
+        }
+        r->spawn_id = 0;
+        if (r->eof) {
+            cgi_spawn_failed(r);
+        }
+    }
+}
+
+static int cb_cgi_spawn_reply(void *data)
+{
+    ssize_t len;
+    struct cgi_request *r;
+    struct cgi_spawn_reply reply;
+    struct cgi_spawn_worker *w = data;
+
+    while (1) {
+        len = recv(w->fd, &reply, sizeof(reply), MSG_DONTWAIT);
+        if (len == -1 && errno == EAGAIN) {
+            break;
+        }
+        else if (len != sizeof(reply)) {
+            cgi_spawn_worker_close(w);
+            break;
+        }
+
+        r = cgi_req_get_by_spawn(reply.id);
+        if (!r) {
+            /* The request ended already */
+            if (reply.pid > 0) {
+                kill(reply.pid, SIGKILL);
+            }
+            continue;
+        }
+
+        r->spawn_id = 0;
+        if (reply.pid <= 0) {
+            cgi_spawn_failed(r);
+            continue;
+        }
+
+        r->child = reply.pid;
+        if (r->eof) {
+            cgi_finish(r);
+        }
+    }
+
+    return 0;
+}
+
+int cgi_spawn_worker_init()
+{
+    int ret;
+    int sv[2];
+    char hello = 0;
+    struct mk_event *event;
+    struct cgi_spawn_worker *w;
+
+    if (cgi_spawn_ctl == -1) {
+        return 0;
+    }
+
+    ret = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                     0, sv);
+    if (ret == -1) {
+        mk_libc_error("socketpair");
+        return -1;
+    }
+
+    /* Hand one end to the spawner */
+    ret = cgi_spawn_send(cgi_spawn_ctl, &hello, sizeof(hello), sv[1], -1);
+    close(sv[1]);
+    if (ret == -1) {
+        close(sv[0]);
+        return -1;
+    }
+
+    w = mk_api->mem_alloc_z(sizeof(struct cgi_spawn_worker));
+    if (!w) {
+        close(sv[0]);
+        return -1;
+    }
+    w->fd = sv[0];
+
+    event = &w->event;
+    event->fd      = w->fd;
+    event->type    = MK_EVENT_CUSTOM;
+    event->mask    = MK_EVENT_EMPTY;
+    event->status  = MK_EVENT_NONE;
+    event->data    = w;
+    event->handler = cb_cgi_spawn_reply;
+
+    ret = mk_api->ev_add(mk_api->sched_loop(), w->fd,
+                         MK_EVENT_CUSTOM, MK_EVENT_READ, w);
+    if (ret != 0) {
+        close(w->fd);
+        mk_api->mem_free(w);
+        return -1;
+    }
+
+    pthread_setspecific(cgi_spawn_key, w);
+    return 0;
+}
+
+/* Ask the spawner to run the script, the process ID comes back later */
+int cgi_spawn_request(const char *file, char *interpreter, char **env,
+                      int fd_in, int fd_out, uint32_t *id)
+{
+    int i;
+    int ret;
+    size_t len;
+    size_t size;
+    char *p;
+    char msg[CGI_SPAWN_MSG_MAX];
+    struct cgi_spawn_req req;
+    struct cgi_spawn_worker *w;
+
+    if (cgi_spawn_ctl == -1) {
+        return CGI_SPAWN_UNAVAILABLE;
+    }
+
+    w = pthread_getspecific(cgi_spawn_key);
+    if (!w) {
+        return CGI_SPAWN_UNAVAILABLE;
+    }
+
+    w->next_id++;
+    if (w->next_id == 0) {
+        w->next_id++;
+    }
+
+    req.id = w->next_id;
+    req.n_env = 0;
+    req.interpreter = (interpreter != NULL);
+
+    p = msg + sizeof(req);
+    size = sizeof(msg) - sizeof(req);
+
+    len = strlen(file) + 1;
+    if (len > size) {
+        return CGI_SPAWN_UNAVAILABLE;
+    }
+    memcpy(p, file, len);
+    p += len;
+    size -= len;
+
+    if (interpreter) {
+        len = strlen(interpreter) + 1;
+        if (len > size) {
+            return CGI_SPAWN_UNAVAILABLE;
+        }
+        memcpy(p, interpreter, len);
+        p += len;
+        size -= len;
+    }
+
+    for (i = 0; env[i]; i++) {
+        len = strlen(env[i]) + 1;
+        if (len > size) {
+            return CGI_SPAWN_UNAVAILABLE;
+        }
+        memcpy(p, env[i], len);
+        p += len;
+        size -= len;
+        req.n_env++;
+    }
+    memcpy(msg, &req, sizeof(req));
+
+    ret = cgi_spawn_send(w->fd, msg, p - msg, fd_in, fd_out);
+    if (ret == -1) {
+        if (errno == EAGAIN) {
+            return CGI_SPAWN_FULL;
+        }
+        cgi_spawn_worker_close(w);
+        return CGI_SPAWN_UNAVAILABLE;
+    }
+
+    *id = req.id;
+    return CGI_SPAWN_QUEUED;
+}
+
+void cgi_spawn_exit()
+{
+    ssize_t len;
+    struct timeval tv;
+    struct cgi_spawn_stats stats;
+
+    if (cgi_spawn_ctl == -1) {
+        return;
+    }
+
+    /* The spawner exits on EOF, its counters come back */
+    shutdown(cgi_spawn_ctl, SHUT_WR);
+
+    tv.tv_sec = 2;
+    tv.tv_usec = 0;
+    setsockopt(cgi_spawn_ctl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    len = recv(cgi_spawn_ctl, &stats, sizeof(stats), 0);
+    if (len == sizeof(stats) && stats.requests > 0) {
+        mk_info("[cgi] %lu requests: %lu spawned, "
+                "%lu queued, %lu timed out, %lu rejected",
+                stats.requests, stats.spawned,
+                stats.queued, stats.timeouts, stats.rejected);
+    }
+
+    close(cgi_spawn_ctl);
+    cgi_spawn_ctl = -1;
+}
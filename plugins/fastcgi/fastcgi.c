@@ -21,32 +21,146 @@
 
 #include "fastcgi.h"
 #include "fcgi_handler.h"
+#include "fcgi_pool.h"
+#include "fcgi_upstream.h"
 
-static int mk_fastcgi_config(char *path)
+static struct fcgi_group *fcgi_config_group_get(char *name)
 {
-    int ret;
-    int sep;
-    char *file = NULL;
-    char *cnf_srv_name = NULL;
-    char *cnf_srv_addr = NULL;
-    char *cnf_srv_port = NULL;
-    char *cnf_srv_path = NULL;
-    unsigned long len;
-    struct file_info finfo;
-    struct mk_rconf *conf;
-    struct mk_rconf_section *section;
+    struct mk_list *head;
+    struct fcgi_group *group;
 
-    mk_api->str_build(&file, &len, "%sfastcgi.conf", path);
-    conf = mk_api->config_open(file);
-    if (!conf) {
+    mk_list_foreach(head, &fcgi_conf.groups) {
+        group = mk_list_entry(head, struct fcgi_group, _head);
+        if (strcasecmp(group->name, name) == 0) {
+            return group;
+        }
+    }
+
+    group = mk_api->mem_alloc_z(sizeof(struct fcgi_group));
+    if (!group) {
+        return NULL;
+    }
+
+    group->name = mk_api->str_dup(name);
+    group->balance = FCGI_BALANCE_ROUND_ROBIN;
+    group->hash_key = FCGI_HASH_URI;
+    group->max_fails = FCGI_GROUP_MAX_FAILS;
+    group->fail_timeout = FCGI_GROUP_FAIL_TIMEOUT;
+    group->slow_start = 0;
+    mk_list_add(&group->_head, &fcgi_conf.groups);
+
+    return group;
+}
+
+/* [FASTCGI_GROUP] section */
+static int fcgi_config_group(struct mk_rconf_section *section)
+{
+    int ret = 0;
+    char *name;
+    char *balance;
+    char *hash_key;
+    size_t max_fails;
+    size_t fail_timeout;
+    size_t slow_start;
+    struct fcgi_group *group;
+
+    name = mk_api->config_section_get_key(section, "Name", MK_RCONF_STR);
+    if (!name) {
+        mk_warn("[fastcgi] Missing Name in [FASTCGI_GROUP]");
         return -1;
     }
 
-    section = mk_api->config_section_get(conf, "FASTCGI_SERVER");
-    if (!section) {
+    group = fcgi_config_group_get(name);
+    mk_api->mem_free(name);
+    if (!group) {
         return -1;
     }
 
+    balance = mk_api->config_section_get_key(section, "Balance",
+                                             MK_RCONF_STR);
+    hash_key = mk_api->config_section_get_key(section, "HashKey",
+                                              MK_RCONF_STR);
+    max_fails = (size_t) mk_api->config_section_get_key(section,
+                                                        "MaxFails",
+                                                        MK_RCONF_NUM);
+    fail_timeout = (size_t) mk_api->config_section_get_key(section,
+                                                           "FailTimeout",
+                                                           MK_RCONF_NUM);
+    slow_start = (size_t) mk_api->config_section_get_key(section,
+                                                         "SlowStart",
+                                                         MK_RCONF_NUM);
+
+    if (balance) {
+        if (strcasecmp(balance, "RoundRobin") == 0) {
+            group->balance = FCGI_BALANCE_ROUND_ROBIN;
+        }
+        else if (strcasecmp(balance, "LeastRequests") == 0) {
+            group->balance = FCGI_BALANCE_LEAST_REQS;
+        }
+        else if (strcasecmp(balance, "Hash") == 0) {
+            group->balance = FCGI_BALANCE_HASH;
+        }
+        else {
+            mk_warn("[fastcgi] Invalid Balance '%s' in group %s",
+                    balance, group->name);
+            ret = -1;
+        }
+        mk_api->mem_free(balance);
+    }
+
+    if (hash_key) {
+        if (strcasecmp(hash_key, "Uri") == 0) {
+            group->hash_key = FCGI_HASH_URI;
+        }
+        else if (strcasecmp(hash_key, "Host") == 0) {
+            group->hash_key = FCGI_HASH_HOST;
+        }
+        else if (strcasecmp(hash_key, "RemoteAddr") == 0) {
+            group->hash_key = FCGI_HASH_REMOTE;
+        }
+        else {
+            mk_warn("[fastcgi] Invalid HashKey '%s' in group %s",
+                    hash_key, group->name);
+            ret = -1;
+        }
+        mk_api->mem_free(hash_key);
+    }
+
+    if (max_fails > 0) {
+        group->max_fails = max_fails;
+    }
+    if (fail_timeout > 0) {
+        group->fail_timeout = fail_timeout;
+    }
+    group->slow_start = slow_start;
+
+    return ret;
+}
+
+/* [FASTCGI_SERVER] section */
+static int fcgi_config_server(struct mk_rconf_section *section)
+{
+    int ret;
+    int port = 0;
+    int lookup = MK_FALSE;
+    char *sep;
+    char *cnf_srv_name = NULL;
+    char *cnf_srv_addr = NULL;
+    char *cnf_srv_path = NULL;
+    char *cnf_group = NULL;
+    char *cnf_keepalive = NULL;
+    char *cnf_multiplex = NULL;
+    int weight;
+    int max_conns;
+    int max_idle;
+    int idle_timeout;
+    int max_requests;
+    struct file_info finfo;
+    struct mk_net_addr net;
+    struct mk_list *head;
+    struct fcgi_group *group;
+    struct fcgi_server *server;
+
     /* Get section values */
     cnf_srv_name = mk_api->config_section_get_key(section,
                                                   "ServerName",
@@ -57,6 +171,32 @@ static int mk_fastcgi_config(char *path)
     cnf_srv_path = mk_api->config_section_get_key(section,
                                                   "ServerPath",
                                                   MK_RCONF_STR);
+    cnf_group = mk_api->config_section_get_key(section,
+                                               "Group",
+                                               MK_RCONF_STR);
+    weight = (size_t) mk_api->config_section_get_key(section,
+                                                     "Weight",
+                                                     MK_RCONF_NUM);
+
+    /* Backend connections */
+    cnf_keepalive = mk_api->config_section_get_key(section,
+                                                   "KeepAlive",
+                                                   MK_RCONF_STR);
+    cnf_multiplex = mk_api->config_section_get_key(section,
+                                                   "Multiplex",
+                                                   MK_RCONF_STR);
+    max_conns = (size_t) mk_api->config_section_get_key(section,
+                                                        "MaxConnections",
+                                                        MK_RCONF_NUM);
+    max_idle = (size_t) mk_api->config_section_get_key(section,
+                                                       "MaxIdleConnections",
+                                                       MK_RCONF_NUM);
+    idle_timeout = (size_t) mk_api->config_section_get_key(section,
+                                                           "IdleTimeout",
+                                                           MK_RCONF_NUM);
+    max_requests = (size_t) mk_api->config_section_get_key(section,
+                                                           "MaxRequests",
+                                                           MK_RCONF_NUM);
 
     /* Validations */
     if (!cnf_srv_name) {
@@ -64,16 +204,24 @@ static int mk_fastcgi_config(char *path)
         return -1;
     }
 
-    /* Split the address, try to lookup the TCP port */
+    mk_list_foreach(head, &fcgi_conf.servers) {
+        server = mk_list_entry(head, struct fcgi_server, _head);
+        if (strcasecmp(server->name, cnf_srv_name) == 0) {
+            mk_warn("[fastcgi] Duplicated ServerName %s", cnf_srv_name);
+            return -1;
+        }
+    }
+
+    /* Split the address, the port goes last: 127.0.0.1:9000, [::1]:9000 */
     if (cnf_srv_addr) {
-        sep = mk_api->str_char_search(cnf_srv_addr, ':', strlen(cnf_srv_addr));
-        if (sep <= 0) {
+        sep = strrchr(cnf_srv_addr, ':');
+        if (!sep || sep == cnf_srv_addr || atoi(sep + 1) <= 0) {
             mk_warn("[fastcgi] Missing TCP port con ServerAddress key");
             return -1;
         }
 
-        cnf_srv_port = mk_api->str_dup(cnf_srv_addr + sep + 1);
-        cnf_srv_addr[sep] = '\0';
+        port = atoi(sep + 1);
+        *sep = '\0';
     }
 
     /* Just one mode can exist (for now) */
@@ -82,42 +230,155 @@ static int mk_fastcgi_config(char *path)
         return -1;
     }
 
-    /* Unix socket path */
+    if (!cnf_srv_path && !cnf_srv_addr) {
+        mk_warn("[fastcgi] Missing ServerAddr or ServerPath for %s",
+                cnf_srv_name);
+        return -1;
+    }
+
+    /* Unix socket path, or a Linux abstract socket name: @name */
     if (cnf_srv_path) {
-        ret = mk_api->file_get_info(cnf_srv_path, &finfo, MK_FILE_READ);
+        if (cnf_srv_path[0] != '@') {
+            ret = mk_api->file_get_info(cnf_srv_path, &finfo, MK_FILE_READ);
+            if (ret == -1) {
+                mk_warn("[fastcgi] Cannot open unix socket: %s", cnf_srv_path);
+                return -1;
+            }
+        }
+
+        ret = mk_api->net_addr_parse(cnf_srv_path, 0, &net);
         if (ret == -1) {
-            mk_warn("[fastcgi] Cannot open unix socket: %s", cnf_srv_path);
+            mk_warn("[fastcgi] Invalid unix socket: %s", cnf_srv_path);
             return -1;
         }
     }
+    else {
+        /* A numeric address is parsed once, names are looked up later */
+        ret = mk_api->net_addr_parse(cnf_srv_addr, port, &net);
+        lookup = (ret == -1);
+    }
+
+    group = fcgi_config_group_get(cnf_group ? cnf_group : FCGI_GROUP_DEFAULT);
+    if (cnf_group) {
+        mk_api->mem_free(cnf_group);
+    }
+    if (!group) {
+        return -1;
+    }
+
+    if (group->size == FCGI_GROUP_MAX_SERVERS) {
+        mk_warn("[fastcgi] Too many servers in group %s", group->name);
+        return -1;
+    }
+
+    server = mk_api->mem_alloc_z(sizeof(struct fcgi_server));
+    if (!server) {
+        return -1;
+    }
+
+    server->id = fcgi_conf.n_servers++;
+    server->name = cnf_srv_name;
+    server->addr = cnf_srv_addr;
+    server->port = port;
+    server->path = cnf_srv_path;
+    server->lookup = lookup;
+    memcpy(&server->net, &net, sizeof(net));
+    server->weight = weight > 0 ? weight : 1;
+
+    /* Keep connections open unless told otherwise */
+    server->keepalive = MK_TRUE;
+    if (cnf_keepalive && strcasecmp(cnf_keepalive, "off") == 0) {
+        server->keepalive = MK_FALSE;
+    }
+
+    server->multiplex = FCGI_MPX_AUTO;
+    if (cnf_multiplex) {
+        if (strcasecmp(cnf_multiplex, "on") == 0) {
+            server->multiplex = FCGI_MPX_ON;
+        }
+        else if (strcasecmp(cnf_multiplex, "off") == 0) {
+            server->multiplex = FCGI_MPX_OFF;
+        }
+    }
 
-    /* Set the global configuration */
-    fcgi_conf.server_name = cnf_srv_name;
-    fcgi_conf.server_addr = cnf_srv_addr;
-    fcgi_conf.server_port = cnf_srv_port;
-    fcgi_conf.server_path = cnf_srv_path;
+    server->max_conns = max_conns > 0 ? max_conns : 0;
+    server->max_idle = max_idle > 0 ? max_idle : FCGI_POOL_MAX_IDLE;
+    server->idle_timeout = idle_timeout > 0 ? idle_timeout : FCGI_POOL_IDLE_TIMEOUT;
+    server->max_requests = max_requests > 0 ? max_requests : 0;
+
+    server->group = group;
+    server->index = group->size;
+    group->servers[group->size++] = server;
+    mk_list_add(&server->_head, &fcgi_conf.servers);
+
+    if (cnf_keepalive) {
+        mk_api->mem_free(cnf_keepalive);
+    }
+    if (cnf_multiplex) {
+        mk_api->mem_free(cnf_multiplex);
+    }
 
     return 0;
 }
 
-
-/* Entry point for thread/co-routine */
-static void mk_fastcgi_stage30_thread(struct mk_plugin *plugin,
-                                      struct mk_http_session *cs,
-                                      struct mk_http_request *sr,
-                                      int n_params,
-                                      struct mk_list *params)
+static int mk_fastcgi_config(char *path)
 {
-    struct fcgi_handler *handler;
-    (void) plugin;
-    (void) n_params;
-    (void) params;
+    int ret;
+    char *file = NULL;
+    unsigned long len;
+    struct mk_list *head;
+    struct mk_rconf *conf;
+    struct mk_rconf_section *section;
+    struct fcgi_group *group;
 
-    printf("entering thread\n");
-    handler = fcgi_handler_new(cs, sr);
-    if (!handler) {
-        fprintf(stderr, "Could not create handler");
+    mk_api->str_build(&file, &len, "%sfastcgi.conf", path);
+    conf = mk_api->config_open(file);
+    mk_api->mem_free(file);
+    if (!conf) {
+        return -1;
+    }
+
+    mk_list_init(&fcgi_conf.servers);
+    mk_list_init(&fcgi_conf.groups);
+
+    /* Groups first, then the servers that join them */
+    ret = 0;
+    mk_list_foreach(head, &conf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "FASTCGI_GROUP") == 0) {
+            ret = fcgi_config_group(section);
+            if (ret == -1) {
+                break;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        mk_list_foreach(head, &conf->sections) {
+            section = mk_list_entry(head, struct mk_rconf_section, _head);
+            if (strcasecmp(section->name, "FASTCGI_SERVER") == 0) {
+                ret = fcgi_config_server(section);
+                if (ret == -1) {
+                    break;
+                }
+            }
+        }
+    }
+    mk_api->config_free(conf);
+
+    if (ret == -1 || fcgi_conf.n_servers == 0) {
+        return -1;
+    }
+
+    mk_list_foreach(head, &fcgi_conf.groups) {
+        group = mk_list_entry(head, struct fcgi_group, _head);
+        if (group->size == 0) {
+            mk_warn("[fastcgi] Group %s has no servers", group->name);
+            return -1;
+        }
     }
+
+    return 0;
 }
 
 /* Callback handler */
@@ -127,24 +388,34 @@ int mk_fastcgi_stage30(struct mk_plugin *plugin,
                        int n_params,
                        struct mk_list *params)
 {
-    (void) n_params;
-    (void) params;
+    char *name = NULL;
+    struct fcgi_group *group;
     struct fcgi_handler *handler;
+    struct mk_vhost_handler_param *param;
 
-    /*
-     * This plugin uses the Monkey Thread model (co-routines), for hence
-     * upon return MK_PLUGIN_RET_CONTINUE, Monkey core will create a
-     * new thread (co-routine) and defer the control to the stage30_thread
-     * callback function (mk_fastcgi_stage30_thread).
-     *
-     * We don't do any validation, so we are OK with MK_PLUGIN_RET_CONTINUE.
-     */
+    /* Servers group given to the handler rule */
+    if (n_params > 0) {
+        param = mk_api->handler_param_get(0, params);
+        if (param) {
+            name = param->p.data;
+        }
+    }
 
-    return MK_PLUGIN_RET_CONTINUE;
+    group = fcgi_upstream_group(name);
+    if (!group) {
+        mk_warn("[fastcgi] unknown servers group %s", name);
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
 
-    ret = mk_fastcgi_start_processing(cs, sr);
-    if (ret == 0) {
-        return MK_PLUGIN_RET_CONTINUE;
+    /*
+     * The request is sent over a backend connection from the worker pool,
+     * the response is delivered later through the worker event loop.
+     */
+    handler = fcgi_handler_new(plugin, cs, sr, group);
+    if (!handler) {
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
     }
 
     return MK_PLUGIN_RET_CONTINUE;
@@ -163,14 +434,10 @@ int mk_fastcgi_stage30_hangup(struct mk_plugin *plugin,
         return -1;
     }
 
-    if (handler->hangup == MK_TRUE) {
-        return 0;
-    }
-
-    handler->active = MK_FALSE;
-    handler->hangup = MK_TRUE;
-
-    fcgi_exit(sr->handler_data);
+    /* The client is gone, the backend connection stays in the pool */
+    fcgi_pool_detach(handler);
+    sr->handler_data = NULL;
+    fcgi_handler_free(handler);
 
     return 0;
 }
@@ -185,12 +452,20 @@ int mk_fastcgi_plugin_init(struct plugin_api **api, char *confdir)
     ret = mk_fastcgi_config(confdir);
     if (ret == -1) {
         mk_warn("[fastcgi] configuration error/missing, plugin disabled.");
+        return ret;
+    }
+
+    ret = fcgi_upstream_init();
+    if (ret == -1) {
+        return ret;
     }
-	return ret;
+
+    return fcgi_pool_init();
 }
 
 int mk_fastcgi_plugin_exit()
 {
+    fcgi_pool_exit();
     return 0;
 }
 
@@ -202,11 +477,16 @@ int mk_fastcgi_master_init(struct mk_server *server)
 
 void mk_fastcgi_worker_init()
 {
+    int ret;
+
+    ret = fcgi_pool_worker_init();
+    if (ret == -1) {
+        mk_err("[fastcgi] could not initialize the connections pool");
+    }
 }
 
 struct mk_plugin_stage mk_plugin_stage_fastcgi = {
     .stage30        = &mk_fastcgi_stage30,
-    .stage30_thread = &mk_fastcgi_stage30_thread,
     .stage30_hangup = &mk_fastcgi_stage30_hangup
 };
 
@@ -226,8 +506,5 @@ struct mk_plugin mk_plugin_fastcgi = {
     .worker_init   = mk_fastcgi_worker_init,
 
     /* Type */
-    .stage         = &mk_plugin_stage_fastcgi,
-
-    /* Flags */
-    .flags         = MK_PLUGIN_THREAD
+    .stage         = &mk_plugin_stage_fastcgi
 };
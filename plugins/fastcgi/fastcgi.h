@@ -20,15 +20,93 @@
 #ifndef MK_FASTCGI_H
 #define MK_FASTCGI_H
 
-struct mk_fcgi_conf {
-    char *server_name;
+#include <monkey/mk_api.h>
+
+/* Pool defaults */
+#define FCGI_POOL_MAX_IDLE      8
+#define FCGI_POOL_IDLE_TIMEOUT  60
+
+/* Multiplex mode */
+#define FCGI_MPX_AUTO  -1        /* ask the server: FCGI_MPXS_CONNS */
+#define FCGI_MPX_OFF    0
+#define FCGI_MPX_ON     1
+
+/* Group defaults */
+#define FCGI_GROUP_DEFAULT      "default"
+#define FCGI_GROUP_MAX_SERVERS  64
+#define FCGI_GROUP_MAX_FAILS    3
+#define FCGI_GROUP_FAIL_TIMEOUT 10
+
+/* Balancing methods */
+#define FCGI_BALANCE_ROUND_ROBIN  0
+#define FCGI_BALANCE_LEAST_REQS   1
+#define FCGI_BALANCE_HASH         2
+
+/* Request key for consistent hashing */
+#define FCGI_HASH_URI     0
+#define FCGI_HASH_HOST    1
+#define FCGI_HASH_REMOTE  2
+
+/* A FastCGI server, [FASTCGI_SERVER] section */
+struct fcgi_server {
+    int id;                      /* index of the worker pool       */
+    int index;                   /* position in its group          */
+    char *name;
+    int weight;
 
     /* Unix Socket */
-    char *server_path;
+    char *path;
 
     /* TCP Server */
-    char *server_addr;
-    char *server_port;
+    char *addr;
+    int port;
+
+    /* Address to connect to, unless a host name must be looked up */
+    int lookup;
+    struct mk_net_addr net;
+
+    /* Backend connections, pooled per worker */
+    int keepalive;               /* FCGI_KEEP_CONN                 */
+    int max_conns;               /* 0: unlimited                   */
+    int max_idle;
+    int idle_timeout;            /* seconds                        */
+    int max_requests;            /* per connection, 0: unlimited   */
+    int multiplex;               /* FCGI_MPX_AUTO / ON / OFF       */
+
+    struct fcgi_group *group;
+    struct mk_list _head;        /* link to fcgi_conf.servers      */
+};
+
+/* Point of a server on the consistent hashing ring */
+struct fcgi_hash_point {
+    uint32_t hash;
+    int index;                   /* server position in the group   */
+};
+
+/* Servers sharing the load, [FASTCGI_GROUP] section */
+struct fcgi_group {
+    char *name;
+    int balance;                 /* FCGI_BALANCE_*                 */
+    int hash_key;                /* FCGI_HASH_*                    */
+
+    /* Passive health checks */
+    int max_fails;               /* failures in a row to eject     */
+    int fail_timeout;            /* seconds a server is ejected    */
+    int slow_start;              /* seconds to recover full weight */
+
+    int size;
+    struct fcgi_server *servers[FCGI_GROUP_MAX_SERVERS];
+
+    int ring_size;
+    struct fcgi_hash_point *ring;
+
+    struct mk_list _head;        /* link to fcgi_conf.groups       */
+};
+
+struct mk_fcgi_conf {
+    int n_servers;
+    struct mk_list servers;
+    struct mk_list groups;       /* first one is the default       */
 };
 
 struct mk_fcgi_conf fcgi_conf;
@@ -18,18 +18,24 @@
  */
 
 #include <monkey/mk_api.h>
-#include <monkey/mk_net.h>
 
 #include "fastcgi.h"
 #include "fcgi_handler.h"
+#include "fcgi_pool.h"
 
-#define FCGI_BUF(h)           (char *) h->buf_data + h->buf_len
-#define FCGI_PARAM_DYN(str)   str, strlen(str), MK_FALSE
-#define FCGI_PARAM_CONST(str) str, sizeof(str) -1, MK_FALSE
-#define FCGI_PARAM_PTR(ptr)   ptr.data, ptr.len, MK_FALSE
-#define FCGI_PARAM_DUP(str)   mk_api->str_dup(str), strlen(str), MK_TRUE
+#define FCGI_PARAM_CONST(str) str, sizeof(str) - 1
+#define FCGI_PARAM_PTR(ptr)   ptr.data, ptr.len
 
 int fcgi_pad[256] = {0};
+static char fcgi_chunk_end[] = "\r\n0\r\n\r\n";
+
+/* Network params of the request, see fcgi_params_net() */
+struct fcgi_params_net {
+    char server_addr[INET6_ADDRSTRLEN];
+    char server_port[8];
+    char remote_addr[INET6_ADDRSTRLEN];
+    char remote_port[8];
+};
 
 static inline void fcgi_build_header(struct fcgi_record_header *rec,
                                      uint8_t type, uint16_t request_id,
@@ -43,105 +49,61 @@ static inline void fcgi_build_header(struct fcgi_record_header *rec,
     rec->reserved        = 0;
 }
 
-static inline void fcgi_build_request_body(struct fcgi_begin_request_body *body)
+static inline void fcgi_build_request_body(struct fcgi_begin_request_body *body,
+                                           int keep_conn)
 {
     fcgi_encode16(&body->role, FCGI_RESPONDER);
-    body->flags       = 0;
+    body->flags       = keep_conn ? FCGI_KEEP_CONN : 0;
     memset(body->reserved, '\0', sizeof(body->reserved));
 }
 
-static inline size_t fcgi_write_length(char *p, size_t len)
+/* Lengths up to 127 take one byte, longer ones four */
+static inline size_t fcgi_length_size(size_t len)
 {
-    if (len < 127) {
-		*p++ = len;
-		return 1;
-    }
-    else{
-		*p++  = (len >> 24) | 0x80;
-		*p++  = (len >> 16) & 0xff;
-		*p++  = (len >>  8) & 0xff;
-		*p++  = (len)       & 0xff;
-		return 4;
-	}
+    return len < 128 ? 1 : 4;
 }
 
-static inline int fcgi_add_param_empty(struct fcgi_handler *handler)
+static inline size_t fcgi_param_size(size_t key_len, size_t val_len)
 {
-    char *p;
-
-    p = FCGI_BUF(handler);
-    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS, 1, 0);
-    mk_api->iov_add(handler->iov, p,
-                    sizeof(struct fcgi_record_header), MK_FALSE);
-    handler->buf_len += sizeof(struct fcgi_record_header);
-    return 0;
+    return fcgi_length_size(key_len) + fcgi_length_size(val_len) +
+        key_len + val_len;
 }
 
-static inline int fcgi_add_param(struct fcgi_handler *handler,
-                                 char *key, int key_len, int key_free,
-                                 char *val, int val_len, int val_free)
+static inline char *fcgi_write_length(char *p, size_t len)
 {
-    int ret;
-    int len;
-    int diff;
-    int padding;
-    char *p;
-    char *buf;
-    struct fcgi_record_header *h;
-
-    buf = p = (char * ) handler->buf_data + handler->buf_len;
-
-	len  = key_len + val_len;
-	len += key_len > 127 ? 4 : 1;
-	len += val_len > 127 ? 4 : 1;
-
-    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS, 1, len);
-    padding = ~(len - 1) & 7;
-    if (padding) {
-        h = (struct fcgi_record_header *) p;
-        h->padding_length = padding;
+    if (len < 128) {
+        *p++ = len;
     }
-
-    p += sizeof(struct fcgi_record_header);
-    p += fcgi_write_length(p, key_len);
-    p += fcgi_write_length(p, val_len);
-
-    diff = (p - buf);
-    handler->buf_len += diff;
-    ret = mk_api->iov_add(handler->iov, buf, diff, MK_FALSE);
-    if (ret == -1) {
-        return -1;
-    }
-
-    mk_api->iov_add(handler->iov, key, key_len, key_free);
-    mk_api->iov_add(handler->iov, val, val_len, val_free);
-
-    if (padding) {
-        mk_api->iov_add(handler->iov, fcgi_pad, h->padding_length, MK_FALSE);
+    else {
+        *p++  = (len >> 24) | 0x80;
+        *p++  = (len >> 16) & 0xff;
+        *p++  = (len >>  8) & 0xff;
+        *p++  = (len)       & 0xff;
     }
+    return p;
+}
 
-    return 0;
+/* Encode a name-value pair at 'p', returns the end of it */
+static inline char *fcgi_param(char *p,
+                               const char *key, size_t key_len,
+                               const char *val, size_t val_len)
+{
+    p = fcgi_write_length(p, key_len);
+    p = fcgi_write_length(p, val_len);
+    memcpy(p, key, key_len);
+    p += key_len;
+    memcpy(p, val, val_len);
+    return p + val_len;
 }
 
-static inline int fcgi_add_param_http_header(struct fcgi_handler *handler,
-                                             struct mk_http_header *header)
+static inline char *fcgi_param_http_header(char *p,
+                                           struct mk_http_header *header)
 {
     unsigned int i;
-    int avail;
-    int req;
-    int diff;
-    char *p;
-    char *buf;
 
-    avail = (sizeof(handler->buf_data) - handler->buf_len);
-    req   = sizeof(struct fcgi_record_header) + 8;
-    req  += header->key.len + 5;
+    p = fcgi_write_length(p, header->key.len + 5);
+    p = fcgi_write_length(p, header->val.len);
 
-    if (avail < req) {
-        return -1;
-    }
-
-    buf = p = (handler->buf_data + handler->buf_len);
     *p++ = 'H';
     *p++ = 'T';
     *p++ = 'T';
@@ -157,27 +119,57 @@ static inline int fcgi_add_param_http_header(struct fcgi_handler *handler,
         }
     }
 
-    diff = (p - buf);
-    handler->buf_len += diff;
-    fcgi_add_param(handler,
-                   buf, diff, MK_FALSE,
-                   header->val.data, header->val.len, MK_FALSE);
+    memcpy(p, header->val.data, header->val.len);
+    return p + header->val.len;
+}
+
+static int fcgi_addr_string(struct sockaddr_storage *addr,
+                            char *buf, size_t size, char *port)
+{
+    const char *p;
+    struct sockaddr_in *s;
+    struct sockaddr_in6 *s6;
+    struct in_addr addr4;
+
+    if (addr->ss_family == AF_INET) {
+        s = (struct sockaddr_in *) addr;
+        snprintf(port, 8, "%d", ntohs(s->sin_port));
+        p = inet_ntop(AF_INET, &s->sin_addr, buf, size);
+    }
+    else { /* AF_INET6 */
+        s6 = (struct sockaddr_in6 *) addr;
+        snprintf(port, 8, "%d", ntohs(s6->sin6_port));
 
+        if (IN6_IS_ADDR_V4MAPPED(&s6->sin6_addr)) {
+            /* This is V4-Mapped-V6 - Lets convert it to plain IPV4 address.
+             * E.g. we would have received like this ::ffff:10.106.146.73.
+             * This would be converted to 10.106.146.73.
+             */
+            memcpy(&addr4.s_addr, s6->sin6_addr.s6_addr + 12,
+                   sizeof(addr4.s_addr));
+            p = inet_ntop(AF_INET, &addr4, buf, size);
+        }
+        else {
+            p = inet_ntop(AF_INET6, &s6->sin6_addr, buf, size);
+        }
+    }
+
+    if (!p) {
+        perror("inet_ntop");
+        return -1;
+    }
     return 0;
 }
 
-static inline int fcgi_add_param_net(struct fcgi_handler *handler)
+/* SERVER_ADDR, SERVER_PORT, REMOTE_ADDR & REMOTE_PORT */
+static int fcgi_params_net(struct fcgi_handler *handler,
+                           struct fcgi_params_net *net)
 {
     int ret;
-    const char *p;
-    char buffer[256];
-
-    /* This is to identify whether its IPV4 or IPV6 */
     struct sockaddr_storage addr;
-    int port = 0;
-	socklen_t addr_len = sizeof(struct sockaddr_in);
+    socklen_t addr_len = sizeof(addr);
 
-    ret = getsockname(handler->cs->socket, (struct sockaddr *)&addr, &addr_len);
+    ret = getsockname(handler->cs->socket, (struct sockaddr *) &addr, &addr_len);
     if (ret == -1) {
 #ifdef TRACE
         perror("getsockname");
@@ -189,311 +181,291 @@ static inline int fcgi_add_param_net(struct fcgi_handler *handler)
         return -1;
     }
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *s = (struct sockaddr_in *)&addr;
-        port = ntohs(s->sin_port);
-        p = inet_ntop(AF_INET, &s->sin_addr, buffer, sizeof(buffer));
-        if (!p) {
-            perror("inet_ntop");
-            return -1;
-        }
-    } else { /* AF_INET6 */
-        struct sockaddr_in6 *s = (struct sockaddr_in6 *)&addr;
-        port = ntohs(s->sin6_port);
-        p = inet_ntop(AF_INET6, &s->sin6_addr, buffer, sizeof(buffer));
-        if (!p) {
-            perror("inet_ntop");
-            return -1;
-        }
+    ret = fcgi_addr_string(&addr, net->server_addr, sizeof(net->server_addr),
+                           net->server_port);
+    if (ret == -1) {
+        return -1;
     }
 
-    /* Server Address */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("SERVER_ADDR"),
-                   FCGI_PARAM_DUP(buffer));
-
-    /* Server Port */
-    snprintf(buffer, 256, "%d", port);
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("SERVER_PORT"),
-                   FCGI_PARAM_DUP(buffer));
-
+    /* The remote address was kept when the connection was accepted */
+    if (handler->cs->conn && handler->cs->conn->peer.len > 0) {
+        return fcgi_addr_string((struct sockaddr_storage *)
+                                &handler->cs->conn->peer.addr,
+                                net->remote_addr, sizeof(net->remote_addr),
+                                net->remote_port);
+    }
 
-    ret = getpeername(handler->cs->socket, (struct sockaddr *)&addr, &addr_len);
+    addr_len = sizeof(addr);
+    ret = getpeername(handler->cs->socket, (struct sockaddr *) &addr, &addr_len);
     if (ret == -1) {
         perror("getpeername");
         return -1;
     }
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *s = (struct sockaddr_in *)&addr;
-        port = ntohs(s->sin_port);
-        p = inet_ntop(AF_INET, &s->sin_addr, buffer, sizeof(buffer));
-        if (!p) {
-            perror("inet_ntop");
-            return -1;
-        }
-    } else { /* AF_INET6 */
-        struct sockaddr_in6 *s = (struct sockaddr_in6 *)&addr;
-        port = ntohs(s->sin6_port);
-
-        if (IN6_IS_ADDR_V4MAPPED(&s->sin6_addr)) {
-            /* This is V4-Mapped-V6 - Lets convert it to plain IPV4 address.
-             * E.g. we would have received like this ::ffff:10.106.146.73.
-             * This would be converted to 10.106.146.73.
-             */
-            struct sockaddr_in addr4;
-            struct sockaddr_in *s4 = (struct sockaddr_in *)&addr4;
-            memset(&addr4, 0, sizeof(addr4));
-            addr4.sin_family = AF_INET;
-            addr4.sin_port = &s->sin6_port;
-            memcpy(&addr4.sin_addr.s_addr,
-                   s->sin6_addr.s6_addr + 12,
-                   sizeof(addr4.sin_addr.s_addr));
-            p = inet_ntop(AF_INET, &s4->sin_addr, buffer, sizeof(buffer));
-            if (!p) {
-                perror("inet_ntop");
-                return -1;
-            }
-        } else {
-            p = inet_ntop(AF_INET6, &s->sin6_addr, buffer, sizeof(buffer));
-            if (!p) {
-                perror("inet_ntop");
-                return -1;
-            }
-        }
-    }
-
-    /* Remote Addr */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("REMOTE_ADDR"),
-                   FCGI_PARAM_DUP(buffer));
-
-    /* Remote Port */
-    snprintf(buffer, 256, "%d", port);
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("REMOTE_PORT"),
-                   FCGI_PARAM_DUP(buffer));
-
-    return 0;
+    return fcgi_addr_string(&addr, net->remote_addr, sizeof(net->remote_addr),
+                            net->remote_port);
 }
 
-static inline int fcgi_stdin_chunk(struct fcgi_handler *handler)
+/* PARAMS that only depend on the virtual host, encoded on first use */
+static struct fcgi_params_prefix *fcgi_params_prefix(struct mk_http_request *sr)
 {
-    int padding = 0;
-    uint16_t max = 65535;
-    uint16_t chunk;
-    uint64_t total;
+    size_t len;
     char *p;
-    char *eof;
-    struct fcgi_record_header *h;
-
-    total = handler->stdin_length - handler->stdin_offset;
-    if (total > max) {
-        chunk = max;
-    }
-    else {
-        chunk = total;
+    char *signature;
+    struct mk_list *head;
+    struct fcgi_worker *worker;
+    struct fcgi_params_prefix *prefix;
+
+    worker = fcgi_pool_worker();
+    mk_list_foreach(head, &worker->params) {
+        prefix = mk_list_entry(head, struct fcgi_params_prefix, _head);
+        if (prefix->host == sr->host_conf && prefix->alias == sr->host_alias) {
+            return prefix;
+        }
     }
 
-    p = FCGI_BUF(handler);
-    h = (struct fcgi_record_header *) p;
-    fcgi_build_header(h, FCGI_STDIN, 1, chunk);
-    h->padding_length = ~(chunk - 1) & 7;
+    signature = mk_api->config->server_signature;
 
-    MK_TRACE("[fastcgi] STDIN: length=%i", chunk);
+    len  = fcgi_param_size(17, 7);             /* GATEWAY_INTERFACE */
+    len += fcgi_param_size(15, 3);             /* REDIRECT_STATUS   */
+    len += fcgi_param_size(15, strlen(signature));
+    len += fcgi_param_size(15, 8);             /* SERVER_PROTOCOL   */
+    len += fcgi_param_size(11, sr->host_alias->len);
+    len += fcgi_param_size(13, sr->host_conf->documentroot.len);
 
-    mk_api->iov_add(handler->iov, p, FCGI_RECORD_HEADER_SIZE, MK_FALSE);
-    handler->buf_len += FCGI_RECORD_HEADER_SIZE;
+    prefix = mk_api->mem_alloc(sizeof(struct fcgi_params_prefix) + len);
+    if (!prefix) {
+        return NULL;
+    }
+    prefix->host = sr->host_conf;
+    prefix->alias = sr->host_alias;
+    prefix->len = len;
+    prefix->data = (char *) (prefix + 1);
 
+    p = prefix->data;
+    p = fcgi_param(p, FCGI_PARAM_CONST("GATEWAY_INTERFACE"),
+                   FCGI_PARAM_CONST("CGI/1.1"));
+    p = fcgi_param(p, FCGI_PARAM_CONST("REDIRECT_STATUS"),
+                   FCGI_PARAM_CONST("200"));
+    p = fcgi_param(p, FCGI_PARAM_CONST("SERVER_SOFTWARE"),
+                   signature, strlen(signature));
+    p = fcgi_param(p, FCGI_PARAM_CONST("SERVER_PROTOCOL"),
+                   FCGI_PARAM_CONST("HTTP/1.1"));
+    p = fcgi_param(p, FCGI_PARAM_CONST("SERVER_NAME"),
+                   sr->host_alias->name, sr->host_alias->len);
+    fcgi_param(p, FCGI_PARAM_CONST("DOCUMENT_ROOT"),
+               FCGI_PARAM_PTR(sr->host_conf->documentroot));
 
-    if (chunk > 0) {
-        mk_api->iov_add(handler->iov,
-                        handler->stdin_buffer + handler->stdin_offset,
-                        chunk,
-                        MK_FALSE);
-    }
+    mk_list_add(&prefix->_head, &worker->params);
+    return prefix;
+}
 
-    if (h->padding_length > 0) {
-        mk_api->iov_add(handler->iov,
-                        fcgi_pad, h->padding_length,
-                        MK_FALSE);
-    }
+void fcgi_params_free(struct fcgi_worker *worker)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct fcgi_params_prefix *prefix;
 
-    if (handler->stdin_offset + chunk == handler->stdin_length) {
-        eof = FCGI_BUF(handler);
-        fcgi_build_header((struct fcgi_record_header *) eof, FCGI_STDIN, 1, 0);
-        mk_api->iov_add(handler->iov, eof, FCGI_RECORD_HEADER_SIZE, MK_FALSE);
-        handler->buf_len += FCGI_RECORD_HEADER_SIZE + padding;
+    mk_list_foreach_safe(head, tmp, &worker->params) {
+        prefix = mk_list_entry(head, struct fcgi_params_prefix, _head);
+        mk_list_del(&prefix->_head);
+        mk_api->mem_free(prefix);
     }
+}
 
-    handler->stdin_offset += chunk;
-    return 0;
+/* Records needed to carry 'len' bytes of a stream, plus the empty one */
+static inline int fcgi_stream_records(size_t len)
+{
+    return (len + FCGI_PARAMS_RECORD - 1) / FCGI_PARAMS_RECORD + 1;
 }
 
-static inline int fcgi_add_stdin(struct fcgi_handler *handler)
+/*
+ * Queue the 'type' records carrying the buffers 'a' and 'b' one after the
+ * other, followed by the empty record that ends the stream. The data is
+ * referenced, the record headers are taken from 'hdrs'.
+ */
+static char *fcgi_add_stream(struct fcgi_handler *handler, int type, char *hdrs,
+                             char *a, size_t a_len, char *b, size_t b_len)
 {
-    uint64_t bytes = handler->sr->data.len;
+    size_t n;
+    size_t len;
+    struct fcgi_record_header *h;
 
-    if (bytes <= 0) {
-        return -1;
+    while (a_len + b_len > 0) {
+        len = a_len + b_len;
+        if (len > FCGI_PARAMS_RECORD) {
+            len = FCGI_PARAMS_RECORD;
+        }
+
+        h = (struct fcgi_record_header *) hdrs;
+        hdrs += FCGI_RECORD_HEADER_SIZE;
+        fcgi_build_header(h, type, handler->request_id, len);
+        h->padding_length = ~(len - 1) & 7;
+        mk_api->iov_add(handler->iov, h, FCGI_RECORD_HEADER_SIZE, MK_FALSE);
+
+        while (len > 0) {
+            if (a_len == 0) {
+                a = b;
+                a_len = b_len;
+                b_len = 0;
+            }
+            n = (a_len < len) ? a_len : len;
+            mk_api->iov_add(handler->iov, a, n, MK_FALSE);
+            a += n;
+            a_len -= n;
+            len -= n;
+        }
+
+        if (h->padding_length > 0) {
+            mk_api->iov_add(handler->iov, fcgi_pad, h->padding_length,
+                            MK_FALSE);
+        }
     }
 
-    handler->stdin_length = bytes;
-    handler->stdin_offset = 0;
-    handler->stdin_buffer = handler->sr->data.data;
-    fcgi_stdin_chunk(handler);
+    fcgi_build_header((struct fcgi_record_header *) hdrs, type,
+                      handler->request_id, 0);
+    mk_api->iov_add(handler->iov, hdrs, FCGI_RECORD_HEADER_SIZE, MK_FALSE);
 
-    return 0;
+    return hdrs + FCGI_RECORD_HEADER_SIZE;
 }
 
-static int fcgi_encode_request(struct fcgi_handler *handler)
+/*
+ * Encode the HTTP request as FastCGI records for the assigned request_id.
+ * The PARAMS stream is the prefix of the virtual host followed by the
+ * params of this request, which are encoded in a single buffer along
+ * with the record headers; the request body is sent from where it is.
+ */
+int fcgi_encode_request(struct fcgi_handler *handler, int keep_conn)
 {
     int ret;
+    int records;
+    size_t len;
+    char *p;
+    struct mk_list *head;
     struct mk_http_header *header;
+    struct mk_http_header *content_type;
+    struct mk_http_request *sr = handler->sr;
     struct fcgi_begin_request_record *request;
+    struct fcgi_params_prefix *prefix;
+    struct fcgi_params_net net;
 
     MK_TRACE("ENCODE REQUEST");
 
-    request = &handler->header_request;
-    fcgi_build_header(&request->header, FCGI_BEGIN_REQUEST, 1,
-                      FCGI_BEGIN_REQUEST_BODY_SIZE);
-
-    fcgi_build_request_body(&request->body);
-
-    /* BEGIN_REQUEST */
-    mk_api->iov_add(handler->iov,
-                    &handler->header_request,
-                    sizeof(handler->header_request),
-                    MK_FALSE);
-
-    /* Server Software */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("GATEWAY_INTERFACE"),
-                   FCGI_PARAM_CONST("CGI/1.1"));
-
-    /* Server Software */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("REDIRECT_STATUS"),
-                   FCGI_PARAM_CONST("200"));
+    prefix = fcgi_params_prefix(sr);
+    if (!prefix) {
+        return -1;
+    }
 
-    /* Server Software */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("SERVER_SOFTWARE"),
-                   FCGI_PARAM_DYN(mk_api->config->server_signature));
+    ret = fcgi_params_net(handler, &net);
+    if (ret == -1) {
+        return -1;
+    }
 
-    /* Server Name */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("SERVER_PROTOCOL"),
-                   FCGI_PARAM_CONST("HTTP/1.1"));
+    content_type = &handler->cs->parser.headers[MK_HEADER_CONTENT_TYPE];
 
-    /* Server Name */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("SERVER_NAME"),
-                   handler->sr->host_alias->name,
-                   handler->sr->host_alias->len,
-                   MK_FALSE);
+    len  = fcgi_param_size(11, strlen(net.server_addr));
+    len += fcgi_param_size(11, strlen(net.server_port));
+    len += fcgi_param_size(11, strlen(net.remote_addr));
+    len += fcgi_param_size(11, strlen(net.remote_port));
+    len += fcgi_param_size(15, sr->real_path.len);
+    len += fcgi_param_size(11, sr->uri_processed.len);
+    len += fcgi_param_size(14, sr->method_p.len);
+    len += fcgi_param_size(11, sr->uri.len);
+    if (sr->query_string.len > 0) {
+        len += fcgi_param_size(12, sr->query_string.len);
+    }
+    if (MK_SCHED_CONN_PROP(handler->cs->conn) & MK_CAP_SOCK_TLS) {
+        len += fcgi_param_size(5, 2);
+    }
+    if (sr->_content_length.data) {
+        len += fcgi_param_size(14, sr->_content_length.len);
+    }
+    if (content_type->type == MK_HEADER_CONTENT_TYPE) {
+        len += fcgi_param_size(12, content_type->val.len);
+    }
+    mk_list_foreach(head, &handler->cs->parser.header_list) {
+        header = mk_list_entry(head, struct mk_http_header, _head);
+        len += fcgi_param_size(header->key.len + 5, header->val.len);
+    }
 
-    /* Document Root */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("DOCUMENT_ROOT"),
-                   FCGI_PARAM_PTR(handler->sr->host_conf->documentroot));
+    /* A request replayed on another connection is encoded again */
+    if (handler->iov) {
+        mk_api->iov_free(handler->iov);
+    }
+    if (handler->req_buf) {
+        mk_api->mem_free(handler->req_buf);
+    }
 
-    /* Network params: SERVER_ADDR, SERVER_PORT, REMOTE_ADDR & REMOTE_PORT */
-    ret = fcgi_add_param_net(handler);
-    if (ret == -1) {
+    /* Every record takes its header, two data slices at most and padding */
+    records = fcgi_stream_records(prefix->len + len) +
+        fcgi_stream_records(sr->data.len);
+    handler->iov = mk_api->iov_create(1 + records * 4, 0);
+    handler->req_buf = mk_api->mem_alloc(len +
+                                         records * FCGI_RECORD_HEADER_SIZE);
+    if (!handler->iov || !handler->req_buf) {
         return -1;
     }
 
-    /* Script Filename */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("SCRIPT_FILENAME"),
-                   FCGI_PARAM_PTR(handler->sr->real_path));
-
-    /* Script Filename */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("SCRIPT_NAME"),
-                   FCGI_PARAM_PTR(handler->sr->uri_processed));
-
-    /* Request Method */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("REQUEST_METHOD"),
-                   FCGI_PARAM_PTR(handler->sr->method_p));
+    request = &handler->header_request;
+    fcgi_build_header(&request->header, FCGI_BEGIN_REQUEST,
+                      handler->request_id, FCGI_BEGIN_REQUEST_BODY_SIZE);
 
+    fcgi_build_request_body(&request->body, keep_conn);
 
-    /* Request URI */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("REQUEST_URI"),
-                   FCGI_PARAM_PTR(handler->sr->uri));
+    /* BEGIN_REQUEST */
+    mk_api->iov_add(handler->iov,
+                    &handler->header_request,
+                    sizeof(handler->header_request),
+                    MK_FALSE);
 
-    /* Query String */
-    if (handler->sr->query_string.len > 0) {
-        fcgi_add_param(handler,
-                       FCGI_PARAM_CONST("QUERY_STRING"),
-                       FCGI_PARAM_PTR(handler->sr->query_string));
+    p = handler->req_buf;
+    p = fcgi_param(p, FCGI_PARAM_CONST("SERVER_ADDR"),
+                   net.server_addr, strlen(net.server_addr));
+    p = fcgi_param(p, FCGI_PARAM_CONST("SERVER_PORT"),
+                   net.server_port, strlen(net.server_port));
+    p = fcgi_param(p, FCGI_PARAM_CONST("REMOTE_ADDR"),
+                   net.remote_addr, strlen(net.remote_addr));
+    p = fcgi_param(p, FCGI_PARAM_CONST("REMOTE_PORT"),
+                   net.remote_port, strlen(net.remote_port));
+    p = fcgi_param(p, FCGI_PARAM_CONST("SCRIPT_FILENAME"),
+                   FCGI_PARAM_PTR(sr->real_path));
+    p = fcgi_param(p, FCGI_PARAM_CONST("SCRIPT_NAME"),
+                   FCGI_PARAM_PTR(sr->uri_processed));
+    p = fcgi_param(p, FCGI_PARAM_CONST("REQUEST_METHOD"),
+                   FCGI_PARAM_PTR(sr->method_p));
+    p = fcgi_param(p, FCGI_PARAM_CONST("REQUEST_URI"),
+                   FCGI_PARAM_PTR(sr->uri));
+    if (sr->query_string.len > 0) {
+        p = fcgi_param(p, FCGI_PARAM_CONST("QUERY_STRING"),
+                       FCGI_PARAM_PTR(sr->query_string));
     }
-
-    /* HTTPS */
     if (MK_SCHED_CONN_PROP(handler->cs->conn) & MK_CAP_SOCK_TLS) {
-        fcgi_add_param(handler,
-                       FCGI_PARAM_CONST("HTTPS"),
-                       FCGI_PARAM_CONST("on"));
+        p = fcgi_param(p, FCGI_PARAM_CONST("HTTPS"), FCGI_PARAM_CONST("on"));
     }
-
-    /* Content Length */
-    if (handler->sr->_content_length.data) {
-        fcgi_add_param(handler,
-                       FCGI_PARAM_CONST("CONTENT_LENGTH"),
-                       FCGI_PARAM_PTR(handler->sr->_content_length));
+    if (sr->_content_length.data) {
+        p = fcgi_param(p, FCGI_PARAM_CONST("CONTENT_LENGTH"),
+                       FCGI_PARAM_PTR(sr->_content_length));
     }
-
-    /* Content Length */
-    header = &handler->cs->parser.headers[MK_HEADER_CONTENT_TYPE];
-    if (header->type == MK_HEADER_CONTENT_TYPE) {
-        fcgi_add_param(handler,
-                       FCGI_PARAM_CONST("CONTENT_TYPE"),
-                       FCGI_PARAM_PTR(header->val));
-
+    if (content_type->type == MK_HEADER_CONTENT_TYPE) {
+        p = fcgi_param(p, FCGI_PARAM_CONST("CONTENT_TYPE"),
+                       FCGI_PARAM_PTR(content_type->val));
     }
 
     /* Append HTTP request headers */
-    struct mk_list *head;
-    struct mk_http_header *http_header;
     mk_list_foreach(head, &handler->cs->parser.header_list) {
-        http_header = mk_list_entry(head, struct mk_http_header, _head);
-        fcgi_add_param_http_header(handler, http_header);
+        header = mk_list_entry(head, struct mk_http_header, _head);
+        p = fcgi_param_http_header(p, header);
     }
 
-    /* Append the empty params record */
-    fcgi_add_param_empty(handler);
-
-    /* Data for FCGI_STDIN */
-    fcgi_add_stdin(handler);
+    /* PARAMS, then the request body as FCGI_STDIN */
+    p = fcgi_add_stream(handler, FCGI_PARAMS, p,
+                        prefix->data, prefix->len, handler->req_buf, len);
+    fcgi_add_stream(handler, FCGI_STDIN, p,
+                    sr->data.data, sr->data.len, NULL, 0);
 
     return 0;
 }
 
-size_t fcgi_read_header(void *p, struct fcgi_record_header *h)
-{
-    memcpy(h, p, sizeof(struct fcgi_record_header));
-    h->request_id     = htons(h->request_id);
-    h->content_length = htons(h->content_length);
-
-	return sizeof(*h);
-}
-
-static inline int fcgi_buffer_consume(struct fcgi_handler *handler, size_t bytes)
-{
-    if (bytes >= handler->buf_len) {
-        handler->buf_len = 0;
-        return 0;
-    }
-
-    memmove(handler->buf_data, handler->buf_data + bytes,
-            handler->buf_len - bytes);
-    handler->buf_len -= bytes;
-    return 0;
-}
 
 static char *getearliestbreak(const char buf[], const unsigned bufsize,
                               unsigned char * const advance)
@@ -523,373 +495,335 @@ static char *getearliestbreak(const char buf[], const unsigned bufsize,
     return crend;
 }
 
-static int fcgi_write(struct fcgi_handler *handler, char *buf, size_t len)
+/* Find the 'Status:' line of the response headers, it's not sent as is */
+static char *fcgi_header_status(char *buf, size_t len,
+                                int *status, size_t *line_len)
 {
-    mk_stream_in_cbuf(handler->stream,
-                      NULL,
-                      buf, len,
-                      NULL, NULL);
+    char *p = buf;
+    char *eol;
+    char *end = buf + len;
 
-    if (handler->headers_set == MK_TRUE) {
-        mk_stream_in_cbuf(handler->stream,
-                          NULL,
-                          "\r\n", 2,
-                          NULL, NULL);
+    while (p < end) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            break;
+        }
+
+        if (eol - p > 7 && strncasecmp(p, "Status:", 7) == 0) {
+            *status = atoi(p + 7);
+            *line_len = (eol - p) + 1;
+            return p;
+        }
+        p = eol + 1;
     }
-    return 0;
+
+    return NULL;
 }
 
-void fcgi_stream_eof(struct mk_stream_input *in)
+static inline void fcgi_write(struct fcgi_handler *handler,
+                              char *buf, size_t len)
 {
-    (void) in;
-    // FIXME
-    //struct fcgi_handler *handler;
-
-    //handler = stream->data;
-    //if (handler->hangup == MK_FALSE) {
-    //    fcgi_exit(handler);
-    //}
+    mk_stream_in_cbuf(&handler->sr->stream,
+                      NULL,
+                      buf, len,
+                      NULL, NULL);
 }
 
-int fcgi_exit(struct fcgi_handler *handler)
+static void fcgi_rbuf_finished(struct mk_stream_input *in)
 {
-    /* Always disable any backend notification first */
-    if (handler->server_fd > 0) {
-        mk_api->ev_del(mk_api->sched_loop(), &handler->event);
-        close(handler->server_fd);
-        handler->server_fd = -1;
-    }
-
-    /*
-     * Before to exit our handler, we need to verify that our parent
-     * channel have sent the whole information, otherwise we may face
-     * some corruption. If there is still some data enqueued, just
-     * defer the exit process.
-     */
-    if (mk_channel_is_empty(handler->cs->channel) != 0 &&
-        handler->eof == MK_FALSE &&
-        handler->active == MK_TRUE) {
-        MK_TRACE("[fastcgi=%i] deferring exit, EOF stream",
-                 handler->server_fd);
-
-        /* Now set an EOF stream/callback to resume the exiting process */
-        mk_stream_in_eof(handler->stream,
-                         NULL,
-                         fcgi_stream_eof);
-        handler->eof = MK_TRUE;
-        return 1;
-    }
-
-    MK_TRACE("[fastcgi] exiting");
+    fcgi_rbuf_release(in->context);
+}
 
-    if (handler->iov) {
-        mk_api->iov_free(handler->iov);
-        mk_api->sched_event_free((struct mk_event *) handler);
-        handler->iov = NULL;
-    }
+/* Queue data of a receive buffer, which is held until it's sent */
+static int fcgi_write_ref(struct fcgi_handler *handler,
+                          struct fcgi_rbuf *rbuf, char *buf, size_t len)
+{
+    struct mk_stream_input *in;
 
-    if (handler->active == MK_TRUE) {
-        handler->active = MK_FALSE;
-        mk_api->http_request_end(handler->plugin, handler->cs, handler->hangup);
+    in = mk_api->mem_alloc(sizeof(struct mk_stream_input));
+    if (!in) {
+        return -1;
     }
 
-    return 1;
-}
+    mk_stream_in_raw(&handler->sr->stream, in, buf, len,
+                     NULL, fcgi_rbuf_finished);
+    in->dynamic = MK_TRUE;
+    in->context = rbuf;
+    rbuf->refs++;
 
-int fcgi_error(struct fcgi_handler *handler)
-{
-    fcgi_exit(handler);
-    mk_api->http_request_error(500, handler->cs, handler->sr, handler->plugin);
     return 0;
 }
 
-static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
+/*
+ * Response body. Data in a receive buffer is sent from there: the 'room'
+ * bytes before it were parsed already, so the chunk size line (and the
+ * end of the previous chunk) is written in place right before the data.
+ */
+static int fcgi_write_body(struct fcgi_handler *handler,
+                           struct fcgi_rbuf *rbuf, char *buf, size_t len,
+                           size_t room)
 {
-    int status;
-    int diff;
     int xlen;
     char tmp[16];
-    char *p;
-    char *end;
-    size_t p_len;
-    unsigned char advance;
-
-    MK_TRACE("[fastcgi=%i] process response len=%lu",
-             handler->server_fd, len);
 
-    p = buf;
-    p_len = len;
+    if (handler->chunked == MK_TRUE) {
+        xlen = snprintf(tmp, sizeof(tmp), "%s%x\r\n",
+                        handler->chunks > 0 ? "\r\n" : "",
+                        (unsigned int) len);
+        handler->chunks++;
 
-    if (len == 0 && handler->chunked && handler->headers_set == MK_TRUE) {
-        MK_TRACE("[fastcgi=%i] sending EOF", handler->server_fd);
-        mk_stream_in_cbuf(handler->stream,
-                          NULL,
-                          "0\r\n\r\n", 5,
-                          NULL, NULL);
-        mk_api->channel_flush(handler->cs->channel);
-        return 0;
-    }
-
-    if (handler->headers_set == MK_FALSE) {
-        advance = 4;
-
-        if (!buf) {
-            return -1;
-        }
-
-        end = getearliestbreak(buf, len, &advance);
-        if (!end) {
-            /* we need more data */
-            return -1;
-        }
-
-        handler->sr->headers.cgi = MK_TRUE;
-        if (strncasecmp(buf, "Status: ", 8) == 0) {
-            sscanf(buf + 8, "%d", &status);
-            MK_TRACE("FastCGI status %i", status);
-            mk_api->header_set_http_status(handler->sr, status);
+        if (rbuf && (size_t) xlen <= room) {
+            buf -= xlen;
+            len += xlen;
+            memcpy(buf, tmp, xlen);
         }
         else {
-            mk_api->header_set_http_status(handler->sr, 200);
-        }
-
-        /* Set transfer encoding */
-        if (handler->sr->protocol >= MK_HTTP_PROTOCOL_11) {
-            handler->sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
-            handler->chunked = MK_TRUE;
+            fcgi_write(handler, tmp, xlen);
         }
-
-        mk_api->header_prepare(handler->plugin, handler->cs, handler->sr);
-
-        diff = (end - buf) + advance;
-        fcgi_write(handler, buf, diff);
-
-        p = buf + diff;
-        p_len -= diff;
-        handler->write_rounds++;
-        handler->headers_set = MK_TRUE;
     }
 
-    if (p_len > 0) {
-        xlen = snprintf(tmp, 16, "%x\r\n", (unsigned int) p_len);
-        mk_stream_in_cbuf(handler->stream,
-                          NULL,
-                          tmp, xlen,
-                          NULL, NULL);
-        fcgi_write(handler, p, p_len);
+    if (rbuf) {
+        return fcgi_write_ref(handler, rbuf, buf, len);
     }
 
+    fcgi_write(handler, buf, len);
     return 0;
 }
 
-int cb_fastcgi_on_read(void *data)
+/* Headers block complete: prepare the HTTP response headers */
+static void fcgi_response_headers(struct fcgi_handler *handler,
+                                  char *buf, size_t len)
 {
-    int n;
-    int ret = 0;
-    int avail;
-    char *body;
-    size_t offset;
-    struct fcgi_handler *handler = data;
-    struct fcgi_record_header header;
-
-    if (handler->active == MK_FALSE) {
-        fcgi_exit(handler);
-        return -1;
+    int status = 200;
+    size_t line_len = 0;
+    char *line;
+    struct mk_http_request *sr = handler->sr;
+
+    line = fcgi_header_status(buf, len, &status, &line_len);
+    MK_TRACE("FastCGI status %i", status);
+
+    sr->headers.cgi = MK_TRUE;
+    mk_api->header_set_http_status(sr, status);
+
+    /* Set transfer encoding */
+    if (sr->protocol >= MK_HTTP_PROTOCOL_11 &&
+        (status < MK_REDIR_MULTIPLE || status > MK_REDIR_USE_PROXY)) {
+        sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+        handler->chunked = MK_TRUE;
     }
 
-    avail = FCGI_BUF_SIZE - handler->buf_len;
-    n = read(handler->server_fd, handler->buf_data + handler->buf_len, avail);
-    MK_TRACE("[fastcgi=%i] read()=%i", handler->server_fd, n);
-    if (n <= 0) {
-        MK_TRACE("[fastcgi=%i] FastCGI server ended", handler->server_fd);
-        fcgi_exit(handler);
-        return -1;
+    mk_api->header_prepare(handler->plugin, handler->cs, sr);
+
+    if (line) {
+        if (line > buf) {
+            fcgi_write(handler, buf, line - buf);
+        }
+        fcgi_write(handler, line + line_len, len - (line - buf) - line_len);
     }
     else {
-        handler->buf_len += n;
+        fcgi_write(handler, buf, len);
     }
 
-    if ((unsigned) handler->buf_len < FCGI_RECORD_HEADER_SIZE) {
-        /* wait for more data */
-        return n;
-    }
+    handler->headers_set = MK_TRUE;
+}
+
+/* FCGI_STDOUT content, returns -1 if the response cannot continue */
+static int fcgi_response(struct fcgi_handler *handler,
+                         struct fcgi_rbuf *rbuf, char *buf, size_t len)
+{
+    int ret;
+    char *end;
+    char *data;
+    size_t size;
+    size_t diff;
+    unsigned char advance;
 
-    while (1) {
-        /* decode the header */
-        fcgi_read_header(&handler->buf_data, &header);
+    MK_TRACE("[fastcgi] process response len=%lu", len);
 
-        if (header.type != FCGI_STDOUT && header.type != FCGI_STDERR &&
-            header.type != FCGI_END_REQUEST) {
-            fcgi_exit(handler);
+    if (handler->headers_set == MK_TRUE) {
+        ret = fcgi_write_body(handler, rbuf, buf, len,
+                              FCGI_RECORD_HEADER_SIZE);
+        if (ret == -1) {
             return -1;
         }
+        goto flush;
+    }
 
-        /* Check if the package is complete */
-        if (handler->buf_len < (FCGI_RECORD_HEADER_SIZE + header.content_length)) {
-            /* we need more data */
-            return n;
+    /* The headers may come in more than one record */
+    if (handler->headers_len == 0) {
+        data = buf;
+        size = len;
+    }
+    else {
+        if (handler->headers_len + len > FCGI_HEADERS_MAX) {
+            return -1;
         }
-
-        body = handler->buf_data + FCGI_RECORD_HEADER_SIZE;
-        switch (header.type) {
-        case FCGI_STDOUT:
-            MK_TRACE("[fastcgi=%i] FCGI_STDOUT content_length=%i",
-                     handler->server_fd, header.content_length);
-            /*
-             * Issue seen with Chrome & Firefox browsers:
-             * Sometimes content length is coming as ZERO and we are encoding a
-             * HTTP response packet with ZERO size data. This makes Chrome & Firefox
-             * browsers fail to proceed furhter and subsequent content loading fails.
-             * However, IE/Safari discards the packets with ZERO size data.
-             */
-            if (0 != header.content_length) {
-                ret = fcgi_response(handler, body, header.content_length);
+        memcpy(handler->headers_buf + handler->headers_len, buf, len);
+        handler->headers_len += len;
+        data = handler->headers_buf;
+        size = handler->headers_len;
+    }
+
+    advance = 4;
+    end = getearliestbreak(data, size, &advance);
+    if (!end) {
+        /* we need more data */
+        if (data == buf) {
+            if (len > FCGI_HEADERS_MAX) {
+                return -1;
             }
-            else {
-                MK_TRACE("[fastcgi=%i] ZERO byte content length in FCGI_STDOUT, discard!!",
-                         handler->server_fd);
-                ret = 0;
+            if (!handler->headers_buf) {
+                handler->headers_buf = mk_api->mem_alloc(FCGI_HEADERS_MAX);
+                if (!handler->headers_buf) {
+                    return -1;
+                }
             }
-            break;
-        case FCGI_STDERR:
-            MK_TRACE("[fastcgi=%i] FCGI_STDERR content_length=%i",
-                     handler->server_fd, header.content_length);
-            break;
-        case FCGI_END_REQUEST:
-            MK_TRACE("[fastcgi=%i] FCGI_END_REQUEST content_length=%i",
-                     handler->server_fd, header.content_length);
-            ret = fcgi_response(handler, NULL, 0);
-            break;
-        default:
-            //fcgi_exit(handler);
-            return -1;
+            memcpy(handler->headers_buf, buf, len);
+            handler->headers_len = len;
         }
+        return 0;
+    }
+
+    diff = (end - data) + advance;
+    fcgi_response_headers(handler, data, diff);
 
+    if (size > diff) {
+        /* Body data copied to headers_buf along with the headers */
+        if (data != buf) {
+            rbuf = NULL;
+        }
+        ret = fcgi_write_body(handler, rbuf, data + diff, size - diff,
+                              FCGI_RECORD_HEADER_SIZE + diff);
         if (ret == -1) {
-            /* Missing header breaklines ? */
-            return n;
+            return -1;
         }
+    }
 
-        /* adjust buffer content */
-        offset = FCGI_RECORD_HEADER_SIZE +
-            header.content_length + header.padding_length;
-
-        fcgi_buffer_consume(handler, offset);
+ flush:
+    ret = mk_api->channel_flush(handler->cs->channel);
+    if (ret & MK_CHANNEL_ERROR) {
+        return -1;
     }
-    return n;
+
+    return 0;
 }
 
-int cb_fastcgi_request_flush(void *data)
+/* Release the handler and end the HTTP request */
+static int fcgi_handler_finish(struct fcgi_handler *handler, int close)
 {
-    int ret;
-    size_t count = 0;
-    struct fcgi_handler *handler = data;
-
-    ret = mk_api->channel_write(&handler->fcgi_channel, &count);
-
-    MK_TRACE("[fastcgi=%i] %lu bytes, ret=%i",
-             handler->server_fd, count, ret);
-
-    if (ret == MK_CHANNEL_DONE || ret == MK_CHANNEL_EMPTY) {
-        /* Do we have more data for the stdin ? */
-        if (handler->stdin_length - handler->stdin_offset > 0) {
-            mk_api->iov_free(handler->iov);
-            handler->iov = mk_api->iov_create(64, 0);
-            fcgi_stdin_chunk(handler);
-
-            mk_api->stream_set(&handler->fcgi_stream,
-                               MK_STREAM_IOV,
-                               &handler->fcgi_channel,
-                               handler->iov,
-                               -1,
-                               handler,
-                               NULL, NULL, NULL);
-            return MK_CHANNEL_FLUSH;
-        }
+    struct mk_plugin *plugin = handler->plugin;
+    struct mk_http_session *cs = handler->cs;
 
-        /* Request done, switch the event side to receive the FCGI response */
-        handler->buf_len = 0;
-        handler->event.handler = cb_fastcgi_on_read;
-        ret = mk_api->ev_add(mk_api->sched_loop(),
-                             handler->server_fd,
-                             MK_EVENT_CUSTOM, MK_EVENT_READ, handler);
-        if (ret == -1) {
-            goto error;
-        }
-    }
-    else if (ret == MK_CHANNEL_ERROR) {
-        fcgi_exit(handler);
-    }
-    else if (ret == MK_CHANNEL_BUSY) {
-        return -1;
+    fcgi_pool_detach(handler);
+    handler->sr->handler_data = NULL;
+    fcgi_handler_free(handler);
+
+    return mk_api->http_request_end(plugin, cs, close);
+}
+
+/*
+ * The request cannot be served: reply with an error while the response
+ * headers were not sent yet, otherwise the client connection is closed.
+ */
+int fcgi_handler_fail(struct fcgi_handler *handler)
+{
+    struct mk_http_request *sr = handler->sr;
+
+    handler->failed = MK_TRUE;
+
+    if (handler->headers_set == MK_TRUE) {
+        return fcgi_handler_finish(handler, MK_TRUE);
     }
 
-    return ret;
+    mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+    sr->headers.content_length = 0;
+    mk_api->header_prepare(handler->plugin, handler->cs, sr);
+    mk_api->channel_flush(handler->cs->channel);
 
- error:
-    return -1;
+    return fcgi_handler_finish(handler, handler->hangup);
 }
 
-/* Callback: on connect to the backend server */
-static int fastcgi_on_connect(struct fcgi_handler *handler)
+/* A record for this request arrived from the FastCGI server */
+int fcgi_handler_record(struct fcgi_handler *handler,
+                        struct fcgi_record_header *header,
+                        struct fcgi_rbuf *rbuf, char *body)
 {
     int ret;
-    int s_err;
-    size_t count;
-    socklen_t s_len = sizeof(s_err);
-    struct mk_list *head;
-    struct mk_plugin *pio;
-    struct mk_channel *channel;
 
-    /* Convert the original request to FCGI format */
-    ret = fcgi_encode_request(handler);
-    if (ret == -1) {
-        goto error;
-    }
+    handler->response_bytes += FCGI_RECORD_HEADER_SIZE + header->content_length;
+
+    switch (header->type) {
+    case FCGI_STDOUT:
+        MK_TRACE("[fastcgi] FCGI_STDOUT content_length=%i",
+                 header->content_length);
+        /*
+         * Issue seen with Chrome & Firefox browsers:
+         * Sometimes content length is coming as ZERO and we are encoding a
+         * HTTP response packet with ZERO size data. This makes Chrome & Firefox
+         * browsers fail to proceed furhter and subsequent content loading fails.
+         * However, IE/Safari discards the packets with ZERO size data.
+         */
+        if (header->content_length == 0) {
+            return 0;
+        }
 
-    /* Prepare the channel */
-    channel = &handler->fcgi_channel;
-    channel->type = MK_CHANNEL_SOCKET;
-    channel->fd   = handler->server_fd;
+        ret = fcgi_response(handler, rbuf, body, header->content_length);
+        if (ret == -1) {
+            fcgi_handler_fail(handler);
+            return -1;
+        }
+        break;
+    case FCGI_STDERR:
+        MK_TRACE("[fastcgi] FCGI_STDERR content_length=%i",
+                 header->content_length);
+        break;
+    case FCGI_END_REQUEST:
+        MK_TRACE("[fastcgi] FCGI_END_REQUEST content_length=%i",
+                 header->content_length);
+        if (handler->headers_set == MK_FALSE) {
+            fcgi_handler_fail(handler);
+            return -1;
+        }
 
-    /* FIXME: Discovery process needs to be fast */
-    mk_list_foreach(head, &mk_api->config->plugins) {
-        pio = mk_list_entry(head, struct mk_plugin, _head);
-        if (strncmp(pio->shortname, "liana", 5) == 0) {
-            break;
+        if (handler->chunked == MK_TRUE) {
+            /* Ends the last chunk, if any, and the body */
+            if (handler->chunks > 0) {
+                mk_stream_in_raw(&handler->sr->stream, NULL,
+                                 fcgi_chunk_end, 7, NULL, NULL);
+            }
+            else {
+                mk_stream_in_raw(&handler->sr->stream, NULL,
+                                 fcgi_chunk_end + 2, 5, NULL, NULL);
+            }
+            mk_api->channel_flush(handler->cs->channel);
         }
-        pio = NULL;
+        return fcgi_handler_finish(handler, handler->hangup);
     }
-    channel->io   = pio->network;
-
-    mk_list_init(&channel->streams);
-    mk_api->stream_set(&handler->fcgi_stream,
-                       MK_STREAM_IOV,
-                       &handler->fcgi_channel,
-                       handler->iov,
-                       -1,
-                       handler,
-                       NULL, NULL, NULL);
-
-    handler->event.handler = cb_fastcgi_request_flush;
-    handler->event.data = handler;
 
     return 0;
+}
 
- error:
-    fcgi_error(handler);
-    mk_api->channel_write(handler->cs->channel, &count);
-    return 0;
+void fcgi_handler_free(struct fcgi_handler *handler)
+{
+    if (handler->iov) {
+        mk_api->iov_free(handler->iov);
+    }
+    if (handler->req_buf) {
+        mk_api->mem_free(handler->req_buf);
+    }
+    if (handler->headers_buf) {
+        mk_api->mem_free(handler->headers_buf);
+    }
+    mk_api->mem_free(handler);
 }
 
 struct fcgi_handler *fcgi_handler_new(struct mk_plugin *plugin,
                                       struct mk_http_session *cs,
-                                      struct mk_http_request *sr)
+                                      struct mk_http_request *sr,
+                                      struct fcgi_group *group)
 {
     int ret;
-    int entries;
     struct fcgi_handler *h = NULL;
-    struct mk_net_connection *conn = NULL;
 
     /* Allocate handler instance and set fields */
     h = mk_api->mem_alloc_z(sizeof(struct fcgi_handler));
@@ -897,32 +831,11 @@ struct fcgi_handler *fcgi_handler_new(struct mk_plugin *plugin,
         return NULL;
     }
 
-    stream = mk_stream_set(NULL, cs->channel, h,
-                           NULL, NULL, NULL);
-    if (!stream) {
-        mk_api->mem_free(h);
-        return NULL;
-    }
-
-    h->stream = stream;
     h->plugin = plugin;
     h->cs = cs;
     h->sr = sr;
-    h->write_rounds = 0;
-    h->active = MK_TRUE;
-    h->server_fd = -1;
-    h->eof = MK_FALSE;
-    h->stdin_length = 0;
-    h->stdin_offset = 0;
-    h->stdin_buffer = NULL;
-    h->conn         = NULL;
-
-    /* Allocate enough space for our data */
-    entries = 128 + (cs->parser.header_count * 3);
-    h->iov = mk_api->iov_create(entries, 0);
-
-    /* Associate the handler with the Session Request */
-    sr->handler_data = h;
+    h->retried = MK_FALSE;
+    h->group = group;
 
     if (sr->protocol >= MK_HTTP_PROTOCOL_11) {
         h->hangup = MK_FALSE;
@@ -931,36 +844,14 @@ struct fcgi_handler *fcgi_handler_new(struct mk_plugin *plugin,
         h->hangup = MK_TRUE;
     }
 
-    /* Params buffer set an offset to include the header */
-    h->buf_len = FCGI_RECORD_HEADER_SIZE;
-
-    /* Request and async connection to the server */
-    if (fcgi_conf.server_addr) {
-        conn = mk_api->net_conn_create(fcgi_conf.server_addr,
-                                       atoi(fcgi_conf.server_port));
-        if (!conn) {
-            goto error;
-        }
-        h->conn      = conn;
-        h->server_fd = conn->fd;
-    }
-    else if (fcgi_conf.server_path) {
-        /* FIXME: unix socket connection NOT FUNCTIONAL for now */
-        h->server_fd = mk_api->socket_open(fcgi_conf.server_path, MK_TRUE);
-    }
-
-    if (h->server_fd == -1) {
-        goto error;
+    /* Take a server and a connection to it, or wait for one */
+    ret = fcgi_pool_attach(h);
+    if (ret == -1) {
+        fcgi_handler_free(h);
+        return NULL;
     }
 
-    fastcgi_on_connect(h);
+    /* Associate the handler with the Session Request */
+    sr->handler_data = h;
     return h;
-
- error:
-    mk_api->iov_free(h->iov);
-    mk_api->mem_free(h);
-    sr->handler_data = NULL;
-    mk_api->http_request_error(500, cs, sr, plugin);
-
-    return NULL;
 }
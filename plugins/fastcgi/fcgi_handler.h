@@ -57,6 +57,9 @@ struct fcgi_begin_request_record {
 #define FCGI_AUTHORIZER 2
 #define FCGI_FILTER     3
 
+/* Mask for flags component of FCGI_BeginRequestBody */
+#define FCGI_KEEP_CONN  1
+
 /*
  * Values for type component of FCGI_Header
  */
@@ -71,44 +74,71 @@ struct fcgi_begin_request_record {
 #define FCGI_GET_VALUES          9
 #define FCGI_GET_VALUES_RESULT  10
 
+/* Largest response header block accepted from the backend */
+#define FCGI_HEADERS_MAX      FCGI_RECORD_MAX_SIZE
+
+/* PARAMS record content, the last one is padded */
+#define FCGI_PARAMS_RECORD    65528
+
+struct fcgi_conn;
+struct fcgi_pool;
+struct fcgi_group;
+struct fcgi_rbuf;
+struct fcgi_worker;
+
+/*
+ * PARAMS that only depend on the virtual host and the name it was
+ * reached by, encoded once per worker and shared by its requests.
+ */
+struct fcgi_params_prefix {
+    struct mk_vhost *host;
+    struct mk_vhost_alias *alias;
+    size_t len;
+    char *data;
+    struct mk_list _head;
+};
+
 /*
  * FastCGI Handler context, it keeps information of states and other
  * request/response references.
  */
 struct fcgi_handler {
-    struct mk_event event;       /* built-in event-loop data */
-
-    int server_fd;               /* backend FastCGI server         */
     int chunked;                 /* chunked response ?             */
-    int active;                  /* is this handler active ?       */
     int hangup;                  /* hangup connection once ready ? */
     int headers_set;             /* headers set ?                  */
-    int eof;                     /* exiting: MK_TRUE / MK_FALSE    */
-
-    /* stdin data */
-    uint64_t stdin_length;
-    uint64_t stdin_offset;
-    char *stdin_buffer;
+    int retried;                 /* request replayed once ?        */
+    int failed;                  /* ended with an error ?          */
+    int chunks;                  /* body chunks sent               */
 
+    struct mk_plugin *plugin;    /* plugin context                 */
     struct mk_http_session *cs;  /* HTTP session context           */
     struct mk_http_request *sr;  /* HTTP request context           */
 
     /* FastCGI */
+    uint16_t request_id;         /* request id on the connection   */
     struct fcgi_begin_request_record header_request;
 
-    uint64_t write_rounds;
-    unsigned int buf_len;
-    char buf_data[FCGI_BUF_SIZE];
+    uint64_t request_sent;       /* bytes written to the backend   */
+    uint64_t response_bytes;     /* bytes received from backend    */
 
-    /* Channel to stream request to the FCGI server */
-    struct mk_channel fcgi_channel;
-    struct mk_stream  fcgi_stream;
+    /* Response headers split across STDOUT records */
+    char *headers_buf;
+    unsigned int headers_len;
 
+    /* Encoded request, written to the backend from iov_pos */
     struct mk_iov *iov;
-    struct mk_list _head;
+    int iov_pos;
+    char *req_buf;               /* request PARAMS and headers     */
 
-    /* TCP connection context */
-    struct mk_net_connection *conn;
+    /* Servers group, server and connection serving the request */
+    struct fcgi_group *group;
+    struct fcgi_pool *pool;
+    struct fcgi_conn *conn;
+    uint64_t tried;              /* servers that failed, by index  */
+    uint64_t start;              /* usec, latency counter          */
+
+    /* Link to the connection write queue or the pool wait queue */
+    struct mk_list _head;
 };
 
 static inline void fcgi_encode16(void *a, unsigned b)
@@ -121,8 +151,15 @@ static inline void fcgi_encode16(void *a, unsigned b)
 
 struct fcgi_handler *fcgi_handler_new(struct mk_plugin *plugin,
                                       struct mk_http_session *cs,
-                                      struct mk_http_request *sr);
-
-int fcgi_exit(struct fcgi_handler *handler);
+                                      struct mk_http_request *sr,
+                                      struct fcgi_group *group);
+
+int fcgi_encode_request(struct fcgi_handler *handler, int keep_conn);
+int fcgi_handler_record(struct fcgi_handler *handler,
+                        struct fcgi_record_header *header,
+                        struct fcgi_rbuf *rbuf, char *body);
+int fcgi_handler_fail(struct fcgi_handler *handler);
+void fcgi_handler_free(struct fcgi_handler *handler);
+void fcgi_params_free(struct fcgi_worker *worker);
 
 #endif
@@ -0,0 +1,1223 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <limits.h>
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+#include "fcgi_pool.h"
+#include "fcgi_upstream.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * Every worker owns a pool of connections to each FastCGI server. Requests
+ * are sent with FCGI_KEEP_CONN so the server leaves the connection open
+ * once the response is done, and the next request reuses it. If the server
+ * reports FCGI_MPXS_CONNS, concurrent requests share a connection and are
+ * told apart by their request_id.
+ */
+static pthread_key_t fcgi_worker_key;
+
+/* Workers state, to report the counters on exit */
+static struct mk_list fcgi_workers;
+static pthread_mutex_t fcgi_workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int fcgi_conn_event(void *data);
+static void fcgi_conn_error(struct fcgi_conn *conn);
+static void fcgi_conn_release(struct fcgi_conn *conn);
+static int fcgi_pool_failover(struct fcgi_handler *handler);
+static void fcgi_pool_pump(struct fcgi_pool *pool);
+
+static inline struct fcgi_worker *fcgi_worker_get()
+{
+    return pthread_getspecific(fcgi_worker_key);
+}
+
+struct fcgi_worker *fcgi_pool_worker()
+{
+    return fcgi_worker_get();
+}
+
+static struct fcgi_rbuf *fcgi_rbuf_get(struct fcgi_worker *worker)
+{
+    struct fcgi_rbuf *rbuf;
+
+    if (mk_list_is_empty(&worker->rbufs) != 0) {
+        rbuf = mk_list_entry_last(&worker->rbufs, struct fcgi_rbuf, _head);
+        mk_list_del(&rbuf->_head);
+        worker->rbufs_free--;
+    }
+    else {
+        rbuf = mk_api->mem_alloc(sizeof(struct fcgi_rbuf));
+        if (!rbuf) {
+            return NULL;
+        }
+    }
+
+    rbuf->refs = 1;
+    return rbuf;
+}
+
+/* Drop a reference, the last one hands the buffer back to the worker */
+void fcgi_rbuf_release(struct fcgi_rbuf *rbuf)
+{
+    struct fcgi_worker *worker;
+
+    if (--rbuf->refs > 0) {
+        return;
+    }
+
+    worker = fcgi_worker_get();
+    if (worker && worker->rbufs_free < FCGI_RBUF_FREE_MAX) {
+        mk_list_add(&rbuf->_head, &worker->rbufs);
+        worker->rbufs_free++;
+        return;
+    }
+
+    mk_api->mem_free(rbuf);
+}
+
+static inline uint64_t fcgi_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* No more connections can be opened to the server, for now */
+static inline int fcgi_pool_full(struct fcgi_pool *pool)
+{
+    return (pool->resolving == MK_TRUE ||
+            (pool->server->max_conns > 0 &&
+             pool->count >= pool->server->max_conns));
+}
+
+/* FCGI_GET_VALUES record asking for FCGI_MPXS_CONNS and FCGI_MAX_REQS */
+static int fcgi_get_values(char *buf)
+{
+    char *p;
+    struct fcgi_record_header *h;
+
+    h = (struct fcgi_record_header *) buf;
+    p = buf + FCGI_RECORD_HEADER_SIZE;
+
+    *p++ = sizeof("FCGI_MPXS_CONNS") - 1;
+    *p++ = 0;
+    memcpy(p, "FCGI_MPXS_CONNS", sizeof("FCGI_MPXS_CONNS") - 1);
+    p += sizeof("FCGI_MPXS_CONNS") - 1;
+
+    *p++ = sizeof("FCGI_MAX_REQS") - 1;
+    *p++ = 0;
+    memcpy(p, "FCGI_MAX_REQS", sizeof("FCGI_MAX_REQS") - 1);
+    p += sizeof("FCGI_MAX_REQS") - 1;
+
+    h->version = FCGI_VERSION_1;
+    h->type = FCGI_GET_VALUES;
+    fcgi_encode16(&h->request_id, 0);
+    fcgi_encode16(&h->content_length, p - buf - FCGI_RECORD_HEADER_SIZE);
+    h->padding_length = 0;
+    h->reserved = 0;
+
+    return p - buf;
+}
+
+static inline size_t fcgi_read_length(unsigned char *p, size_t avail,
+                                      size_t *len)
+{
+    if (avail < 1) {
+        return 0;
+    }
+
+    if ((p[0] & 0x80) == 0) {
+        *len = p[0];
+        return 1;
+    }
+
+    if (avail < 4) {
+        return 0;
+    }
+
+    *len = ((p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    return 4;
+}
+
+/* FCGI_GET_VALUES_RESULT: learn whether requests can be multiplexed */
+static void fcgi_get_values_result(struct fcgi_conn *conn,
+                                   unsigned char *body, size_t size)
+{
+    int i;
+    int num;
+    size_t n;
+    size_t off = 0;
+    size_t key_len;
+    size_t val_len;
+    char val[16];
+    struct fcgi_pool *pool = conn->pool;
+    struct mk_list *head;
+    struct fcgi_conn *c;
+
+    while (off < size) {
+        n = fcgi_read_length(body + off, size - off, &key_len);
+        if (n == 0) {
+            return;
+        }
+        off += n;
+
+        n = fcgi_read_length(body + off, size - off, &val_len);
+        if (n == 0 || off + n + key_len + val_len > size) {
+            return;
+        }
+        off += n;
+
+        if (val_len >= sizeof(val)) {
+            off += key_len + val_len;
+            continue;
+        }
+
+        memcpy(val, body + off + key_len, val_len);
+        val[val_len] = '\0';
+        num = atoi(val);
+
+        if (key_len == sizeof("FCGI_MPXS_CONNS") - 1 &&
+            strncmp((char *) body + off, "FCGI_MPXS_CONNS", key_len) == 0) {
+            pool->mpxs = (num > 0);
+        }
+        else if (key_len == sizeof("FCGI_MAX_REQS") - 1 &&
+                 strncmp((char *) body + off, "FCGI_MAX_REQS", key_len) == 0) {
+            pool->max_reqs = num;
+        }
+        off += key_len + val_len;
+    }
+
+    if (pool->mpxs == -1) {
+        pool->mpxs = 0;
+    }
+
+    if (pool->mpxs == 0) {
+        return;
+    }
+
+    /* Open up the slots of the connections already established */
+    num = FCGI_CONN_SLOTS_MAX;
+    if (pool->max_reqs > 0 && pool->max_reqs < num) {
+        num = pool->max_reqs;
+    }
+
+    for (i = 0; i < 2; i++) {
+        mk_list_foreach(head, i == 0 ? &pool->busy : &pool->idle_list) {
+            c = mk_list_entry(head, struct fcgi_conn, _head);
+            c->slots_size = num;
+        }
+    }
+}
+
+/* Register for read events, and write events when there is data to send */
+static int fcgi_conn_update(struct fcgi_conn *conn)
+{
+    uint32_t mask = MK_EVENT_READ;
+
+    if (conn->status == FCGI_CONN_CONNECTING || conn->out_len > 0 ||
+        mk_list_is_empty(&conn->writes) != 0) {
+        mask |= MK_EVENT_WRITE;
+    }
+
+    if (conn->event.mask == mask) {
+        return 0;
+    }
+
+    return mk_api->ev_add(mk_api->sched_loop(), conn->fd,
+                          MK_EVENT_CUSTOM, mask, conn);
+}
+
+/* The server name is resolved: open connections for the requests queued */
+static void fcgi_pool_resolved(void *data, int status, struct mk_net_addr *addr)
+{
+    struct fcgi_pool *pool = data;
+    (void) status;
+    (void) addr;
+
+    pool->resolving = MK_FALSE;
+    fcgi_pool_pump(pool);
+}
+
+/*
+ * Open a socket to the server. A host name is resolved off the event loop:
+ * on a cache miss the pool waits for the answer, requests are queued.
+ */
+static int fcgi_conn_connect(struct fcgi_pool *pool)
+{
+    int fd;
+    int ret;
+    struct mk_net_addr addr;
+    struct mk_net_addr *net;
+    struct fcgi_server *server = pool->server;
+
+    net = &server->net;
+    if (server->lookup == MK_TRUE) {
+        ret = mk_api->net_resolve(server->addr, server->port, &addr,
+                                  fcgi_pool_resolved, pool);
+        if (ret == MK_RESOLVER_WAIT) {
+            pool->resolving = MK_TRUE;
+            return -1;
+        }
+        else if (ret == -1) {
+            mk_warn("[fastcgi] cannot resolve %s: %s",
+                    server->addr, strerror(errno));
+            return -1;
+        }
+        net = &addr;
+    }
+
+    fd = mk_api->net_connect(net);
+    if (fd == -1) {
+        mk_warn("[fastcgi] cannot connect to %s: %s",
+                server->name, strerror(errno));
+    }
+
+    return fd;
+}
+
+static struct fcgi_conn *fcgi_conn_create(struct fcgi_pool *pool)
+{
+    int fd;
+    int ret;
+    struct fcgi_conn *conn;
+    struct fcgi_server *server = pool->server;
+
+    fd = fcgi_conn_connect(pool);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    conn = mk_api->mem_alloc_z(sizeof(struct fcgi_conn));
+    if (!conn) {
+        close(fd);
+        return NULL;
+    }
+
+    conn->rbuf = fcgi_rbuf_get(fcgi_worker_get());
+    if (!conn->rbuf) {
+        close(fd);
+        mk_api->mem_free(conn);
+        return NULL;
+    }
+
+    MK_EVENT_INIT(&conn->event, fd, conn, fcgi_conn_event);
+    conn->fd = fd;
+    conn->status = FCGI_CONN_CONNECTING;
+    conn->pool = pool;
+    mk_list_init(&conn->writes);
+
+    if (server->multiplex == FCGI_MPX_ON) {
+        conn->slots_size = FCGI_CONN_SLOTS_MAX;
+    }
+    else if (server->multiplex == FCGI_MPX_AUTO && pool->mpxs == 1) {
+        conn->slots_size = FCGI_CONN_SLOTS_MAX;
+        if (pool->max_reqs > 0 && pool->max_reqs < conn->slots_size) {
+            conn->slots_size = pool->max_reqs;
+        }
+    }
+    else {
+        conn->slots_size = 1;
+    }
+
+    /* Ask once what the server can do */
+    if (server->multiplex == FCGI_MPX_AUTO && pool->mpxs == -1 &&
+        pool->connects == 0) {
+        conn->out_len = fcgi_get_values(conn->out_buf);
+    }
+
+    ret = fcgi_conn_update(conn);
+    if (ret == -1) {
+        close(fd);
+        fcgi_rbuf_release(conn->rbuf);
+        mk_api->mem_free(conn);
+        return NULL;
+    }
+
+    mk_list_add(&conn->_head, &pool->busy);
+    pool->count++;
+    pool->connects++;
+
+    MK_TRACE("[fastcgi=%i] new backend connection", fd);
+    return conn;
+}
+
+static void fcgi_conn_close(struct fcgi_conn *conn)
+{
+    struct fcgi_pool *pool = conn->pool;
+
+    if (conn->status == FCGI_CONN_CLOSED) {
+        return;
+    }
+
+    MK_TRACE("[fastcgi=%i] close backend connection", conn->fd);
+
+    mk_api->ev_del(mk_api->sched_loop(), &conn->event);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->status = FCGI_CONN_CLOSED;
+    conn->closed_tick = pool->ticks;
+
+    if (conn->idle_since > 0) {
+        pool->idle--;
+    }
+
+    mk_list_del(&conn->_head);
+    mk_list_add(&conn->_head, &pool->closed);
+    pool->count--;
+}
+
+/* A kept alive connection the server closed meanwhile is not usable */
+static int fcgi_conn_alive(struct fcgi_conn *conn)
+{
+    int ret;
+    char c;
+
+    if (conn->status != FCGI_CONN_READY) {
+        return MK_TRUE;
+    }
+
+    ret = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/* Find a connection with a free slot, open one if allowed */
+static struct fcgi_conn *fcgi_pool_conn_get(struct fcgi_pool *pool)
+{
+    struct mk_list *head;
+    struct fcgi_conn *conn;
+    struct fcgi_conn *best = NULL;
+
+    /* Multiplexing: the busy connection with fewer requests in flight */
+    mk_list_foreach(head, &pool->busy) {
+        conn = mk_list_entry(head, struct fcgi_conn, _head);
+        if (conn->requests >= conn->slots_size) {
+            continue;
+        }
+        if (!best || conn->requests < best->requests) {
+            best = conn;
+        }
+    }
+
+    if (best) {
+        return best;
+    }
+
+    /* Most recently used idle connection, it's the less likely to be gone */
+    while (mk_list_is_empty(&pool->idle_list) != 0) {
+        conn = mk_list_entry_last(&pool->idle_list, struct fcgi_conn, _head);
+        if (fcgi_conn_alive(conn) == MK_FALSE) {
+            fcgi_conn_close(conn);
+            continue;
+        }
+
+        mk_list_del(&conn->_head);
+        mk_list_add(&conn->_head, &pool->busy);
+        conn->idle_since = 0;
+        pool->idle--;
+        pool->reuses++;
+        return conn;
+    }
+
+    if (fcgi_pool_full(pool)) {
+        return NULL;
+    }
+
+    return fcgi_conn_create(pool);
+}
+
+/* Take a slot on the connection and queue the request to be written */
+static int fcgi_conn_assign(struct fcgi_conn *conn, struct fcgi_handler *handler)
+{
+    int i;
+    int ret;
+
+    for (i = 0; i < conn->slots_size; i++) {
+        if (!conn->slots[i]) {
+            break;
+        }
+    }
+
+    if (i == conn->slots_size) {
+        return -1;
+    }
+
+    handler->conn = conn;
+    handler->request_id = i + 1;
+    handler->request_sent = 0;
+    handler->iov_pos = 0;
+
+    ret = fcgi_encode_request(handler, conn->pool->server->keepalive);
+    if (ret == -1) {
+        handler->conn = NULL;
+        fcgi_conn_release(conn);
+        return -1;
+    }
+
+    conn->slots[i] = handler;
+    conn->requests++;
+    mk_list_add(&handler->_head, &conn->writes);
+
+    /*
+     * The request is written from the event loop: writing it here could
+     * end the HTTP request before the caller returns.
+     */
+    ret = fcgi_conn_update(conn);
+    if (ret == -1) {
+        mk_list_del(&handler->_head);
+        conn->slots[i] = NULL;
+        conn->requests--;
+        handler->conn = NULL;
+        fcgi_conn_close(conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Hand waiting requests to connections released or closed */
+static void fcgi_pool_pump(struct fcgi_pool *pool)
+{
+    int ret;
+    struct fcgi_conn *conn;
+    struct fcgi_handler *handler;
+
+    while (mk_list_is_empty(&pool->queue) != 0) {
+        conn = fcgi_pool_conn_get(pool);
+        if (!conn && fcgi_pool_full(pool)) {
+            return;
+        }
+
+        handler = mk_list_entry_first(&pool->queue, struct fcgi_handler, _head);
+        mk_list_del(&handler->_head);
+
+        if (conn) {
+            ret = fcgi_conn_assign(conn, handler);
+        }
+        else {
+            /* The server is not reachable anymore, try another one */
+            fcgi_upstream_failure(pool);
+            ret = fcgi_pool_failover(handler);
+        }
+        if (ret == -1) {
+            fcgi_handler_fail(handler);
+        }
+    }
+}
+
+/* No requests in flight: keep the connection for later or close it */
+static void fcgi_conn_release(struct fcgi_conn *conn)
+{
+    struct fcgi_pool *pool = conn->pool;
+    struct fcgi_server *server = pool->server;
+
+    if (conn->status == FCGI_CONN_CLOSED || conn->requests > 0) {
+        return;
+    }
+
+    if (server->keepalive == MK_FALSE ||
+        (server->max_requests > 0 &&
+         conn->served >= (uint64_t) server->max_requests) ||
+        pool->idle >= server->max_idle) {
+        fcgi_conn_close(conn);
+    }
+    else {
+        mk_list_del(&conn->_head);
+        mk_list_add(&conn->_head, &pool->idle_list);
+        conn->idle_since = mk_api->time_unix();
+        pool->idle++;
+    }
+
+    fcgi_pool_pump(pool);
+}
+
+static inline void fcgi_iov_advance(struct fcgi_handler *handler, size_t bytes)
+{
+    struct iovec *io;
+
+    handler->request_sent += bytes;
+    while (handler->iov_pos < handler->iov->iov_idx) {
+        io = &handler->iov->io[handler->iov_pos];
+        if (bytes < io->iov_len) {
+            io->iov_base = (char *) io->iov_base + bytes;
+            io->iov_len -= bytes;
+            return;
+        }
+        bytes -= io->iov_len;
+        handler->iov_pos++;
+    }
+}
+
+/*
+ * Write pending records, returns -1 if the connection broke. Management
+ * records in out_buf only go out between requests: a request partly
+ * written is finished first so they never land inside one of its records.
+ */
+static int fcgi_conn_flush(struct fcgi_conn *conn)
+{
+    int count;
+    ssize_t bytes;
+    struct fcgi_handler *handler;
+
+    while (1) {
+        handler = NULL;
+        if (mk_list_is_empty(&conn->writes) != 0) {
+            handler = mk_list_entry_first(&conn->writes,
+                                          struct fcgi_handler, _head);
+        }
+
+        if (conn->out_len > 0 && (!handler || handler->request_sent == 0)) {
+            bytes = write(conn->fd, conn->out_buf, conn->out_len);
+            if (bytes == -1) {
+                return (errno == EAGAIN) ? 0 : -1;
+            }
+
+            conn->out_len -= bytes;
+            if (conn->out_len > 0) {
+                memmove(conn->out_buf, conn->out_buf + bytes, conn->out_len);
+                return 0;
+            }
+            continue;
+        }
+
+        if (!handler) {
+            break;
+        }
+
+        count = handler->iov->iov_idx - handler->iov_pos;
+        if (count > IOV_MAX) {
+            count = IOV_MAX;
+        }
+
+        bytes = writev(conn->fd, handler->iov->io + handler->iov_pos, count);
+        MK_TRACE("[fastcgi=%i] writev()=%zd", conn->fd, bytes);
+        if (bytes == -1) {
+            return (errno == EAGAIN) ? 0 : -1;
+        }
+
+        fcgi_iov_advance(handler, bytes);
+        if (handler->iov_pos < handler->iov->iov_idx) {
+            continue;
+        }
+
+        /* The whole request is on the wire */
+        mk_list_del(&handler->_head);
+    }
+
+    return 0;
+}
+
+/* Dispatch the complete records received, returns -1 on protocol error */
+static int fcgi_conn_records(struct fcgi_conn *conn)
+{
+    int idx;
+    size_t total;
+    char *body;
+    struct fcgi_rbuf *rbuf = conn->rbuf;
+    struct fcgi_record_header header;
+    struct fcgi_handler *handler;
+
+    while (conn->rbuf_len - conn->rbuf_pos >= FCGI_RECORD_HEADER_SIZE) {
+        memcpy(&header, rbuf->data + conn->rbuf_pos, sizeof(header));
+        header.request_id = ntohs(header.request_id);
+        header.content_length = ntohs(header.content_length);
+
+        total = FCGI_RECORD_HEADER_SIZE + header.content_length +
+            header.padding_length;
+        if (conn->rbuf_len - conn->rbuf_pos < total) {
+            break;
+        }
+
+        body = rbuf->data + conn->rbuf_pos + FCGI_RECORD_HEADER_SIZE;
+        conn->rbuf_pos += total;
+
+        /* Management record */
+        if (header.request_id == 0) {
+            if (header.type == FCGI_GET_VALUES_RESULT) {
+                fcgi_get_values_result(conn, (unsigned char *) body,
+                                       header.content_length);
+            }
+            continue;
+        }
+
+        idx = header.request_id - 1;
+        if (idx >= conn->slots_size || !conn->slots[idx]) {
+            mk_warn("[fastcgi] %s: record for unknown request id %i",
+                    conn->pool->server->name, header.request_id);
+            return -1;
+        }
+
+        handler = conn->slots[idx];
+        if (header.type == FCGI_END_REQUEST) {
+            conn->slots[idx] = NULL;
+            conn->requests--;
+            conn->served++;
+            fcgi_upstream_success(conn->pool);
+        }
+
+        if (handler == FCGI_SLOT_ABORTED) {
+            if (header.type == FCGI_END_REQUEST) {
+                fcgi_conn_release(conn);
+            }
+        }
+        else if (header.type == FCGI_END_REQUEST) {
+            handler->conn = NULL;
+
+            /* Answered before the whole request was read */
+            if (mk_list_is_set(&handler->_head) == 0) {
+                mk_list_del(&handler->_head);
+                fcgi_handler_record(handler, &header, rbuf, body);
+                fcgi_conn_error(conn);
+                return 0;
+            }
+
+            /* Release first, so the connection is usable right away */
+            fcgi_conn_release(conn);
+            fcgi_handler_record(handler, &header, rbuf, body);
+        }
+        else {
+            fcgi_handler_record(handler, &header, rbuf, body);
+        }
+
+        if (conn->status == FCGI_CONN_CLOSED) {
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Room to read into the receive buffer. Parsed data still referenced by
+ * client streams stays in place: the partial record left is moved to a
+ * buffer of its own.
+ */
+static int fcgi_conn_rbuf_room(struct fcgi_conn *conn)
+{
+    unsigned int left;
+    struct fcgi_rbuf *rbuf = conn->rbuf;
+
+    left = conn->rbuf_len - conn->rbuf_pos;
+    if (left == 0 && rbuf->refs == 1) {
+        conn->rbuf_pos = conn->rbuf_len = 0;
+        return 0;
+    }
+
+    if (FCGI_RBUF_SIZE - conn->rbuf_len >= FCGI_RBUF_MIN_READ ||
+        conn->rbuf_pos == 0) {
+        return 0;
+    }
+
+    if (rbuf->refs == 1) {
+        memmove(rbuf->data, rbuf->data + conn->rbuf_pos, left);
+    }
+    else {
+        rbuf = fcgi_rbuf_get(fcgi_worker_get());
+        if (!rbuf) {
+            return -1;
+        }
+        memcpy(rbuf->data, conn->rbuf->data + conn->rbuf_pos, left);
+        fcgi_rbuf_release(conn->rbuf);
+        conn->rbuf = rbuf;
+    }
+
+    conn->rbuf_pos = 0;
+    conn->rbuf_len = left;
+    return 0;
+}
+
+static int fcgi_conn_read(struct fcgi_conn *conn)
+{
+    int ret;
+    ssize_t bytes;
+
+    ret = fcgi_conn_rbuf_room(conn);
+    if (ret == -1) {
+        return -1;
+    }
+
+    bytes = read(conn->fd, conn->rbuf->data + conn->rbuf_len,
+                 FCGI_RBUF_SIZE - conn->rbuf_len);
+    MK_TRACE("[fastcgi=%i] read()=%zd", conn->fd, bytes);
+
+    if (bytes == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    else if (bytes <= 0) {
+        return -1;
+    }
+
+    conn->rbuf_len += bytes;
+    return fcgi_conn_records(conn);
+}
+
+static int fcgi_conn_event(void *data)
+{
+    int ret;
+    struct fcgi_conn *conn = data;
+
+    if (conn->status == FCGI_CONN_CLOSED) {
+        return 0;
+    }
+
+    if (conn->status == FCGI_CONN_CONNECTING) {
+        ret = mk_api->net_connect_status(conn->fd);
+        if (ret == -1) {
+            mk_warn("[fastcgi] cannot connect to %s: %s",
+                    conn->pool->server->name, strerror(errno));
+            fcgi_conn_error(conn);
+            return 0;
+        }
+        conn->status = FCGI_CONN_READY;
+    }
+
+    ret = fcgi_conn_flush(conn);
+    if (ret == -1) {
+        fcgi_conn_error(conn);
+        return 0;
+    }
+
+    ret = fcgi_conn_read(conn);
+    if (conn->status == FCGI_CONN_CLOSED) {
+        return 0;
+    }
+
+    if (ret == -1) {
+        if (conn->requests == 0 && conn->idle_since > 0) {
+            /* The server closed an idle connection */
+            fcgi_conn_close(conn);
+        }
+        else {
+            fcgi_conn_error(conn);
+        }
+        return 0;
+    }
+
+    fcgi_conn_update(conn);
+    return 0;
+}
+
+/*
+ * The connection broke: requests that never got an answer over a reused
+ * connection are replayed once on another one, as the server may just have
+ * closed it while idle. A connection that never completed a request counts
+ * as a server failure, its requests fail over to another server of the
+ * group when that is safe. Everything else fails.
+ */
+static void fcgi_conn_error(struct fcgi_conn *conn)
+{
+    int i;
+    int n = 0;
+    int ret;
+    int reused;
+    struct fcgi_pool *pool = conn->pool;
+    struct fcgi_conn *retry;
+    struct fcgi_handler *handler;
+    struct fcgi_handler *list[FCGI_CONN_SLOTS_MAX];
+
+    reused = (conn->served > 0);
+
+    for (i = 0; i < conn->slots_size; i++) {
+        handler = conn->slots[i];
+        conn->slots[i] = NULL;
+        if (!handler || handler == FCGI_SLOT_ABORTED) {
+            continue;
+        }
+
+        if (mk_list_is_set(&handler->_head) == 0) {
+            mk_list_del(&handler->_head);
+        }
+        handler->conn = NULL;
+        list[n++] = handler;
+    }
+    conn->requests = 0;
+
+    /* Unlinked from the connection, the handlers can be ended safely */
+    fcgi_conn_close(conn);
+
+    if (!reused) {
+        fcgi_upstream_failure(pool);
+    }
+
+    for (i = 0; i < n; i++) {
+        handler = list[i];
+
+        if (handler->response_bytes > 0) {
+            fcgi_handler_fail(handler);
+            continue;
+        }
+
+        if (reused && handler->retried == MK_FALSE) {
+            handler->retried = MK_TRUE;
+            pool->retries++;
+
+            /* Other idle connections may be stale as well */
+            retry = NULL;
+            if (!fcgi_pool_full(pool)) {
+                retry = fcgi_conn_create(pool);
+            }
+
+            if (retry) {
+                ret = fcgi_conn_assign(retry, handler);
+            }
+            else {
+                ret = fcgi_pool_attach(handler);
+            }
+        }
+        else if (!reused && (handler->request_sent == 0 ||
+                             handler->sr->method != MK_METHOD_POST)) {
+            /* The server may have run a POST it got, don't run it twice */
+            ret = fcgi_pool_failover(handler);
+        }
+        else {
+            ret = -1;
+        }
+
+        if (ret == -1) {
+            fcgi_handler_fail(handler);
+        }
+    }
+
+    fcgi_pool_pump(pool);
+}
+
+/* Account the request on the pool of the server picked */
+static inline void fcgi_pool_enter(struct fcgi_pool *pool,
+                                   struct fcgi_handler *handler)
+{
+    if (handler->pool == pool) {
+        return;
+    }
+
+    if (handler->pool) {
+        handler->pool->outstanding--;
+    }
+    handler->pool = pool;
+    pool->outstanding++;
+}
+
+/*
+ * Assign a server of the group and a connection to it to the request.
+ * Servers that cannot be reached are skipped, it fails when none is left.
+ */
+int fcgi_pool_attach(struct fcgi_handler *handler)
+{
+    struct fcgi_worker *worker = fcgi_worker_get();
+    struct fcgi_pool *pool;
+    struct fcgi_conn *conn;
+
+    if (handler->start == 0) {
+        handler->start = fcgi_clock();
+    }
+
+    while ((pool = fcgi_upstream_select(worker, handler)) != NULL) {
+        fcgi_pool_enter(pool, handler);
+
+        conn = fcgi_pool_conn_get(pool);
+        if (conn) {
+            return fcgi_conn_assign(conn, handler);
+        }
+
+        if (fcgi_pool_full(pool)) {
+            MK_TRACE("[fastcgi] all backend connections busy, queue request");
+            mk_list_add(&handler->_head, &pool->queue);
+            return 0;
+        }
+
+        fcgi_upstream_failure(pool);
+        handler->tried |= (1ULL << pool->server->index);
+        pool->failovers++;
+    }
+
+    return -1;
+}
+
+/* The server failed the request before answering, try another one */
+static int fcgi_pool_failover(struct fcgi_handler *handler)
+{
+    handler->tried |= (1ULL << handler->pool->server->index);
+    handler->pool->failovers++;
+
+    return fcgi_pool_attach(handler);
+}
+
+/* The HTTP request is done or gone, release what it holds */
+void fcgi_pool_detach(struct fcgi_handler *handler)
+{
+    int i;
+    uint64_t usec;
+    struct fcgi_pool *pool = handler->pool;
+    struct fcgi_conn *conn = handler->conn;
+    struct fcgi_record_header *h;
+
+    if (pool) {
+        handler->pool = NULL;
+        pool->outstanding--;
+        pool->requests++;
+        if (handler->failed == MK_TRUE) {
+            pool->errors++;
+        }
+        else {
+            usec = fcgi_clock() - handler->start;
+            pool->latency_usec += usec;
+            if (usec > pool->latency_max) {
+                pool->latency_max = usec;
+            }
+        }
+    }
+
+    /* Still waiting for a connection */
+    if (!conn) {
+        if (mk_list_is_set(&handler->_head) == 0) {
+            mk_list_del(&handler->_head);
+        }
+        return;
+    }
+
+    handler->conn = NULL;
+    i = handler->request_id - 1;
+
+    /* Not written yet: as if it never existed */
+    if (mk_list_is_set(&handler->_head) == 0) {
+        mk_list_del(&handler->_head);
+        if (handler->request_sent > 0) {
+            /* Half a request on the wire, the connection is useless */
+            conn->slots[i] = NULL;
+            conn->requests--;
+            fcgi_conn_error(conn);
+            return;
+        }
+
+        conn->slots[i] = NULL;
+        conn->requests--;
+        fcgi_conn_release(conn);
+        return;
+    }
+
+    /*
+     * In flight: the response is discarded once it arrives. A server that
+     * multiplexes is told to stop working on it, the record goes out once
+     * the request being written is complete, see fcgi_conn_flush().
+     */
+    conn->slots[i] = FCGI_SLOT_ABORTED;
+
+    if (conn->slots_size > 1 &&
+        conn->out_len + FCGI_RECORD_HEADER_SIZE <= sizeof(conn->out_buf)) {
+        h = (struct fcgi_record_header *) (conn->out_buf + conn->out_len);
+        h->version = FCGI_VERSION_1;
+        h->type = FCGI_ABORT_REQUEST;
+        fcgi_encode16(&h->request_id, handler->request_id);
+        fcgi_encode16(&h->content_length, 0);
+        h->padding_length = 0;
+        h->reserved = 0;
+        conn->out_len += FCGI_RECORD_HEADER_SIZE;
+        fcgi_conn_update(conn);
+    }
+}
+
+/* Close idle connections past IdleTimeout, free closed ones */
+static void fcgi_pool_sweep(struct fcgi_pool *pool, time_t now)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct fcgi_conn *conn;
+
+    pool->ticks++;
+
+    mk_list_foreach_safe(head, tmp, &pool->idle_list) {
+        conn = mk_list_entry(head, struct fcgi_conn, _head);
+        if (now - conn->idle_since < pool->server->idle_timeout) {
+            break;
+        }
+        fcgi_conn_close(conn);
+    }
+
+    mk_list_foreach_safe(head, tmp, &pool->closed) {
+        conn = mk_list_entry(head, struct fcgi_conn, _head);
+        if (conn->closed_tick + 1 < pool->ticks) {
+            mk_list_del(&conn->_head);
+            fcgi_rbuf_release(conn->rbuf);
+            mk_api->mem_free(conn);
+        }
+    }
+}
+
+static int fcgi_worker_timer(void *data)
+{
+    int i;
+    int ret;
+    time_t now;
+    uint64_t val;
+    struct fcgi_worker *worker = data;
+
+    ret = read(worker->timer.fd, &val, sizeof(val));
+    if (ret <= 0) {
+        return 0;
+    }
+
+    now = mk_api->time_unix();
+    for (i = 0; i < fcgi_conf.n_servers; i++) {
+        fcgi_pool_sweep(&worker->pools[i], now);
+    }
+
+    return 0;
+}
+
+int fcgi_pool_init()
+{
+    mk_list_init(&fcgi_workers);
+    return pthread_key_create(&fcgi_worker_key, NULL);
+}
+
+int fcgi_pool_worker_init()
+{
+    int fd;
+    struct mk_list *head;
+    struct fcgi_pool *pool;
+    struct fcgi_server *server;
+    struct fcgi_worker *worker;
+
+    worker = mk_api->mem_alloc_z(sizeof(struct fcgi_worker));
+    if (!worker) {
+        return -1;
+    }
+
+    worker->pools = mk_api->mem_alloc_z(sizeof(struct fcgi_pool) *
+                                        fcgi_conf.n_servers);
+    if (!worker->pools) {
+        mk_api->mem_free(worker);
+        return -1;
+    }
+    mk_list_init(&worker->rbufs);
+    mk_list_init(&worker->params);
+
+    mk_list_foreach(head, &fcgi_conf.servers) {
+        server = mk_list_entry(head, struct fcgi_server, _head);
+        pool = &worker->pools[server->id];
+        pool->server = server;
+        pool->mpxs = -1;
+        mk_list_init(&pool->busy);
+        mk_list_init(&pool->idle_list);
+        mk_list_init(&pool->queue);
+        mk_list_init(&pool->closed);
+    }
+
+    fd = mk_api->ev_timeout_create(mk_api->sched_loop(), 1, 0, &worker->timer);
+    if (fd == -1) {
+        mk_api->mem_free(worker->pools);
+        mk_api->mem_free(worker);
+        return -1;
+    }
+    worker->timer.type = MK_EVENT_CUSTOM;
+    worker->timer.handler = fcgi_worker_timer;
+
+    pthread_mutex_lock(&fcgi_workers_mutex);
+    mk_list_add(&worker->_head, &fcgi_workers);
+    pthread_mutex_unlock(&fcgi_workers_mutex);
+
+    pthread_setspecific(fcgi_worker_key, worker);
+    return 0;
+}
+
+/* Report the counters of each server, added up across workers */
+void fcgi_pool_exit()
+{
+    int i;
+    uint64_t ok;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_list *r_head;
+    struct mk_list *r_tmp;
+    struct fcgi_rbuf *rbuf;
+    struct fcgi_pool *pool;
+    struct fcgi_pool *total;
+    struct fcgi_server *server;
+    struct fcgi_worker *worker;
+
+    total = mk_api->mem_alloc_z(sizeof(struct fcgi_pool) * fcgi_conf.n_servers);
+    if (!total) {
+        return;
+    }
+
+    pthread_mutex_lock(&fcgi_workers_mutex);
+    mk_list_foreach_safe(head, tmp, &fcgi_workers) {
+        worker = mk_list_entry(head, struct fcgi_worker, _head);
+        for (i = 0; i < fcgi_conf.n_servers; i++) {
+            pool = &worker->pools[i];
+            total[i].connects     += pool->connects;
+            total[i].reuses       += pool->reuses;
+            total[i].retries      += pool->retries;
+            total[i].requests     += pool->requests;
+            total[i].errors       += pool->errors;
+            total[i].failures     += pool->failures;
+            total[i].failovers    += pool->failovers;
+            total[i].ejections    += pool->ejections;
+            total[i].latency_usec += pool->latency_usec;
+            if (pool->latency_max > total[i].latency_max) {
+                total[i].latency_max = pool->latency_max;
+            }
+        }
+        mk_list_foreach_safe(r_head, r_tmp, &worker->rbufs) {
+            rbuf = mk_list_entry(r_head, struct fcgi_rbuf, _head);
+            mk_list_del(&rbuf->_head);
+            mk_api->mem_free(rbuf);
+        }
+        fcgi_params_free(worker);
+        mk_list_del(&worker->_head);
+        mk_api->mem_free(worker->pools);
+        mk_api->mem_free(worker);
+    }
+    pthread_mutex_unlock(&fcgi_workers_mutex);
+
+    mk_list_foreach(head, &fcgi_conf.servers) {
+        server = mk_list_entry(head, struct fcgi_server, _head);
+        pool = &total[server->id];
+        ok = pool->requests - pool->errors;
+
+        mk_info("[fastcgi] %s/%s: %lu requests, %lu errors, latency "
+                "avg %lu max %lu us",
+                server->group->name, server->name,
+                pool->requests, pool->errors,
+                ok ? pool->latency_usec / ok : 0, pool->latency_max);
+        mk_info("[fastcgi] %s/%s: %lu connects %lu reuses %lu retries, "
+                "%lu failures %lu failovers %lu ejections",
+                server->group->name, server->name,
+                pool->connects, pool->reuses, pool->retries,
+                pool->failures, pool->failovers, pool->ejections);
+    }
+
+    mk_api->mem_free(total);
+}
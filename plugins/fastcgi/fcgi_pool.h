@@ -0,0 +1,159 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FASTCGI_POOL_H
+#define MK_FASTCGI_POOL_H
+
+#include <monkey/mk_api.h>
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+
+/* Backend connection status */
+#define FCGI_CONN_CONNECTING  0
+#define FCGI_CONN_READY       1
+#define FCGI_CONN_CLOSED      2
+
+/* Requests multiplexed on a single connection, at most */
+#define FCGI_CONN_SLOTS_MAX   64
+
+/* Slot of a request whose client is gone, records are discarded */
+#define FCGI_SLOT_ABORTED     ((struct fcgi_handler *) 1)
+
+/* Receive buffer size: the largest record fits from the start */
+#define FCGI_RBUF_SIZE        (FCGI_BUF_SIZE + 255)
+
+/* Free receive buffers kept by a worker */
+#define FCGI_RBUF_FREE_MAX    16
+
+/* Smaller room left at the end of the buffer is reclaimed first */
+#define FCGI_RBUF_MIN_READ    4096
+
+/*
+ * Records are read from the server into a receive buffer and parsed in
+ * place. STDOUT data is queued to the client streams as references to
+ * the buffer, which is reused once the streams consumed it.
+ */
+struct fcgi_rbuf {
+    int refs;                    /* connection and stream inputs   */
+    struct mk_list _head;        /* link to the worker free list   */
+    char data[FCGI_RBUF_SIZE];
+};
+
+/*
+ * A connection to the FastCGI server. It outlives the HTTP requests it
+ * serves when the server keeps it open (FCGI_KEEP_CONN).
+ */
+struct fcgi_conn {
+    struct mk_event event;       /* built-in event-loop data       */
+
+    int fd;
+    int status;                  /* FCGI_CONN_CONNECTING / READY   */
+    int requests;                /* requests in flight             */
+    uint64_t served;             /* requests completed             */
+    time_t idle_since;
+    uint64_t closed_tick;        /* sweep tick it was closed at    */
+
+    /* Requests in flight, indexed by request_id - 1 */
+    int slots_size;
+    struct fcgi_handler *slots[FCGI_CONN_SLOTS_MAX];
+
+    /* Management records (GET_VALUES, ABORT_REQUEST), sent first */
+    unsigned int out_len;
+    char out_buf[64];
+
+    /* Handlers with request data to write, in order */
+    struct mk_list writes;
+
+    /* Records from the server, parsed up to rbuf_pos */
+    struct fcgi_rbuf *rbuf;
+    unsigned int rbuf_pos;
+    unsigned int rbuf_len;
+
+    struct fcgi_pool *pool;
+    struct mk_list _head;        /* link to a pool list            */
+};
+
+/* Connections to a FastCGI server owned by a worker */
+struct fcgi_pool {
+    struct fcgi_server *server;
+    uint64_t ticks;              /* sweeps done                    */
+
+    int count;                   /* connections open               */
+    int idle;                    /* connections in the idle list   */
+
+    /* FCGI_MPXS_CONNS / FCGI_MAX_REQS reported by the server */
+    int mpxs;                    /* -1: not known yet              */
+    int max_reqs;
+
+    int resolving;               /* server name lookup in flight   */
+
+    struct mk_list busy;         /* connections serving requests   */
+    struct mk_list idle_list;    /* kept alive, most recent first  */
+    struct mk_list queue;        /* handlers waiting a connection  */
+
+    /*
+     * Closed connections, released one sweep later: an event for them
+     * may still be pending in the current event loop round.
+     */
+    struct mk_list closed;
+
+    /* Passive health of the server, as seen by this worker */
+    int fails;                   /* failures in a row              */
+    time_t ejected_until;
+    time_t recovered_at;         /* slow start begins              */
+
+    /* Balancing */
+    int current;                 /* smooth weighted round robin    */
+    int outstanding;             /* requests attached              */
+
+    /* Counters */
+    uint64_t connects;
+    uint64_t reuses;
+    uint64_t retries;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t failures;           /* connect or transport errors    */
+    uint64_t failovers;
+    uint64_t ejections;
+    uint64_t latency_usec;       /* attach to response end         */
+    uint64_t latency_max;
+};
+
+/* FastCGI state of a worker: one pool per server */
+struct fcgi_worker {
+    struct mk_event timer;       /* idle connections sweep         */
+    unsigned int rr;             /* ties rotation                  */
+    struct fcgi_pool *pools;
+
+    int rbufs_free;
+    struct mk_list rbufs;        /* free receive buffers           */
+    struct mk_list params;       /* PARAMS prefix of each vhost    */
+    struct mk_list _head;        /* link to the workers list       */
+};
+
+struct fcgi_worker *fcgi_pool_worker();
+void fcgi_rbuf_release(struct fcgi_rbuf *rbuf);
+
+int fcgi_pool_init();
+int fcgi_pool_worker_init();
+void fcgi_pool_exit();
+int fcgi_pool_attach(struct fcgi_handler *handler);
+void fcgi_pool_detach(struct fcgi_handler *handler);
+
+#endif
@@ -0,0 +1,414 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+#include "fcgi_pool.h"
+#include "fcgi_upstream.h"
+
+/*
+ * Requests mapped to a group are spread across its servers. Every worker
+ * balances and tracks the health of the servers on its own, so no state
+ * is shared between threads: a server is ejected by a worker after
+ * MaxFails connect or transport errors in a row, and gets requests again
+ * once FailTimeout expires, ramping up its weight along SlowStart.
+ */
+
+static inline uint32_t fcgi_hash(const void *data, size_t len, uint32_t hash)
+{
+    size_t i;
+    const unsigned char *p = data;
+
+    /* FNV-1a */
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619;
+    }
+
+    /* Final mix, so close keys land far away on the ring */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+static int fcgi_hash_point_cmp(const void *a, const void *b)
+{
+    const struct fcgi_hash_point *pa = a;
+    const struct fcgi_hash_point *pb = b;
+
+    if (pa->hash < pb->hash) {
+        return -1;
+    }
+    return pa->hash > pb->hash;
+}
+
+/* Consistent hashing ring, each server owns points by its weight */
+static int fcgi_upstream_ring(struct fcgi_group *group)
+{
+    int i;
+    int n;
+    int len;
+    int points = 0;
+    char key[256];
+    struct fcgi_server *server;
+
+    for (i = 0; i < group->size; i++) {
+        points += group->servers[i]->weight * FCGI_HASH_POINTS;
+    }
+
+    group->ring = mk_api->mem_alloc(sizeof(struct fcgi_hash_point) * points);
+    if (!group->ring) {
+        return -1;
+    }
+
+    group->ring_size = 0;
+    for (i = 0; i < group->size; i++) {
+        server = group->servers[i];
+        for (n = 0; n < server->weight * FCGI_HASH_POINTS; n++) {
+            len = snprintf(key, sizeof(key), "%s-%i", server->name, n);
+            group->ring[group->ring_size].hash = fcgi_hash(key, len,
+                                                           2166136261u);
+            group->ring[group->ring_size].index = i;
+            group->ring_size++;
+        }
+    }
+
+    qsort(group->ring, group->ring_size, sizeof(struct fcgi_hash_point),
+          fcgi_hash_point_cmp);
+    return 0;
+}
+
+int fcgi_upstream_init()
+{
+    int ret;
+    struct mk_list *head;
+    struct fcgi_group *group;
+
+    mk_list_foreach(head, &fcgi_conf.groups) {
+        group = mk_list_entry(head, struct fcgi_group, _head);
+        if (group->balance != FCGI_BALANCE_HASH) {
+            continue;
+        }
+
+        ret = fcgi_upstream_ring(group);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Group given to the handler rule, the first one if none */
+struct fcgi_group *fcgi_upstream_group(char *name)
+{
+    struct mk_list *head;
+    struct fcgi_group *group;
+
+    if (!name) {
+        return mk_list_entry_first(&fcgi_conf.groups, struct fcgi_group, _head);
+    }
+
+    mk_list_foreach(head, &fcgi_conf.groups) {
+        group = mk_list_entry(head, struct fcgi_group, _head);
+        if (strcasecmp(group->name, name) == 0) {
+            return group;
+        }
+    }
+
+    return NULL;
+}
+
+/* Weight of the server right now: 0 while ejected, reduced on slow start */
+static int fcgi_upstream_weight(struct fcgi_pool *pool, time_t now)
+{
+    int weight;
+    time_t elapsed;
+    struct fcgi_server *server = pool->server;
+    struct fcgi_group *group = server->group;
+
+    if (pool->ejected_until > now) {
+        return 0;
+    }
+
+    weight = server->weight * 100;
+    if (pool->recovered_at > 0) {
+        elapsed = now - pool->recovered_at;
+        if (elapsed >= group->slow_start) {
+            pool->recovered_at = 0;
+        }
+        else {
+            weight = weight * (elapsed + 1) / (group->slow_start + 1);
+            if (weight < 1) {
+                weight = 1;
+            }
+        }
+    }
+
+    return weight;
+}
+
+static uint32_t fcgi_upstream_key(struct fcgi_handler *handler)
+{
+    struct mk_socket_addr *peer;
+    struct mk_http_request *sr = handler->sr;
+
+    switch (handler->group->hash_key) {
+    case FCGI_HASH_HOST:
+        return fcgi_hash(sr->host.data, sr->host.len, 2166136261u);
+    case FCGI_HASH_REMOTE:
+        if (!handler->cs->conn || handler->cs->conn->peer.len == 0) {
+            break;
+        }
+        peer = &handler->cs->conn->peer;
+        if (peer->addr.sa.sa_family == AF_INET) {
+            return fcgi_hash(&peer->addr.in.sin_addr,
+                             sizeof(struct in_addr), 2166136261u);
+        }
+        else if (peer->addr.sa.sa_family == AF_INET6) {
+            return fcgi_hash(&peer->addr.in6.sin6_addr,
+                             sizeof(struct in6_addr), 2166136261u);
+        }
+        break;
+    }
+
+    return fcgi_hash(sr->uri_processed.data, sr->uri_processed.len,
+                     2166136261u);
+}
+
+/* Smooth weighted round robin: spread evenly, in proportion to weights */
+static int fcgi_balance_round_robin(struct fcgi_worker *worker,
+                                    struct fcgi_group *group, int *weights)
+{
+    int i;
+    int total = 0;
+    int best = -1;
+    struct fcgi_pool *pool;
+
+    for (i = 0; i < group->size; i++) {
+        if (weights[i] <= 0) {
+            continue;
+        }
+
+        pool = &worker->pools[group->servers[i]->id];
+        pool->current += weights[i];
+        total += weights[i];
+
+        if (best == -1 ||
+            pool->current > worker->pools[group->servers[best]->id].current) {
+            best = i;
+        }
+    }
+
+    if (best != -1) {
+        worker->pools[group->servers[best]->id].current -= total;
+    }
+
+    return best;
+}
+
+/* Fewest requests in flight relative to the weight, ties rotate */
+static int fcgi_balance_least_requests(struct fcgi_worker *worker,
+                                       struct fcgi_group *group, int *weights)
+{
+    int i;
+    int n;
+    int best = -1;
+    uint64_t a;
+    uint64_t b;
+    struct fcgi_pool *pool;
+    struct fcgi_pool *best_pool = NULL;
+
+    worker->rr++;
+    for (n = 0; n < group->size; n++) {
+        i = (worker->rr + n) % group->size;
+        if (weights[i] <= 0) {
+            continue;
+        }
+
+        pool = &worker->pools[group->servers[i]->id];
+        if (best != -1) {
+            a = (uint64_t) (pool->outstanding + 1) * weights[best];
+            b = (uint64_t) (best_pool->outstanding + 1) * weights[i];
+            if (a >= b) {
+                continue;
+            }
+        }
+        best = i;
+        best_pool = pool;
+    }
+
+    return best;
+}
+
+/*
+ * Consistent hashing: the first server clockwise from the key. A server on
+ * slow start only takes the share of its keys its weight allows yet.
+ */
+static int fcgi_balance_hash(struct fcgi_handler *handler,
+                             struct fcgi_group *group, int *weights)
+{
+    int i;
+    int n;
+    int lo;
+    int hi;
+    int mid;
+    int full;
+    int pass;
+    uint32_t key;
+    struct fcgi_hash_point *point;
+
+    key = fcgi_upstream_key(handler);
+
+    lo = 0;
+    hi = group->ring_size;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (group->ring[mid].hash < key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        for (n = 0; n < group->ring_size; n++) {
+            point = &group->ring[(lo + n) % group->ring_size];
+            i = point->index;
+            if (weights[i] <= 0) {
+                continue;
+            }
+
+            full = group->servers[i]->weight * 100;
+            if (pass == 0 && weights[i] < full &&
+                (int) (key % full) >= weights[i]) {
+                continue;
+            }
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Pick the server for the request, NULL if all of them were tried */
+struct fcgi_pool *fcgi_upstream_select(struct fcgi_worker *worker,
+                                       struct fcgi_handler *handler)
+{
+    int i;
+    int best = -1;
+    int available = 0;
+    time_t now;
+    struct fcgi_group *group = handler->group;
+    int weights[FCGI_GROUP_MAX_SERVERS];
+
+    now = mk_api->time_unix();
+
+    for (i = 0; i < group->size; i++) {
+        if (handler->tried & (1ULL << i)) {
+            weights[i] = -1;
+            continue;
+        }
+
+        weights[i] = fcgi_upstream_weight(&worker->pools[group->servers[i]->id],
+                                          now);
+        if (weights[i] > 0) {
+            available++;
+        }
+    }
+
+    /* Every server left is ejected: better to try them than to fail */
+    if (available == 0) {
+        for (i = 0; i < group->size; i++) {
+            if (weights[i] == 0) {
+                weights[i] = group->servers[i]->weight * 100;
+                available++;
+            }
+        }
+    }
+
+    if (available == 0) {
+        return NULL;
+    }
+
+    switch (group->balance) {
+    case FCGI_BALANCE_LEAST_REQS:
+        best = fcgi_balance_least_requests(worker, group, weights);
+        break;
+    case FCGI_BALANCE_HASH:
+        best = fcgi_balance_hash(handler, group, weights);
+        break;
+    default:
+        best = fcgi_balance_round_robin(worker, group, weights);
+    }
+
+    if (best == -1) {
+        return NULL;
+    }
+
+    return &worker->pools[group->servers[best]->id];
+}
+
+void fcgi_upstream_success(struct fcgi_pool *pool)
+{
+    pool->fails = 0;
+}
+
+/* The server could not be reached or broke a connection */
+void fcgi_upstream_failure(struct fcgi_pool *pool)
+{
+    time_t now;
+    struct fcgi_server *server = pool->server;
+    struct fcgi_group *group = server->group;
+
+    pool->failures++;
+    pool->fails++;
+    if (pool->fails < group->max_fails) {
+        return;
+    }
+
+    now = mk_api->time_unix();
+    if (pool->ejected_until > now) {
+        return;
+    }
+
+    /* Once back, a single failure ejects it again */
+    pool->fails = group->max_fails - 1;
+    pool->ejected_until = now + group->fail_timeout;
+    pool->ejections++;
+    if (group->slow_start > 0) {
+        pool->recovered_at = pool->ejected_until;
+    }
+
+    mk_warn("[fastcgi] server %s ejected from group %s for %i seconds",
+            server->name, group->name, group->fail_timeout);
+}
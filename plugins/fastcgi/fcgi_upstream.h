@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FASTCGI_UPSTREAM_H
+#define MK_FASTCGI_UPSTREAM_H
+
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+#include "fcgi_pool.h"
+
+/* Points of a server (per unit of weight) on the hashing ring */
+#define FCGI_HASH_POINTS  160
+
+int fcgi_upstream_init();
+struct fcgi_group *fcgi_upstream_group(char *name);
+struct fcgi_pool *fcgi_upstream_select(struct fcgi_worker *worker,
+                                       struct fcgi_handler *handler);
+void fcgi_upstream_success(struct fcgi_pool *pool);
+void fcgi_upstream_failure(struct fcgi_pool *pool);
+
+#endif
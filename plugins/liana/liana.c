@@ -118,6 +118,21 @@ int mk_liana_send_file(int socket_fd, int file_fd, off_t *file_offset,
 #endif
 }
 
+#ifdef MK_HAVE_SPLICE
+int mk_liana_splice(int socket_fd, int pipe_fd, size_t count)
+{
+    ssize_t ret;
+
+    ret = splice(pipe_fd, NULL, socket_fd, NULL, count,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (ret == -1 && errno != EAGAIN) {
+        PLUGIN_TRACE("[FD %i] error from splice(): %s",
+                     socket_fd, strerror(errno));
+    }
+    return ret;
+}
+#endif
+
 /* Network Layer plugin Callbacks */
 struct mk_plugin_network mk_plugin_network_liana = {
     .read          = mk_liana_read,
@@ -125,6 +140,9 @@ struct mk_plugin_network mk_plugin_network_liana = {
     .writev        = mk_liana_writev,
     .close         = mk_liana_close,
     .send_file     = mk_liana_send_file,
+#ifdef MK_HAVE_SPLICE
+    .splice        = mk_liana_splice,
+#endif
     .buffer_size   = MK_REQUEST_CHUNK
 };
 
@@ -23,7 +23,7 @@
 
 /* System Headers */
 #include <time.h>
-#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -31,28 +31,6 @@
 #include "logger.h"
 #include "pointers.h"
 
-struct status_response {
-    int   i_status;
-    char *s_status;
-};
-
-static struct status_response response_codes[] = {
-    /* Common matches first */
-    {200, "200"}, {404, "404"},
-
-    {100, "100"}, {101, "101"},
-    {201, "201"}, {202, "202"}, {203, "203"}, {204, "204"},
-    {205, "205"}, {206, "206"},
-    {300, "300"}, {301, "301"}, {302, "302"}, {303, "303"}, {304, "304"},
-    {305, "305"},
-    {400, "400"}, {401, "401"}, {402, "402"}, {403, "403"},
-    {405, "405"}, {406, "406"}, {407, "407"}, {408, "408"}, {409, "409"},
-    {410, "410"}, {411, "411"}, {412, "412"}, {413, "413"}, {414, "414"},
-    {415, "415"},
-    {500, "500"}, {501, "501"}, {502, "502"}, {503, "503"}, {504, "504"},
-    {505, "505"},
-};
-
 static struct log_target *mk_logger_match_by_host(struct mk_vhost *host, int is_ok)
 {
     struct mk_list *head;
@@ -68,162 +46,693 @@ static struct log_target *mk_logger_match_by_host(struct mk_vhost *host, int is_
     return NULL;
 }
 
-static struct iov *mk_logger_get_cache()
+/* Log thread context */
+static struct mk_event_loop *mk_logger_evl;
+static struct mk_event mk_logger_timer;
+static struct mk_event mk_logger_notify;
+static int mk_logger_ch_r;
+static int mk_logger_ch_w;
+static int mk_logger_workers;           /* worker ids handed out */
+static pthread_mutex_t mk_logger_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Worker side: copy the record into the worker ring of the target. Once
+ * the ring goes over its limit the log thread is told to flush it now.
+ */
+static void mk_logger_push(struct log_target *target,
+                           struct iovec *iov, int iov_n, size_t total)
 {
-    return pthread_getspecific(cache_iov);
+    int i;
+    long id;
+    size_t len;
+    size_t off;
+    size_t n;
+    uint64_t head;
+    uint64_t used;
+    uint64_t limit;
+    uint64_t val = 1;
+    struct log_ring *ring;
+
+    id = (long) pthread_getspecific(cache_worker);
+    if (id <= 0) {
+        return;
+    }
+    ring = target->rings[id - 1];
+
+    head = ring->head;
+    used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (total > ring->size - used) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (i = 0; i < iov_n; i++) {
+        len = iov[i].iov_len;
+        off = 0;
+        while (len > 0) {
+            n = ring->size - (head & (ring->size - 1));
+            if (n > len) {
+                n = len;
+            }
+            memcpy(ring->buf + (head & (ring->size - 1)),
+                   (char *) iov[i].iov_base + off, n);
+            head += n;
+            off += n;
+            len -= n;
+        }
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+    limit = ring->size * MK_LOGGER_RING_LIMIT;
+    if (used < limit && used + total >= limit) {
+        if (write(mk_logger_ch_w, &val, sizeof(val)) == -1) {
+            /* the log thread has a wake up pending already */
+        }
+    }
 }
 
-static ssize_t _mk_logger_append(int pipe_fd_in,
-        int file_fd_out,
-        size_t bytes)
+/*
+ * Open the target file. If it fails the previous descriptor is kept, so
+ * entries still go to the old file; 'fd' is -1 if none could be opened.
+ */
+static void mk_logger_open(struct log_target *target)
 {
-    ssize_t ret;
-#ifdef MK_HAVE_SPLICE
-    ret = splice(pipe_fd_in, NULL, file_fd_out,
-            NULL, bytes, SPLICE_F_MOVE);
-    return ret;
-#else
-    unsigned char buffer[4096];
-    ssize_t buffer_used;
-    size_t bytes_written = 0;
-
-    while (bytes_written < bytes) {
-        ret = read(pipe_fd_in, buffer, sizeof(buffer));
-        if (ret < 0) {
-            break;
-        }
-        buffer_used = ret;
-        ret = write(file_fd_out, buffer, buffer_used);
-        if (ret < 0) {
-            break;
-        }
-        bytes_written += ret;
-    }
-    if (ret < 0 && bytes_written == 0)
-        return -1;
-    else
-        return bytes_written;
-#endif
+    int fd;
+    struct stat st;
+
+    fd = open(target->file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        if (target->open_failed == MK_FALSE) {
+            mk_warn("Could not open logfile '%s' (%s)",
+                    target->file, strerror(errno));
+        }
+        target->open_failed = MK_TRUE;
+        return;
+    }
+
+    if (target->fd != -1) {
+        close(target->fd);
+    }
+    target->fd = fd;
+    target->open_failed = MK_FALSE;
+    if (fstat(target->fd, &st) == 0) {
+        target->dev = st.st_dev;
+        target->ino = st.st_ino;
+    }
 }
 
-static void mk_logger_start_worker(void *args)
+/* The file was moved or removed (eg: logrotate) since we opened it */
+static int mk_logger_rotated(struct log_target *target)
 {
-    int fd;
-    int bytes, err;
-    int max_events = mk_api->config->nhosts;
-    int flog;
-    int clk;
-    long slen;
-    int timeout;
-    char *target;
-    (void) args;
-    struct mk_list *head;
-    struct log_target *entry;
-    struct mk_event *event;
-    struct mk_event_loop *evl;
-
-    /* pipe_size:
-     * ----------
-     * Linux set a pipe size usingto the PAGE_SIZE,
-     * check linux/include/pipe_fs_i.h for details:
-     *
-     *       #define PIPE_SIZE               PAGE_SIZE
-     *
-     * In the same header file we can found that every
-     * pipe has 16 pages, so our real memory allocation
-     * is: (PAGE_SIZE*PIPE_BUFFERS)
-     */
-    long pipe_size;
+    struct stat st;
 
-    /* buffer_limit:
-     * -------------
-     * it means the maximum data that a monkey log pipe can contain.
-     */
-    long buffer_limit;
+    if (target->fd == -1) {
+        return MK_TRUE;
+    }
 
-    mk_api->worker_rename("monkey: logger");
+    if (stat(target->file, &st) == -1) {
+        return MK_TRUE;
+    }
 
-    /* Monkey allow just 75% of a pipe capacity */
-    pipe_size = sysconf(_SC_PAGESIZE) * 16;
-    buffer_limit = (pipe_size * MK_LOGGER_PIPE_LIMIT);
+    return (st.st_dev != target->dev || st.st_ino != target->ino);
+}
 
-    /* Creating poll */
-    evl = mk_api->ev_loop_create(max_events);
+/* Log thread buffers for the text and JSON formats */
+static char mk_logger_out[MK_LOGGER_OUT_SIZE];
+static size_t mk_logger_out_len;
+static char mk_logger_str[255 + MK_LOGGER_URI_MAX];
+static char mk_logger_date[LOG_TIME_BUFFER_SIZE];
+static time_t mk_logger_date_time = -1;
+
+static const mk_ptr_t mk_logger_methods[] = {
+    mk_ptr_init(MK_METHOD_GET_STR),
+    mk_ptr_init(MK_METHOD_POST_STR),
+    mk_ptr_init(MK_METHOD_HEAD_STR),
+    mk_ptr_init(MK_METHOD_PUT_STR),
+    mk_ptr_init(MK_METHOD_DELETE_STR),
+    mk_ptr_init(MK_METHOD_OPTIONS_STR)
+};
 
-    /* Registering targets for virtualhosts */
-    mk_list_foreach(head, &targets_list) {
-        entry = mk_list_entry(head, struct log_target, _head);
-        event = &entry->event;
-        event->mask  = MK_EVENT_EMPTY;
-        event->data  = entry;
-        event->handler = NULL;
-        event->status = MK_EVENT_NONE;
+static void mk_logger_ring_copy(struct log_ring *ring, uint64_t pos,
+                                void *dst, size_t len)
+{
+    size_t off = pos & (ring->size - 1);
+    size_t n = ring->size - off;
+
+    if (n >= len) {
+        memcpy(dst, ring->buf + off, len);
+    }
+    else {
+        memcpy(dst, ring->buf + off, n);
+        memcpy((char *) dst + n, ring->buf, len - n);
+    }
+}
+
+static inline void mk_logger_cat(const char *data, size_t len)
+{
+    memcpy(mk_logger_out + mk_logger_out_len, data, len);
+    mk_logger_out_len += len;
+}
+
+static inline void mk_logger_cat_ptr(const mk_ptr_t *p)
+{
+    mk_logger_cat(p->data, p->len);
+}
 
-        /* Add access log file */
-        if (entry->pipe[0] > 0) {
-            event->fd = entry->pipe[0];
-            mk_api->ev_add(evl, entry->pipe[0],
-                           MK_EVENT_CONNECTION, MK_EVENT_READ, entry);
+static inline void mk_logger_cat_num(long long num)
+{
+    mk_logger_out_len += snprintf(mk_logger_out + mk_logger_out_len,
+                                  24, "%lld", num);
+}
+
+/* JSON string body: quotes, backslashes and control characters escaped */
+static void mk_logger_cat_json(const char *data, size_t len)
+{
+    size_t i;
+    unsigned char c;
+    char *p = mk_logger_out + mk_logger_out_len;
+
+    for (i = 0; i < len; i++) {
+        c = data[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        }
+        else if (c < 0x20) {
+            p += sprintf(p, "\\u%04x", c);
+        }
+        else {
+            *p++ = c;
         }
     }
+    mk_logger_out_len = p - mk_logger_out;
+}
 
-    /* Set initial timeout */
-    timeout = time(NULL) + mk_logger_timeout;
+static void mk_logger_record_ip(struct log_record *rec, mk_ptr_t *ip,
+                                char *buf)
+{
+    if (rec->family != AF_INET && rec->family != AF_INET6) {
+        ip->data = MK_LOGGER_IOV_EMPTY;
+        ip->len = 1;
+        return;
+    }
 
-    /* Reading pipe buffer */
-    while (1) {
-        usleep(1200);
+    inet_ntop(rec->family, rec->addr, buf, INET6_ADDRSTRLEN);
+    ip->data = buf;
+    ip->len = strlen(buf);
+}
 
-        /* wait for events */
-        mk_api->ev_wait(evl);
+static void mk_logger_record_protocol(struct log_record *rec, mk_ptr_t *p)
+{
+    switch (rec->protocol) {
+    case MK_HTTP_PROTOCOL_09:
+        mk_ptr_set(p, MK_HTTP_PROTOCOL_09_STR);
+        break;
+    case MK_HTTP_PROTOCOL_10:
+        mk_ptr_set(p, MK_HTTP_PROTOCOL_10_STR);
+        break;
+    case MK_HTTP_PROTOCOL_11:
+        mk_ptr_set(p, MK_HTTP_PROTOCOL_11_STR);
+        break;
+    default:
+        mk_ptr_set(p, MK_LOGGER_IOV_EMPTY);
+    }
+}
 
-        /* get current time */
-        clk = mk_api->time_unix();
+/* Same lines the access and error logs always had */
+static void mk_logger_format_text(struct log_record *rec,
+                                  mk_ptr_t *method, mk_ptr_t *uri)
+{
+    time_t t = rec->time;
+    struct tm tm;
+    mk_ptr_t ip;
+    mk_ptr_t protocol;
+    const mk_ptr_t *msg = NULL;
+    char ip_buf[INET6_ADDRSTRLEN];
+
+    if (t != mk_logger_date_time) {
+        strftime(mk_logger_date, sizeof(mk_logger_date), "[%d/%b/%G %T %z]",
+                 localtime_r(&t, &tm));
+        mk_logger_date_time = t;
+    }
+
+    mk_logger_record_ip(rec, &ip, ip_buf);
+    mk_logger_cat_ptr(&ip);
+    mk_logger_cat_ptr(&mk_logger_iov_dash);
+    mk_logger_cat(mk_logger_date, strlen(mk_logger_date));
+    mk_logger_cat_ptr(&mk_logger_iov_space);
+
+    if (rec->status < 400) {
+        mk_logger_record_protocol(rec, &protocol);
+        mk_logger_cat_ptr(method);
+        mk_logger_cat_ptr(&mk_logger_iov_space);
+        mk_logger_cat_ptr(uri);
+        mk_logger_cat_ptr(&mk_logger_iov_space);
+        mk_logger_cat_ptr(&protocol);
+        mk_logger_cat_ptr(&mk_logger_iov_space);
+        mk_logger_cat_num(rec->status);
+        mk_logger_cat_ptr(&mk_logger_iov_space);
+        if (rec->bytes < 0) {
+            mk_logger_cat_ptr(&mk_logger_iov_empty);
+        }
+        else {
+            mk_logger_cat_num(rec->bytes);
+        }
+        mk_logger_cat_ptr(&mk_logger_iov_lf);
+        return;
+    }
+
+    switch (rec->status) {
+    case MK_CLIENT_BAD_REQUEST:
+        msg = &error_msg_400;
+        break;
+    case MK_CLIENT_REQUEST_TIMEOUT:
+        msg = &error_msg_408;
+        break;
+    case MK_CLIENT_LENGTH_REQUIRED:
+        msg = &error_msg_411;
+        break;
+    case MK_CLIENT_REQUEST_ENTITY_TOO_LARGE:
+        msg = &error_msg_413;
+        break;
+    case MK_SERVER_INTERNAL_ERROR:
+        msg = &error_msg_500;
+        break;
+    case MK_SERVER_HTTP_VERSION_UNSUP:
+        msg = &error_msg_505;
+        break;
+    case MK_CLIENT_FORBIDDEN:
+        mk_logger_cat_ptr(&error_msg_403);
+        mk_logger_cat_ptr(&mk_logger_iov_space);
+        mk_logger_cat_ptr(uri);
+        break;
+    case MK_CLIENT_NOT_FOUND:
+        mk_logger_cat_ptr(&error_msg_404);
+        mk_logger_cat_ptr(&mk_logger_iov_space);
+        mk_logger_cat_ptr(uri);
+        break;
+    case MK_CLIENT_METHOD_NOT_ALLOWED:
+        mk_logger_cat_ptr(&error_msg_405);
+        mk_logger_cat_ptr(&mk_logger_iov_space);
+        mk_logger_cat_ptr(method);
+        break;
+    case MK_SERVER_NOT_IMPLEMENTED:
+        mk_logger_cat_ptr(&error_msg_501);
+        mk_logger_cat_ptr(&mk_logger_iov_space);
+        mk_logger_cat_ptr(method);
+        break;
+    default:
+        mk_logger_out_len += snprintf(mk_logger_out + mk_logger_out_len, 80,
+                                      "[error %u] (no description) ",
+                                      rec->status);
+        mk_logger_cat_ptr(uri);
+    }
+
+    if (msg) {
+        mk_logger_cat_ptr(msg);
+    }
+    mk_logger_cat_ptr(&mk_logger_iov_lf);
+}
+
+static void mk_logger_format_json(struct log_record *rec,
+                                  mk_ptr_t *method, mk_ptr_t *uri)
+{
+    mk_ptr_t ip;
+    mk_ptr_t protocol;
+    char ip_buf[INET6_ADDRSTRLEN];
+
+    mk_logger_record_ip(rec, &ip, ip_buf);
+    mk_logger_record_protocol(rec, &protocol);
+
+    mk_logger_out_len += snprintf(mk_logger_out + mk_logger_out_len, 256,
+                                  "{\"time\":%lld,\"remote\":\"%.*s\","
+                                  "\"port\":%u,\"vhost\":%u,\"method\":\"",
+                                  (long long) rec->time,
+                                  (int) ip.len, ip.data,
+                                  rec->port, rec->vhost);
+    mk_logger_cat_json(method->data, method->len);
+    mk_logger_cat("\",\"uri\":\"", 9);
+    mk_logger_cat_json(uri->data, uri->len);
+    mk_logger_out_len += snprintf(mk_logger_out + mk_logger_out_len, 256,
+                                  "\",\"protocol\":\"%.*s\",\"status\":%u,"
+                                  "\"bytes\":",
+                                  (int) protocol.len, protocol.data,
+                                  rec->status);
+    if (rec->bytes < 0) {
+        mk_logger_cat("null", 4);
+    }
+    else {
+        mk_logger_cat_num(rec->bytes);
+    }
+    mk_logger_out_len += snprintf(mk_logger_out + mk_logger_out_len, 64,
+                                  ",\"duration_us\":%u}\n", rec->duration);
+}
 
-        /* translate the backend events triggered */
-        mk_event_foreach(event, evl) {
-            entry = (struct log_target *) event;
-            target = entry->file;
-            fd = entry->pipe[0];
+/*
+ * Write the formatted lines, on success the first 'rings' rings can
+ * release them: the ones after were not formatted in this pass yet.
+ */
+static int mk_logger_out_write(struct log_target *target, int rings)
+{
+    int i;
+    size_t sent = 0;
+    ssize_t bytes;
+    struct log_ring *ring;
+
+    while (target->fd != -1 && sent < mk_logger_out_len) {
+        bytes = write(target->fd, mk_logger_out + sent,
+                      mk_logger_out_len - sent);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (bytes <= 0) {
+            mk_warn("Could not write to log file '%s' (%s)",
+                    target->file, strerror(errno));
+            mk_logger_out_len = 0;
+            return -1;
+        }
+        sent += bytes;
+    }
+    mk_logger_out_len = 0;
+
+    for (i = 0; i < rings; i++) {
+        ring = __atomic_load_n(&target->rings[i], __ATOMIC_ACQUIRE);
+        if (ring && target->done[i] != ring->tail) {
+            __atomic_store_n(&ring->tail, target->done[i], __ATOMIC_RELEASE);
+        }
+    }
 
-            err = ioctl(fd, FIONREAD, &bytes);
-            if (mk_unlikely(err == -1)){
-                perror("ioctl");
+    return 0;
+}
+
+/*
+ * Text and JSON: the records of every ring are turned into lines here,
+ * so the workers never pay for the formatting. Without a file they are
+ * just discarded.
+ */
+static void mk_logger_flush_format(struct log_target *target)
+{
+    int i;
+    size_t len;
+    uint64_t tail;
+    uint64_t head;
+    mk_ptr_t method;
+    mk_ptr_t uri;
+    struct log_record rec;
+    struct log_ring *ring;
+
+    mk_logger_out_len = 0;
+
+    for (i = 0; i < mk_api->config->workers; i++) {
+        ring = __atomic_load_n(&target->rings[i], __ATOMIC_ACQUIRE);
+        if (!ring) {
+            continue;
+        }
+
+        tail = ring->tail;
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        target->done[i] = tail;
+
+        while (tail < head) {
+            mk_logger_ring_copy(ring, tail, &rec, sizeof(rec));
+            len = rec.method_len + rec.uri_len;
+            if (rec.size < sizeof(rec) + len || rec.size > head - tail) {
+                mk_warn("[logger] corrupt entries discarded for '%s'",
+                        target->file);
+                target->done[i] = head;
+                break;
             }
 
-            if (bytes < buffer_limit && clk <= timeout) {
+            if (target->fd == -1) {
+                tail += rec.size;
+                target->done[i] = tail;
                 continue;
             }
 
-            timeout = clk + mk_logger_timeout;
+            /* Worst case line: every character escaped */
+            if (mk_logger_out_len + 256 + len * 6 > sizeof(mk_logger_out)) {
+                if (mk_logger_out_write(target, i + 1) == -1) {
+                    return;
+                }
+            }
 
-            flog = open(target, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
-            if (mk_unlikely(flog == -1)) {
-                mk_warn("Could not open logfile '%s' (%s)", target, strerror(errno));
+            mk_logger_ring_copy(ring, tail + sizeof(rec),
+                                mk_logger_str, len);
+            if (rec.method_len > 0) {
+                method.data = mk_logger_str;
+                method.len = rec.method_len;
+            }
+            else if (rec.method < MK_METHOD_SIZEOF) {
+                method = mk_logger_methods[rec.method];
+            }
+            else {
+                mk_ptr_set(&method, MK_LOGGER_IOV_EMPTY);
+            }
+            uri.data = mk_logger_str + rec.method_len;
+            uri.len = rec.uri_len;
 
-                int consumed = 0;
-                char buf[255];
-                do {
-                    slen = read(fd, buf, 255);
-                    if (slen > 0) {
-                        consumed += slen;
+            if (mk_logger_format == MK_LOGGER_FORMAT_JSON) {
+                mk_logger_format_json(&rec, &method, &uri);
+            }
+            else {
+                mk_logger_format_text(&rec, &method, &uri);
+            }
+
+            tail += rec.size;
+            target->done[i] = tail;
+        }
+    }
+
+    mk_logger_out_write(target, mk_api->config->workers);
+}
+
+/*
+ * Binary: write what the workers queued for a target as it is, every ring
+ * holds up to two contiguous regions, a batch of rings goes out in one
+ * writev(2).
+ */
+static void mk_logger_flush_binary(struct log_target *target)
+{
+    int i;
+    int n;
+    int first;
+    int base;
+    uint64_t tail;
+    uint64_t len;
+    uint64_t off;
+    uint64_t adv;
+    size_t total;
+    size_t sent;
+    ssize_t bytes;
+    struct log_ring *ring;
+    struct log_ring *rings[MK_LOGGER_BATCH];
+    uint64_t pending[MK_LOGGER_BATCH];
+    struct iovec iov[MK_LOGGER_BATCH * 2];
+    int workers = mk_api->config->workers;
+
+    for (base = 0; base < workers; base += MK_LOGGER_BATCH) {
+        n = 0;
+        first = 0;
+        total = 0;
+        memset(pending, 0, sizeof(pending));
+
+        for (i = base; i < workers && i < base + MK_LOGGER_BATCH; i++) {
+            ring = __atomic_load_n(&target->rings[i], __ATOMIC_ACQUIRE);
+            if (!ring) {
+                continue;
+            }
+
+            tail = ring->tail;
+            len = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+            if (len == 0) {
+                continue;
+            }
+
+            rings[i - base] = ring;
+            pending[i - base] = len;
+            total += len;
+
+            off = tail & (ring->size - 1);
+            iov[n].iov_base = ring->buf + off;
+            if (off + len > ring->size) {
+                iov[n].iov_len = ring->size - off;
+                n++;
+                iov[n].iov_base = ring->buf;
+                iov[n].iov_len = len - (ring->size - off);
+            }
+            else {
+                iov[n].iov_len = len;
+            }
+            n++;
+        }
+
+        if (total == 0) {
+            continue;
+        }
+
+        /* Without a file the entries are discarded */
+        sent = total;
+        if (target->fd != -1) {
+            sent = 0;
+            while (sent < total) {
+                bytes = writev(target->fd, iov + first, n - first);
+                if (bytes == -1 && errno == EINTR) {
+                    continue;
+                }
+                else if (bytes <= 0) {
+                    mk_warn("Could not write to log file '%s' (%s)",
+                            target->file, strerror(errno));
+                    break;
+                }
+
+                sent += bytes;
+                while (bytes > 0) {
+                    if ((size_t) bytes >= iov[first].iov_len) {
+                        bytes -= iov[first].iov_len;
+                        first++;
                     }
                     else {
-                        break;
+                        iov[first].iov_base = (char *) iov[first].iov_base +
+                                              bytes;
+                        iov[first].iov_len -= bytes;
+                        bytes = 0;
                     }
-                } while (consumed < bytes);
+                }
+            }
+        }
 
+        /* Release the space of what was written */
+        for (i = base; i < workers && i < base + MK_LOGGER_BATCH; i++) {
+            if (pending[i - base] == 0) {
                 continue;
             }
 
-            lseek(flog, 0, SEEK_END);
-            slen = _mk_logger_append(fd, flog, bytes);
-            if (mk_unlikely(slen == -1)) {
-                mk_warn("Could not write to log file: splice() = %ld", slen);
+            ring = rings[i - base];
+            adv = pending[i - base];
+            if (adv > sent) {
+                adv = sent;
             }
+            sent -= adv;
+            __atomic_store_n(&ring->tail, ring->tail + adv, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void mk_logger_flush(struct log_target *target)
+{
+    if (mk_logger_format == MK_LOGGER_FORMAT_BINARY) {
+        mk_logger_flush_binary(target);
+    }
+    else {
+        mk_logger_flush_format(target);
+    }
+}
+
+/* Report the entries dropped since the last check */
+static void mk_logger_check_drops(struct log_target *target)
+{
+    int i;
+    uint64_t dropped = 0;
+    struct log_ring *ring;
+
+    for (i = 0; i < mk_api->config->workers; i++) {
+        ring = __atomic_load_n(&target->rings[i], __ATOMIC_ACQUIRE);
+        if (ring) {
+            dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (dropped > target->dropped) {
+        mk_warn("[logger] %lu entries dropped for '%s', buffers full",
+                (unsigned long) (dropped - target->dropped), target->file);
+        target->dropped = dropped;
+    }
+}
+
+static void mk_logger_flush_all(int check)
+{
+    struct mk_list *head;
+    struct log_target *entry;
+
+    pthread_mutex_lock(&mk_logger_flush_lock);
+    mk_list_foreach(head, &targets_list) {
+        entry = mk_list_entry(head, struct log_target, _head);
+        mk_logger_flush(entry);
+
+        if (check == MK_TRUE) {
+            mk_logger_check_drops(entry);
+            if (mk_logger_rotated(entry)) {
+                mk_logger_open(entry);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mk_logger_flush_lock);
+}
+
+/* SIGHUP: open every log file again, the master log too */
+static void mk_logger_reopen()
+{
+    struct mk_list *head;
+    struct log_target *entry;
+
+    pthread_mutex_lock(&mk_logger_flush_lock);
+    mk_list_foreach(head, &targets_list) {
+        entry = mk_list_entry(head, struct log_target, _head);
+        mk_logger_flush(entry);
+        mk_logger_open(entry);
+    }
+    pthread_mutex_unlock(&mk_logger_flush_lock);
+
+    if (mk_logger_master_path != NULL && mk_api->config->is_daemon == MK_TRUE) {
+        mk_logger_master_stdout = freopen(mk_logger_master_path, "ae", stdout);
+        mk_logger_master_stderr = freopen(mk_logger_master_path, "ae", stderr);
+    }
+}
+
+static void mk_logger_start_worker(void *args)
+{
+    int ret;
+    int full;
+    int reopen;
+    time_t now;
+    time_t timeout;
+    uint64_t val;
+    (void) args;
+    struct mk_event *event;
+
+    mk_api->worker_rename("monkey: logger");
 
-            MK_TRACE("written %i bytes", bytes);
-            close(flog);
+    reopen = mk_api->config->reopen_logs;
+    timeout = time(NULL) + mk_logger_timeout;
+
+    while (1) {
+        mk_api->ev_wait(mk_logger_evl);
+
+        full = MK_FALSE;
+        mk_event_foreach(event, mk_logger_evl) {
+            ret = read(event->fd, &val, sizeof(val));
+            if (ret <= 0) {
+                continue;
+            }
+
+            /* A worker ring went over its limit */
+            if (event == &mk_logger_notify) {
+                full = MK_TRUE;
+            }
+        }
+
+        if (reopen != mk_api->config->reopen_logs) {
+            reopen = mk_api->config->reopen_logs;
+            mk_logger_reopen();
+        }
+
+        now = time(NULL);
+        if (now >= timeout) {
+            timeout = now + mk_logger_timeout;
+            mk_logger_flush_all(MK_TRUE);
+        }
+        else if (full == MK_TRUE) {
+            mk_logger_flush_all(MK_FALSE);
         }
     }
 }
@@ -231,7 +740,9 @@ static void mk_logger_start_worker(void *args)
 static int mk_logger_read_config(char *path)
 {
     int timeout;
+    long size;
     char *logfilename = NULL;
+    char *format;
     unsigned long len;
     char *default_file = NULL;
     struct mk_rconf *conf;
@@ -257,6 +768,34 @@ static int mk_logger_read_config(char *path)
         mk_logger_timeout = timeout;
         MK_TRACE("FlushTimeout %i seconds", mk_logger_timeout);
 
+        /* BufferSize */
+        size = (size_t) mk_api->config_section_get_key(section,
+                                                       "BufferSize",
+                                                       MK_RCONF_NUM);
+        if (size > 0) {
+            mk_logger_buffer_size = size;
+        }
+
+        /* Format */
+        format = mk_api->config_section_get_key(section, "Format",
+                                                MK_RCONF_STR);
+        if (format) {
+            if (strcasecmp(format, "text") == 0) {
+                mk_logger_format = MK_LOGGER_FORMAT_TEXT;
+            }
+            else if (strcasecmp(format, "json") == 0) {
+                mk_logger_format = MK_LOGGER_FORMAT_JSON;
+            }
+            else if (strcasecmp(format, "binary") == 0) {
+                mk_logger_format = MK_LOGGER_FORMAT_BINARY;
+            }
+            else {
+                mk_err("Format must be text, json or binary");
+                exit(EXIT_FAILURE);
+            }
+            mk_api->mem_free(format);
+        }
+
         /* MasterLog */
         logfilename = mk_api->config_section_get_key(section,
                                                      "MasterLog",
@@ -315,13 +854,12 @@ int mk_logger_plugin_init(struct plugin_api **api, char *confdir)
     mk_api = *api;
 
     /* Specific thread key */
-    pthread_key_create(&cache_iov, NULL);
-    pthread_key_create(&cache_content_length, NULL);
-    pthread_key_create(&cache_status, NULL);
-    pthread_key_create(&cache_ip_str, NULL);
+    pthread_key_create(&cache_worker, NULL);
 
     /* Global configuration */
     mk_logger_timeout = MK_LOGGER_TIMEOUT_DEFAULT;
+    mk_logger_format = MK_LOGGER_FORMAT_TEXT;
+    mk_logger_buffer_size = MK_LOGGER_BUFFER_DEFAULT;
     mk_logger_master_path = NULL;
     mk_logger_read_config(confdir);
 
@@ -347,24 +885,53 @@ int mk_logger_plugin_exit()
     struct mk_list *head, *tmp;
     struct log_target *entry;
 
+    /* Write what is still queued, the log thread may be flushing too */
+    pthread_mutex_lock(&mk_logger_flush_lock);
     mk_list_foreach_safe(head, tmp, &targets_list) {
         entry = mk_list_entry(head, struct log_target, _head);
+        mk_logger_flush(entry);
+        mk_logger_check_drops(entry);
+
         mk_list_del(&entry->_head);
-        if (entry->pipe[0] > 0) close(entry->pipe[0]);
-        if (entry->pipe[1] > 0) close(entry->pipe[1]);
+        if (entry->fd != -1) {
+            close(entry->fd);
+        }
         mk_api->mem_free(entry->file);
+        mk_api->mem_free(entry->done);
         mk_api->mem_free(entry);
     }
+    pthread_mutex_unlock(&mk_logger_flush_lock);
 
     mk_api->mem_free(mk_logger_master_path);
 
     return 0;
 }
 
+static void mk_logger_target_add(struct mk_vhost *host, char *file, int is_ok)
+{
+    struct log_target *new;
+
+    new = mk_api->mem_alloc_z(sizeof(struct log_target));
+    new->rings = mk_api->mem_alloc_z(sizeof(struct log_ring *) *
+                                     mk_api->config->workers);
+    new->done = mk_api->mem_alloc_z(sizeof(uint64_t) *
+                                    mk_api->config->workers);
+    if (!new->rings || !new->done) {
+        mk_err("Could not allocate log buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    new->is_ok = is_ok;
+    new->fd = -1;
+    new->file = file;
+    new->host = host;
+    mk_logger_open(new);
+    mk_list_add(&new->_head, &targets_list);
+}
+
 int mk_logger_master_init(struct mk_server_config *config)
 {
     int ret;
-    struct log_target *new;
     struct mk_vhost *entry_host;
     struct mk_list *hosts = &mk_api->config->hosts;
     struct mk_list *head_host;
@@ -400,54 +967,36 @@ int mk_logger_master_init(struct mk_server_config *config)
                                                                       MK_RCONF_STR);
 
             if (access_file_name) {
-                new = mk_api->mem_alloc(sizeof(struct log_target));
-                new->is_ok = MK_TRUE;
-
-                /* Set access pipe */
-                if (pipe(new->pipe) < 0) {
-                    mk_err("Could not create pipe");
-                    exit(EXIT_FAILURE);
-                }
-                if (fcntl(new->pipe[1], F_SETFL, O_NONBLOCK) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[0], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[1], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                new->file = access_file_name;
-                new->host = entry_host;
-                mk_list_add(&new->_head, &targets_list);
+                mk_logger_target_add(entry_host, access_file_name, MK_TRUE);
             }
 
-            /* Set error pipe */
             if (error_file_name) {
-                new = mk_api->mem_alloc(sizeof(struct log_target));
-                new->is_ok = MK_FALSE;
-
-                if (pipe(new->pipe) < 0) {
-                    mk_err("Could not create pipe");
-                    exit(EXIT_FAILURE);
-                }
-                if (fcntl(new->pipe[1], F_SETFL, O_NONBLOCK) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[0], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[1], F_SETFD, FD_CLOEXEC) == -1 ){
-                    perror("fcntl");
-                }
-                new->file = error_file_name;
-                new->host = entry_host;
-                mk_list_add(&new->_head, &targets_list);
-
+                mk_logger_target_add(entry_host, error_file_name, MK_FALSE);
             }
         }
     }
 
+    /* Log thread loop: flush timer and 'ring is full' notifications */
+    mk_logger_evl = mk_api->ev_loop_create(4);
+    if (!mk_logger_evl) {
+        return -1;
+    }
+
+    ret = mk_api->ev_timeout_create(mk_logger_evl, 1, 0, &mk_logger_timer);
+    if (ret == -1) {
+        return -1;
+    }
+
+    ret = mk_api->ev_channel_create(mk_logger_evl,
+                                    &mk_logger_ch_r, &mk_logger_ch_w,
+                                    &mk_logger_notify);
+    if (ret != 0) {
+        return -1;
+    }
+    fcntl(mk_logger_ch_w, F_SETFL, O_NONBLOCK);
+    fcntl(mk_logger_ch_r, F_SETFD, FD_CLOEXEC);
+    fcntl(mk_logger_ch_w, F_SETFD, FD_CLOEXEC);
+
     ret = mk_api->worker_spawn((void *) mk_logger_start_worker, NULL, &tid);
     if (ret == -1) {
         return -1;
@@ -458,373 +1007,129 @@ int mk_logger_master_init(struct mk_server_config *config)
 
 void mk_logger_worker_init()
 {
-    struct mk_iov *iov_log;
-    mk_ptr_t *content_length;
-    mk_ptr_t *status;
-    mk_ptr_t *ip_str;
-
-
-    MK_TRACE("Creating thread cache");
-
-    /* Cache iov log struct */
-    iov_log = mk_api->iov_create(15, 0);
-    pthread_setspecific(cache_iov, (void *) iov_log);
-
-    /* Cache content length */
-    content_length = mk_api->mem_alloc_z(sizeof(mk_ptr_t));
-    content_length->data = mk_api->mem_alloc_z(MK_UTILS_INT2MKP_BUFFER_LEN);
-    content_length->len = -1;
-    pthread_setspecific(cache_content_length, (void *) content_length);
-
-    /* Cahe status */
-    status = mk_api->mem_alloc_z(sizeof(mk_ptr_t));
-    status->data = mk_api->mem_alloc_z(MK_UTILS_INT2MKP_BUFFER_LEN);
-    status->len = -1;
-    pthread_setspecific(cache_status, (void *) status);
-
-    /* Cache IP address */
-    ip_str = mk_api->mem_alloc_z(sizeof(mk_ptr_t));
-    ip_str->data = mk_api->mem_alloc_z(INET6_ADDRSTRLEN + 1);
-    ip_str->len  = -1;
-    pthread_setspecific(cache_ip_str, (void *) ip_str);
-}
-
-int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
-{
-    int i, http_status, ret, tmp;
-    int array_len = ARRAY_SIZE(response_codes);
-    int access;
+    int id;
+    size_t size;
+    struct mk_list *head;
     struct log_target *target;
-    struct mk_iov *iov;
-    mk_ptr_t *date;
-    mk_ptr_t *content_length;
-    mk_ptr_t *ip_str;
-    mk_ptr_t status;
+    struct log_ring *ring;
 
-    /* Set response status */
-    http_status = sr->headers.status;
+    /* Worker rings, one per log file */
+    id = __atomic_fetch_add(&mk_logger_workers, 1, __ATOMIC_RELAXED);
+    if (id >= mk_api->config->workers) {
+        return;
+    }
 
-    if (http_status < 400) {
-        access = MK_TRUE;
+    size = 4096;
+    while (size < mk_logger_buffer_size * 1024) {
+        size <<= 1;
     }
-    else {
-        access = MK_FALSE;
+
+    mk_list_foreach(head, &targets_list) {
+        target = mk_list_entry(head, struct log_target, _head);
+        ring = mk_api->mem_alloc_z(sizeof(struct log_ring));
+        ring->buf = mk_api->mem_alloc(size);
+        if (!ring->buf) {
+            mk_err("Could not allocate log buffers");
+            exit(EXIT_FAILURE);
+        }
+        ring->size = size;
+        __atomic_store_n(&target->rings[id], ring, __ATOMIC_RELEASE);
     }
+    pthread_setspecific(cache_worker, (void *) (long) (id + 1));
+}
+
+int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
+{
+    int n = 1;
+    size_t len;
+    uint64_t now;
+    struct log_target *target;
+    struct log_record rec;
+    struct mk_socket_addr *peer;
+    struct iovec iov[4];
+    static const char pad[8];
 
-    /* Look for target log file */
-    target = mk_logger_match_by_host(sr->host_conf, access);
+    target = mk_logger_match_by_host(sr->host_conf,
+                                     sr->headers.status < 400);
     if (!target) {
         MK_TRACE("No target found");
         return 0;
     }
 
-    /* Get iov cache struct and reset indexes */
-    iov = (struct mk_iov *) mk_logger_get_cache();
-    iov->iov_idx = 0;
-    iov->buf_idx = 0;
-    iov->total_len = 0;
-
-    /* Format IP string */
-    ip_str = pthread_getspecific(cache_ip_str);
-    ret = mk_api->socket_ip_str(cs->socket,
-                                &ip_str->data,
-                                INET6_ADDRSTRLEN + 1,
-                                &ip_str->len);
     /*
-     * If the socket is not longer available ip_str can be null,
-     * so we must check this condition and return
+     * Only the raw values are taken here, the log thread formats them
+     * (or not at all with Format binary).
      */
-    if (mk_unlikely(ret < 0)) {
-        return 0;
+    memset(&rec, '\0', sizeof(rec));
+    rec.version = MK_LOGGER_RECORD_VERSION;
+    rec.status = sr->headers.status;
+    rec.vhost = sr->host_conf->id;
+    rec.time = mk_api->time_unix();
+    rec.method = sr->method;
+    if (sr->protocol > 0) {
+        rec.protocol = sr->protocol;
     }
 
-    /* Add IP to IOV */
-    mk_api->iov_add(iov,
-                    ip_str->data, ip_str->len,
-                    MK_FALSE);
-    mk_api->iov_add(iov,
-                    mk_logger_iov_dash.data,
-                    mk_logger_iov_dash.len,
-                    MK_FALSE);
-
-    /* Date/time when object was requested */
-    date = mk_api->time_human();
-    mk_api->iov_add(iov,
-                    date->data, date->len,
-                    MK_FALSE);
-    mk_api->iov_add(iov,
-                    mk_logger_iov_space.data,
-                    mk_logger_iov_space.len,
-                    MK_FALSE);
-
-    /* Access Log */
-    if (http_status < 400) {
-        /* No access file defined */
-        if (!target->file) {
-            return 0;
-        }
-
-        /* HTTP Method */
-        mk_api->iov_add(iov,
-                        sr->method_p.data,
-                        sr->method_p.len,
-                        MK_FALSE);
-        mk_api->iov_add(iov,
-                        mk_logger_iov_space.data,
-                        mk_logger_iov_space.len,
-                        MK_FALSE);
-
-        /* HTTP URI required */
-        mk_api->iov_add(iov,
-                        sr->uri.data, sr->uri.len,
-                        MK_FALSE);
-        mk_api->iov_add(iov,
-                        mk_logger_iov_space.data,
-                        mk_logger_iov_space.len,
-                        MK_FALSE);
-
-        /* HTTP Protocol */
-        mk_api->iov_add(iov,
-                        sr->protocol_p.data, sr->protocol_p.len,
-                        MK_FALSE);
-        mk_api->iov_add(iov,
-                        mk_logger_iov_space.data,
-                        mk_logger_iov_space.len,
-                        MK_FALSE);
-
-        /* HTTP Status code response */
-        for (i=0; i < array_len; i++) {
-            if (response_codes[i].i_status == http_status) {
-                break;
-            }
-        }
+    if (sr->method == MK_METHOD_HEAD) {
+        rec.bytes = -1;
+    }
+    else if (sr->headers.content_length > 0) {
+        rec.bytes = sr->headers.content_length;
+    }
 
-        if (array_len == i) {
-            mk_api->str_itop(http_status, &status);
-            status.len -= 2;
+    if (sr->start > 0) {
+        now = mk_clock_usec();
+        if (now - sr->start < UINT32_MAX) {
+            rec.duration = now - sr->start;
         }
         else {
-            status.data = response_codes[i].s_status;
-            status.len  = 3;
-        }
-        mk_api->iov_add(iov,
-                        status.data,
-                        status.len,
-                        MK_FALSE);
-        mk_api->iov_add(iov,
-                        mk_logger_iov_space.data,
-                        mk_logger_iov_space.len,
-                        MK_FALSE);
-
-        /* Content Length */
-        if (sr->method != MK_METHOD_HEAD) {
-            /* Int to mk_ptr_t */
-            content_length = pthread_getspecific(cache_content_length);
-
-            tmp = sr->headers.content_length;
-            if (tmp < 0) {
-                tmp = 0;
-            }
-
-            mk_api->str_itop(tmp, content_length);
+            rec.duration = UINT32_MAX;
+        }
+    }
 
-            mk_api->iov_add(iov,
-                            content_length->data, content_length->len - 2,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
+    peer = cs->conn ? &cs->conn->peer : NULL;
+    if (peer && peer->len > 0) {
+        rec.family = peer->addr.sa.sa_family;
+        rec.port = mk_api->socket_addr_port(peer);
+        if (rec.family == AF_INET) {
+            memcpy(rec.addr, &peer->addr.in.sin_addr, 4);
         }
         else {
-            mk_api->iov_add(iov,
-                            mk_logger_iov_empty.data,
-                            mk_logger_iov_empty.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
+            memcpy(rec.addr, &peer->addr.in6.sin6_addr, 16);
         }
+    }
 
-        /* Write iov array to pipe */
-        mk_api->iov_send(target->pipe[1], iov);
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    len = sizeof(rec);
+
+    /* Known methods are logged by id */
+    if (sr->method == MK_METHOD_UNKNOWN && sr->method_p.len > 0) {
+        rec.method_len = sr->method_p.len < 255 ? sr->method_p.len : 255;
+        iov[n].iov_base = sr->method_p.data;
+        iov[n].iov_len = rec.method_len;
+        len += rec.method_len;
+        n++;
     }
-    else {
-        if (mk_unlikely(!target->file)) {
-            return 0;
-        }
-
-        /* For unknown errors. Needs to exist until iov_send. */
-        char err_str[80];
-
-        switch (http_status) {
-        case MK_CLIENT_BAD_REQUEST:
-            mk_api->iov_add(iov,
-                            error_msg_400.data,
-                            error_msg_400.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_CLIENT_FORBIDDEN:
-            mk_api->iov_add(iov,
-                            error_msg_403.data,
-                            error_msg_403.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            sr->uri.data,
-                            sr->uri.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-
-            break;
-        case MK_CLIENT_NOT_FOUND:
-            mk_api->iov_add(iov,
-                            error_msg_404.data,
-                            error_msg_404.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-
-            mk_api->iov_add(iov,
-                            sr->uri.data,
-                            sr->uri.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-
-            break;
-        case MK_CLIENT_METHOD_NOT_ALLOWED:
-            mk_api->iov_add(iov,
-                            error_msg_405.data,
-                            error_msg_405.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            sr->method_p.data,
-                            sr->method_p.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_CLIENT_REQUEST_TIMEOUT:
-            mk_api->iov_add(iov,
-                            error_msg_408.data,
-                            error_msg_408.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_CLIENT_LENGTH_REQUIRED:
-            mk_api->iov_add(iov,
-                            error_msg_411.data,
-                            error_msg_411.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_CLIENT_REQUEST_ENTITY_TOO_LARGE:
-            mk_api->iov_add(iov,
-                            error_msg_413.data,
-                            error_msg_413.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_SERVER_NOT_IMPLEMENTED:
-            mk_api->iov_add(iov,
-                            error_msg_501.data,
-                            error_msg_501.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            sr->method_p.data,
-                            sr->method_p.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_SERVER_INTERNAL_ERROR:
-            mk_api->iov_add(iov,
-                            error_msg_500.data,
-                            error_msg_500.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            break;
-        case MK_SERVER_HTTP_VERSION_UNSUP:
-            mk_api->iov_add(iov,
-                            error_msg_505.data,
-                            error_msg_505.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        default:
-            {
-            int len = snprintf(err_str, 80, "[error %u] (no description)", http_status);
-            err_str[79] = '\0';
-            if (len > 79) len = 79;
-
-            mk_api->iov_add(iov,
-                            err_str,
-                            len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            sr->uri.data,
-                            sr->uri.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            }
-            break;
-        }
 
+    if (sr->uri.data && sr->uri.len > 0) {
+        rec.uri_len = sr->uri.len < MK_LOGGER_URI_MAX ?
+                      sr->uri.len : MK_LOGGER_URI_MAX;
+        iov[n].iov_base = sr->uri.data;
+        iov[n].iov_len = rec.uri_len;
+        len += rec.uri_len;
+        n++;
+    }
 
-        /* Write iov array to pipe */
-        mk_api->iov_send(target->pipe[1], iov);
+    /* Keep records aligned */
+    rec.size = (len + 7) & ~7;
+    if (rec.size > len) {
+        iov[n].iov_base = (void *) pad;
+        iov[n].iov_len = rec.size - len;
+        n++;
     }
 
+    mk_logger_push(target, iov, n, rec.size);
     return 0;
 }
 
@@ -24,30 +24,84 @@
 #include <stdio.h>
 #include <monkey/mk_api.h>
 
-#define MK_LOGGER_PIPE_LIMIT 0.75
+#define MK_LOGGER_RING_LIMIT 0.75
 #define MK_LOGGER_TIMEOUT_DEFAULT 3
+#define MK_LOGGER_BUFFER_DEFAULT  256      /* KB per worker and log file */
+#define MK_LOGGER_BATCH           64       /* rings per writev(2)        */
+#define MK_LOGGER_OUT_SIZE        65536    /* formatted lines per write  */
+
+/* Format key */
+#define MK_LOGGER_FORMAT_TEXT     0
+#define MK_LOGGER_FORMAT_JSON     1
+#define MK_LOGGER_FORMAT_BINARY   2
 
 int mk_logger_timeout;
+int mk_logger_format;
+size_t mk_logger_buffer_size;
 
 /* MasterLog variables */
 char *mk_logger_master_path;
 FILE *mk_logger_master_stdout;
 FILE *mk_logger_master_stderr;
 
-pthread_key_t cache_content_length;
-pthread_key_t cache_status;
-pthread_key_t cache_ip_str;
-pthread_key_t cache_iov;
+pthread_key_t cache_worker;
+
+/*
+ * One request as queued by the workers, the log thread turns it into a
+ * text or JSON line. With 'Format binary' the records are written as they
+ * are, so this is also the file format: host byte order, the method name
+ * (unknown methods only) and the URI follow the fixed part, the whole
+ * record is padded to 8 bytes and 'size' includes everything.
+ */
+#define MK_LOGGER_RECORD_VERSION  1
+#define MK_LOGGER_URI_MAX         8192
+
+struct log_record {
+    uint16_t size;                /* record bytes, padding included */
+    uint8_t  version;
+    uint8_t  family;              /* AF_INET, AF_INET6 or 0         */
+    uint16_t status;
+    uint16_t vhost;               /* virtual host id                */
+    int64_t  time;                /* unix time                      */
+    int64_t  bytes;               /* response length, -1 for HEAD   */
+    uint32_t duration;            /* usec since the request parsed  */
+    uint16_t port;                /* remote port                    */
+    uint16_t uri_len;
+    uint8_t  method;              /* enum mk_request_methods        */
+    uint8_t  method_len;          /* unknown methods only           */
+    uint8_t  protocol;            /* 9, 10, 11 or 0                 */
+    uint8_t  reserved;
+    uint8_t  addr[16];            /* remote address                 */
+};
+
+/*
+ * Entries of one worker for one log file. The worker only moves 'head'
+ * and the log thread only moves 'tail', both grow forever and are masked
+ * into the buffer, so no lock is needed. An entry that does not fit is
+ * dropped and counted, the worker never waits for the disk.
+ */
+struct log_ring {
+    uint64_t head;                /* written by the worker        */
+    char pad[56];
+    uint64_t tail;                /* written by the log thread    */
+    uint64_t dropped;             /* entries that did not fit     */
+    uint64_t size;                /* power of two                 */
+    char *buf;
+};
 
 struct log_target
 {
-    struct mk_event event;
-
-    /* Pipes */
     int is_ok;
-    int pipe[2];
+    int fd;                       /* log file, -1 if not open     */
+    int open_failed;
+    dev_t dev;                    /* to notice a rotated file     */
+    ino_t ino;
+    uint64_t dropped;             /* drops reported so far        */
     char *file;
 
+    struct log_ring **rings;      /* one per worker               */
+    uint64_t *done;               /* formatted up to, per ring    */
+
     struct mk_vhost *host;
     struct mk_list _head;
 };
@@ -0,0 +1,387 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Metrics
+ * -------
+ * Serves the server metrics in the Prometheus text format. The plugin
+ * is a handler, the URL is set on the virtual host:
+ *
+ *   [HANDLERS]
+ *       Match /metrics metrics
+ */
+
+#include <monkey/mk_api.h>
+
+#include <stdarg.h>
+
+#define METRICS_BUF_SIZE    16384
+
+/* Upper bounds of the buckets exposed, microseconds */
+static const uint64_t metrics_time_bounds[] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+/* bytes */
+static const uint64_t metrics_size_bounds[] = {
+    64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304,
+    16777216, 67108864
+};
+
+static const char *metrics_status[] = {
+    "1xx", "2xx", "3xx", "4xx", "5xx", "other"
+};
+
+static const char *metrics_stage[] = {
+    "10", "20", "30", "40", "50"
+};
+
+static mk_ptr_t metrics_content_type =
+    mk_ptr_init("Content-Type: text/plain; version=0.0.4\r\n");
+
+struct metrics_buf {
+    char *data;
+    size_t len;
+    size_t size;
+    int error;
+};
+
+static void metrics_printf(struct metrics_buf *buf, const char *fmt, ...)
+{
+    int ret;
+    size_t size;
+    char *tmp;
+    va_list ap;
+
+    while (buf->error == MK_FALSE) {
+        va_start(ap, fmt);
+        ret = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+        va_end(ap);
+
+        if (ret < 0) {
+            buf->error = MK_TRUE;
+            return;
+        }
+        if ((size_t) ret < buf->size - buf->len) {
+            buf->len += ret;
+            return;
+        }
+
+        size = buf->size * 2;
+        while (size - buf->len <= (size_t) ret) {
+            size *= 2;
+        }
+        tmp = mk_api->mem_realloc(buf->data, size);
+        if (!tmp) {
+            buf->error = MK_TRUE;
+            return;
+        }
+        buf->data = tmp;
+        buf->size = size;
+    }
+}
+
+static void metrics_header(struct metrics_buf *buf, const char *name,
+                           const char *type, const char *help)
+{
+    metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Write a histogram, the fine grained buckets are folded into the
+ * exposed bounds: a bucket counts for a bound once all its values do.
+ * A 'scale' of zero writes integers (bytes), otherwise it converts
+ * microseconds to seconds.
+ */
+static void metrics_histogram(struct metrics_buf *buf, const char *name,
+                              const char *labels,
+                              struct mk_metrics_histogram *h,
+                              const uint64_t *bounds, int n, int scale)
+{
+    int i;
+    int b = 0;
+    uint64_t count = 0;
+
+    for (i = 0; i < n; i++) {
+        while (b < MK_METRICS_BUCKETS - 1 &&
+               mk_metrics_bucket_low(b + 1) <= bounds[i] + 1) {
+            count += h->buckets[b++];
+        }
+        if (scale) {
+            metrics_printf(buf, "%s_bucket{%sle=\"%g\"} %lu\n",
+                           name, labels, bounds[i] / 1e6, count);
+        }
+        else {
+            metrics_printf(buf, "%s_bucket{%sle=\"%lu\"} %lu\n",
+                           name, labels, bounds[i], count);
+        }
+    }
+
+    for (; b < MK_METRICS_BUCKETS; b++) {
+        count += h->buckets[b];
+    }
+    metrics_printf(buf, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, labels, count);
+
+    /* the sum and count lines take the labels without the trailing comma */
+    i = strlen(labels);
+    if (i > 0) {
+        metrics_printf(buf, "%s_sum{%.*s} ", name, i - 1, labels);
+    }
+    else {
+        metrics_printf(buf, "%s_sum ", name);
+    }
+    if (scale) {
+        metrics_printf(buf, "%g\n", h->sum / 1e6);
+    }
+    else {
+        metrics_printf(buf, "%lu\n", h->sum);
+    }
+
+    if (i > 0) {
+        metrics_printf(buf, "%s_count{%.*s} %lu\n", name, i - 1, labels, count);
+    }
+    else {
+        metrics_printf(buf, "%s_count %lu\n", name, count);
+    }
+}
+
+static void metrics_render(struct metrics_buf *buf, struct mk_metrics *m)
+{
+    int i;
+    int n;
+    char label[32];
+    unsigned long long accepted = 0;
+    unsigned long long closed = 0;
+    struct mk_list *head;
+    struct mk_vhost *host;
+    struct mk_vhost_alias *alias;
+    struct mk_sched_ctx *ctx;
+    struct mk_sched_worker *worker;
+    struct mk_resolver_stats rs;
+
+    /* Requests */
+    metrics_header(buf, "monkey_requests_total", "counter",
+                   "Requests served by status class.");
+    for (i = 0; i < MK_METRICS_STATUS_CLASSES; i++) {
+        metrics_printf(buf, "monkey_requests_total{code=\"%s\"} %lu\n",
+                       metrics_status[i], m->status[i]);
+    }
+
+    metrics_header(buf, "monkey_vhost_requests_total", "counter",
+                   "Requests served by virtual host.");
+    n = 0;
+    mk_list_foreach(head, &mk_api->config->hosts) {
+        if (n >= m->vhosts) {
+            break;
+        }
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        if (mk_list_is_empty(&host->server_names) != 0) {
+            alias = mk_list_entry_first(&host->server_names,
+                                        struct mk_vhost_alias, _head);
+            metrics_printf(buf, "monkey_vhost_requests_total{vhost=\"%s\"} %lu\n",
+                           alias->name, m->vhost_requests[host->id]);
+        }
+        else {
+            metrics_printf(buf, "monkey_vhost_requests_total{vhost=\"%i\"} %lu\n",
+                           host->id, m->vhost_requests[host->id]);
+        }
+        n++;
+    }
+
+    /* Latency and size */
+    metrics_header(buf, "monkey_request_first_byte_seconds", "histogram",
+                   "Time from the request begin to the first response byte.");
+    metrics_histogram(buf, "monkey_request_first_byte_seconds", "",
+                      &m->first_byte, metrics_time_bounds,
+                      sizeof(metrics_time_bounds) / sizeof(uint64_t), MK_TRUE);
+
+    metrics_header(buf, "monkey_request_done_seconds", "histogram",
+                   "Time from the first to the last response byte.");
+    metrics_histogram(buf, "monkey_request_done_seconds", "",
+                      &m->done, metrics_time_bounds,
+                      sizeof(metrics_time_bounds) / sizeof(uint64_t), MK_TRUE);
+
+    metrics_header(buf, "monkey_response_size_bytes", "histogram",
+                   "Bytes written for a response, headers included.");
+    metrics_histogram(buf, "monkey_response_size_bytes", "",
+                      &m->size, metrics_size_bounds,
+                      sizeof(metrics_size_bounds) / sizeof(uint64_t), MK_FALSE);
+
+    metrics_header(buf, "monkey_plugin_stage_seconds", "histogram",
+                   "Time spent running the plugins of a stage.");
+    for (i = 0; i < MK_METRICS_STAGES; i++) {
+        snprintf(label, sizeof(label), "stage=\"%s\",", metrics_stage[i]);
+        metrics_histogram(buf, "monkey_plugin_stage_seconds", label,
+                          &m->stage[i], metrics_time_bounds,
+                          sizeof(metrics_time_bounds) / sizeof(uint64_t),
+                          MK_TRUE);
+    }
+
+    /* Connections, the scheduler counters are only read */
+    ctx = mk_api->config->sched_ctx;
+    for (i = 0; ctx && i < mk_api->config->workers; i++) {
+        worker = &ctx->workers[i];
+        accepted += worker->accepted_connections;
+        closed += worker->closed_connections;
+    }
+    metrics_header(buf, "monkey_connections_accepted_total", "counter",
+                   "Connections accepted.");
+    metrics_printf(buf, "monkey_connections_accepted_total %llu\n", accepted);
+    metrics_header(buf, "monkey_connections_closed_total", "counter",
+                   "Connections closed.");
+    metrics_printf(buf, "monkey_connections_closed_total %llu\n", closed);
+
+    /* Resolver */
+    mk_api->net_resolve_stats(&rs);
+    metrics_header(buf, "monkey_resolver_lookups_total", "counter",
+                   "Host names resolved.");
+    metrics_printf(buf, "monkey_resolver_lookups_total %lu\n", rs.lookups);
+    metrics_header(buf, "monkey_resolver_hits_total", "counter",
+                   "Lookups answered by the cache.");
+    metrics_printf(buf, "monkey_resolver_hits_total %lu\n", rs.hits);
+    metrics_header(buf, "monkey_resolver_failures_total", "counter",
+                   "Lookups that failed.");
+    metrics_printf(buf, "monkey_resolver_failures_total %lu\n", rs.failures);
+}
+
+static void metrics_cb_finished(struct mk_stream_input *in)
+{
+    mk_api->iov_free(in->buffer);
+    in->buffer = NULL;
+}
+
+int mk_metrics_plugin_init(struct plugin_api **api, char *confdir)
+{
+    (void) confdir;
+
+    mk_api = *api;
+    return 0;
+}
+
+int mk_metrics_plugin_exit()
+{
+    return 0;
+}
+
+int mk_metrics_stage30(struct mk_plugin *plugin,
+                       struct mk_http_session *cs,
+                       struct mk_http_request *sr,
+                       int n_params,
+                       struct mk_list *params)
+{
+    struct mk_iov *iov;
+    struct mk_metrics *m;
+    struct metrics_buf buf;
+    (void) n_params;
+    (void) params;
+
+    if (sr->method != MK_METHOD_GET && sr->method != MK_METHOD_HEAD) {
+        mk_api->header_set_http_status(sr, MK_CLIENT_METHOD_NOT_ALLOWED);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    m = mk_api->metrics_collect();
+    if (!m) {
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    buf.len = 0;
+    buf.size = METRICS_BUF_SIZE;
+    buf.error = MK_FALSE;
+    buf.data = mk_api->mem_alloc(buf.size);
+    if (!buf.data) {
+        mk_api->metrics_free(m);
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    metrics_render(&buf, m);
+    mk_api->metrics_free(m);
+
+    if (buf.error == MK_TRUE) {
+        mk_api->mem_free(buf.data);
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    if (sr->method == MK_METHOD_HEAD) {
+        mk_api->mem_free(buf.data);
+        iov = NULL;
+    }
+    else {
+        /* the IOV owns the buffer from here */
+        iov = mk_api->iov_create(1, 0);
+        if (!iov) {
+            mk_api->mem_free(buf.data);
+            mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+            return MK_PLUGIN_RET_CLOSE_CONX;
+        }
+        mk_api->iov_add(iov, buf.data, buf.len, MK_TRUE);
+    }
+
+    mk_api->header_set_http_status(sr, MK_HTTP_OK);
+    sr->headers.content_length = buf.len;
+    sr->headers.content_type = metrics_content_type;
+    mk_api->header_prepare(plugin, cs, sr);
+
+    if (iov) {
+        mk_stream_in_iov(&sr->stream, NULL, iov, NULL, metrics_cb_finished);
+    }
+
+    /* the scheduler finishes the request once the channel is flushed */
+    mk_api->http_request_end(plugin, cs, MK_FALSE);
+    return MK_PLUGIN_RET_CONTINUE;
+}
+
+int mk_metrics_stage30_hangup(struct mk_plugin *plugin,
+                              struct mk_http_session *cs,
+                              struct mk_http_request *sr)
+{
+    (void) plugin;
+    (void) cs;
+    (void) sr;
+
+    return 0;
+}
+
+struct mk_plugin_stage mk_plugin_stage_metrics = {
+    .stage30        = &mk_metrics_stage30,
+    .stage30_hangup = &mk_metrics_stage30_hangup
+};
+
+struct mk_plugin mk_plugin_metrics = {
+    /* Identification */
+    .shortname     = "metrics",
+    .name          = "Prometheus Metrics",
+    .version       = MK_VERSION_STR,
+    .hooks         = MK_PLUGIN_STAGE,
+
+    /* Init / Exit */
+    .init_plugin   = mk_metrics_plugin_init,
+    .exit_plugin   = mk_metrics_plugin_exit,
+
+    /* Init Levels */
+    .master_init   = NULL,
+    .worker_init   = NULL,
+
+    /* Type */
+    .stage         = &mk_plugin_stage_metrics
+};
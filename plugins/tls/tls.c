@@ -23,13 +23,21 @@
 #include <errno.h>
 #include <assert.h>
 #include <unistd.h>
+#include <time.h>
+#include <strings.h>
 
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netdb.h>
 #include <pthread.h>
 
+#ifdef MK_HAVE_KTLS
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#endif
+
 #include <mbedtls/version.h>
 #include <mbedtls/error.h>
 #include <mbedtls/net.h>
@@ -40,12 +48,30 @@
 #include <mbedtls/certs.h>
 #include <mbedtls/x509.h>
 #include <mbedtls/ssl_cache.h>
+#include <mbedtls/cipher.h>
+#include <mbedtls/md.h>
+#include <mbedtls/platform.h>
 #include <mbedtls/pk.h>
 #include <mbedtls/dhm.h>
+#include <mbedtls/ssl_internal.h>
 #include <monkey/mk_api.h>
 
-#ifndef SENDFILE_BUF_SIZE
-#define SENDFILE_BUF_SIZE MBEDTLS_SSL_MAX_CONTENT_LEN
+#include "tls_records.h"
+#include "tls_ktls.h"
+
+/* Seconds a session ticket is accepted, also the ticket key rotation period */
+#ifndef TLS_TICKET_LIFETIME
+#define TLS_TICKET_LIFETIME 43200
+#endif
+
+/* Handshakes waiting for a crypto thread, above it they run inline */
+#ifndef TLS_OFFLOAD_QUEUE
+#define TLS_OFFLOAD_QUEUE 1024
+#endif
+
+/* Slots of the session id to cache shard table */
+#ifndef TLS_SESSION_OWNERS
+#define TLS_SESSION_OWNERS 4096
 #endif
 
 #ifndef POLAR_DEBUG_LEVEL
@@ -59,39 +85,205 @@
 #error "One or more required POLARSSL modules not built."
 #endif
 
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_GCM_C) && \
+    defined(MBEDTLS_SHA256_C) && defined(MBEDTLS_HAVE_TIME)
+#define TLS_TICKETS
+#endif
+
 struct polar_config {
     char *cert_file;
     char *cert_chain_file;
     char *key_file;
     char *dh_param_file;
     int8_t check_client_cert;
+    int8_t ktls;
+    int8_t session_tickets;
+    int handshake_threads;
 };
 
 #if defined(MBEDTLS_SSL_CACHE_C)
+/*
+ * Session cache shard, one per worker. A worker only stores sessions in
+ * its own shard, so the lock is only contended by lookups of sessions
+ * resumed on another worker.
+ */
 struct polar_sessions {
     pthread_mutex_t _mutex;
     mbedtls_ssl_cache_context cache;
 };
 
-static struct polar_sessions global_sessions = {
-    ._mutex = PTHREAD_MUTEX_INITIALIZER,
+static struct polar_sessions *session_shards;
+static int session_shards_size;
+static int session_shards_used;
+
+/* Shard owning a session id (index + 1), indexed by a hash of the id */
+static uint8_t session_owners[TLS_SESSION_OWNERS];
+#endif
+
+#ifdef TLS_TICKETS
+/*
+ * Ticket keys are derived from a process wide secret and the current
+ * period of TLS_TICKET_LIFETIME seconds, so every worker rotates to the
+ * same key without sharing any state. The current and previous keys
+ * are accepted.
+ */
+static unsigned char ticket_secret[32];
+
+struct polar_ticket_key {
+    uint32_t period;
+    mbedtls_cipher_context_t cipher;
+};
+#endif
+
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+/*
+ * Certificate of a virtual host with a [TLS] section, selected through
+ * SNI. The chain is parsed once and shared by all threads, the private
+ * key is kept in PEM form and parsed by each thread on first use since
+ * mbedtls RSA contexts can't be shared.
+ */
+struct polar_sni_cert {
+    mbedtls_x509_crt cert;
+    unsigned char *key;
+    size_t key_len;
 };
 
+/* Indexed by virtual host id */
+static struct polar_sni_cert **sni_certs;
+static int sni_certs_size;
 #endif
 
+/* Counters owned by each thread, added up on exit */
+struct polar_stats {
+    unsigned long handshakes;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long ticket_hits;
+    unsigned long ticket_misses;
+
+    /* Handshake steps run by the crypto threads, times in microseconds */
+    unsigned long offloaded;
+    unsigned long offload_full;
+    unsigned long long wait_usec;
+    unsigned long long wait_max;
+    unsigned long long run_usec;
+    unsigned long long run_max;
+};
+
+/* Handshake offload state of a context */
+#define TLS_OFFLOAD_NONE     0
+#define TLS_OFFLOAD_PENDING  1    /* owned by a crypto thread         */
+#define TLS_OFFLOAD_DONE     2    /* result ready for the worker      */
+#define TLS_OFFLOAD_CLOSED   3    /* closed while pending, release it */
+
+/* handshake_run(): the next step went to a crypto thread */
+#define TLS_HANDSHAKE_QUEUED 1
+
+/*
+ * Crypto threads: handshake steps (private key operations, DHE/ECDHE)
+ * are queued here by the workers when HandshakeThreads is set.
+ */
+struct polar_offload {
+    int threads;
+    int stop;
+    int queued;
+    pthread_t *tids;
+    pthread_once_t once;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct mk_list queue;
+};
+
+static struct polar_offload offload = {
+    .once  = PTHREAD_ONCE_INIT,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond  = PTHREAD_COND_INITIALIZER,
+};
+
+/* Per worker completion channel, the event must be the first field */
+struct polar_offload_worker {
+    struct mk_event event;
+    int ch_r;
+    int ch_w;
+    pthread_mutex_t lock;
+    struct mk_list done;
+};
+
 struct polar_context_head {
     mbedtls_ssl_context context;
     int fd;
-    struct polar_context_head *_next;
+    struct polar_context_head *_next;       /* all contexts of the thread */
+    struct polar_context_head *_next_free;  /* unused, ready for reuse    */
+
+    /* Handshake step run by a crypto thread, see offload_submit() */
+    int offload;
+    int offload_ret;
+    int want_write;                         /* armed for MK_EVENT_WRITE   */
+    int conf_idx;
+    unsigned long long queued_at;
+    struct mk_event *event;
+    struct polar_thread_context *owner;
+    struct mk_list _head_offload;
+
+#ifdef TLS_KTLS
+    /* Records are handled by the kernel, I/O goes straight to the socket */
+    int ktls_tx;
+    int ktls_rx;
+
+    /* client and server write keys, only kept during the handshake */
+    size_t key_len;
+    unsigned char keys[64];
+#endif
 };
 
 struct polar_thread_context {
 
     struct polar_context_head *contexts;
+    struct polar_context_head *contexts_free;
+
+    /* Contexts in use indexed by file descriptor */
+    struct polar_context_head **table;
+    int table_size;
+
+    /* Plaintext of the record being written, see tls_records.h */
+    unsigned char *record;
+
+#ifdef TLS_KTLS
+    /* Context running the handshake, receives the exported keys */
+    struct polar_context_head *handshake;
+    int ktls_disabled;
+#endif
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+    struct polar_sessions *sessions;
+#endif
+
+#ifdef TLS_TICKETS
+    struct polar_ticket_key ticket_keys[2];
+#endif
+
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+    /* Keys of sni_certs parsed by this thread */
+    mbedtls_pk_context **sni_keys;
+#endif
+
+    /* Completion channel, NULL on crypto threads */
+    struct polar_offload_worker *offload;
+
+    struct polar_stats stats;
+
     mbedtls_ctr_drbg_context ctr_drbg;
     mbedtls_pk_context pkey;
     mbedtls_ssl_config conf;
 
+#if defined(MBEDTLS_SSL_ALPN)
+    /*
+     * Copies of 'conf' offering the protocols of a listener, indexed by
+     * its MK_CAP_HTTP and MK_CAP_HTTP2 bits.
+     */
+    mbedtls_ssl_config conf_alpn[4];
+#endif
+
     struct mk_list _head;
 };
 
@@ -112,6 +304,15 @@ static const char *my_dhm_G = MBEDTLS_DHM_RFC5114_MODP_2048_G;
 
 static pthread_key_t local_context;
 
+#if defined(MBEDTLS_SSL_ALPN)
+static const char *alpn_protocols[4][3] = {
+    { NULL },
+    { "http/1.1", NULL },
+    { "h2", NULL },
+    { "h2", "http/1.1", NULL }
+};
+#endif
+
 /*
  * The following function is taken from PolarSSL sources to get
  * the number of available bytes to read from a buffer.
@@ -170,31 +371,292 @@ static int handle_return(int ret)
     }
 }
 
+#if defined(MBEDTLS_SSL_CACHE_C)
+static inline uint8_t *session_owner(const mbedtls_ssl_session *session)
+{
+    uint32_t hash;
+
+    /* Session ids are random, the first bytes are good enough */
+    memcpy(&hash, session->id, sizeof(hash));
+    return &session_owners[hash % TLS_SESSION_OWNERS];
+}
+
 static int tls_cache_get(void *p, mbedtls_ssl_session *session)
 {
-    struct polar_sessions *session_cache;
     int ret;
+    int owner;
+    struct polar_sessions *shard;
+    struct polar_thread_context *thctx = p;
+
+    /* Resumptions often land on another worker, ask the owner shard */
+    owner = __atomic_load_n(session_owner(session), __ATOMIC_RELAXED);
+    if (owner == 0 || owner > session_shards_size) {
+        thctx->stats.cache_misses++;
+        return -1;
+    }
+    shard = &session_shards[owner - 1];
 
-    session_cache = p;
-    pthread_mutex_lock(&session_cache->_mutex);
-    ret = mbedtls_ssl_cache_get(&session_cache->cache, session);
-    pthread_mutex_unlock(&session_cache->_mutex);
+    pthread_mutex_lock(&shard->_mutex);
+    ret = mbedtls_ssl_cache_get(&shard->cache, session);
+    pthread_mutex_unlock(&shard->_mutex);
 
+    if (ret == 0) {
+        thctx->stats.cache_hits++;
+    }
+    else {
+        thctx->stats.cache_misses++;
+    }
     return ret;
 }
 
 static int tls_cache_set(void *p, const mbedtls_ssl_session *session)
 {
-    struct polar_sessions *session_cache;
     int ret;
+    struct polar_sessions *shard;
+    struct polar_thread_context *thctx = p;
 
-    session_cache = p;
-    pthread_mutex_lock(&session_cache->_mutex);
-    ret = mbedtls_ssl_cache_set(&session_cache->cache, session);
-    pthread_mutex_unlock(&session_cache->_mutex);
+    shard = thctx->sessions;
 
+    pthread_mutex_lock(&shard->_mutex);
+    ret = mbedtls_ssl_cache_set(&shard->cache, session);
+    pthread_mutex_unlock(&shard->_mutex);
+
+    if (ret == 0) {
+        __atomic_store_n(session_owner(session),
+                         (uint8_t) (shard - session_shards + 1),
+                         __ATOMIC_RELAXED);
+    }
     return ret;
 }
+#endif
+
+#ifdef TLS_TICKETS
+/*
+ * Serialize a session as mbedtls_ssl_ticket does: the session structure
+ * followed by the 24 bits length and DER of the peer certificate.
+ */
+static int ticket_session_save(const mbedtls_ssl_session *session,
+                               unsigned char *buf, size_t size, size_t *len)
+{
+    size_t cert_len = 0;
+
+    if (size < sizeof(*session) + 3) {
+        return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+    }
+    memcpy(buf, session, sizeof(*session));
+
+#if defined(MBEDTLS_X509_CRT_PARSE_C)
+    if (session->peer_cert) {
+        cert_len = session->peer_cert->raw.len;
+    }
+    if (size < sizeof(*session) + 3 + cert_len) {
+        return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+    }
+    if (cert_len > 0) {
+        memcpy(buf + sizeof(*session) + 3, session->peer_cert->raw.p,
+               cert_len);
+    }
+#endif
+    buf[sizeof(*session)]     = (cert_len >> 16) & 0xff;
+    buf[sizeof(*session) + 1] = (cert_len >> 8) & 0xff;
+    buf[sizeof(*session) + 2] = cert_len & 0xff;
+
+    *len = sizeof(*session) + 3 + cert_len;
+    return 0;
+}
+
+static int ticket_session_load(mbedtls_ssl_session *session,
+                               const unsigned char *buf, size_t len)
+{
+    size_t cert_len;
+
+    if (len < sizeof(*session) + 3) {
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+    memcpy(session, buf, sizeof(*session));
+
+    buf += sizeof(*session);
+    len -= sizeof(*session) + 3;
+    cert_len = (buf[0] << 16) | (buf[1] << 8) | buf[2];
+    buf += 3;
+
+#if defined(MBEDTLS_X509_CRT_PARSE_C)
+    session->peer_cert = NULL;
+    if (cert_len > 0) {
+        if (cert_len > len) {
+            return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+        }
+
+        session->peer_cert = mbedtls_calloc(1, sizeof(mbedtls_x509_crt));
+        if (!session->peer_cert) {
+            return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        }
+        mbedtls_x509_crt_init(session->peer_cert);
+
+        if (mbedtls_x509_crt_parse_der(session->peer_cert,
+                                       buf, cert_len) != 0) {
+            mbedtls_x509_crt_free(session->peer_cert);
+            mbedtls_free(session->peer_cert);
+            session->peer_cert = NULL;
+            return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+        }
+    }
+#else
+    if (cert_len > 0) {
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+#endif
+
+    return 0;
+}
+
+/* Key of a ticket period, derived on first use by this worker */
+static mbedtls_cipher_context_t *ticket_key(struct polar_thread_context *thctx,
+                                            uint32_t period)
+{
+    unsigned char label[17] = "monkey ticket";
+    unsigned char key[32];
+    struct polar_ticket_key *tk;
+
+    tk = &thctx->ticket_keys[period & 1];
+    if (tk->period == period) {
+        return &tk->cipher;
+    }
+
+    label[13] = (period >> 24) & 0xff;
+    label[14] = (period >> 16) & 0xff;
+    label[15] = (period >> 8) & 0xff;
+    label[16] = period & 0xff;
+
+    if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                        ticket_secret, sizeof(ticket_secret),
+                        label, sizeof(label), key) != 0 ||
+        mbedtls_cipher_setkey(&tk->cipher, key, 256, MBEDTLS_ENCRYPT) != 0) {
+        memset(key, 0, sizeof(key));
+        tk->period = 0;
+        return NULL;
+    }
+    memset(key, 0, sizeof(key));
+
+    tk->period = period;
+    return &tk->cipher;
+}
+
+/*
+ * Ticket layout, as in RFC 5077 section 4:
+ *
+ *   period (4) | iv (12) | length (2) | encrypted state | GCM tag (16)
+ *
+ * The period names the key, the first 18 bytes are authenticated.
+ */
+static int tls_ticket_write(void *p, const mbedtls_ssl_session *session,
+                            unsigned char *start, const unsigned char *end,
+                            size_t *tlen, uint32_t *lifetime)
+{
+    int ret;
+    size_t len;
+    size_t enc_len;
+    uint32_t period;
+    unsigned char *state = start + 18;
+    mbedtls_cipher_context_t *cipher;
+    struct polar_thread_context *thctx = p;
+
+    *tlen = 0;
+    if (end - start < 18 + 16) {
+        return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+    }
+
+    period = time(NULL) / TLS_TICKET_LIFETIME;
+    cipher = ticket_key(thctx, period);
+    if (!cipher) {
+        return MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+    }
+
+    ret = ticket_session_save(session, state, end - state - 16, &len);
+    if (ret != 0) {
+        return ret;
+    }
+
+    start[0] = (period >> 24) & 0xff;
+    start[1] = (period >> 16) & 0xff;
+    start[2] = (period >> 8) & 0xff;
+    start[3] = period & 0xff;
+    ret = mbedtls_ctr_drbg_random(&thctx->ctr_drbg, start + 4, 12);
+    if (ret != 0) {
+        return ret;
+    }
+    start[16] = (len >> 8) & 0xff;
+    start[17] = len & 0xff;
+
+    ret = mbedtls_cipher_auth_encrypt(cipher, start + 4, 12, start, 18,
+                                      state, len, state, &enc_len,
+                                      state + len, 16);
+    if (ret != 0) {
+        return ret;
+    }
+
+    *tlen = 18 + enc_len + 16;
+    *lifetime = TLS_TICKET_LIFETIME;
+    return 0;
+}
+
+static int tls_ticket_parse(void *p, mbedtls_ssl_session *session,
+                            unsigned char *buf, size_t len)
+{
+    int ret;
+    size_t enc_len;
+    size_t dec_len;
+    uint32_t now;
+    uint32_t period;
+    mbedtls_cipher_context_t *cipher;
+    struct polar_thread_context *thctx = p;
+
+    thctx->stats.ticket_misses++;
+
+    if (len < 18 + 16) {
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+    enc_len = (buf[16] << 8) | buf[17];
+    if (len != 18 + enc_len + 16) {
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+
+    now = time(NULL) / TLS_TICKET_LIFETIME;
+    period = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    if (period != now && period + 1 != now) {
+        return MBEDTLS_ERR_SSL_SESSION_TICKET_EXPIRED;
+    }
+
+    cipher = ticket_key(thctx, period);
+    if (!cipher) {
+        return MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+    }
+
+    ret = mbedtls_cipher_auth_decrypt(cipher, buf + 4, 12, buf, 18,
+                                      buf + 18, enc_len, buf + 18, &dec_len,
+                                      buf + 18 + enc_len, 16);
+    if (ret == MBEDTLS_ERR_CIPHER_AUTH_FAILED) {
+        return MBEDTLS_ERR_SSL_INVALID_MAC;
+    }
+    else if (ret != 0) {
+        return ret;
+    }
+
+    ret = ticket_session_load(session, buf + 18, dec_len);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (time(NULL) - session->start > TLS_TICKET_LIFETIME) {
+        mbedtls_ssl_session_free(session);
+        return MBEDTLS_ERR_SSL_SESSION_TICKET_EXPIRED;
+    }
+
+    thctx->stats.ticket_misses--;
+    thctx->stats.ticket_hits++;
+    return 0;
+}
+#endif
 
 static int config_parse(const char *confdir, struct polar_config *conf)
 {
@@ -205,6 +667,10 @@ static int config_parse(const char *confdir, struct polar_config *conf)
     char *key_file = NULL;
     char *dh_param_file = NULL;
     int8_t check_client_cert = MK_FALSE;
+    int8_t ktls = MK_FALSE;
+    int8_t session_tickets = MK_TRUE;
+    char *tickets;
+    int handshake_threads = 0;
     struct mk_rconf_section *section;
     struct mk_rconf *conf_head;
 
@@ -237,6 +703,28 @@ static int config_parse(const char *confdir, struct polar_config *conf)
     check_client_cert = mk_api->config_section_get_key(section,
                                                    "CheckClientCert",
                                                    MK_RCONF_BOOL);
+    ktls = (size_t) mk_api->config_section_get_key(section,
+                                                   "KernelTLS",
+                                                   MK_RCONF_BOOL);
+    if (ktls == -1) {
+        ktls = MK_FALSE;
+    }
+
+    /* Enabled unless explicitly turned off */
+    tickets = mk_api->config_section_get_key(section,
+                                             "SessionTickets",
+                                             MK_RCONF_STR);
+    if (tickets) {
+        session_tickets = (strcasecmp(tickets, MK_RCONF_OFF) != 0);
+        mk_api->mem_free(tickets);
+    }
+
+    handshake_threads = (size_t) mk_api->config_section_get_key(section,
+                                                        "HandshakeThreads",
+                                                        MK_RCONF_NUM);
+    if (handshake_threads < 0) {
+        handshake_threads = 0;
+    }
 fallback:
     /* Set default name if not specified */
     if (!cert_file) {
@@ -303,6 +791,9 @@ fallback:
 
     /* Set client cert check */
     conf->check_client_cert = check_client_cert;
+    conf->ktls = ktls;
+    conf->session_tickets = session_tickets;
+    conf->handshake_threads = handshake_threads;
 
     if (conf_head) {
         mk_api->config_free(conf_head);
@@ -416,12 +907,225 @@ static int polar_load_dh_param(const struct polar_config *conf)
     return 0;
 }
 
-static int mk_tls_init()
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+static int polar_sni_cert_load(struct polar_sni_cert *c, const char *confdir,
+                               struct mk_rconf_section *section)
+{
+    int ret = -1;
+    unsigned long len;
+    char *file;
+    char *path = NULL;
+    char err_buf[72];
+    struct stat st;
+    mbedtls_pk_context pk;
+    const char *keys[] = { "CertificateFile", "CertificateChainFile",
+                           "RSAKeyFile" };
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        file = mk_api->config_section_get_key(section, (char *) keys[i],
+                                              MK_RCONF_STR);
+        if (!file) {
+            if (i == 1) {
+                continue;
+            }
+            mk_err("[tls] %s is required in the [TLS] section of a "
+                   "virtual host", keys[i]);
+            return -1;
+        }
+
+        /* Relative paths are based on the plugin configuration directory */
+        if (*file == '/') {
+            path = file;
+        }
+        else {
+            mk_api->str_build(&path, &len, "%s/%s", confdir, file);
+            mk_api->mem_free(file);
+        }
+
+        if (i < 2) {
+            ret = mbedtls_x509_crt_parse_file(&c->cert, path);
+        }
+        else {
+            c->key = (unsigned char *) mk_api->file_to_buffer(path);
+            ret = MBEDTLS_ERR_PK_FILE_IO_ERROR;
+            if (c->key && stat(path, &st) == 0) {
+                /* PEM keys are parsed including the trailing NUL */
+                c->key_len = st.st_size;
+                if (strstr((char *) c->key, "-----BEGIN ")) {
+                    c->key_len++;
+                }
+                /* Validate it now, threads parse it again on demand */
+                mbedtls_pk_init(&pk);
+                ret = mbedtls_pk_parse_key(&pk, c->key, c->key_len, NULL, 0);
+                mbedtls_pk_free(&pk);
+            }
+        }
+
+        if (ret != 0) {
+            mbedtls_strerror(ret, err_buf, sizeof(err_buf));
+            mk_err("[tls] Load '%s' failed: %s", path, err_buf);
+            mk_api->mem_free(path);
+            return -1;
+        }
+        mk_api->mem_free(path);
+        path = NULL;
+    }
+
+    return 0;
+}
+
+static void polar_sni_cert_free(struct polar_sni_cert *c)
+{
+    mbedtls_x509_crt_free(&c->cert);
+    if (c->key) {
+        memset(c->key, 0, c->key_len);
+        mk_api->mem_free(c->key);
+    }
+    mk_api->mem_free(c);
+}
+
+/* Load the certificates declared by the virtual hosts */
+static int polar_load_sni_certs(const char *confdir)
+{
+    int n = 0;
+    struct mk_list *head;
+    struct mk_vhost *host;
+    struct mk_rconf_section *section;
+    struct polar_sni_cert *c;
+
+    mk_list_foreach(head, &mk_api->config->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        if (host->id >= n) {
+            n = host->id + 1;
+        }
+    }
+
+    sni_certs = mk_api->mem_alloc_z(sizeof(struct polar_sni_cert *) * n);
+    if (!sni_certs) {
+        return -1;
+    }
+    sni_certs_size = n;
+
+    n = 0;
+    mk_list_foreach(head, &mk_api->config->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        if (!host->config) {
+            continue;
+        }
+        section = mk_api->config_section_get(host->config, "TLS");
+        if (!section) {
+            continue;
+        }
+
+        c = mk_api->mem_alloc_z(sizeof(struct polar_sni_cert));
+        if (!c) {
+            return -1;
+        }
+        mbedtls_x509_crt_init(&c->cert);
+
+        if (polar_sni_cert_load(c, confdir, section) != 0) {
+            mk_err("[tls] Invalid certificate for virtual host %s",
+                   host->file);
+            polar_sni_cert_free(c);
+            return -1;
+        }
+        sni_certs[host->id] = c;
+        n++;
+    }
+
+    /* Nothing to select, don't bother with SNI */
+    if (n == 0) {
+        mk_api->mem_free(sni_certs);
+        sni_certs = NULL;
+        sni_certs_size = 0;
+    }
+
+    return 0;
+}
+
+static mbedtls_pk_context *sni_key(struct polar_thread_context *thctx, int id)
+{
+    mbedtls_pk_context *key;
+
+    key = thctx->sni_keys[id];
+    if (key) {
+        return key;
+    }
+
+    key = mk_api->mem_alloc(sizeof(mbedtls_pk_context));
+    if (!key) {
+        return NULL;
+    }
+    mbedtls_pk_init(key);
+
+    if (mbedtls_pk_parse_key(key, sni_certs[id]->key, sni_certs[id]->key_len,
+                             NULL, 0) != 0) {
+        mbedtls_pk_free(key);
+        mk_api->mem_free(key);
+        return NULL;
+    }
+
+    thctx->sni_keys[id] = key;
+    return key;
+}
+
+/*
+ * Pick the certificate of the virtual host matching the requested name,
+ * through the server lookup table (exact and wildcard names). Unknown
+ * names get the default certificate.
+ */
+static int tls_sni(void *p, mbedtls_ssl_context *ssl,
+                   const unsigned char *name, size_t len)
+{
+    mk_ptr_t host;
+    struct mk_vhost *vhost;
+    struct mk_vhost_alias *alias;
+    mbedtls_pk_context *key;
+    struct polar_thread_context *thctx = p;
+
+    host.data = (char *) name;
+    host.len  = len;
+    if (mk_api->vhost_get(host, &vhost, &alias, mk_api->config) != 0 ||
+        vhost->id < 0 || vhost->id >= sni_certs_size ||
+        !sni_certs[vhost->id]) {
+        return 0;
+    }
+
+    key = sni_key(thctx, vhost->id);
+    if (!key) {
+        return -1;
+    }
+
+    return mbedtls_ssl_set_hs_own_cert(ssl, &sni_certs[vhost->id]->cert, key);
+}
+#endif
+
+static int mk_tls_init(const char *confdir)
 {
+#if defined(MBEDTLS_SSL_CACHE_C)
+    int i;
+#endif
+
     pthread_key_create(&local_context, NULL);
+    mk_list_init(&offload.queue);
 
 #if defined(MBEDTLS_SSL_CACHE_C)
-    mbedtls_ssl_cache_init(&global_sessions.cache);
+    /* Owners are stored in a byte, extra threads share the last shard */
+    session_shards_size = mk_api->config->workers +
+                          server_context->config.handshake_threads;
+    if (session_shards_size > UINT8_MAX) {
+        session_shards_size = UINT8_MAX;
+    }
+    session_shards = mk_api->mem_alloc_z(sizeof(struct polar_sessions) *
+                                         session_shards_size);
+    if (!session_shards) {
+        return -1;
+    }
+    for (i = 0; i < session_shards_size; i++) {
+        pthread_mutex_init(&session_shards[i]._mutex, NULL);
+        mbedtls_ssl_cache_init(&session_shards[i].cache);
+    }
 #endif
 
     pthread_mutex_lock(&server_context->mutex);
@@ -429,6 +1133,14 @@ static int mk_tls_init()
     mbedtls_entropy_init(&server_context->entropy);
     pthread_mutex_unlock(&server_context->mutex);
 
+#ifdef TLS_TICKETS
+    if (mbedtls_entropy_func(&server_context->entropy, ticket_secret,
+                             sizeof(ticket_secret)) != 0) {
+        mk_err("[tls] Could not generate the session ticket secret");
+        return -1;
+    }
+#endif
+
     PLUGIN_TRACE("[tls] Load certificates.");
     if (polar_load_certs(&server_context->config)) {
         return -1;
@@ -437,6 +1149,14 @@ static int mk_tls_init()
     if (polar_load_dh_param(&server_context->config)) {
         return -1;
     }
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+    PLUGIN_TRACE("[tls] Load virtual hosts certificates.");
+    if (polar_load_sni_certs(confdir)) {
+        return -1;
+    }
+#else
+    (void) confdir;
+#endif
 
     return 0;
 }
@@ -484,83 +1204,95 @@ static void config_free(struct polar_config *conf)
 /* Contexts may be requested from outside workers on exit so we should
  * be prepared for an empty context.
  */
-static mbedtls_ssl_context *context_get(int fd)
+static inline mbedtls_ssl_context *context_get(int fd)
 {
     struct polar_thread_context *thctx = local_thread_context();
-    struct polar_context_head **cur = &thctx->contexts;
 
-    if (cur == NULL) {
+    if (mk_unlikely(thctx == NULL || fd >= thctx->table_size)) {
         return NULL;
     }
 
-    for (; *cur; cur = &(*cur)->_next) {
-        if ((*cur)->fd == fd) {
-            return &(*cur)->context;
-        }
+    if (thctx->table[fd]) {
+        return &thctx->table[fd]->context;
     }
 
     return NULL;
 }
 
+static inline struct polar_context_head *context_head(mbedtls_ssl_context *ssl)
+{
+    return container_of(ssl, struct polar_context_head, context);
+}
+
+static int context_table_grow(struct polar_thread_context *thctx, int fd)
+{
+    int size;
+    struct polar_context_head **table;
+
+    size = thctx->table_size ? thctx->table_size : 1024;
+    while (size <= fd) {
+        size *= 2;
+    }
+
+    table = mk_api->mem_realloc(thctx->table, size * sizeof(*table));
+    if (!table) {
+        return -1;
+    }
+    memset(table + thctx->table_size, 0,
+           (size - thctx->table_size) * sizeof(*table));
+
+    thctx->table = table;
+    thctx->table_size = size;
+
+    return 0;
+}
+
 static mbedtls_ssl_context *context_new(int fd)
 {
     struct polar_thread_context *thctx = local_thread_context();
-    struct polar_context_head **cur = &thctx->contexts;
+    struct polar_context_head *head;
     mbedtls_ssl_context *ssl = NULL;
-    mbedtls_ssl_cache_context cache;
-
-    mbedtls_ssl_cache_init(&cache);
 
-    assert(cur != NULL);
+    assert(thctx != NULL);
 
-    for (; *cur; cur = &(*cur)->_next) {
-        if ((*cur)->fd == -1) {
-            break;
-        }
+    if (fd >= thctx->table_size && context_table_grow(thctx, fd) != 0) {
+        return NULL;
     }
 
-    if (*cur == NULL) {
+    head = thctx->contexts_free;
+    if (head) {
+        thctx->contexts_free = head->_next_free;
+        ssl = &head->context;
+    }
+    else {
         PLUGIN_TRACE("[polarssl %d] New ssl context.", fd);
 
-        *cur = mk_api->mem_alloc(sizeof(**cur));
-        if (*cur == NULL) {
+        head = mk_api->mem_alloc(sizeof(*head));
+        if (head == NULL) {
             return NULL;
         }
-        (*cur)->_next = NULL;
+        head->_next = thctx->contexts;
+        thctx->contexts = head;
 
-        ssl = &(*cur)->context;
+        ssl = &head->context;
 
         mbedtls_ssl_init(ssl);
         mbedtls_ssl_setup(ssl, &thctx->conf);
 
-        mbedtls_ssl_conf_session_cache(&thctx->conf,
-                                       &global_sessions,
-                                       tls_cache_get,
-                                       tls_cache_set);
-
-        mbedtls_ssl_set_bio(ssl, &(*cur)->fd,
+        mbedtls_ssl_set_bio(ssl, &head->fd,
                             mbedtls_net_send, mbedtls_net_recv, NULL);
-
-        mbedtls_ssl_conf_rng(&thctx->conf, mbedtls_ctr_drbg_random,
-                             &thctx->ctr_drbg);
-
-#if (POLAR_DEBUG_LEVEL > 0)
-        mbedtls_ssl_conf_dbg(ssl, polar_debug, 0);
-#endif
-
-        mbedtls_ssl_conf_own_cert(&thctx->conf, &server_context->cert, &thctx->pkey);
-        mbedtls_ssl_conf_ca_chain(&thctx->conf, &server_context->ca_cert, NULL);
-        mbedtls_ssl_conf_dh_param_ctx(&thctx->conf, &server_context->dhm);
-
-        if (server_context->config.check_client_cert == MK_TRUE) {
-          mbedtls_ssl_conf_authmode(&thctx->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-        }
-    }
-    else {
-        ssl = &(*cur)->context;
     }
 
-    (*cur)->fd = fd;
+    head->fd = fd;
+    head->_next_free = NULL;
+    head->offload = TLS_OFFLOAD_NONE;
+    head->want_write = MK_FALSE;
+#ifdef TLS_KTLS
+    head->ktls_tx = MK_FALSE;
+    head->ktls_rx = MK_FALSE;
+    head->key_len = 0;
+#endif
+    thctx->table[fd] = head;
 
     return ssl;
 }
@@ -568,12 +1300,17 @@ static mbedtls_ssl_context *context_new(int fd)
 static int context_unset(int fd, mbedtls_ssl_context *ssl)
 {
     struct polar_context_head *head;
+    struct polar_thread_context *thctx = local_thread_context();
 
-    head = container_of(ssl, struct polar_context_head, context);
+    head = context_head(ssl);
 
     if (head->fd == fd) {
         head->fd = -1;
         mbedtls_ssl_session_reset(ssl);
+
+        thctx->table[fd] = NULL;
+        head->_next_free = thctx->contexts_free;
+        thctx->contexts_free = head;
     }
     else {
         mk_err("[polarssl %d] Context already unset.", fd);
@@ -582,6 +1319,446 @@ static int context_unset(int fd, mbedtls_ssl_context *ssl)
     return 0;
 }
 
+#ifdef TLS_KTLS
+static int ktls_export_keys(void *data, const unsigned char *master,
+                            const unsigned char *key_block,
+                            size_t mac_len, size_t key_len, size_t iv_len)
+{
+    struct polar_context_head *head = local_thread_context()->handshake;
+
+    (void) data;
+    (void) master;
+    (void) iv_len;
+
+    if (head) {
+        ktls_keys_save(head->keys, sizeof(head->keys), &head->key_len,
+                       key_block, mac_len, key_len);
+    }
+    return 0;
+}
+
+/*
+ * Move the record layer of an established session into the kernel. Any
+ * failure leaves the connection on mbedtls, if the kernel lacks the tls
+ * module the worker stops trying.
+ */
+static void ktls_start(int fd, struct polar_context_head *head)
+{
+    mbedtls_ssl_context *ssl = &head->context;
+    struct polar_thread_context *thctx = local_thread_context();
+
+    if (head->key_len == 0 || thctx->ktls_disabled == MK_TRUE ||
+        ssl->minor_ver != MBEDTLS_SSL_MINOR_VERSION_3 ||
+        mbedtls_cipher_get_cipher_mode(&ssl->transform->cipher_ctx_enc) !=
+        MBEDTLS_MODE_GCM) {
+        goto out;
+    }
+
+    if (ktls_setup(fd, ssl, head->keys, head->key_len,
+                   &head->ktls_tx, &head->ktls_rx) != 0) {
+        if (errno == ENOENT || errno == ENOPROTOOPT) {
+            mk_warn("[tls] Kernel TLS not available: %s", strerror(errno));
+            thctx->ktls_disabled = MK_TRUE;
+        }
+        goto out;
+    }
+
+    PLUGIN_TRACE("[tls %d] kTLS tx=%i rx=%i", fd, head->ktls_tx, head->ktls_rx);
+
+ out:
+    memset(head->keys, 0, sizeof(head->keys));
+    head->key_len = 0;
+}
+#endif
+
+/*
+ * Steps running a private key or key exchange operation, the only ones
+ * worth a trip to the crypto threads. The client's certificate is only
+ * verified when it sent one.
+ */
+static inline int handshake_step_costly(mbedtls_ssl_context *ssl)
+{
+    switch (ssl->state) {
+    case MBEDTLS_SSL_SERVER_KEY_EXCHANGE:
+    case MBEDTLS_SSL_CLIENT_KEY_EXCHANGE:
+        return MK_TRUE;
+    case MBEDTLS_SSL_CERTIFICATE_VERIFY:
+        return ssl->session_negotiate->peer_cert != NULL;
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * The certificate is picked while parsing the ClientHello, along with the
+ * key of the thread doing it. A pk context is not safe to share (RSA
+ * blinding values): the thread running a costly step uses its own copy.
+ */
+static int handshake_own_key(struct polar_thread_context *thctx,
+                             mbedtls_ssl_context *ssl)
+{
+    int ret;
+    mbedtls_pk_context *key = NULL;
+    mbedtls_ssl_key_cert *kc = ssl->handshake->key_cert;
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+    int id;
+#endif
+
+    if (!kc) {
+        return 0;
+    }
+
+    if (kc->cert == &server_context->cert) {
+        key = &thctx->pkey;
+    }
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+    else {
+        for (id = 0; id < sni_certs_size; id++) {
+            if (sni_certs[id] && kc->cert == &sni_certs[id]->cert) {
+                key = sni_key(thctx, id);
+                break;
+            }
+        }
+    }
+#endif
+
+    if (!key || key == kc->key) {
+        return 0;
+    }
+
+    /* Per handshake entry, released with the handshake */
+    ret = mbedtls_ssl_set_hs_own_cert(ssl, kc->cert, key);
+    if (ret != 0) {
+        return ret;
+    }
+    for (kc = ssl->handshake->sni_key_cert; kc->next; kc = kc->next);
+    ssl->handshake->key_cert = kc;
+
+    return 0;
+}
+
+/* Run a single handshake step, on a worker or on a crypto thread */
+static int handshake_step(struct polar_thread_context *thctx,
+                          mbedtls_ssl_context *ssl)
+{
+    int ret;
+
+    if (handshake_step_costly(ssl)) {
+        ret = handshake_own_key(thctx, ssl);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+#ifdef TLS_KTLS
+    thctx->handshake = context_head(ssl);
+    ret = mbedtls_ssl_handshake_step(ssl);
+    thctx->handshake = NULL;
+#else
+    ret = mbedtls_ssl_handshake_step(ssl);
+#endif
+
+    return ret;
+}
+
+/* The client's flight arrived: a step parsing it will not just wait */
+static inline int handshake_input_ready(int fd, mbedtls_ssl_context *ssl)
+{
+    char c;
+
+    if (ssl->state == MBEDTLS_SSL_SERVER_KEY_EXCHANGE ||
+        ssl->in_left > 0 || ssl->in_msglen > ssl->in_hslen) {
+        return MK_TRUE;
+    }
+
+    if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return MK_FALSE;
+    }
+
+    return MK_TRUE;
+}
+
+/*
+ * Wait for the socket state the last handshake step asked for, the
+ * scheduler resumes pending handshakes on both read and write events.
+ */
+static void handshake_wait(struct polar_context_head *head, int fd,
+                           struct mk_event *event, int ret)
+{
+    int want_write = (ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    if (!event || head->want_write == want_write) {
+        return;
+    }
+
+    head->want_write = want_write;
+    mk_api->ev_add(mk_api->sched_loop(), fd, MK_EVENT_CONNECTION,
+                   want_write ? MK_EVENT_WRITE : MK_EVENT_READ, event);
+}
+
+static struct polar_thread_context *thread_context_create(void);
+
+static inline unsigned long long offload_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void offload_thread(void *data)
+{
+    int ret;
+    uint64_t val = 1;
+    unsigned long long start;
+    unsigned long long usec;
+    const mbedtls_ssl_config *conf;
+    struct polar_context_head *head;
+    struct polar_thread_context *thctx;
+    struct polar_offload_worker *worker;
+    (void) data;
+
+    mk_api->worker_rename("monkey: tls");
+
+    thctx = thread_context_create();
+    if (!thctx) {
+        mk_err("[tls] Could not create the crypto thread context");
+        return;
+    }
+    pthread_setspecific(local_context, thctx);
+
+    while (1) {
+        pthread_mutex_lock(&offload.mutex);
+        while (mk_list_is_empty(&offload.queue) == 0 &&
+               offload.stop == MK_FALSE) {
+            pthread_cond_wait(&offload.cond, &offload.mutex);
+        }
+        if (offload.stop == MK_TRUE) {
+            pthread_mutex_unlock(&offload.mutex);
+            break;
+        }
+        head = mk_list_entry_first(&offload.queue,
+                                   struct polar_context_head, _head_offload);
+        mk_list_del(&head->_head_offload);
+        offload.queued--;
+        pthread_mutex_unlock(&offload.mutex);
+
+        start = offload_clock();
+        usec = start - head->queued_at;
+        thctx->stats.wait_usec += usec;
+        if (usec > thctx->stats.wait_max) {
+            thctx->stats.wait_max = usec;
+        }
+
+        /* Same setup, with the key and random generator of this thread */
+        conf = head->context.conf;
+#if defined(MBEDTLS_SSL_ALPN)
+        head->context.conf = &thctx->conf_alpn[head->conf_idx];
+#else
+        head->context.conf = &thctx->conf;
+#endif
+        head->offload_ret = handshake_step(thctx, &head->context);
+        head->context.conf = conf;
+
+        usec = offload_clock() - start;
+        thctx->stats.run_usec += usec;
+        if (usec > thctx->stats.run_max) {
+            thctx->stats.run_max = usec;
+        }
+
+        /* Hand the context back to its worker */
+        worker = head->owner->offload;
+        pthread_mutex_lock(&worker->lock);
+        mk_list_add(&head->_head_offload, &worker->done);
+        pthread_mutex_unlock(&worker->lock);
+
+        ret = write(worker->ch_w, &val, sizeof(val));
+        if (ret <= 0) {
+            mk_libc_error("write");
+        }
+    }
+}
+
+/* Worker side: resume the connections whose handshake step is done */
+static int offload_worker_handler(void *data)
+{
+    int fd;
+    int ret;
+    uint64_t val;
+    struct mk_list done;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct polar_context_head *ctx;
+    struct polar_offload_worker *worker = data;
+
+    ret = read(worker->ch_r, &val, sizeof(val));
+    if (ret <= 0) {
+        return -1;
+    }
+
+    mk_list_init(&done);
+    pthread_mutex_lock(&worker->lock);
+    mk_list_foreach_safe(head, tmp, &worker->done) {
+        ctx = mk_list_entry(head, struct polar_context_head, _head_offload);
+        mk_list_del(&ctx->_head_offload);
+        mk_list_add(&ctx->_head_offload, &done);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    mk_list_foreach_safe(head, tmp, &done) {
+        ctx = mk_list_entry(head, struct polar_context_head, _head_offload);
+        mk_list_del(&ctx->_head_offload);
+        fd = ctx->fd;
+
+        /* The server dropped the connection meanwhile */
+        if (ctx->offload == TLS_OFFLOAD_CLOSED) {
+            ctx->offload = TLS_OFFLOAD_NONE;
+            context_unset(fd, &ctx->context);
+            close(fd);
+            continue;
+        }
+        ctx->offload = TLS_OFFLOAD_DONE;
+
+        /* Make the failure visible to the event loop */
+        ret = ctx->offload_ret;
+        if (ret != 0 && ret != MBEDTLS_ERR_SSL_WANT_READ &&
+            ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            shutdown(fd, SHUT_RD);
+        }
+
+        /*
+         * A step waiting for socket space resumes on a write event, so
+         * does a completed one: the next steps run inline right away.
+         */
+        ctx->want_write = (ret == 0 || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+        mk_api->ev_add(mk_api->sched_loop(), fd, MK_EVENT_CONNECTION,
+                       ctx->want_write ? MK_EVENT_WRITE : MK_EVENT_READ,
+                       ctx->event);
+    }
+
+    return 0;
+}
+
+/*
+ * Queue the next handshake step of a connection for the crypto threads,
+ * the connection leaves the event loop until it's done. Returns -1 if
+ * the step must run inline.
+ */
+static int offload_submit(struct polar_thread_context *thctx,
+                          struct polar_context_head *head,
+                          struct mk_event *event)
+{
+    if (!thctx->offload || !event) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&offload.mutex);
+    if (offload.queued >= TLS_OFFLOAD_QUEUE) {
+        pthread_mutex_unlock(&offload.mutex);
+        thctx->stats.offload_full++;
+        return -1;
+    }
+
+    head->offload = TLS_OFFLOAD_PENDING;
+    head->owner = thctx;
+    head->event = event;
+    head->queued_at = offload_clock();
+
+    mk_list_add(&head->_head_offload, &offload.queue);
+    offload.queued++;
+    pthread_cond_signal(&offload.cond);
+    pthread_mutex_unlock(&offload.mutex);
+
+    mk_api->ev_del(mk_api->sched_loop(), event);
+    thctx->stats.offloaded++;
+
+    return 0;
+}
+
+/*
+ * Worker side: run the handshake inline until it's over or it waits for
+ * the socket. A costly step is queued for the crypto threads instead,
+ * TLS_HANDSHAKE_QUEUED is returned then.
+ */
+static int handshake_run(struct polar_thread_context *thctx,
+                         struct polar_context_head *head,
+                         struct mk_event *event)
+{
+    int ret;
+    mbedtls_ssl_context *ssl = &head->context;
+
+    while (ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        if (thctx->offload && event && handshake_step_costly(ssl)) {
+            if (handshake_input_ready(head->fd, ssl) == MK_FALSE) {
+                return MBEDTLS_ERR_SSL_WANT_READ;
+            }
+            if (offload_submit(thctx, head, event) == 0) {
+                return TLS_HANDSHAKE_QUEUED;
+            }
+        }
+
+        ret = handshake_step(thctx, ssl);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+#ifdef TLS_KTLS
+    if (server_context->config.ktls == MK_TRUE) {
+        ktls_start(head->fd, head);
+    }
+#endif
+
+    return 0;
+}
+
+static int offload_worker_init(struct polar_thread_context *thctx)
+{
+    int ret;
+    struct polar_offload_worker *worker;
+
+    worker = mk_api->mem_alloc_z(sizeof(struct polar_offload_worker));
+    if (!worker) {
+        return -1;
+    }
+
+    ret = mk_api->ev_channel_create(mk_api->sched_loop(),
+                                    &worker->ch_r, &worker->ch_w, worker);
+    if (ret != 0) {
+        mk_api->mem_free(worker);
+        return -1;
+    }
+    worker->event.type    = MK_EVENT_CUSTOM;
+    worker->event.handler = offload_worker_handler;
+
+    pthread_mutex_init(&worker->lock, NULL);
+    mk_list_init(&worker->done);
+
+    thctx->offload = worker;
+    return 0;
+}
+
+static void offload_start(void)
+{
+    int i;
+    int n = server_context->config.handshake_threads;
+
+    offload.tids = mk_api->mem_alloc_z(sizeof(pthread_t) * n);
+    if (!offload.tids) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (mk_api->worker_spawn(offload_thread, NULL,
+                                 &offload.tids[i]) != 0) {
+            mk_warn("[tls] Could not create crypto thread");
+            break;
+        }
+        offload.threads++;
+    }
+}
+
 int mk_tls_read(int fd, void *buf, int count)
 {
     size_t avail;
@@ -590,6 +1767,11 @@ int mk_tls_read(int fd, void *buf, int count)
     if (!ssl) {
         ssl = context_new(fd);
     }
+#ifdef TLS_KTLS
+    else if (context_head(ssl)->ktls_rx) {
+        return read(fd, buf, count);
+    }
+#endif
 
     int ret = handle_return(mbedtls_ssl_read(ssl, buf, count));
     PLUGIN_TRACE("IN: %i SSL READ: %i ; CORE COUNT: %i",
@@ -617,92 +1799,131 @@ int mk_tls_write(int fd, const void *buf, size_t count)
     if (!ssl) {
         ssl = context_new(fd);
     }
+#ifdef TLS_KTLS
+    else if (context_head(ssl)->ktls_tx) {
+        return write(fd, buf, count);
+    }
+#endif
 
     return handle_return(mbedtls_ssl_write(ssl, buf, count));
 }
 
 int mk_tls_writev(int fd, struct mk_iov *mk_io)
 {
+    unsigned char *buf = local_thread_context()->record;
     mbedtls_ssl_context *ssl = context_get(fd);
-    const int iov_len = mk_io->iov_idx;
-    const struct iovec *io = mk_io->io;
-    const size_t len = mk_io->total_len;
-    unsigned char *buf;
-    size_t used = 0;
-    int ret = 0, i;
 
     if (!ssl) {
         ssl = context_new(fd);
     }
-
-    buf = mk_api->mem_alloc(len);
-    if (buf == NULL) {
-        mk_err("malloc failed: %s", strerror(errno));
-        return -1;
-    }
-
-    for (i = 0; i < iov_len; i++) {
-        memcpy(buf + used, io[i].iov_base, io[i].iov_len);
-        used += io[i].iov_len;
+#ifdef TLS_KTLS
+    else if (context_head(ssl)->ktls_tx) {
+        return mk_api->iov_send(fd, mk_io);
     }
+#endif
 
-    assert(used == len);
-    ret = mbedtls_ssl_write(ssl, buf, len);
-    mk_api->mem_free(buf);
-
-    return handle_return(ret);
+    return handle_return(tls_records_writev(ssl, mk_io->io,
+                                            mk_io->iov_idx, buf));
 }
 
 int mk_tls_send_file(int fd, int file_fd, off_t *file_offset,
         size_t file_count)
 {
-    mbedtls_ssl_context *ssl = context_get(fd);
-    unsigned char *buf;
-    ssize_t used, remain = file_count, sent = 0;
     int ret;
+    unsigned char *buf = local_thread_context()->record;
+    mbedtls_ssl_context *ssl = context_get(fd);
 
     if (!ssl) {
         ssl = context_new(fd);
     }
+#ifdef TLS_KTLS
+    else if (context_head(ssl)->ktls_tx) {
+        return sendfile(fd, file_fd, file_offset, file_count);
+    }
+#endif
 
-    buf = mk_api->mem_alloc(SENDFILE_BUF_SIZE);
-    if (buf == NULL) {
-        return -1;
+    ret = tls_records_file(ssl, file_fd, file_offset, file_count, buf);
+    if (ret == TLS_RECORDS_EREAD) {
+        mk_err("[tls] Read from file failed: %s", strerror(errno));
     }
+    return handle_return(ret);
+}
 
-    do {
-        used = pread(file_fd, buf, SENDFILE_BUF_SIZE, *file_offset);
-        if (used == 0) {
-            ret = 0;
-        }
-        else if (used < 0) {
-            mk_err("[tls] Read from file failed: %s", strerror(errno));
-            ret = -1;
-        }
-        else if (remain > 0) {
-            ret = mbedtls_ssl_write(ssl, buf, used < remain ? used : remain);
-        }
-        else {
-            ret = mbedtls_ssl_write(ssl, buf, used);
-        }
+/*
+ * Run the handshake before any read, so the scheduler can switch the
+ * connection to the protocol negotiated through ALPN (RFC 7301).
+ */
+int mk_tls_handshake(int fd, int caps, int *selected, struct mk_event *event)
+{
+    int ret;
+#if defined(MBEDTLS_SSL_ALPN)
+    const char *alpn;
+#endif
+    struct polar_context_head *head;
+    struct polar_thread_context *thctx = local_thread_context();
+    mbedtls_ssl_context *ssl = context_get(fd);
 
-        if (ret > 0) {
-            if (remain > 0) {
-                remain -= ret;
-            }
-            sent += ret;
-            *file_offset += ret;
+    if (!ssl) {
+        ssl = context_new(fd);
+        if (!ssl) {
+            return -1;
         }
-    } while (ret > 0);
+    }
+    head = context_head(ssl);
 
-    mk_api->mem_free(buf);
+#if defined(MBEDTLS_SSL_ALPN)
+    /* Contexts are recycled, bind the listener setup on a new session */
+    if (ssl->state == MBEDTLS_SSL_HELLO_REQUEST) {
+        head->conf_idx = caps & (MK_CAP_HTTP | MK_CAP_HTTP2);
+        ssl->conf = &thctx->conf_alpn[head->conf_idx];
+    }
+#else
+    (void) caps;
+#endif
 
-    if (sent > 0) {
-        return sent;
+    if (head->offload == TLS_OFFLOAD_PENDING) {
+        errno = EAGAIN;
+        return -1;
+    }
+    else if (head->offload == TLS_OFFLOAD_DONE) {
+        head->offload = TLS_OFFLOAD_NONE;
+        ret = head->offload_ret;
+        if (ret == 0) {
+            ret = handshake_run(thctx, head, event);
+        }
     }
     else {
-        return handle_return(ret);
+        ret = handshake_run(thctx, head, event);
     }
+
+    if (ret == TLS_HANDSHAKE_QUEUED) {
+        errno = EAGAIN;
+        return -1;
+    }
+    else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        handshake_wait(head, fd, event, ret);
+        errno = EAGAIN;
+        return -1;
+    }
+    else if (ret != 0) {
+        handle_return(ret);
+        errno = ECONNABORTED;
+        return -1;
+    }
+
+    /* The scheduler re-arms the connection for reading */
+    head->want_write = MK_FALSE;
+    thctx->stats.handshakes++;
+
+    *selected = 0;
+#if defined(MBEDTLS_SSL_ALPN)
+    alpn = mbedtls_ssl_get_alpn_protocol(ssl);
+    if (alpn) {
+        *selected = strcmp(alpn, "h2") == 0 ? MK_CAP_HTTP2 : MK_CAP_HTTP;
+    }
+#endif
+
+    return 0;
 }
 
 int mk_tls_close(int fd)
@@ -712,7 +1933,22 @@ int mk_tls_close(int fd)
     PLUGIN_TRACE("[fd %d] Closing connection", fd);
 
     if (ssl) {
+        /* A crypto thread owns it, it's released once handed back */
+        if (context_head(ssl)->offload == TLS_OFFLOAD_PENDING) {
+            context_head(ssl)->offload = TLS_OFFLOAD_CLOSED;
+            return 0;
+        }
+
+#ifdef TLS_KTLS
+        if (context_head(ssl)->ktls_tx) {
+            ktls_close_notify(fd);
+        }
+        else {
+            mbedtls_ssl_close_notify(ssl);
+        }
+#else
         mbedtls_ssl_close_notify(ssl);
+#endif
         context_unset(fd, ssl);
     }
 
@@ -743,7 +1979,7 @@ int mk_tls_plugin_init(struct plugin_api **api, char *confdir)
         /* If it's used, load certificates.. mandatory */
         server_context = mk_api->mem_alloc_z(sizeof(struct polar_server_context));
         config_parse(confdir, &server_context->config);
-        return mk_tls_init();
+        return mk_tls_init(confdir);
     }
     else {
         /* Plugin is not used, just unregister in silence */
@@ -751,8 +1987,10 @@ int mk_tls_plugin_init(struct plugin_api **api, char *confdir)
     }
 }
 
-void mk_tls_worker_init(void)
+/* Setup of a thread running handshakes: a worker or a crypto thread */
+static struct polar_thread_context *thread_context_create(void)
 {
+    int i;
     int ret;
     struct polar_thread_context *thctx;
     const char *pers = "monkey";
@@ -761,11 +1999,20 @@ void mk_tls_worker_init(void)
 
     thctx = mk_api->mem_alloc(sizeof(*thctx));
     if (thctx == NULL) {
-        goto error;
+        return NULL;
     }
     thctx->contexts = NULL;
+    thctx->contexts_free = NULL;
+    thctx->table = NULL;
+    thctx->table_size = 0;
+    thctx->offload = NULL;
     mk_list_init(&thctx->_head);
 
+    thctx->record = mk_api->mem_alloc(TLS_RECORD_SIZE);
+    if (thctx->record == NULL) {
+        return NULL;
+    }
+
 
     /* SSL confniguration */
     mbedtls_ssl_config_init(&thctx->conf);
@@ -784,29 +2031,138 @@ void mk_tls_worker_init(void)
                                 (const unsigned char *) pers,
                                 strlen(pers));
     if (ret != 0) {
-        goto error;
+        return NULL;
     }
 
     mbedtls_pk_init(&thctx->pkey);
 
     PLUGIN_TRACE("[tls] Load RSA key.");
     if (polar_load_key(thctx, &server_context->config)) {
-        goto error;
+        return NULL;
     }
 
-    PLUGIN_TRACE("[tls] Set local thread context.");
-    pthread_setspecific(local_context, thctx);
+    memset(&thctx->stats, 0, sizeof(thctx->stats));
 
-    return;
+#if defined(MBEDTLS_SSL_CACHE_C)
+    i = __atomic_fetch_add(&session_shards_used, 1, __ATOMIC_RELAXED);
+    if (i >= session_shards_size) {
+        i = session_shards_size - 1;
+    }
+    thctx->sessions = &session_shards[i];
+    mbedtls_ssl_conf_session_cache(&thctx->conf,
+                                   thctx,
+                                   tls_cache_get,
+                                   tls_cache_set);
+#endif
+
+#ifdef TLS_TICKETS
+    for (i = 0; i < 2; i++) {
+        thctx->ticket_keys[i].period = 0;
+        mbedtls_cipher_init(&thctx->ticket_keys[i].cipher);
+        ret = mbedtls_cipher_setup(&thctx->ticket_keys[i].cipher,
+                        mbedtls_cipher_info_from_type(MBEDTLS_CIPHER_AES_256_GCM));
+        if (ret != 0) {
+            return NULL;
+        }
+    }
+    if (server_context->config.session_tickets == MK_TRUE) {
+        mbedtls_ssl_conf_session_tickets_cb(&thctx->conf,
+                                            tls_ticket_write,
+                                            tls_ticket_parse,
+                                            thctx);
+    }
+#endif
+    mbedtls_ssl_conf_rng(&thctx->conf, mbedtls_ctr_drbg_random,
+                         &thctx->ctr_drbg);
+#if (POLAR_DEBUG_LEVEL > 0)
+    mbedtls_ssl_conf_dbg(&thctx->conf, polar_debug, 0);
+#endif
+    mbedtls_ssl_conf_own_cert(&thctx->conf, &server_context->cert,
+                              &thctx->pkey);
+    mbedtls_ssl_conf_ca_chain(&thctx->conf, &server_context->ca_cert, NULL);
+    mbedtls_ssl_conf_dh_param_ctx(&thctx->conf, &server_context->dhm);
+
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+    thctx->sni_keys = NULL;
+    if (sni_certs_size > 0) {
+        thctx->sni_keys = mk_api->mem_alloc_z(sizeof(mbedtls_pk_context *) *
+                                              sni_certs_size);
+        if (!thctx->sni_keys) {
+            return NULL;
+        }
+        mbedtls_ssl_conf_sni(&thctx->conf, tls_sni, thctx);
+    }
+#endif
+
+    if (server_context->config.check_client_cert == MK_TRUE) {
+        mbedtls_ssl_conf_authmode(&thctx->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
 
- error:
-    exit(EXIT_FAILURE);
+#ifdef TLS_KTLS
+    thctx->handshake = NULL;
+    thctx->ktls_disabled = MK_FALSE;
+    if (server_context->config.ktls == MK_TRUE) {
+        mbedtls_ssl_conf_export_keys_cb(&thctx->conf, ktls_export_keys, NULL);
+    }
+#endif
+
+#if defined(MBEDTLS_SSL_ALPN)
+    /* Shallow copies, they share the certificates and keys of 'conf' */
+    for (i = 0; i < 4; i++) {
+        thctx->conf_alpn[i] = thctx->conf;
+        if (alpn_protocols[i][0]) {
+            mbedtls_ssl_conf_alpn_protocols(&thctx->conf_alpn[i],
+                                            alpn_protocols[i]);
+        }
+    }
+#else
+    (void) i;
+#endif
+
+    return thctx;
+}
+
+void mk_tls_worker_init(void)
+{
+    struct polar_thread_context *thctx;
+
+    thctx = thread_context_create();
+    if (!thctx) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (server_context->config.handshake_threads > 0) {
+        if (offload_worker_init(thctx) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        pthread_once(&offload.once, offload_start);
+    }
+
+    PLUGIN_TRACE("[tls] Set local thread context.");
+    pthread_setspecific(local_context, thctx);
 }
 
 int mk_tls_plugin_exit()
 {
+    int i;
     struct mk_list *cur, *tmp;
     struct polar_thread_context *thctx;
+    struct polar_stats total;
+
+    memset(&total, 0, sizeof(total));
+
+    /* Crypto threads first, they use the thread contexts */
+    pthread_mutex_lock(&offload.mutex);
+    offload.stop = MK_TRUE;
+    pthread_cond_broadcast(&offload.cond);
+    pthread_mutex_unlock(&offload.mutex);
+
+    for (i = 0; i < offload.threads; i++) {
+        pthread_join(offload.tids[i], NULL);
+    }
+    if (offload.tids) {
+        mk_api->mem_free(offload.tids);
+    }
 
     mbedtls_x509_crt_free(&server_context->cert);
     mbedtls_x509_crt_free(&server_context->ca_cert);
@@ -814,16 +2170,95 @@ int mk_tls_plugin_exit()
 
     mk_list_foreach_safe(cur, tmp, &server_context->threads._head) {
         thctx = mk_list_entry(cur, struct polar_thread_context, _head);
-        contexts_free(thctx->contexts);
-        mk_api->mem_free(thctx);
 
+        total.handshakes    += thctx->stats.handshakes;
+        total.cache_hits    += thctx->stats.cache_hits;
+        total.cache_misses  += thctx->stats.cache_misses;
+        total.ticket_hits   += thctx->stats.ticket_hits;
+        total.ticket_misses += thctx->stats.ticket_misses;
+        total.offloaded     += thctx->stats.offloaded;
+        total.offload_full  += thctx->stats.offload_full;
+        total.wait_usec     += thctx->stats.wait_usec;
+        total.run_usec      += thctx->stats.run_usec;
+        if (thctx->stats.wait_max > total.wait_max) {
+            total.wait_max = thctx->stats.wait_max;
+        }
+        if (thctx->stats.run_max > total.run_max) {
+            total.run_max = thctx->stats.run_max;
+        }
+
+        if (thctx->offload) {
+            close(thctx->offload->ch_r);
+            close(thctx->offload->ch_w);
+            pthread_mutex_destroy(&thctx->offload->lock);
+            mk_api->mem_free(thctx->offload);
+        }
+
+#ifdef TLS_TICKETS
+        for (i = 0; i < 2; i++) {
+            mbedtls_cipher_free(&thctx->ticket_keys[i].cipher);
+        }
+#endif
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+        if (thctx->sni_keys) {
+            for (i = 0; i < sni_certs_size; i++) {
+                if (thctx->sni_keys[i]) {
+                    mbedtls_pk_free(thctx->sni_keys[i]);
+                    mk_api->mem_free(thctx->sni_keys[i]);
+                }
+            }
+            mk_api->mem_free(thctx->sni_keys);
+        }
+#endif
+        contexts_free(thctx->contexts);
         mbedtls_pk_free(&thctx->pkey);
+        if (thctx->table) {
+            mk_api->mem_free(thctx->table);
+        }
+        mk_api->mem_free(thctx->record);
+        mk_api->mem_free(thctx);
     }
     pthread_mutex_destroy(&server_context->mutex);
 
 #if defined(MBEDTLS_SSL_CACHE_C)
-    mbedtls_ssl_cache_free(&global_sessions.cache);
+    for (i = 0; i < session_shards_size; i++) {
+        mbedtls_ssl_cache_free(&session_shards[i].cache);
+        pthread_mutex_destroy(&session_shards[i]._mutex);
+    }
+    mk_api->mem_free(session_shards);
+#endif
+#ifdef TLS_TICKETS
+    memset(ticket_secret, 0, sizeof(ticket_secret));
 #endif
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+    for (i = 0; i < sni_certs_size; i++) {
+        if (sni_certs[i]) {
+            polar_sni_cert_free(sni_certs[i]);
+        }
+    }
+    if (sni_certs) {
+        mk_api->mem_free(sni_certs);
+    }
+#endif
+    (void) i;
+
+    if (total.handshakes > 0) {
+        mk_info("[tls] %lu handshakes, resumed %lu (%lu%%): "
+                "cache %lu hits %lu misses, tickets %lu hits %lu misses",
+                total.handshakes,
+                total.cache_hits + total.ticket_hits,
+                (total.cache_hits + total.ticket_hits) * 100 /
+                total.handshakes,
+                total.cache_hits, total.cache_misses,
+                total.ticket_hits, total.ticket_misses);
+    }
+    if (total.offloaded > 0) {
+        mk_info("[tls] %lu handshake steps offloaded, %lu inline (queue "
+                "full): wait avg %llu max %llu us, run avg %llu max %llu us",
+                total.offloaded, total.offload_full,
+                total.wait_usec / total.offloaded, total.wait_max,
+                total.run_usec / total.offloaded, total.run_max);
+    }
 
     config_free(&server_context->config);
     mk_api->mem_free(server_context);
@@ -838,7 +2273,8 @@ struct mk_plugin_network mk_plugin_network_tls = {
     .writev        = mk_tls_writev,
     .close         = mk_tls_close,
     .send_file     = mk_tls_send_file,
-    .buffer_size   = MBEDTLS_SSL_MAX_CONTENT_LEN
+    .buffer_size   = MBEDTLS_SSL_MAX_CONTENT_LEN,
+    .handshake     = mk_tls_handshake
 };
 
 struct mk_plugin mk_plugin_tls = {
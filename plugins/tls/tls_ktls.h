@@ -0,0 +1,176 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_TLS_KTLS_H
+#define MK_TLS_KTLS_H
+
+/*
+ * Kernel TLS (kTLS): the record layer of an established mbedtls session
+ * moves to the socket. It only depends on mbedtls and the kernel headers
+ * so tests/tls_ktls.c checks it against a live mbedtls peer.
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_internal.h>
+
+/* Kernel TLS needs the traffic keys, only TLS 1.2 AES-GCM is handed over */
+#if defined(MK_HAVE_KTLS) && defined(MBEDTLS_SSL_EXPORT_KEYS) && \
+    defined(MBEDTLS_GCM_C) && defined(MBEDTLS_SSL_PROTO_TLS1_2)
+#define TLS_KTLS
+
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+union ktls_crypto_info {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 gcm128;
+#ifdef TLS_CIPHER_AES_GCM_256
+    struct tls12_crypto_info_aes_gcm_256 gcm256;
+#endif
+};
+
+/*
+ * mbedtls exports the key block when the keys are derived, on full and
+ * resumed handshakes. Only the write keys of AEAD suites are kept, the
+ * salts are in the transform once the handshake is over.
+ */
+static inline void ktls_keys_save(unsigned char *keys, size_t size,
+                                  size_t *len,
+                                  const unsigned char *key_block,
+                                  size_t mac_len, size_t key_len)
+{
+    if (mac_len != 0 || key_len * 2 > size) {
+        return;
+    }
+
+    memcpy(keys, key_block, key_len * 2);
+    *len = key_len;
+}
+
+static inline socklen_t ktls_crypto_info_set(union ktls_crypto_info *ci,
+                                             const unsigned char *key,
+                                             size_t key_len,
+                                             const unsigned char *salt,
+                                             const unsigned char *seq)
+{
+    memset(ci, 0, sizeof(*ci));
+    ci->info.version = TLS_1_2_VERSION;
+
+    /* mbedtls uses the record sequence number as explicit nonce */
+    if (key_len == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+        ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(ci->gcm128.key, key, key_len);
+        memcpy(ci->gcm128.salt, salt, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        memcpy(ci->gcm128.iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+        memcpy(ci->gcm128.rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+        return sizeof(ci->gcm128);
+    }
+#ifdef TLS_CIPHER_AES_GCM_256
+    else if (key_len == TLS_CIPHER_AES_GCM_256_KEY_SIZE) {
+        ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(ci->gcm256.key, key, key_len);
+        memcpy(ci->gcm256.salt, salt, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+        memcpy(ci->gcm256.iv, seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy(ci->gcm256.rec_seq, seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+        return sizeof(ci->gcm256);
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Hand the server side of the session to the kernel with the keys saved
+ * by ktls_keys_save(). Returns -1 if the socket does not take the tls
+ * ULP, errno tells why, otherwise 'tx' and 'rx' tell what was moved.
+ */
+static inline int ktls_setup(int fd, mbedtls_ssl_context *ssl,
+                             const unsigned char *keys, size_t key_len,
+                             int *tx, int *rx)
+{
+    socklen_t len;
+    union ktls_crypto_info ci;
+
+    *tx = 0;
+    *rx = 0;
+
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+        return -1;
+    }
+
+    /* The server writes with the second key of the block */
+    len = ktls_crypto_info_set(&ci, keys + key_len, key_len,
+                               ssl->transform->iv_enc, ssl->out_ctr);
+    if (len > 0 && setsockopt(fd, SOL_TLS, TLS_TX, &ci, len) == 0) {
+        *tx = 1;
+    }
+
+    /*
+     * mbedtls never reads past the record it needs, so after the
+     * Finished message nothing is left in its input buffer.
+     */
+    if (ssl->in_left == 0) {
+        len = ktls_crypto_info_set(&ci, keys, key_len,
+                                   ssl->transform->iv_dec, ssl->in_ctr);
+        if (len > 0 && setsockopt(fd, SOL_TLS, TLS_RX, &ci, len) == 0) {
+            *rx = 1;
+        }
+    }
+
+    memset(&ci, 0, sizeof(ci));
+    return 0;
+}
+
+/* Alerts go through the kernel too, as a record of type alert */
+static inline void ktls_close_notify(int fd)
+{
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    unsigned char alert[2] = {
+        MBEDTLS_SSL_ALERT_LEVEL_WARNING,
+        MBEDTLS_SSL_ALERT_MSG_CLOSE_NOTIFY
+    };
+    struct iovec iov = { alert, sizeof(alert) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = MBEDTLS_SSL_MSG_ALERT;
+
+    sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+#endif
+
+#endif
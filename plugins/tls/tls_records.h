@@ -0,0 +1,173 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_TLS_RECORDS_H
+#define MK_TLS_RECORDS_H
+
+/*
+ * Record writers of mk_tls_writev() and mk_tls_send_file(), they only
+ * depend on mbedtls so tests/bench_tls.c runs the same code.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <mbedtls/ssl.h>
+
+#ifndef TLS_RECORD_SIZE
+#define TLS_RECORD_SIZE MBEDTLS_SSL_MAX_CONTENT_LEN
+#endif
+
+/* Records written by a single writev/send_file call before yielding */
+#ifndef TLS_RECORDS_PER_CALL
+#define TLS_RECORDS_PER_CALL 4
+#endif
+
+/* tls_records_file() could not read the file, errno tells why */
+#define TLS_RECORDS_EREAD    -1
+
+/*
+ * Small iovec entries are coalesced into full records in 'buf', entries
+ * bigger than a record are handed to mbedtls as they are. When mbedtls
+ * returns WANT_WRITE the same record must be offered again, that holds
+ * since the caller retries from the first byte not reported as written
+ * and the records are always cut the same way.
+ *
+ * Returns the bytes written, or the mbedtls error if none was.
+ */
+static inline int tls_records_writev(mbedtls_ssl_context *ssl,
+                                     const struct iovec *io, int iov_len,
+                                     unsigned char *buf)
+{
+    int i = 0;
+    int j;
+    int ret = 0;
+    int records = 0;
+    size_t n;
+    size_t len;
+    size_t off = 0;
+    size_t next_off;
+    size_t sent = 0;
+    const unsigned char *data;
+
+    while (i < iov_len && records < TLS_RECORDS_PER_CALL) {
+        if (io[i].iov_len == off) {
+            i++;
+            off = 0;
+            continue;
+        }
+
+        if (io[i].iov_len - off >= TLS_RECORD_SIZE) {
+            data = (unsigned char *) io[i].iov_base + off;
+            len = TLS_RECORD_SIZE;
+            j = i;
+            next_off = off + len;
+        }
+        else {
+            len = 0;
+            j = i;
+            next_off = off;
+            while (j < iov_len && len < TLS_RECORD_SIZE) {
+                n = io[j].iov_len - next_off;
+                if (n > TLS_RECORD_SIZE - len) {
+                    n = TLS_RECORD_SIZE - len;
+                }
+                memcpy(buf + len, (char *) io[j].iov_base + next_off, n);
+                len += n;
+                next_off += n;
+                if (next_off == io[j].iov_len) {
+                    j++;
+                    next_off = 0;
+                }
+            }
+            data = buf;
+        }
+
+        ret = mbedtls_ssl_write(ssl, data, len);
+        if (ret <= 0) {
+            break;
+        }
+        sent += ret;
+        records++;
+
+        /* A smaller maximum fragment length was negotiated */
+        if ((size_t) ret < len) {
+            break;
+        }
+        i = j;
+        off = next_off;
+    }
+
+    if (sent > 0) {
+        return sent;
+    }
+    return ret;
+}
+
+/*
+ * Write a few records of the file and let the event loop call again, a
+ * big file must not keep the worker away from its other connections.
+ *
+ * Returns the bytes written, or zero at the end of the file, the mbedtls
+ * error or TLS_RECORDS_EREAD if none was.
+ */
+static inline int tls_records_file(mbedtls_ssl_context *ssl, int file_fd,
+                                   off_t *file_offset, size_t file_count,
+                                   unsigned char *buf)
+{
+    int ret = 0;
+    int records;
+    size_t len;
+    ssize_t used, remain = file_count, sent = 0;
+
+    for (records = 0; records < TLS_RECORDS_PER_CALL && remain > 0;
+         records++) {
+        len = remain < TLS_RECORD_SIZE ? remain : TLS_RECORD_SIZE;
+        used = pread(file_fd, buf, len, *file_offset);
+        if (used == 0) {
+            ret = 0;
+            break;
+        }
+        else if (used < 0) {
+            ret = TLS_RECORDS_EREAD;
+            break;
+        }
+
+        ret = mbedtls_ssl_write(ssl, buf, used);
+        if (ret <= 0) {
+            break;
+        }
+
+        remain -= ret;
+        sent += ret;
+        *file_offset += ret;
+
+        if (ret < used) {
+            break;
+        }
+    }
+
+    if (sent > 0) {
+        return sent;
+    }
+    return ret;
+}
+
+#endif
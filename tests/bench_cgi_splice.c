@@ -0,0 +1,348 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * CGI response bodies, from the script pipe to a loopback TCP client: the
+ * splice path of the CGI plugin (cgi_splice() in plugins/cgi/event.c), a
+ * pipe stream input written by mk_channel_write() through the splice of
+ * the liana network layer, against the copy path it replaced, a read of
+ * the 4 KB request buffer then a copy handed to the socket.
+ *
+ * Every response comes from its own script thread and pipe, a single
+ * thread reads the connection as the client. The server time is the CPU
+ * time of the thread moving the data only.
+ *
+ *   usage: mk-bench-cgi_splice [MB per size]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_stream.h>
+#include <monkey/mk_plugin_net.h>
+
+#define BENCH_MB            256
+#define BENCH_BUFLEN        4096    /* CGI request buffer, see cgi.h */
+#define BENCH_SCRIPT_WRITE  65536
+
+#ifdef MK_HAVE_SPLICE
+extern struct mk_plugin_network mk_plugin_network_liana;
+
+struct bench_peer {
+    int fd;
+    size_t size;                    /* script: bytes to write          */
+    size_t bytes;                   /* client: bytes read              */
+};
+
+static double bench_cpu()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The script: its whole response, then EOF */
+static void *bench_script(void *data)
+{
+    ssize_t n;
+    size_t left;
+    char buf[BENCH_SCRIPT_WRITE];
+    struct bench_peer *p = data;
+
+    memset(buf, 'x', sizeof(buf));
+    left = p->size;
+    while (left > 0) {
+        n = write(p->fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        left -= n;
+    }
+
+    close(p->fd);
+    return NULL;
+}
+
+static void *bench_client(void *data)
+{
+    ssize_t n;
+    char buf[65536];
+    struct bench_peer *p = data;
+
+    while ((n = read(p->fd, buf, sizeof(buf))) > 0) {
+        p->bytes += n;
+    }
+    return NULL;
+}
+
+/* A connected pair of loopback TCP sockets */
+static int bench_pair(int *server, int *client)
+{
+    int fd;
+    socklen_t len;
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(addr);
+
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, len) != 0 ||
+        listen(fd, 1) != 0 ||
+        getsockname(fd, (struct sockaddr *) &addr, &len) != 0) {
+        perror("listen");
+        return -1;
+    }
+
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    if (*client == -1 ||
+        connect(*client, (struct sockaddr *) &addr, len) != 0) {
+        perror("connect");
+        return -1;
+    }
+
+    *server = accept(fd, NULL, NULL);
+    close(fd);
+    return *server == -1 ? -1 : 0;
+}
+
+/* The previous path: read the request buffer, copy it out, write it */
+static ssize_t bench_copy(int pipe_fd, int sock)
+{
+    ssize_t n;
+    ssize_t w;
+    ssize_t off = 0;
+    char in_buf[BENCH_BUFLEN];
+    char *copy;
+
+    n = read(pipe_fd, in_buf, sizeof(in_buf));
+    if (n <= 0) {
+        return n;
+    }
+
+    /* mk_stream_in_cbuf() */
+    copy = mk_mem_alloc(n);
+    memcpy(copy, in_buf, n);
+    while (off < n) {
+        w = write(sock, copy + off, n - off);
+        if (w <= 0) {
+            mk_mem_free(copy);
+            return -1;
+        }
+        off += w;
+    }
+    mk_mem_free(copy);
+
+    return n;
+}
+
+static void bench_splice_done(struct mk_stream_input *in)
+{
+    *(int *) in->context = MK_TRUE;
+}
+
+/* cgi_splice(): what the pipe holds becomes a pipe input of the stream */
+static ssize_t bench_splice(int pipe_fd, struct mk_channel *channel,
+                            struct mk_stream *stream)
+{
+    int ret;
+    int avail;
+    int done = MK_FALSE;
+    size_t count;
+    struct mk_stream_input in;
+
+    if (ioctl(pipe_fd, FIONREAD, &avail) == -1) {
+        return -1;
+    }
+    else if (avail == 0) {
+        return 0;
+    }
+
+    mk_stream_in_pipe(stream, &in, pipe_fd, avail, NULL, bench_splice_done);
+    in.context = &done;
+
+    while (done == MK_FALSE) {
+        ret = mk_channel_write(channel, &count);
+        if (ret & MK_CHANNEL_ERROR) {
+            return -1;
+        }
+    }
+
+    return avail;
+}
+
+/* One response: a script behind a new pipe, until its EOF */
+static ssize_t bench_response(int splice_mode, size_t size, int sock,
+                              struct mk_channel *channel,
+                              struct mk_stream *stream)
+{
+    int fds[2];
+    ssize_t n;
+    size_t total = 0;
+    pthread_t t_script;
+    struct pollfd pfd;
+    struct bench_peer script;
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    /* The plugin pipes are non-blocking, like the event loop wants */
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    script.fd = fds[1];
+    script.size = size;
+    pthread_create(&t_script, NULL, bench_script, &script);
+
+    pfd.fd = fds[0];
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) > 0) {
+        if (splice_mode) {
+            n = bench_splice(fds[0], channel, stream);
+        }
+        else {
+            n = bench_copy(fds[0], sock);
+        }
+
+        if (n == -1 && errno == EAGAIN) {
+            continue;
+        }
+        else if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+
+    pthread_join(t_script, NULL);
+    close(fds[0]);
+    return total;
+}
+
+static int bench_run(const char *name, int splice_mode, size_t size,
+                     int count)
+{
+    int i;
+    int sock;
+    int client_fd;
+    size_t total = 0;
+    double cpu;
+    double wall;
+    pthread_t t_client;
+    struct bench_peer client;
+    struct mk_channel *channel;
+    struct mk_stream stream;
+
+    if (bench_pair(&sock, &client_fd) != 0) {
+        return -1;
+    }
+
+    channel = mk_channel_new(MK_CHANNEL_SOCKET, sock);
+    channel->io = &mk_plugin_network_liana;
+    mk_stream_set(&stream, channel, NULL, NULL, NULL, NULL);
+
+    client.fd = client_fd;
+    client.bytes = 0;
+    pthread_create(&t_client, NULL, bench_client, &client);
+
+    cpu = bench_cpu();
+    wall = bench_now();
+    for (i = 0; i < count; i++) {
+        total += bench_response(splice_mode, size, sock, channel, &stream);
+    }
+    cpu = bench_cpu() - cpu;
+
+    shutdown(sock, SHUT_WR);
+    pthread_join(t_client, NULL);
+    wall = bench_now() - wall;
+
+    if (total != size * count || client.bytes != total) {
+        fprintf(stderr, "%s: %zu bytes moved, %zu read, %zu expected\n",
+                name, total, client.bytes, size * count);
+        return -1;
+    }
+
+    printf("  %-8s %8.1f MB/s %8.1f us server CPU per MB\n", name,
+           total / wall / 1e6, cpu * 1e6 / (total / 1e6));
+
+    mk_list_del(&stream._head);
+    mk_mem_free(channel);
+    close(sock);
+    close(client_fd);
+    return 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+#ifndef MK_HAVE_SPLICE
+    (void) argc;
+    (void) argv;
+    printf("splice(2) is not available, the CGI plugin copies\n");
+    return EXIT_SUCCESS;
+#else
+    int i;
+    int mb = BENCH_MB;
+    size_t sizes[] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+
+    if (argc > 1) {
+        mb = atoi(argv[1]);
+    }
+    if (mb <= 0) {
+        fprintf(stderr, "usage: %s [MB per size]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < 3; i++) {
+        printf("%zu KB responses, %i MB\n", sizes[i] / 1024, mb);
+        if (bench_run("copy", MK_FALSE, sizes[i],
+                      (size_t) mb * 1024 * 1024 / sizes[i]) ||
+            bench_run("splice", MK_TRUE, sizes[i],
+                      (size_t) mb * 1024 * 1024 / sizes[i])) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+#endif
+}
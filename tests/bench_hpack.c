@@ -0,0 +1,134 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * HPACK throughput: the RFC 7541 Appendix C sequences through the decoder
+ * and a typical response head through the encoder.
+ *
+ *   usage: mk-bench-hpack [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <monkey/mk_core.h>
+
+#include "hpack_vectors.h"
+
+#define BENCH_ROUNDS    200000
+
+static double bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_cb(void *data,
+                    char *name, size_t name_len,
+                    char *value, size_t value_len)
+{
+    (void) name;
+    (void) value;
+
+    *(size_t *) data += name_len + value_len;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int b;
+    int n;
+    int r;
+    int rounds = BENCH_ROUNDS;
+    int blocks = 0;
+    int len[HPACK_VECTORS][HPACK_MAX_BLOCKS];
+    size_t bytes = 0;
+    size_t out = 0;
+    double t;
+    uint8_t data[HPACK_VECTORS][HPACK_MAX_BLOCKS][512];
+    uint8_t buf[1024];
+    struct mk_hpack ctx;
+    static const struct hpack_field head[] = {
+        {"server",         "Monkey/1.7.0"},
+        {"date",           "Sun, 18 Oct 2026 09:42:32 GMT"},
+        {"last-modified",  "Sun, 18 Oct 2026 09:12:44 GMT"},
+        {"content-type",   "text/html"},
+        {"etag",           "\"6ad48d8c-3\""},
+        {"content-length", "12345"},
+        {"accept-ranges",  "bytes"},
+    };
+
+    if (argc > 1) {
+        rounds = atoi(argv[1]);
+    }
+
+    for (i = 0; i < (int) HPACK_VECTORS; i++) {
+        for (b = 0; b < HPACK_MAX_BLOCKS; b++) {
+            len[i][b] = 0;
+            if (hpack_vectors[i].blocks[b].hex) {
+                len[i][b] = hpack_unhex(hpack_vectors[i].blocks[b].hex,
+                                        data[i][b], sizeof(data[i][b]));
+                blocks++;
+            }
+        }
+    }
+
+    t = bench_now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < (int) HPACK_VECTORS; i++) {
+            mk_hpack_init(&ctx, hpack_vectors[i].max_size);
+            for (b = 0; b < HPACK_MAX_BLOCKS && len[i][b] > 0; b++) {
+                if (mk_hpack_decode(&ctx, data[i][b], len[i][b],
+                                    bench_cb, &out) != 0) {
+                    fprintf(stderr, "decode failed: %s\n",
+                            hpack_vectors[i].section);
+                    return EXIT_FAILURE;
+                }
+                bytes += len[i][b];
+            }
+            mk_hpack_destroy(&ctx);
+        }
+    }
+    t = bench_now() - t;
+    printf("decode RFC 7541 C.2-C.6: %.1f MB/s, %.0f ns/block\n",
+           bytes / t / 1e6, t * 1e9 / ((double) rounds * blocks));
+
+    n = 0;
+    t = bench_now();
+    for (r = 0; r < rounds * 10; r++) {
+        n = mk_hpack_encode_status(buf, sizeof(buf), 200);
+        for (i = 0; i < (int) (sizeof(head) / sizeof(head[0])); i++) {
+            n += mk_hpack_encode_header(buf + n, sizeof(buf) - n,
+                                        (char *) head[i].name,
+                                        strlen(head[i].name),
+                                        (char *) head[i].value,
+                                        strlen(head[i].value));
+        }
+    }
+    t = bench_now() - t;
+    printf("encode response head: %i bytes, %.0f ns/head\n",
+           n, t * 1e9 / ((double) rounds * 10));
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Extension lookups per second: mk_phash against the rb-tree the mime
+ * types table used before, over the extensions of monkey.mime.
+ *
+ *   usage: mk-bench-mimetype [monkey.mime] [lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <monkey/mk_core.h>
+#include <rbtree.h>
+
+#define BENCH_MIME_FILE     MK_TESTS_SOURCE_DIR "/conf/monkey.mime.in"
+#define BENCH_MAX_KEYS      1024
+#define BENCH_LOOKUPS       20000000
+
+struct bench_node {
+    char *key;
+    struct rb_tree_node _rb_head;
+};
+
+static int bench_cmp(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+static double bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Same rules as the server: '#' comments, sections and the type column */
+static int bench_load(const char *path, char **keys, int *lens)
+{
+    int i;
+    int n = 0;
+    char key[64];
+    char line[256];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) && n < BENCH_MAX_KEYS) {
+        if (sscanf(line, " %63s", key) != 1 || key[0] == '#' ||
+            key[0] == '[' || strchr(key, '/')) {
+            continue;
+        }
+        for (i = 0; i < n && strcmp(keys[i], key) != 0; i++);
+        if (i < n) {
+            continue;
+        }
+        keys[n] = strdup(key);
+        lens[n] = strlen(key);
+        n++;
+    }
+    fclose(f);
+
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int n;
+    long j;
+    long lookups = BENCH_LOOKUPS;
+    int lens[BENCH_MAX_KEYS];
+    char *keys[BENCH_MAX_KEYS];
+    void *data[BENCH_MAX_KEYS];
+    double t_phash;
+    double t_rb;
+    double start;
+    volatile void *sink;
+    struct rb_tree tree;
+    struct rb_tree_node *found;
+    struct bench_node *node;
+    struct mk_phash *ph;
+
+    n = bench_load(argc > 1 ? argv[1] : BENCH_MIME_FILE, keys, lens);
+    if (n <= 0) {
+        return EXIT_FAILURE;
+    }
+    if (argc > 2) {
+        lookups = atol(argv[2]);
+    }
+
+    rb_tree_new(&tree, bench_cmp);
+    for (i = 0; i < n; i++) {
+        data[i] = keys[i];
+        node = calloc(1, sizeof(struct bench_node));
+        node->key = keys[i];
+        rb_tree_insert(&tree, node->key, &node->_rb_head);
+    }
+
+    ph = mk_phash_create(keys, lens, data, n);
+    if (!ph) {
+        fprintf(stderr, "could not build the perfect hash\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Both must find every key before timing anything */
+    for (i = 0; i < n; i++) {
+        found = NULL;
+        rb_tree_find(&tree, keys[i], &found);
+        if (!found || mk_phash_lookup(ph, keys[i], lens[i]) != data[i]) {
+            fprintf(stderr, "lookup failed for '%s'\n", keys[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    start = bench_now();
+    for (j = 0; j < lookups; j++) {
+        i = j % n;
+        sink = mk_phash_lookup(ph, keys[i], lens[i]);
+    }
+    t_phash = bench_now() - start;
+
+    start = bench_now();
+    for (j = 0; j < lookups; j++) {
+        i = j % n;
+        found = NULL;
+        rb_tree_find(&tree, keys[i], &found);
+        sink = found;
+    }
+    t_rb = bench_now() - start;
+    (void) sink;
+
+    printf("%i extensions, %li lookups\n", n, lookups);
+    printf("  mk_phash %8.1f M lookups/s\n", lookups / t_phash / 1e6);
+    printf("  rb-tree  %8.1f M lookups/s\n", lookups / t_rb / 1e6);
+
+    mk_phash_destroy(ph);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,418 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * TLS writes of the plugin: the record writers of tls_records.h against
+ * what mk_tls_writev() and mk_tls_send_file() did before, a copy of the
+ * whole iovec per call and a file loop running until the socket blocks.
+ *
+ * Both ends run in this process over a socketpair, a thread reads and
+ * decrypts everything. The server time is the CPU time of the writing
+ * thread only.
+ *
+ *   usage: mk-bench-tls [rounds] [entry size] [file MB]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/net.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/certs.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+
+#include "tls_records.h"
+
+#define BENCH_ROUNDS        2000
+#define BENCH_ENTRY_SIZE    1024    /* payload of each frame            */
+#define BENCH_FRAMES        32      /* HTTP/2 DATA frames per iovec     */
+#define BENCH_FILE_MB       8
+
+struct bench_tls {
+    int fd;
+    mbedtls_net_context net;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+};
+
+struct bench_reader {
+    struct bench_tls *tls;
+    size_t bytes;
+};
+
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context drbg;
+static mbedtls_x509_crt cert;
+static mbedtls_pk_context key;
+
+static double bench_cpu()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_tls_init(struct bench_tls *tls, int fd, int endpoint)
+{
+    mbedtls_ssl_init(&tls->ssl);
+    mbedtls_ssl_config_init(&tls->conf);
+    mbedtls_ssl_config_defaults(&tls->conf, endpoint,
+                                MBEDTLS_SSL_TRANSPORT_STREAM,
+                                MBEDTLS_SSL_PRESET_DEFAULT);
+    mbedtls_ssl_conf_rng(&tls->conf, mbedtls_ctr_drbg_random, &drbg);
+    mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_NONE);
+
+    if (endpoint == MBEDTLS_SSL_IS_SERVER &&
+        mbedtls_ssl_conf_own_cert(&tls->conf, &cert, &key) != 0) {
+        return -1;
+    }
+    if (mbedtls_ssl_setup(&tls->ssl, &tls->conf) != 0) {
+        return -1;
+    }
+
+    tls->fd = fd;
+    tls->net.fd = fd;
+    mbedtls_ssl_set_bio(&tls->ssl, &tls->net,
+                        mbedtls_net_send, mbedtls_net_recv, NULL);
+    return 0;
+}
+
+static void bench_tls_free(struct bench_tls *tls)
+{
+    mbedtls_ssl_free(&tls->ssl);
+    mbedtls_ssl_config_free(&tls->conf);
+    close(tls->fd);
+}
+
+/* Client side: handshake, then decrypt until the server closes */
+static void *bench_read(void *data)
+{
+    int ret;
+    unsigned char buf[MBEDTLS_SSL_MAX_CONTENT_LEN];
+    struct bench_reader *r = data;
+
+    while ((ret = mbedtls_ssl_handshake(&r->tls->ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
+            ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return NULL;
+        }
+    }
+
+    while ((ret = mbedtls_ssl_read(&r->tls->ssl, buf, sizeof(buf))) > 0) {
+        r->bytes += ret;
+    }
+    return NULL;
+}
+
+/* The previous mk_tls_writev(): copy it all, the caller retries the rest */
+static int bench_writev_copy(mbedtls_ssl_context *ssl,
+                             const struct iovec *io, int iov_len)
+{
+    int i;
+    int ret;
+    size_t used = 0;
+    size_t len = 0;
+    unsigned char *buf;
+
+    for (i = 0; i < iov_len; i++) {
+        len += io[i].iov_len;
+    }
+
+    buf = malloc(len);
+    if (!buf) {
+        return -1;
+    }
+    for (i = 0; i < iov_len; i++) {
+        memcpy(buf + used, io[i].iov_base, io[i].iov_len);
+        used += io[i].iov_len;
+    }
+
+    ret = mbedtls_ssl_write(ssl, buf, len);
+    free(buf);
+    return ret;
+}
+
+/* The previous mk_tls_send_file(): write until EOF or the socket blocks */
+static int bench_file_loop(mbedtls_ssl_context *ssl, int file_fd,
+                           off_t *file_offset)
+{
+    int ret;
+    ssize_t used;
+    ssize_t sent = 0;
+    unsigned char *buf;
+
+    buf = malloc(MBEDTLS_SSL_MAX_CONTENT_LEN);
+    if (!buf) {
+        return -1;
+    }
+
+    do {
+        used = pread(file_fd, buf, MBEDTLS_SSL_MAX_CONTENT_LEN, *file_offset);
+        if (used <= 0) {
+            ret = used;
+            break;
+        }
+        ret = mbedtls_ssl_write(ssl, buf, used);
+        if (ret > 0) {
+            sent += ret;
+            *file_offset += ret;
+        }
+    } while (ret > 0);
+
+    free(buf);
+    return sent > 0 ? sent : ret;
+}
+
+/* Skip the bytes written, as the core does through mk_iov */
+static int bench_iov_consume(struct iovec *io, int iov_len, size_t bytes)
+{
+    int i = 0;
+
+    while (i < iov_len && bytes >= io[i].iov_len) {
+        bytes -= io[i].iov_len;
+        i++;
+    }
+    if (i < iov_len) {
+        io[i].iov_base = (char *) io[i].iov_base + bytes;
+        io[i].iov_len -= bytes;
+    }
+    return i;
+}
+
+/*
+ * Run one variant over a new connection. Mode 0 and 1 write the iovec
+ * 'rounds' times, copying or with tls_records_writev(). Mode 2 and 3
+ * send the file 'rounds' times, looping or with tls_records_file().
+ */
+static int bench_run(const char *name, int mode, int rounds,
+                     struct iovec *frames, int n_frames,
+                     int file_fd, size_t file_size)
+{
+    int i;
+    int ret;
+    int off;
+    int sv[2];
+    off_t file_offset;
+    size_t total = 0;
+    double cpu;
+    double wall;
+    pthread_t tid;
+    struct iovec io[BENCH_FRAMES * 2];
+    struct bench_tls server;
+    struct bench_tls client;
+    struct bench_reader reader;
+    unsigned char *record;
+
+    record = malloc(TLS_RECORD_SIZE);
+    if (!record || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        return -1;
+    }
+
+    if (bench_tls_init(&server, sv[0], MBEDTLS_SSL_IS_SERVER) != 0 ||
+        bench_tls_init(&client, sv[1], MBEDTLS_SSL_IS_CLIENT) != 0) {
+        fprintf(stderr, "could not set up the TLS contexts\n");
+        return -1;
+    }
+
+    reader.tls = &client;
+    reader.bytes = 0;
+    pthread_create(&tid, NULL, bench_read, &reader);
+
+    while ((ret = mbedtls_ssl_handshake(&server.ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
+            ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            fprintf(stderr, "handshake failed: -0x%x\n", -ret);
+            return -1;
+        }
+    }
+
+    cpu = bench_cpu();
+    wall = bench_now();
+
+    for (i = 0; i < rounds; i++) {
+        if (mode < 2) {
+            memcpy(io, frames, sizeof(struct iovec) * n_frames);
+            off = 0;
+            while (off < n_frames) {
+                if (mode == 0) {
+                    ret = bench_writev_copy(&server.ssl, io + off,
+                                            n_frames - off);
+                }
+                else {
+                    ret = tls_records_writev(&server.ssl, io + off,
+                                             n_frames - off, record);
+                }
+                if (ret <= 0) {
+                    return -1;
+                }
+                total += ret;
+                off += bench_iov_consume(io + off, n_frames - off, ret);
+            }
+        }
+        else {
+            file_offset = 0;
+            while ((size_t) file_offset < file_size) {
+                if (mode == 2) {
+                    ret = bench_file_loop(&server.ssl, file_fd, &file_offset);
+                }
+                else {
+                    ret = tls_records_file(&server.ssl, file_fd, &file_offset,
+                                           file_size - file_offset, record);
+                }
+                if (ret <= 0) {
+                    return -1;
+                }
+                total += ret;
+            }
+        }
+    }
+
+    cpu = bench_cpu() - cpu;
+    mbedtls_ssl_close_notify(&server.ssl);
+    shutdown(sv[0], SHUT_WR);
+    pthread_join(tid, NULL);
+    wall = bench_now() - wall;
+
+    if (reader.bytes != total) {
+        fprintf(stderr, "%s: %zu bytes written, %zu read\n",
+                name, total, reader.bytes);
+        return -1;
+    }
+
+    printf("  %-16s %8.1f MB/s %8.1f us server CPU per MB\n", name,
+           total / wall / 1e6, cpu * 1e6 / (total / 1e6));
+
+    bench_tls_free(&server);
+    bench_tls_free(&client);
+    free(record);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int fd;
+    int rounds = BENCH_ROUNDS;
+    int entry = BENCH_ENTRY_SIZE;
+    int file_mb = BENCH_FILE_MB;
+    size_t file_size;
+    char path[] = "/tmp/mk-bench-tls-XXXXXX";
+    char *payload;
+    char *chunk;
+    unsigned char header[9] = { 0 };
+    struct iovec frames[BENCH_FRAMES * 2];
+
+    if (argc > 1) {
+        rounds = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        entry = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        file_mb = atoi(argv[3]);
+    }
+    if (rounds <= 0 || entry <= 0 || file_mb <= 0) {
+        fprintf(stderr, "usage: %s [rounds] [entry size] [file MB]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_x509_crt_init(&cert);
+    mbedtls_pk_init(&key);
+
+    if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                              (const unsigned char *) "mk-bench-tls",
+                              12) != 0 ||
+        mbedtls_x509_crt_parse(&cert,
+                               (const unsigned char *) mbedtls_test_srv_crt,
+                               mbedtls_test_srv_crt_len) != 0 ||
+        mbedtls_pk_parse_key(&key,
+                             (const unsigned char *) mbedtls_test_srv_key,
+                             mbedtls_test_srv_key_len, NULL, 0) != 0) {
+        fprintf(stderr, "could not load the mbedtls test certificate\n");
+        return EXIT_FAILURE;
+    }
+
+    /* HTTP/2 DATA frames: a 9 bytes header, then the payload */
+    payload = malloc(entry);
+    memset(payload, 'x', entry);
+    for (i = 0; i < BENCH_FRAMES; i++) {
+        frames[i * 2].iov_base = header;
+        frames[i * 2].iov_len = sizeof(header);
+        frames[i * 2 + 1].iov_base = payload;
+        frames[i * 2 + 1].iov_len = entry;
+    }
+
+    fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    unlink(path);
+
+    chunk = malloc(1024 * 1024);
+    memset(chunk, 'y', 1024 * 1024);
+    for (i = 0; i < file_mb; i++) {
+        if (write(fd, chunk, 1024 * 1024) != 1024 * 1024) {
+            perror("write");
+            return EXIT_FAILURE;
+        }
+    }
+    file_size = (size_t) file_mb * 1024 * 1024;
+    free(chunk);
+
+    printf("writev: %i rounds of %i frames of %i bytes\n",
+           rounds, BENCH_FRAMES, entry);
+    if (bench_run("copy", 0, rounds, frames, BENCH_FRAMES * 2, -1, 0) ||
+        bench_run("records", 1, rounds, frames, BENCH_FRAMES * 2, -1, 0)) {
+        return EXIT_FAILURE;
+    }
+
+    rounds = rounds / 100 > 0 ? rounds / 100 : 1;
+    printf("send_file: %i rounds of a %i MB file\n", rounds, file_mb);
+    if (bench_run("loop", 2, rounds, NULL, 0, fd, file_size) ||
+        bench_run("records", 3, rounds, NULL, 0, fd, file_size)) {
+        return EXIT_FAILURE;
+    }
+
+    close(fd);
+    free(payload);
+    return EXIT_SUCCESS;
+}
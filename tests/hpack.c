@@ -0,0 +1,236 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * HPACK codec: the RFC 7541 Appendix C examples through the decoder, the
+ * Huffman code both ways and the encoder output read back by the decoder.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <monkey/mk_core.h>
+
+#include "hpack_vectors.h"
+
+static int failures;
+
+#define CHECK(cond, ...)                                    \
+    do {                                                    \
+        if (!(cond)) {                                      \
+            fprintf(stderr, "FAIL %s:%i: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__);                   \
+            fprintf(stderr, "\n");                          \
+            failures++;                                     \
+        }                                                   \
+    } while (0)
+
+/* Decoded fields are compared in order against the expected list */
+struct hpack_check {
+    const char *section;
+    const struct hpack_field *fields;
+    int index;
+};
+
+static int hpack_check_cb(void *data,
+                          char *name, size_t name_len,
+                          char *value, size_t value_len)
+{
+    struct hpack_check *c = data;
+    const struct hpack_field *f;
+
+    if (c->index >= HPACK_MAX_FIELDS || !c->fields[c->index].name) {
+        CHECK(0, "%s: unexpected field '%.*s'", c->section,
+              (int) name_len, name);
+        return -1;
+    }
+
+    f = &c->fields[c->index++];
+    CHECK(name_len == strlen(f->name) && !memcmp(name, f->name, name_len),
+          "%s: name '%.*s', expected '%s'", c->section,
+          (int) name_len, name, f->name);
+    CHECK(value_len == strlen(f->value) && !memcmp(value, f->value, value_len),
+          "%s: value '%.*s', expected '%s'", c->section,
+          (int) value_len, value, f->value);
+    return 0;
+}
+
+static int hpack_field_count(const struct hpack_field *fields)
+{
+    int n = 0;
+
+    while (n < HPACK_MAX_FIELDS && fields[n].name) {
+        n++;
+    }
+    return n;
+}
+
+static void test_rfc_vectors()
+{
+    int i;
+    int b;
+    int len;
+    int ret;
+    uint8_t block[512];
+    struct mk_hpack ctx;
+    struct hpack_check check;
+    const struct hpack_sequence *seq;
+    const struct hpack_block *blk;
+
+    for (i = 0; i < (int) HPACK_VECTORS; i++) {
+        seq = &hpack_vectors[i];
+        ret = mk_hpack_init(&ctx, seq->max_size);
+        CHECK(ret == 0, "%s: init", seq->section);
+
+        for (b = 0; b < HPACK_MAX_BLOCKS && seq->blocks[b].hex; b++) {
+            blk = &seq->blocks[b];
+            len = hpack_unhex(blk->hex, block, sizeof(block));
+            CHECK(len > 0, "%s.%i: bad hex", seq->section, b + 1);
+
+            check.section = seq->section;
+            check.fields = blk->fields;
+            check.index = 0;
+
+            ret = mk_hpack_decode(&ctx, block, len, hpack_check_cb, &check);
+            CHECK(ret == 0, "%s.%i: decode returned %i",
+                  seq->section, b + 1, ret);
+            CHECK(check.index == hpack_field_count(blk->fields),
+                  "%s.%i: %i fields decoded, expected %i", seq->section,
+                  b + 1, check.index, hpack_field_count(blk->fields));
+            CHECK(ctx.size == blk->size,
+                  "%s.%i: table size %u, expected %zu", seq->section,
+                  b + 1, ctx.size, blk->size);
+        }
+        mk_hpack_destroy(&ctx);
+    }
+}
+
+static void test_huffman()
+{
+    int i;
+    int len;
+    int ret;
+    char out[128];
+    uint8_t buf[128];
+    uint8_t expected[64];
+    uint8_t bad_eos[] = {0xff, 0xff, 0xff, 0xff};
+    uint8_t bad_pad[] = {0x1f, 0xff};
+
+    /* RFC 7541 C.4.1 and C.6.1 string literals */
+    static const struct hpack_field strings[] = {
+        {"www.example.com", "f1e3c2e5f23a6ba0ab90f4ff"},
+        {"no-cache",        "a8eb10649cbf"},
+        {"custom-key",      "25a849e95ba97d7f"},
+        {"custom-value",    "25a849e95bb8e8b4bf"},
+        {"302",             "6402"},
+        {"private",         "aec3771a4b"},
+        {HPACK_DATE_21,     "d07abe941054d444a8200595040b8166e082a62d1bff"},
+        {HPACK_LOCATION,    "9d29ad171863c78f0b97c8e9ae82ae43d3"},
+        {HPACK_COOKIE,      "94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672"
+                            "c1ab270fb5291f9587316065c003ed4ee5b1063d5007"},
+    };
+
+    for (i = 0; i < (int) (sizeof(strings) / sizeof(strings[0])); i++) {
+        len = hpack_unhex(strings[i].value, expected, sizeof(expected));
+        CHECK(mk_hpack_huffman_length(strings[i].name,
+                                      strlen(strings[i].name)) == (size_t) len,
+              "huffman length of '%s'", strings[i].name);
+
+        ret = mk_hpack_huffman_encode(buf, sizeof(buf), strings[i].name,
+                                      strlen(strings[i].name));
+        CHECK(ret == len && !memcmp(buf, expected, len),
+              "huffman encode of '%s'", strings[i].name);
+
+        ret = mk_hpack_huffman_decode(expected, len, out);
+        CHECK(ret == (int) strlen(strings[i].name) &&
+              !memcmp(out, strings[i].name, ret),
+              "huffman decode of '%s'", strings[i].name);
+    }
+
+    /* RFC 7541 5.2: EOS in the stream and padding longer than 7 bits */
+    CHECK(mk_hpack_huffman_decode(bad_eos, sizeof(bad_eos), out) < 0,
+          "huffman EOS accepted");
+    CHECK(mk_hpack_huffman_decode(bad_pad, sizeof(bad_pad), out) < 0,
+          "huffman long padding accepted");
+
+    /* Output buffer too small */
+    CHECK(mk_hpack_huffman_encode(buf, 4, "www.example.com", 15) < 0,
+          "huffman encode overflow");
+}
+
+static void test_encoder()
+{
+    int n = 0;
+    int ret;
+    uint8_t buf[512];
+    struct mk_hpack ctx;
+    struct hpack_check check;
+    static const struct hpack_field fields[HPACK_MAX_FIELDS] = {
+        {":status", "404"},
+        {"server", "Monkey"},
+        {"content-type", "text/html"},
+        {"date", HPACK_DATE_22},
+        {"x-custom", "value"},
+        {"set-cookie", HPACK_COOKIE},
+    };
+
+    ret = mk_hpack_encode_status(buf, sizeof(buf), 404);
+    CHECK(ret > 0, "encode status");
+    n += ret;
+
+    for (ret = 1; ret < hpack_field_count(fields); ret++) {
+        n += mk_hpack_encode_header(buf + n, sizeof(buf) - n,
+                                    (char *) fields[ret].name,
+                                    strlen(fields[ret].name),
+                                    (char *) fields[ret].value,
+                                    strlen(fields[ret].value));
+    }
+
+    mk_hpack_init(&ctx, 4096);
+    check.section = "encoder";
+    check.fields = fields;
+    check.index = 0;
+    ret = mk_hpack_decode(&ctx, buf, n, hpack_check_cb, &check);
+    CHECK(ret == 0, "encoder: decode returned %i", ret);
+    CHECK(check.index == hpack_field_count(fields), "encoder: %i fields",
+          check.index);
+
+    /* The encoder never indexes, the peer table stays empty */
+    CHECK(ctx.size == 0, "encoder: table size %u", ctx.size);
+    mk_hpack_destroy(&ctx);
+
+    CHECK(mk_hpack_encode_header(buf, 4, "server", 6, "Monkey", 6) < 0,
+          "encoder: overflow");
+}
+
+int main()
+{
+    test_rfc_vectors();
+    test_huffman();
+    test_encoder();
+
+    if (failures) {
+        fprintf(stderr, "%i check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("hpack: all checks passed\n");
+    return EXIT_SUCCESS;
+}
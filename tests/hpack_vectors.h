@@ -0,0 +1,160 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Header block examples from RFC 7541 Appendix C, shared by the HPACK
+ * unit test and its benchmark. Every sequence runs against one decoding
+ * context; 'size' is the dynamic table size expected after each block.
+ */
+
+#ifndef MK_TESTS_HPACK_VECTORS_H
+#define MK_TESTS_HPACK_VECTORS_H
+
+#define HPACK_MAX_FIELDS    8
+#define HPACK_MAX_BLOCKS    3
+
+struct hpack_field {
+    const char *name;
+    const char *value;
+};
+
+struct hpack_block {
+    const char *hex;
+    size_t size;
+    struct hpack_field fields[HPACK_MAX_FIELDS];
+};
+
+struct hpack_sequence {
+    const char *section;
+    uint32_t max_size;
+    struct hpack_block blocks[HPACK_MAX_BLOCKS];
+};
+
+#define HPACK_DATE_21   "Mon, 21 Oct 2013 20:13:21 GMT"
+#define HPACK_DATE_22   "Mon, 21 Oct 2013 20:13:22 GMT"
+#define HPACK_LOCATION  "https://www.example.com"
+#define HPACK_COOKIE    "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"
+
+#define HPACK_REQ1      {":method", "GET"}, {":scheme", "http"},      \
+                        {":path", "/"}, {":authority", "www.example.com"}
+#define HPACK_REQ2      HPACK_REQ1, {"cache-control", "no-cache"}
+#define HPACK_REQ3      {":method", "GET"}, {":scheme", "https"},     \
+                        {":path", "/index.html"},                     \
+                        {":authority", "www.example.com"},            \
+                        {"custom-key", "custom-value"}
+
+#define HPACK_RES1      {":status", "302"}, {"cache-control", "private"}, \
+                        {"date", HPACK_DATE_21}, {"location", HPACK_LOCATION}
+#define HPACK_RES2      {":status", "307"}, {"cache-control", "private"}, \
+                        {"date", HPACK_DATE_21}, {"location", HPACK_LOCATION}
+#define HPACK_RES3      {":status", "200"}, {"cache-control", "private"}, \
+                        {"date", HPACK_DATE_22}, {"location", HPACK_LOCATION}, \
+                        {"content-encoding", "gzip"},                 \
+                        {"set-cookie", HPACK_COOKIE}
+
+static const struct hpack_sequence hpack_vectors[] = {
+    /* C.2: literal header field representations, one block each */
+    {"C.2.1", 4096, {
+        {"400a637573746f6d2d6b65790d637573746f6d2d686561646572", 55,
+         {{"custom-key", "custom-header"}}}}},
+    {"C.2.2", 4096, {
+        {"040c2f73616d706c652f70617468", 0,
+         {{":path", "/sample/path"}}}}},
+    {"C.2.3", 4096, {
+        {"100870617373776f726406736563726574", 0,
+         {{"password", "secret"}}}}},
+    {"C.2.4", 4096, {
+        {"82", 0,
+         {{":method", "GET"}}}}},
+
+    /* C.3: requests without Huffman coding */
+    {"C.3", 4096, {
+        {"828684410f7777772e6578616d706c652e636f6d", 57, {HPACK_REQ1}},
+        {"828684be58086e6f2d6361636865", 110, {HPACK_REQ2}},
+        {"828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565", 164,
+         {HPACK_REQ3}}}},
+
+    /* C.4: requests with Huffman coding */
+    {"C.4", 4096, {
+        {"828684418cf1e3c2e5f23a6ba0ab90f4ff", 57, {HPACK_REQ1}},
+        {"828684be5886a8eb10649cbf", 110, {HPACK_REQ2}},
+        {"828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", 164,
+         {HPACK_REQ3}}}},
+
+    /* C.5: responses without Huffman coding, 256 bytes table (evictions) */
+    {"C.5", 256, {
+        {"4803333032580770726976617465611d4d6f6e2c203231204f637420323031"
+         "332032303a31333a323120474d546e1768747470733a2f2f7777772e657861"
+         "6d706c652e636f6d", 222, {HPACK_RES1}},
+        {"4803333037c1c0bf", 222, {HPACK_RES2}},
+        {"88c1611d4d6f6e2c203231204f637420323031332032303a31333a32322047"
+         "4d54c05a04677a69707738666f6f3d4153444a4b48514b425a584f5157454f"
+         "50495541585157454f49553b206d61782d6167653d333630303b2076657273"
+         "696f6e3d31", 215, {HPACK_RES3}}}},
+
+    /* C.6: responses with Huffman coding, 256 bytes table (evictions) */
+    {"C.6", 256, {
+        {"488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082"
+         "a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3", 222,
+         {HPACK_RES1}},
+        {"4883640effc1c0bf", 222, {HPACK_RES2}},
+        {"88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9"
+         "ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5"
+         "291f9587316065c003ed4ee5b1063d5007", 215, {HPACK_RES3}}}},
+};
+
+#define HPACK_VECTORS   (sizeof(hpack_vectors) / sizeof(hpack_vectors[0]))
+
+/* Hex string to bytes, blanks are skipped; returns the length or -1 */
+static inline int hpack_unhex(const char *hex, uint8_t *out, size_t size)
+{
+    int hi = -1;
+    int c;
+    size_t len = 0;
+
+    for (; *hex; hex++) {
+        c = *hex;
+        if (c == ' ') {
+            continue;
+        }
+        if (c >= '0' && c <= '9') {
+            c -= '0';
+        }
+        else if (c >= 'a' && c <= 'f') {
+            c -= 'a' - 10;
+        }
+        else {
+            return -1;
+        }
+
+        if (hi < 0) {
+            hi = c;
+            continue;
+        }
+        if (len == size) {
+            return -1;
+        }
+        out[len++] = (hi << 4) | c;
+        hi = -1;
+    }
+
+    return hi < 0 ? (int) len : -1;
+}
+
+#endif
@@ -0,0 +1,399 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * HTTP/2 header blocks that end in a stream error (RFC 7540 4.3): a HEADERS
+ * frame sent on a stream the client already half closed must still be
+ * decoded, CONTINUATION included, so the HPACK context shared by the whole
+ * connection stays in sync.
+ *
+ * The rejected block adds ":path: /small" to the dynamic table, the next
+ * request refers to it by index only. If the server skipped the block the
+ * index would be unknown and the connection would be torn down.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <monkey/mk_lib.h>
+#include <monkey/mk_http2.h>
+
+#define TEST_PORT           2198
+#define TEST_PREFACE        "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define TEST_BULK_SIZE      (1024 * 1024)
+#define TEST_SMALL_SIZE     1000
+#define TEST_BULK_ID        1
+#define TEST_SMALL_ID       3
+
+struct test_client {
+    int fd;
+    uint32_t headers_id;
+    int small_status;
+    size_t small_bytes;
+    int small_done;
+    size_t bulk_bytes;
+    uint32_t bulk_reset;
+    struct mk_hpack hpack;
+};
+
+static int test_file(char *dir, char *name, size_t size)
+{
+    char path[256];
+    char buf[4096];
+    size_t len;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "w");
+    if (!f) {
+        return -1;
+    }
+
+    memset(buf, 'x', sizeof(buf));
+    while (size > 0) {
+        len = size < sizeof(buf) ? size : sizeof(buf);
+        fwrite(buf, 1, len, f);
+        size -= len;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void test_cleanup(char *dir)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/bulk", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/small", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static int test_write(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+    char *p = buf;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int test_read(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+    char *p = buf;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int test_frame(int fd, int type, int flags, uint32_t id,
+                      void *payload, size_t len)
+{
+    uint8_t hdr[MK_HTTP2_HEADER_SIZE];
+
+    hdr[0] = (len >> 16) & 0xff;
+    hdr[1] = (len >> 8) & 0xff;
+    hdr[2] = len & 0xff;
+    hdr[3] = type;
+    hdr[4] = flags;
+    hdr[5] = (id >> 24) & 0x7f;
+    hdr[6] = (id >> 16) & 0xff;
+    hdr[7] = (id >> 8) & 0xff;
+    hdr[8] = id & 0xff;
+
+    if (test_write(fd, hdr, sizeof(hdr)) != 0) {
+        return -1;
+    }
+    if (len > 0) {
+        return test_write(fd, payload, len);
+    }
+    return 0;
+}
+
+static int test_window_update(int fd, uint32_t id, uint32_t increment)
+{
+    uint8_t buf[4];
+
+    buf[0] = (increment >> 24) & 0x7f;
+    buf[1] = (increment >> 16) & 0xff;
+    buf[2] = (increment >> 8) & 0xff;
+    buf[3] = increment & 0xff;
+
+    return test_frame(fd, MK_HTTP2_WINDOW_UPDATE, 0, id, buf, sizeof(buf));
+}
+
+static int test_status_cb(void *data,
+                          char *name, size_t name_len,
+                          char *value, size_t value_len)
+{
+    struct test_client *c = data;
+
+    if (c->headers_id == TEST_SMALL_ID &&
+        name_len == 7 && memcmp(name, ":status", 7) == 0) {
+        c->small_status = atoi(value);
+    }
+    (void) value_len;
+    return 0;
+}
+
+/*
+ * Read one frame. Only the connection window gets credit back, the bulk
+ * stream stays blocked on its own window and so remains half closed.
+ */
+static int test_frame_read(struct test_client *c)
+{
+    int ret;
+    int type;
+    int flags;
+    uint32_t id;
+    uint32_t len;
+    uint8_t hdr[MK_HTTP2_HEADER_SIZE];
+    static uint8_t payload[1 << 16];
+
+    if (test_read(c->fd, hdr, sizeof(hdr)) != 0) {
+        fprintf(stderr, "connection closed\n");
+        return -1;
+    }
+
+    len = (hdr[0] << 16) | (hdr[1] << 8) | hdr[2];
+    type = hdr[3];
+    flags = hdr[4];
+    id = ((hdr[5] & 0x7f) << 24) | (hdr[6] << 16) | (hdr[7] << 8) | hdr[8];
+
+    if (len > sizeof(payload) || test_read(c->fd, payload, len) != 0) {
+        fprintf(stderr, "bad frame length %u\n", len);
+        return -1;
+    }
+
+    switch (type) {
+    case MK_HTTP2_SETTINGS:
+        if (!(flags & MK_HTTP2_SETTINGS_ACK)) {
+            return test_frame(c->fd, MK_HTTP2_SETTINGS,
+                              MK_HTTP2_SETTINGS_ACK, 0, NULL, 0);
+        }
+        break;
+    case MK_HTTP2_HEADERS:
+        c->headers_id = id;
+        ret = mk_hpack_decode(&c->hpack, payload, len, test_status_cb, c);
+        if (ret != 0) {
+            fprintf(stderr, "bad header block on stream %u\n", id);
+            return -1;
+        }
+        break;
+    case MK_HTTP2_DATA:
+        if (id == TEST_SMALL_ID) {
+            c->small_bytes += len;
+            if (flags & MK_HTTP2_END_STREAM) {
+                c->small_done = MK_TRUE;
+            }
+        }
+        else {
+            c->bulk_bytes += len;
+        }
+        if (len > 0 && test_window_update(c->fd, 0, len) != 0) {
+            return -1;
+        }
+        break;
+    case MK_HTTP2_RST_STREAM:
+        if (id != TEST_BULK_ID || len != 4) {
+            fprintf(stderr, "unexpected RST_STREAM on stream %u\n", id);
+            return -1;
+        }
+        c->bulk_reset = (payload[0] << 24) | (payload[1] << 16) |
+                        (payload[2] << 8) | payload[3];
+        break;
+    case MK_HTTP2_GOAWAY:
+        fprintf(stderr, "GOAWAY, error code %u\n",
+                len >= 8 ? (unsigned) ((payload[4] << 24) |
+                                       (payload[5] << 16) |
+                                       (payload[6] << 8) | payload[7]) : 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int test_request(int fd, uint32_t id, char *path)
+{
+    int n = 0;
+    int i;
+    uint8_t buf[256];
+    char *fields[][2] = {
+        {":method",    "GET"},
+        {":scheme",    "http"},
+        {":path",      path},
+        {":authority", "127.0.0.1"},
+    };
+
+    for (i = 0; i < 4; i++) {
+        n += mk_hpack_encode_header(buf + n, sizeof(buf) - n,
+                                    fields[i][0], strlen(fields[i][0]),
+                                    fields[i][1], strlen(fields[i][1]));
+    }
+
+    return test_frame(fd, MK_HTTP2_HEADERS,
+                      MK_HTTP2_END_HEADERS | MK_HTTP2_END_STREAM,
+                      id, buf, n);
+}
+
+static int test_run(struct test_client *c)
+{
+    int n;
+    struct timeval tv = {5, 0};
+    struct sockaddr_in addr;
+    static char preface[] = TEST_PREFACE;
+
+    /* ":path: /small", literal with incremental indexing, indexed name */
+    uint8_t trailer_head[] = {0x44, 0x06, '/', 's'};
+    uint8_t trailer_tail[] = {'m', 'a', 'l', 'l'};
+    uint8_t request[64] = {
+        0x82,   /* :method: GET                      */
+        0x86,   /* :scheme: http                     */
+        0xbe,   /* :path: /small, dynamic entry 62   */
+    };
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TEST_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("connect");
+        return -1;
+    }
+
+    if (test_write(c->fd, preface, sizeof(preface) - 1) != 0 ||
+        test_frame(c->fd, MK_HTTP2_SETTINGS, 0, 0, NULL, 0) != 0) {
+        return -1;
+    }
+
+    /* The bulk response keeps its stream half closed (remote) */
+    if (test_request(c->fd, TEST_BULK_ID, "/bulk") != 0) {
+        return -1;
+    }
+    while (c->bulk_bytes == 0) {
+        if (test_frame_read(c) != 0) {
+            return -1;
+        }
+    }
+
+    /* A second header block on it, split over a CONTINUATION frame */
+    if (test_frame(c->fd, MK_HTTP2_HEADERS, MK_HTTP2_END_STREAM,
+                   TEST_BULK_ID, trailer_head, sizeof(trailer_head)) != 0 ||
+        test_frame(c->fd, MK_HTTP2_CONTINUATION, MK_HTTP2_END_HEADERS,
+                   TEST_BULK_ID, trailer_tail, sizeof(trailer_tail)) != 0) {
+        return -1;
+    }
+
+    n = 3;
+    n += mk_hpack_encode_header(request + n, sizeof(request) - n,
+                                ":authority", 10, "127.0.0.1", 9);
+    if (test_frame(c->fd, MK_HTTP2_HEADERS,
+                   MK_HTTP2_END_HEADERS | MK_HTTP2_END_STREAM,
+                   TEST_SMALL_ID, request, n) != 0) {
+        return -1;
+    }
+
+    while (c->small_done == MK_FALSE || c->bulk_reset == 0) {
+        if (test_frame_read(c) != 0) {
+            return -1;
+        }
+    }
+
+    printf("stream %i reset with code %u, stream %i: status %i, %zu bytes\n",
+           TEST_BULK_ID, c->bulk_reset, TEST_SMALL_ID,
+           c->small_status, c->small_bytes);
+
+    if (c->bulk_reset != MK_HTTP2_STREAM_CLOSED) {
+        fprintf(stderr, "FAIL: expected STREAM_CLOSED\n");
+        return -1;
+    }
+    if (c->small_status != 200 || c->small_bytes != TEST_SMALL_SIZE) {
+        fprintf(stderr, "FAIL: unexpected response for the indexed path\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int main()
+{
+    int ret;
+    int vid;
+    char dir[] = "/tmp/mk-test-http2-XXXXXX";
+    char listen[32];
+    mk_ctx_t *ctx;
+    struct test_client c;
+
+    if (!mkdtemp(dir) ||
+        test_file(dir, "bulk", TEST_BULK_SIZE) != 0 ||
+        test_file(dir, "small", TEST_SMALL_SIZE) != 0) {
+        perror("test files");
+        return EXIT_FAILURE;
+    }
+
+    ctx = mk_create();
+    snprintf(listen, sizeof(listen), "127.0.0.1:%i h2c", TEST_PORT);
+    mk_config_set(ctx, "Listen", listen, "Workers", "1", NULL);
+    vid = mk_vhost_create(ctx, NULL);
+    mk_vhost_set(ctx, vid, "DocumentRoot", dir, NULL);
+
+    if (mk_start(ctx) != 0) {
+        fprintf(stderr, "could not start the server\n");
+        test_cleanup(dir);
+        return EXIT_FAILURE;
+    }
+
+    memset(&c, 0, sizeof(c));
+    mk_hpack_init(&c.hpack, 4096);
+    ret = test_run(&c);
+    mk_hpack_destroy(&c.hpack);
+    close(c.fd);
+
+    mk_stop(ctx);
+    mk_destroy(ctx);
+    test_cleanup(dir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,390 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * HTTP/2 urgency scheduler (RFC 9218): time to first byte of an urgent
+ * response issued while eight large downloads share the connection.
+ *
+ * The client returns flow control credit for every DATA frame it reads, so
+ * the connection window (64 KB) bounds what the server had in flight when
+ * the urgent request arrived. With strict urgency levels, the bytes of the
+ * other streams received before the urgent response is complete must stay
+ * around that bound; round robin would hand them eight times the size of
+ * the urgent response.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <monkey/mk_lib.h>
+#include <monkey/mk_http2.h>
+
+#define TEST_PORT           2199
+#define TEST_PREFACE        "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define TEST_BULK_STREAMS   8
+#define TEST_BULK_SIZE      (1024 * 1024)
+#define TEST_URGENT_SIZE    (256 * 1024)
+#define TEST_URGENT_ID      ((TEST_BULK_STREAMS * 2) + 1)
+
+/* Bulk bytes read before the urgent request is issued */
+#define TEST_WARMUP         (TEST_BULK_SIZE)
+
+/* Connection window plus a couple of frames sitting in the socket */
+#define TEST_MAX_INTERLEAVED    (192 * 1024)
+
+struct test_client {
+    int fd;
+    size_t bulk_bytes;
+    size_t urgent_bytes;
+    int urgent_status;
+    uint32_t headers_id;
+    int urgent_done;
+    struct mk_hpack hpack;
+};
+
+static double test_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int test_file(char *dir, char *name, size_t size)
+{
+    char path[256];
+    char buf[4096];
+    size_t len;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "w");
+    if (!f) {
+        return -1;
+    }
+
+    memset(buf, 'x', sizeof(buf));
+    while (size > 0) {
+        len = size < sizeof(buf) ? size : sizeof(buf);
+        fwrite(buf, 1, len, f);
+        size -= len;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void test_cleanup(char *dir)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/bulk", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/urgent", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static int test_write(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+    char *p = buf;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int test_read(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+    char *p = buf;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int test_frame(int fd, int type, int flags, uint32_t id,
+                      void *payload, size_t len)
+{
+    uint8_t hdr[MK_HTTP2_HEADER_SIZE];
+
+    hdr[0] = (len >> 16) & 0xff;
+    hdr[1] = (len >> 8) & 0xff;
+    hdr[2] = len & 0xff;
+    hdr[3] = type;
+    hdr[4] = flags;
+    hdr[5] = (id >> 24) & 0x7f;
+    hdr[6] = (id >> 16) & 0xff;
+    hdr[7] = (id >> 8) & 0xff;
+    hdr[8] = id & 0xff;
+
+    if (test_write(fd, hdr, sizeof(hdr)) != 0) {
+        return -1;
+    }
+    if (len > 0) {
+        return test_write(fd, payload, len);
+    }
+    return 0;
+}
+
+static int test_window_update(int fd, uint32_t id, uint32_t increment)
+{
+    uint8_t buf[4];
+
+    buf[0] = (increment >> 24) & 0x7f;
+    buf[1] = (increment >> 16) & 0xff;
+    buf[2] = (increment >> 8) & 0xff;
+    buf[3] = increment & 0xff;
+
+    return test_frame(fd, MK_HTTP2_WINDOW_UPDATE, 0, id, buf, sizeof(buf));
+}
+
+static int test_request(int fd, uint32_t id, char *path, char *priority)
+{
+    int n = 0;
+    int i;
+    uint8_t buf[512];
+    char *fields[][2] = {
+        {":method",    "GET"},
+        {":scheme",    "http"},
+        {":path",      path},
+        {":authority", "127.0.0.1"},
+        {"priority",   priority},
+    };
+
+    for (i = 0; i < (priority ? 5 : 4); i++) {
+        n += mk_hpack_encode_header(buf + n, sizeof(buf) - n,
+                                    fields[i][0], strlen(fields[i][0]),
+                                    fields[i][1], strlen(fields[i][1]));
+    }
+
+    return test_frame(fd, MK_HTTP2_HEADERS,
+                      MK_HTTP2_END_HEADERS | MK_HTTP2_END_STREAM,
+                      id, buf, n);
+}
+
+static int test_status_cb(void *data,
+                          char *name, size_t name_len,
+                          char *value, size_t value_len)
+{
+    struct test_client *c = data;
+
+    if (c->headers_id == TEST_URGENT_ID &&
+        name_len == 7 && memcmp(name, ":status", 7) == 0) {
+        c->urgent_status = atoi(value);
+    }
+    (void) value_len;
+    return 0;
+}
+
+/* Read one frame, return credit for DATA and account it per stream */
+static int test_frame_read(struct test_client *c)
+{
+    int ret;
+    int type;
+    int flags;
+    uint32_t id;
+    uint32_t len;
+    uint8_t hdr[MK_HTTP2_HEADER_SIZE];
+    static uint8_t payload[1 << 16];
+
+    if (test_read(c->fd, hdr, sizeof(hdr)) != 0) {
+        fprintf(stderr, "connection closed\n");
+        return -1;
+    }
+
+    len = (hdr[0] << 16) | (hdr[1] << 8) | hdr[2];
+    type = hdr[3];
+    flags = hdr[4];
+    id = ((hdr[5] & 0x7f) << 24) | (hdr[6] << 16) | (hdr[7] << 8) | hdr[8];
+
+    if (len > sizeof(payload) || test_read(c->fd, payload, len) != 0) {
+        fprintf(stderr, "bad frame length %u\n", len);
+        return -1;
+    }
+
+    switch (type) {
+    case MK_HTTP2_SETTINGS:
+        if (!(flags & MK_HTTP2_SETTINGS_ACK)) {
+            return test_frame(c->fd, MK_HTTP2_SETTINGS,
+                              MK_HTTP2_SETTINGS_ACK, 0, NULL, 0);
+        }
+        break;
+    case MK_HTTP2_HEADERS:
+        c->headers_id = id;
+        ret = mk_hpack_decode(&c->hpack, payload, len, test_status_cb, c);
+        if (ret != 0) {
+            fprintf(stderr, "bad header block on stream %u\n", id);
+            return -1;
+        }
+        break;
+    case MK_HTTP2_DATA:
+        if (id == TEST_URGENT_ID) {
+            c->urgent_bytes += len;
+            if (flags & MK_HTTP2_END_STREAM) {
+                c->urgent_done = MK_TRUE;
+            }
+        }
+        else {
+            c->bulk_bytes += len;
+        }
+        if (len > 0) {
+            if (test_window_update(c->fd, 0, len) != 0 ||
+                test_window_update(c->fd, id, len) != 0) {
+                return -1;
+            }
+        }
+        break;
+    case MK_HTTP2_RST_STREAM:
+    case MK_HTTP2_GOAWAY:
+        fprintf(stderr, "frame type %i on stream %u\n", type, id);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int test_run(struct test_client *c)
+{
+    int i;
+    double t;
+    size_t bulk;
+    struct sockaddr_in addr;
+    static char preface[] = TEST_PREFACE;
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TEST_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("connect");
+        return -1;
+    }
+
+    if (test_write(c->fd, preface, sizeof(preface) - 1) != 0 ||
+        test_frame(c->fd, MK_HTTP2_SETTINGS, 0, 0, NULL, 0) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < TEST_BULK_STREAMS; i++) {
+        if (test_request(c->fd, (i * 2) + 1, "/bulk", NULL) != 0) {
+            return -1;
+        }
+    }
+
+    while (c->bulk_bytes < TEST_WARMUP) {
+        if (test_frame_read(c) != 0) {
+            return -1;
+        }
+    }
+
+    /* The urgent request, timed until its response is complete */
+    bulk = c->bulk_bytes;
+    t = test_now();
+    if (test_request(c->fd, TEST_URGENT_ID, "/urgent", "u=0") != 0) {
+        return -1;
+    }
+
+    while (c->urgent_done == MK_FALSE) {
+        if (test_frame_read(c) != 0) {
+            return -1;
+        }
+    }
+    t = test_now() - t;
+    bulk = c->bulk_bytes - bulk;
+
+    printf("urgent response: status %i, %zu bytes in %.1f ms, "
+           "%zu bulk bytes interleaved\n",
+           c->urgent_status, c->urgent_bytes, t * 1000, bulk);
+
+    if (c->urgent_status != 200 || c->urgent_bytes != TEST_URGENT_SIZE) {
+        fprintf(stderr, "FAIL: unexpected urgent response\n");
+        return -1;
+    }
+    if (bulk > TEST_MAX_INTERLEAVED) {
+        fprintf(stderr, "FAIL: %zu bulk bytes sent ahead of the urgent "
+                "response, expected at most %i\n", bulk, TEST_MAX_INTERLEAVED);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main()
+{
+    int ret;
+    int vid;
+    char dir[] = "/tmp/mk-test-http2-XXXXXX";
+    char listen[32];
+    mk_ctx_t *ctx;
+    struct test_client c;
+
+    if (!mkdtemp(dir) ||
+        test_file(dir, "bulk", TEST_BULK_SIZE) != 0 ||
+        test_file(dir, "urgent", TEST_URGENT_SIZE) != 0) {
+        perror("test files");
+        return EXIT_FAILURE;
+    }
+
+    ctx = mk_create();
+    snprintf(listen, sizeof(listen), "127.0.0.1:%i h2c", TEST_PORT);
+    mk_config_set(ctx, "Listen", listen, "Workers", "1", NULL);
+    vid = mk_vhost_create(ctx, NULL);
+    mk_vhost_set(ctx, vid, "DocumentRoot", dir, NULL);
+
+    if (mk_start(ctx) != 0) {
+        fprintf(stderr, "could not start the server\n");
+        test_cleanup(dir);
+        return EXIT_FAILURE;
+    }
+
+    memset(&c, 0, sizeof(c));
+    mk_hpack_init(&c.hpack, 4096);
+    ret = test_run(&c);
+    mk_hpack_destroy(&c.hpack);
+    close(c.fd);
+
+    mk_stop(ctx);
+    mk_destroy(ctx);
+    test_cleanup(dir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,216 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Peer addresses: the literal forms of mk_net_addr_parse(), Unix paths,
+ * abstract names, IPv4 and bracketed IPv6, back through mk_net_addr_str().
+ * The abstract address is also bound and connected to, its length is the
+ * name itself.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_net.h>
+
+static int failures;
+
+#define CHECK(cond, ...)                                    \
+    do {                                                    \
+        if (!(cond)) {                                      \
+            fprintf(stderr, "FAIL %s:%i: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__);                   \
+            fprintf(stderr, "\n");                          \
+            failures++;                                     \
+        }                                                   \
+    } while (0)
+
+#define UN_LEN(n)   (socklen_t) (offsetof(struct sockaddr_un, sun_path) + (n))
+
+/* Parse 'host', it must succeed and print back as 'str' */
+static int addr_ok(const char *host, int port, int family, socklen_t len,
+                   const char *str, struct mk_net_addr *addr)
+{
+    char buf[128];
+
+    if (mk_net_addr_parse(host, port, addr) != 0) {
+        CHECK(0, "'%s': rejected (%s)", host, strerror(errno));
+        return -1;
+    }
+
+    CHECK(addr->family == family, "'%s': family %i, expected %i",
+          host, addr->family, family);
+    CHECK(addr->addr.sa.sa_family == family, "'%s': sa_family %i",
+          host, addr->addr.sa.sa_family);
+    CHECK(addr->len == len, "'%s': length %u, expected %u",
+          host, (unsigned) addr->len, (unsigned) len);
+
+    mk_net_addr_str(addr, buf, sizeof(buf));
+    CHECK(strcmp(buf, str) == 0, "'%s': printed as '%s', expected '%s'",
+          host, buf, str);
+    return 0;
+}
+
+static void addr_fail(const char *host, int err)
+{
+    struct mk_net_addr addr;
+
+    errno = 0;
+    CHECK(mk_net_addr_parse(host, 80, &addr) == -1,
+          "'%s': accepted", host);
+    CHECK(errno == err, "'%s': errno %i, expected %i", host, errno, err);
+}
+
+static void test_unix()
+{
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path) + 1];
+    struct mk_net_addr addr;
+
+    addr_ok("/run/app.sock", 0, AF_UNIX, UN_LEN(14), "unix:/run/app.sock",
+            &addr);
+    CHECK(strcmp(addr.addr.un.sun_path, "/run/app.sock") == 0,
+          "path '%s'", addr.addr.un.sun_path);
+
+    addr_ok("unix:/run/app.sock", 0, AF_UNIX, UN_LEN(14),
+            "unix:/run/app.sock", &addr);
+    CHECK(strcmp(addr.addr.un.sun_path, "/run/app.sock") == 0,
+          "path '%s'", addr.addr.un.sun_path);
+
+    /* Abstract: leading NUL, no trailing one */
+    addr_ok("@app", 0, AF_UNIX, UN_LEN(4), "@app", &addr);
+    CHECK(addr.addr.un.sun_path[0] == '\0' &&
+          memcmp(addr.addr.un.sun_path + 1, "app", 3) == 0,
+          "abstract name not in place");
+
+    addr_ok("unix:@app", 0, AF_UNIX, UN_LEN(4), "@app", &addr);
+    CHECK(addr.addr.un.sun_path[0] == '\0', "abstract name not in place");
+
+    addr_fail("unix:", ENAMETOOLONG);
+
+    /* sun_path must keep room for the trailing NUL */
+    memset(path, 'a', sizeof(path) - 1);
+    path[0] = '/';
+    path[sizeof(path) - 1] = '\0';
+    addr_fail(path, ENAMETOOLONG);
+    path[sizeof(path) - 2] = '\0';
+    CHECK(mk_net_addr_parse(path, 0, &addr) == 0,
+          "longest path rejected");
+}
+
+static void test_inet()
+{
+    struct in6_addr in6;
+    struct mk_net_addr addr;
+
+    addr_ok("127.0.0.1", 8080, AF_INET, sizeof(struct sockaddr_in),
+            "127.0.0.1:8080", &addr);
+    CHECK(addr.addr.in.sin_port == htons(8080), "IPv4 port");
+    CHECK(addr.addr.in.sin_addr.s_addr == htonl(INADDR_LOOPBACK),
+          "IPv4 address");
+
+    addr_ok("[127.0.0.1]", 80, AF_INET, sizeof(struct sockaddr_in),
+            "127.0.0.1:80", &addr);
+
+    addr_ok("::1", 9000, AF_INET6, sizeof(struct sockaddr_in6),
+            "[::1]:9000", &addr);
+    CHECK(IN6_IS_ADDR_LOOPBACK(&addr.addr.in6.sin6_addr), "IPv6 address");
+    CHECK(addr.addr.in6.sin6_port == htons(9000), "IPv6 port");
+
+    addr_ok("[2001:db8::10]", 443, AF_INET6, sizeof(struct sockaddr_in6),
+            "[2001:db8::10]:443", &addr);
+    inet_pton(AF_INET6, "2001:db8::10", &in6);
+    CHECK(memcmp(&addr.addr.in6.sin6_addr, &in6, sizeof(in6)) == 0,
+          "bracketed IPv6 address");
+
+    addr_ok("[::ffff:10.0.0.1]", 1, AF_INET6, sizeof(struct sockaddr_in6),
+            "[::ffff:10.0.0.1]:1", &addr);
+
+    addr_fail("[::1", EINVAL);
+    addr_fail("::1]", EINVAL);
+    addr_fail("[]", EINVAL);
+    addr_fail("[::1]:80", EINVAL);
+    addr_fail("[1111:1111:1111:1111:1111:1111:1111:1111:1111:1111]", EINVAL);
+    addr_fail("256.0.0.1", EINVAL);
+
+    /* Names are for mk_net_addr_resolve() */
+    addr_fail("localhost", EINVAL);
+    addr_fail("", EINVAL);
+}
+
+/* The parsed abstract address must reach the same socket as bind(2) */
+static void test_abstract_connect()
+{
+    int fd;
+    int lfd;
+    int cfd;
+    char name[64];
+    struct mk_net_addr addr;
+
+    snprintf(name, sizeof(name), "@mk-test-net-%i", getpid());
+    if (mk_net_addr_parse(name, 0, &addr) != 0) {
+        CHECK(0, "'%s': rejected", name);
+        return;
+    }
+
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd == -1 || bind(lfd, &addr.addr.sa, addr.len) != 0 ||
+        listen(lfd, 1) != 0) {
+        CHECK(0, "bind '%s': %s", name, strerror(errno));
+        return;
+    }
+
+    fd = mk_net_connect(&addr);
+    CHECK(fd >= 0, "connect '%s': %s", name, strerror(errno));
+
+    cfd = accept(lfd, NULL, NULL);
+    CHECK(cfd >= 0, "accept '%s': %s", name, strerror(errno));
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (cfd >= 0) {
+        close(cfd);
+    }
+    close(lfd);
+}
+
+int main()
+{
+    test_unix();
+    test_inet();
+    test_abstract_connect();
+
+    if (failures) {
+        fprintf(stderr, "%i check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("net_addr: all checks passed\n");
+    return EXIT_SUCCESS;
+}
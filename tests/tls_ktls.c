@@ -0,0 +1,352 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Kernel TLS hand over of the TLS plugin, see plugins/tls/tls_ktls.h: an
+ * mbedtls server and client complete a TLS 1.2 AES-GCM handshake over
+ * loopback TCP, then the server side moves to the kernel with the keys
+ * exported by mbedtls. The client stays on mbedtls, so it must decrypt
+ * what the kernel writes, the kernel what it writes, and get the
+ * close_notify alert sent through a control message.
+ *
+ * Without the 'tls' kernel module setsockopt(TCP_ULP) fails: the session
+ * must then keep working on mbedtls, and the rest of the test is skipped.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/net.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/certs.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+
+#include "tls_ktls.h"
+
+/* ctest reports the test as skipped, see tests/CMakeLists.txt */
+#define TEST_SKIP           77
+
+#define TEST_TO_CLIENT      "written by the kernel"
+#define TEST_TO_SERVER      "read by the kernel"
+
+struct test_tls {
+    mbedtls_net_context net;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+};
+
+struct test_keys {
+    size_t len;
+    unsigned char buf[64];
+};
+
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context drbg;
+static mbedtls_x509_crt cert;
+static mbedtls_pk_context key;
+
+static int test_tls_init(struct test_tls *tls, int fd, int endpoint,
+                         const int *suites)
+{
+    mbedtls_ssl_init(&tls->ssl);
+    mbedtls_ssl_config_init(&tls->conf);
+    mbedtls_ssl_config_defaults(&tls->conf, endpoint,
+                                MBEDTLS_SSL_TRANSPORT_STREAM,
+                                MBEDTLS_SSL_PRESET_DEFAULT);
+    mbedtls_ssl_conf_rng(&tls->conf, mbedtls_ctr_drbg_random, &drbg);
+    mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_NONE);
+
+    if (endpoint == MBEDTLS_SSL_IS_SERVER) {
+        mbedtls_ssl_conf_ciphersuites(&tls->conf, suites);
+        if (mbedtls_ssl_conf_own_cert(&tls->conf, &cert, &key) != 0) {
+            return -1;
+        }
+    }
+    if (mbedtls_ssl_setup(&tls->ssl, &tls->conf) != 0) {
+        return -1;
+    }
+
+    tls->net.fd = fd;
+    mbedtls_ssl_set_bio(&tls->ssl, &tls->net,
+                        mbedtls_net_send, mbedtls_net_recv, NULL);
+    return 0;
+}
+
+static void test_tls_free(struct test_tls *tls)
+{
+    mbedtls_ssl_free(&tls->ssl);
+    mbedtls_ssl_config_free(&tls->conf);
+    close(tls->net.fd);
+}
+
+static int test_handshake(mbedtls_ssl_context *ssl)
+{
+    int ret;
+
+    while ((ret = mbedtls_ssl_handshake(ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
+            ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void *test_client_handshake(void *data)
+{
+    struct test_tls *client = data;
+
+    if (test_handshake(&client->ssl) != 0) {
+        return client;
+    }
+    return NULL;
+}
+
+/* A connected pair of loopback TCP sockets */
+static int test_pair(int *server, int *client)
+{
+    int fd;
+    socklen_t len;
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(addr);
+
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, len) != 0 ||
+        listen(fd, 1) != 0 ||
+        getsockname(fd, (struct sockaddr *) &addr, &len) != 0) {
+        perror("listen");
+        return -1;
+    }
+
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    if (*client == -1 ||
+        connect(*client, (struct sockaddr *) &addr, len) != 0) {
+        perror("connect");
+        return -1;
+    }
+
+    *server = accept(fd, NULL, NULL);
+    close(fd);
+    if (*server == -1) {
+        perror("accept");
+        return -1;
+    }
+    return 0;
+}
+
+/* The client must read 'msg' from a record written by the server */
+static int test_client_read(struct test_tls *client, const char *msg)
+{
+    int ret;
+    char buf[64];
+
+    ret = mbedtls_ssl_read(&client->ssl, (unsigned char *) buf, sizeof(buf));
+    if (ret != (int) strlen(msg) || memcmp(buf, msg, ret) != 0) {
+        fprintf(stderr, "FAIL: client read returned -0x%x\n",
+                ret < 0 ? -ret : ret);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef TLS_KTLS
+static int test_export_keys(void *data, const unsigned char *master,
+                            const unsigned char *key_block,
+                            size_t mac_len, size_t key_len, size_t iv_len)
+{
+    struct test_keys *keys = data;
+
+    (void) master;
+    (void) iv_len;
+
+    ktls_keys_save(keys->buf, sizeof(keys->buf), &keys->len,
+                   key_block, mac_len, key_len);
+    return 0;
+}
+
+static int test_session(int suite, const char *name)
+{
+    int tx;
+    int rx;
+    int ret;
+    int err;
+    int fd_server;
+    int fd_client;
+    int suites[2] = { suite, 0 };
+    char buf[64];
+    void *failed;
+    pthread_t tid;
+    struct test_keys keys;
+    struct test_tls server;
+    struct test_tls client;
+
+    if (test_pair(&fd_server, &fd_client) != 0) {
+        return -1;
+    }
+
+    memset(&keys, 0, sizeof(keys));
+    if (test_tls_init(&server, fd_server, MBEDTLS_SSL_IS_SERVER,
+                      suites) != 0 ||
+        test_tls_init(&client, fd_client, MBEDTLS_SSL_IS_CLIENT,
+                      NULL) != 0) {
+        fprintf(stderr, "FAIL: could not set up the TLS contexts\n");
+        return -1;
+    }
+    mbedtls_ssl_conf_export_keys_cb(&server.conf, test_export_keys, &keys);
+
+    pthread_create(&tid, NULL, test_client_handshake, &client);
+    ret = test_handshake(&server.ssl);
+    pthread_join(tid, &failed);
+    if (ret != 0 || failed) {
+        fprintf(stderr, "FAIL: %s handshake failed\n", name);
+        return -1;
+    }
+    if (keys.len == 0) {
+        fprintf(stderr, "FAIL: %s keys were not exported\n", name);
+        return -1;
+    }
+
+    ret = ktls_setup(fd_server, &server.ssl, keys.buf, keys.len, &tx, &rx);
+    if (ret != 0) {
+        err = errno;
+        if (err != ENOENT && err != ENOPROTOOPT) {
+            fprintf(stderr, "FAIL: setsockopt(TCP_ULP): %s\n", strerror(err));
+            return -1;
+        }
+
+        /* The plugin falls back to mbedtls, the session must still work */
+        ret = mbedtls_ssl_write(&server.ssl,
+                                (unsigned char *) TEST_TO_CLIENT,
+                                strlen(TEST_TO_CLIENT));
+        if (ret != (int) strlen(TEST_TO_CLIENT) ||
+            test_client_read(&client, TEST_TO_CLIENT) != 0) {
+            fprintf(stderr, "FAIL: %s session broken after the fallback\n",
+                    name);
+            return -1;
+        }
+
+        printf("%s: fallback to mbedtls ok\n", name);
+        printf("SKIP: setsockopt(TCP_ULP, \"tls\"): %s, the kernel has no "
+               "'tls' module, the kTLS record path was not run\n",
+               strerror(err));
+        test_tls_free(&server);
+        test_tls_free(&client);
+        return TEST_SKIP;
+    }
+
+    if (!tx || !rx) {
+        fprintf(stderr, "FAIL: %s kernel took tx=%i rx=%i\n", name, tx, rx);
+        return -1;
+    }
+
+    /* Server to client: written in clear text, encrypted by the kernel */
+    ret = write(fd_server, TEST_TO_CLIENT, strlen(TEST_TO_CLIENT));
+    if (ret != (int) strlen(TEST_TO_CLIENT) ||
+        test_client_read(&client, TEST_TO_CLIENT) != 0) {
+        fprintf(stderr, "FAIL: %s client could not read the kernel record\n",
+                name);
+        return -1;
+    }
+
+    /* Client to server: decrypted by the kernel */
+    ret = mbedtls_ssl_write(&client.ssl, (unsigned char *) TEST_TO_SERVER,
+                            strlen(TEST_TO_SERVER));
+    if (ret != (int) strlen(TEST_TO_SERVER)) {
+        fprintf(stderr, "FAIL: %s client write failed\n", name);
+        return -1;
+    }
+    ret = read(fd_server, buf, sizeof(buf));
+    if (ret != (int) strlen(TEST_TO_SERVER) ||
+        memcmp(buf, TEST_TO_SERVER, ret) != 0) {
+        fprintf(stderr, "FAIL: %s kernel read returned %i (%s)\n",
+                name, ret, strerror(errno));
+        return -1;
+    }
+
+    ktls_close_notify(fd_server);
+    ret = mbedtls_ssl_read(&client.ssl, (unsigned char *) buf, sizeof(buf));
+    if (ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+        fprintf(stderr, "FAIL: %s expected close_notify, got -0x%x\n",
+                name, ret < 0 ? -ret : ret);
+        return -1;
+    }
+
+    printf("%s: kernel tx, rx and close_notify ok\n", name);
+    test_tls_free(&server);
+    test_tls_free(&client);
+    return 0;
+}
+#endif
+
+int main()
+{
+#ifndef TLS_KTLS
+    printf("SKIP: built without kernel TLS support, it needs <linux/tls.h> "
+           "and mbedtls with MBEDTLS_SSL_EXPORT_KEYS and MBEDTLS_GCM_C\n");
+    return TEST_SKIP;
+#else
+    int ret;
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_x509_crt_init(&cert);
+    mbedtls_pk_init(&key);
+
+    if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                              (const unsigned char *) "mk-test-tls_ktls",
+                              16) != 0 ||
+        mbedtls_x509_crt_parse(&cert,
+                               (const unsigned char *) mbedtls_test_srv_crt,
+                               mbedtls_test_srv_crt_len) != 0 ||
+        mbedtls_pk_parse_key(&key,
+                             (const unsigned char *) mbedtls_test_srv_key,
+                             mbedtls_test_srv_key_len, NULL, 0) != 0) {
+        fprintf(stderr, "could not load the mbedtls test certificate\n");
+        return EXIT_FAILURE;
+    }
+
+    ret = test_session(MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+                       "AES-128-GCM");
+    if (ret == 0) {
+        ret = test_session(MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+                           "AES-256-GCM");
+    }
+
+    if (ret == TEST_SKIP) {
+        return TEST_SKIP;
+    }
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+#endif
+}